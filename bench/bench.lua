@@ -0,0 +1,538 @@
+-- LuaCrypto microbenchmarks.
+--
+-- usage: lua bench.lua [options] [pattern ...]
+--   --quick      fewer message sizes and a shorter run per case
+--   --time=S     seconds to spend on each case (default 0.25)
+--   --json       one JSON object per case instead of a table
+--   --list       print the case names and exit
+--   --cpath=DIR  load the crypto module from DIR first
+-- Only cases whose name contains one of the patterns are run.
+--
+-- Each case is timed in samples of enough calls to last about a
+-- millisecond. Throughput is computed over all samples and latency
+-- percentiles over the per-call time of each sample. Times are wall
+-- clock time from crypto.clock, a monotonic clock: os.clock sums the
+-- CPU time of all threads, which hides the speedup of the threaded
+-- cases and misses time spent waiting on I/O or workers.
+
+local options = { time = 0.25 }
+local patterns = {}
+for _, a in ipairs(arg or {}) do
+  local k, v = a:match("^%-%-([%w_]+)=?(.*)$")
+  if k then
+    options[k] = v ~= "" and v or true
+  else
+    patterns[#patterns + 1] = a
+  end
+end
+if options.cpath then
+  package.cpath = options.cpath .. "/?.so;" .. package.cpath
+end
+require 'crypto'
+
+local budget = tonumber(options.time) or 0.25
+if options.quick then
+  budget = math.min(budget, 0.05)
+end
+
+local SIZES = options.quick and { 16, 1024, 65536 }
+  or { 16, 64, 256, 1024, 8192, 65536, 1048576, 16777216 }
+local BATCHES = options.quick and { 16 } or { 1, 16, 256 }
+
+local clock = crypto.clock
+
+---------------------------------------------------------------------
+-- measurement
+
+local function percentile(sorted, p)
+  local i = math.max(1, math.ceil(p * #sorted))
+  return sorted[i]
+end
+
+-- Runs f(n) (which performs n calls) until the time budget is spent
+-- and returns the statistics for one call.
+local function measure(f)
+  -- calibrate: grow the sample until it lasts about a millisecond
+  local n = 1
+  while true do
+    local t = clock()
+    f(n)
+    local dt = clock() - t
+    if dt >= 0.001 or n >= 2^20 then
+      n = math.max(1, math.floor(n * 0.001 / math.max(dt, 1e-9)))
+      break
+    end
+    n = n * 4
+  end
+
+  local samples, calls, total = {}, 0, 0
+  repeat
+    local t = clock()
+    f(n)
+    local dt = clock() - t
+    samples[#samples + 1] = dt / n
+    calls = calls + n
+    total = total + dt
+  until (total >= budget and #samples >= 5) or #samples >= 100000
+  table.sort(samples)
+  return {
+    calls = calls,
+    seconds = total,
+    samples = #samples,
+    p50 = percentile(samples, 0.50),
+    p90 = percentile(samples, 0.90),
+    p99 = percentile(samples, 0.99),
+  }
+end
+
+---------------------------------------------------------------------
+-- reporting
+
+local function json_value(v)
+  if type(v) == "string" then
+    return '"' .. v:gsub('[%c"\\]', function(c) return string.format("\\u%04x", c:byte()) end) .. '"'
+  elseif type(v) == "number" then
+    if v ~= v or v == math.huge or v == -math.huge then return "null" end
+    return string.format("%.6g", v)
+  end
+  return tostring(v)
+end
+
+local function json_object(t, keys)
+  local parts = {}
+  for _, k in ipairs(keys) do
+    if t[k] ~= nil then
+      parts[#parts + 1] = json_value(k) .. ":" .. json_value(t[k])
+    end
+  end
+  return "{" .. table.concat(parts, ",") .. "}"
+end
+
+local RESULT_KEYS = { "case", "alg", "size", "batch", "ops_per_sec", "mb_per_sec",
+                      "p50_us", "p90_us", "p99_us", "calls", "samples" }
+
+local function human_size(n)
+  if n >= 1048576 and n % 1048576 == 0 then return (n / 1048576) .. "M" end
+  if n >= 1024 and n % 1024 == 0 then return (n / 1024) .. "K" end
+  return tostring(n)
+end
+
+local header_done = false
+local function report(r)
+  if options.json then
+    print(json_object(r, RESULT_KEYS))
+    return
+  end
+  if not header_done then
+    print(string.format("%-34s %6s %5s %12s %10s %10s %10s %10s",
+      "case", "size", "batch", "ops/s", "MB/s", "p50 us", "p90 us", "p99 us"))
+    header_done = true
+  end
+  print(string.format("%-34s %6s %5s %12.0f %10.1f %10.3f %10.3f %10.3f",
+    r.case .. (r.alg and (" " .. r.alg) or ""), r.size and human_size(r.size) or "-",
+    r.batch or "-", r.ops_per_sec, r.mb_per_sec or 0, r.p50_us, r.p90_us, r.p99_us))
+end
+
+---------------------------------------------------------------------
+-- cases
+
+local cases = {}
+
+-- setup(size, batch) returns the function to time, which performs the
+-- operation n times on size byte messages (batch of them per call for
+-- batched cases).
+local function add(name, alg, setup, opts)
+  opts = opts or {}
+  cases[#cases + 1] = { name = name, alg = alg, setup = setup,
+                        sizes = opts.sizes or SIZES, batches = opts.batches }
+end
+
+local payloads = {}
+local function payload(size)
+  if not payloads[size] then
+    payloads[size] = crypto.rand.pseudo_bytes(math.min(size, 65536))
+    if size > 65536 then
+      payloads[size] = string.rep(payloads[size], size / 65536)
+    end
+  end
+  return payloads[size]
+end
+
+local KEY16, KEY32 = string.rep("k", 16), string.rep("k", 32)
+local IV16, NONCE = string.rep("i", 16), string.rep("n", 12)
+
+for _, alg in ipairs({ "md5", "sha1", "sha256", "sha512" }) do
+  add("digest", alg, function(size)
+    local s = payload(size)
+    return function(n) for _ = 1, n do crypto.digest(alg, s, true) end end
+  end)
+end
+
+add("digest.handle", "sha256", function(size)
+  local s, md = payload(size), crypto.md("sha256")
+  return function(n) for _ = 1, n do md:digest(s, true) end end
+end, { sizes = { 16, 64, 1024 } })
+
+add("digest.update", "sha256", function(size)
+  local s, d = payload(size), crypto.digest.new("sha256")
+  return function(n) for _ = 1, n do d:update(s) end end
+end)
+
+-- against "digest" above: the same sizes through the non-cryptographic hashes
+local SIPKEY = string.rep("s", 16)
+for _, alg in ipairs({ "xxh3", "xxh128", "siphash" }) do
+  local key = alg == "siphash" and SIPKEY or nil
+  add("fasthash", alg, function(size)
+    local s = payload(size)
+    return function(n) for _ = 1, n do crypto.fasthash(alg, s, key, true) end end
+  end)
+end
+
+add("fasthash.batch", "xxh3", function(size, batch)
+  local items = {}
+  for i = 1, batch do items[i] = payload(size) end
+  return function(n) for _ = 1, n do crypto.fasthash.batch("xxh3", items, nil, true) end end
+end, { sizes = { 16, 64 }, batches = { 256 } })
+
+local tmpfiles = {}
+add("digest.file", "sha256", function(size)
+  local path = os.tmpname()
+  tmpfiles[#tmpfiles + 1] = path
+  local f = assert(io.open(path, "wb"))
+  f:write(payload(size))
+  f:close()
+  return function(n) for _ = 1, n do crypto.digest.file("sha256", path, nil, nil, true) end end
+end, { sizes = { 1024, 1048576, 16777216 } })
+
+add("digest.files", "sha256", function(size, batch)
+  local paths = {}
+  for i = 1, batch do
+    paths[i] = os.tmpname()
+    tmpfiles[#tmpfiles + 1] = paths[i]
+    local f = assert(io.open(paths[i], "wb"))
+    f:write(payload(size))
+    f:close()
+  end
+  return function(n) for _ = 1, n do crypto.digest.files("sha256", paths, true) end end
+end, { sizes = { 1024, 1048576 }, batches = { 64 } })
+
+-- chunking with the default 8 KiB average; "digest sha256" is the hashing
+-- alone, so the difference is the cost of finding the boundaries
+add("chunker.chunks", "sha256", function(size)
+  local s = payload(size)
+  return function(n) for _ = 1, n do crypto.chunker.chunks("sha256", s, true) end end
+end, { sizes = { 65536, 1048576, 16777216 } })
+
+add("chunker.file", "sha256", function(size)
+  local path = os.tmpname()
+  tmpfiles[#tmpfiles + 1] = path
+  local f = assert(io.open(path, "wb"))
+  f:write(payload(size))
+  f:close()
+  return function(n) for _ = 1, n do crypto.chunker.file("sha256", path, nil, nil, true) end end
+end, { sizes = { 1048576, 16777216 } })
+
+for _, threads in ipairs({ 1, 0 }) do
+  -- threads = 0 leaves the default, one per processor
+  add("digest.tree", threads == 1 and "sha256-1t" or "sha256", function(size)
+    local s = payload(size)
+    local options = threads > 0 and { threads = threads } or nil
+    return function(n) for _ = 1, n do crypto.digest.tree("sha256", s, true, options) end end
+  end, { sizes = { 1048576, 16777216 } })
+end
+
+for _, alg in ipairs({ "sha1", "sha256", "md5" }) do
+  add("digest.batch", alg, function(size, batch)
+    local items = {}
+    for i = 1, batch do items[i] = payload(size) end
+    return function(n) for _ = 1, n do crypto.digest.batch(alg, items, true) end end
+  end, { sizes = { 16, 64, 1024 }, batches = BATCHES })
+end
+
+for _, alg in ipairs({ "sha1", "sha256" }) do
+  add("hmac", alg, function(size)
+    local s = payload(size)
+    return function(n) for _ = 1, n do crypto.hmac.digest(alg, s, KEY32, true) end end
+  end)
+end
+
+for _, alg in ipairs({ "aes-128-ctr", "chacha20" }) do
+  if pcall(crypto.cipher, alg) then
+    add("encrypt.threads", alg, function(size)
+      local s = payload(size)
+      return function(n) for _ = 1, n do crypto.encrypt(alg, s, KEY32, IV16, nil, {}) end end
+    end, { sizes = { 16777216 } })
+  end
+end
+
+for _, alg in ipairs({ "aes-128-cbc", "aes-128-ctr", "aes-256-cbc" }) do
+  add("encrypt", alg, function(size)
+    local s = payload(size)
+    return function(n) for _ = 1, n do crypto.encrypt(alg, s, KEY32, IV16) end end
+  end)
+  add("decrypt", alg, function(size)
+    local c = crypto.encrypt(alg, payload(size), KEY32, IV16)
+    return function(n) for _ = 1, n do crypto.decrypt(alg, c, KEY32, IV16) end end
+  end)
+  add("encrypt.update", alg, function(size)
+    local s, e = payload(size), crypto.encrypt.new(alg, KEY32, IV16)
+    return function(n) for _ = 1, n do e:update(s) end end
+  end)
+  add("encrypt.update.buffer", alg, function(size)
+    local s, e, b = payload(size), crypto.encrypt.new(alg, KEY32, IV16), crypto.buffer.new()
+    return function(n) for _ = 1, n do b:clear(); e:update(s, b) end end
+  end)
+end
+
+for _, alg in ipairs({ "aes-128-gcm", "aes-256-gcm", "chacha20-poly1305" }) do
+  local key = alg == "aes-128-gcm" and KEY16 or KEY32
+  if pcall(crypto.cipher, alg) then
+    add("aead.seal", alg, function(size)
+      local s = payload(size)
+      return function(n) for _ = 1, n do crypto.aead.seal(alg, key, NONCE, s) end end
+    end)
+    add("aead.open", alg, function(size)
+      local c, t = crypto.aead.seal(alg, key, NONCE, payload(size))
+      return function(n) for _ = 1, n do crypto.aead.open(alg, key, NONCE, c, t) end end
+    end)
+  end
+end
+
+add("etm.encrypt", "aes-128-ctr+sha256", function(size)
+  local s = payload(size)
+  return function(n) for _ = 1, n do crypto.etm.encrypt("aes-128-ctr", KEY16, IV16, "sha256", KEY32, s) end end
+end)
+
+-- PBKDF2 at 10000 iterations, against the same loop over hmac.digest in Lua;
+-- size is the key length, so 128 bytes is four SHA-256 blocks
+local ITER = 10000
+local function bxor(a, b)
+  local t = {}
+  for i = 1, #a do
+    local x, y, r, bit = a:byte(i), b:byte(i), 0, 1
+    while x > 0 or y > 0 do
+      if x % 2 ~= y % 2 then r = r + bit end
+      x, y, bit = math.floor(x / 2), math.floor(y / 2), bit * 2
+    end
+    t[i] = string.char(r)
+  end
+  return table.concat(t)
+end
+add("kdf.pbkdf2", "sha256", function(size)
+  return function(n) for _ = 1, n do crypto.kdf.pbkdf2("sha256", "password", "salt", ITER, size) end end
+end, { sizes = { 32, 128 } })
+add("kdf.pbkdf2-lua", "sha256", function()
+  return function(n)
+    for _ = 1, n do
+      local u = crypto.hmac.digest("sha256", "salt\0\0\0\1", "password", true)
+      local t = u
+      for _ = 2, ITER do
+        u = crypto.hmac.digest("sha256", u, "password", true)
+        t = bxor(t, u)
+      end
+    end
+  end
+end, { sizes = { 32 } })
+add("kdf.hkdf", "sha256", function(size)
+  return function(n) for _ = 1, n do crypto.kdf.hkdf("sha256", KEY32, "salt", "info", size) end end
+end, { sizes = { 32, 128 } })
+-- the interactive-login parameters of RFC 7914, with p lanes
+add("kdf.scrypt", "N16384-r8", function(size)
+  return function(n) for _ = 1, n do crypto.kdf.scrypt("password", "salt", 16384, 8, size, 32) end end
+end, { sizes = { 1, 4 } })
+
+local rsa
+local function rsa_key()
+  rsa = rsa or assert(crypto.pkey.generate("rsa", 2048))
+  return rsa
+end
+
+add("sign", "rsa2048-sha256", function(size)
+  local s, k = payload(size), rsa_key()
+  return function(n) for _ = 1, n do crypto.sign("sha256", s, k) end end
+end, { sizes = { 64 } })
+
+add("verify", "rsa2048-sha256", function(size)
+  local s, k = payload(size), rsa_key()
+  local sig = crypto.sign("sha256", s, k)
+  return function(n) for _ = 1, n do crypto.verify("sha256", s, sig, k) end end
+end, { sizes = { 64 } })
+
+for _, kind in ipairs({ "ec", "ed25519" }) do
+  if pcall(crypto.pkey.generate, kind) then
+    local name = kind == "ec" and "p256-sha256" or "ed25519"
+    add("sign", name, function(size)
+      local s, k = payload(size), crypto.pkey.generate(kind)
+      return function(n) for _ = 1, n do crypto.sign("sha256", s, k) end end
+    end, { sizes = { 64 } })
+    add("verify", name, function(size)
+      local s, k = payload(size), crypto.pkey.generate(kind)
+      local sig = crypto.sign("sha256", s, k)
+      return function(n) for _ = 1, n do crypto.verify("sha256", s, sig, k) end end
+    end, { sizes = { 64 } })
+  end
+end
+
+for _, form in ipairs({ "pem", "der" }) do
+  add("pkey.from_" .. form, "rsa2048", function()
+    local s = rsa_key()["to_" .. form](rsa_key(), true)
+    local from = crypto.pkey["from_" .. form]
+    return function(n) for _ = 1, n do from(s, true) end end
+  end, { sizes = { 1 } })
+end
+
+-- public keys reloaded from PEM, parsed every time and through the key cache
+for _, capacity in ipairs({ 0, 512 }) do
+  add(capacity == 0 and "pkey.parse" or "pkey.cached", "rsa2048-pem", function()
+    local s = rsa_key():to_pem()
+    crypto.pkey.cache_capacity(capacity)
+    return function(n) for _ = 1, n do crypto.pkey.from_pem(s) end end
+  end, { sizes = { 1 } })
+end
+
+add("derive", "p256", function()
+  local a, b = crypto.pkey.generate("ec"), crypto.pkey.generate("ec")
+  return function(n) for _ = 1, n do a:derive(b) end end
+end, { sizes = { 32 } })
+if pcall(crypto.pkey.generate, "x25519") then
+  add("derive", "x25519", function()
+    local a, b = crypto.pkey.generate("x25519"), crypto.pkey.generate("x25519")
+    return function(n) for _ = 1, n do a:derive(b) end end
+  end, { sizes = { 32 } })
+end
+
+add("verify.batch", "rsa2048-sha256", function(size, batch)
+  local k, items, sigs = rsa_key(), {}, {}
+  for i = 1, batch do
+    items[i] = payload(size)
+    sigs[i] = crypto.sign("sha256", items[i], k)
+  end
+  return function(n) for _ = 1, n do crypto.verify.batch("sha256", items, sigs, k, {}) end end
+end, { sizes = { 64 }, batches = { 64 } })
+
+-- round trip through the worker pool, against the direct call above
+add("job.digest", "sha256", function(size)
+  local s = payload(size)
+  return function(n) for _ = 1, n do crypto.job.digest("sha256", s, true):wait() end end
+end, { sizes = { 64, 1048576 } })
+
+add("job.sign", "rsa2048-sha256", function(size, batch)
+  local s, k, jobs = payload(size), rsa_key(), {}
+  return function(n)
+    for _ = 1, n do
+      for i = 1, batch do jobs[i] = crypto.job.sign("sha256", s, k) end
+      for i = 1, batch do jobs[i]:wait() end
+    end
+  end
+end, { sizes = { 64 }, batches = { 16 } })
+
+add("rand.bytes", nil, function(size)
+  crypto.rand.set_pool(false)
+  return function(n) for _ = 1, n do crypto.rand.bytes(size) end end
+end, { sizes = { 16, 256, 65536 } })
+
+add("rand.pseudo_bytes", nil, function(size)
+  return function(n) for _ = 1, n do crypto.rand.pseudo_bytes(size) end end
+end, { sizes = { 16, 256, 65536 } })
+
+add("rand.fill", nil, function(size)
+  local b = crypto.buffer.new()
+  return function(n) for _ = 1, n do crypto.rand.fill(b, size) end end
+end, { sizes = { 65536, 1048576 } })
+
+-- batch integers per call, against as many rand.int calls
+add("rand.ints", nil, function(size, batch)
+  return function(n) for _ = 1, n do crypto.rand.ints(batch, 1, 1000000) end end
+end, { sizes = { 8 }, batches = { 1000 } })
+add("rand.int", nil, function(size, batch)
+  return function(n)
+    for _ = 1, n do
+      for _ = 1, batch do crypto.rand.int(1, 1000000) end
+    end
+  end
+end, { sizes = { 8 }, batches = { 1000 } })
+
+-- rand.bytes served from a pool of this state
+add("rand.bytes", "pool", function(size)
+  crypto.rand.set_pool(true)
+  return function(n) for _ = 1, n do crypto.rand.bytes(size) end end
+end, { sizes = { 16, 256 } })
+
+add("rand.token", "pool", function(size)
+  local pool = crypto.rand.pool()
+  return function(n) for _ = 1, n do pool:token(size) end end
+end, { sizes = { 16 } })
+
+add("rand.int", "pool", function()
+  local pool = crypto.rand.pool()
+  return function(n) for _ = 1, n do pool:int(1, 1000000) end end
+end, { sizes = { 8 } })
+
+add("hex", nil, function(size)
+  local s = payload(size)
+  return function(n) for _ = 1, n do crypto.hex(s) end end
+end)
+
+add("unhex", nil, function(size)
+  local h = crypto.hex(payload(size))
+  return function(n) for _ = 1, n do crypto.unhex(h) end end
+end)
+
+add("base64.encode", nil, function(size)
+  local s = payload(size)
+  return function(n) for _ = 1, n do crypto.base64.encode(s) end end
+end)
+
+add("base64.decode", nil, function(size)
+  local b = crypto.base64.encode(payload(size))
+  return function(n) for _ = 1, n do crypto.base64.decode(b) end end
+end)
+
+---------------------------------------------------------------------
+-- main
+
+local function selected(name)
+  if #patterns == 0 then return true end
+  for _, p in ipairs(patterns) do
+    if name:find(p, 1, true) then return true end
+  end
+  return false
+end
+
+if options.list then
+  for _, c in ipairs(cases) do
+    print(c.name .. (c.alg and (" " .. c.alg) or ""))
+  end
+  return
+end
+
+if options.json then
+  print(json_object({ type = "meta", lua = _VERSION, luacrypto = crypto._VERSION,
+                      date = os.date("!%Y-%m-%dT%H:%M:%SZ"), time_per_case = budget,
+                      timer = "monotonic" },
+                    { "type", "lua", "luacrypto", "date", "time_per_case", "timer" }))
+end
+
+for _, c in ipairs(cases) do
+  local full = c.name .. (c.alg and (" " .. c.alg) or "")
+  if selected(full) then
+    for _, size in ipairs(c.sizes) do
+      for _, batch in ipairs(c.batches or { false }) do
+        local m = measure(c.setup(size, batch or nil))
+        local per_op = m.seconds / m.calls
+        local items = batch or 1
+        report({
+          case = c.name, alg = c.alg, size = size, batch = batch or nil,
+          ops_per_sec = 1 / per_op,
+          mb_per_sec = size * items / per_op / 1e6,
+          p50_us = m.p50 * 1e6, p90_us = m.p90 * 1e6, p99_us = m.p99 * 1e6,
+          calls = m.calls, samples = m.samples,
+        })
+      end
+    end
+  end
+end
+
+for _, path in ipairs(tmpfiles) do
+  os.remove(path)
+end
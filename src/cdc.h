@@ -0,0 +1,51 @@
+/*
+** Content-defined chunking (FastCDC).
+** See Copyright Notice in license.html
+**
+** Chunk boundaries depend only on the bytes near them, so an insertion
+** or deletion in a large input changes only the chunks around it and
+** the others deduplicate. A Gear rolling hash is run over each chunk
+** from its minimum size on; a boundary follows the first byte where the
+** hash has its top bits clear, using a stricter mask before the average
+** size and a looser one after it (normalized chunking, level 2), and at
+** the latest at the maximum size. The result does not depend on how the
+** input is split into calls.
+**
+** Xia et al., "FastCDC: a Fast and Efficient Content-Defined Chunking
+** Approach for Data Deduplication", USENIX ATC 2016.
+*/
+
+#ifndef _LUACRYPTO_CDC_
+#define _LUACRYPTO_CDC_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CDC_DEFAULT_AVG 8192
+
+typedef struct cdc {
+  size_t min, avg, max;
+  uint64_t mask_s, mask_l;     /* before and after the average size */
+  uint64_t fp;                 /* rolling hash */
+  size_t n;                    /* bytes of the current chunk seen so far */
+} cdc;
+
+/*
+** Prepares c; requires 1 <= min <= avg <= max and avg >= 64.
+*/
+void cdc_init (cdc *c, size_t min, size_t avg, size_t max);
+
+/*
+** Returns how many of the len bytes at data belong to the current
+** chunk. If the chunk ends with them, sets *cut to 1 and starts the next
+** chunk; otherwise all len bytes were taken and *cut is 0.
+*/
+size_t cdc_scan (cdc *c, const unsigned char *data, size_t len, int *cut);
+
+/*
+** Bytes of the current, unfinished chunk: the length of the last chunk
+** once the input is over.
+*/
+#define cdc_pending(c) ((c)->n)
+
+#endif
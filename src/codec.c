@@ -0,0 +1,570 @@
+/*
+** Binary-to-text encoders shared by the LuaCrypto bindings.
+** See Copyright Notice in license.html
+**
+** Every codec has a table-driven scalar version that also handles the
+** tails, plus SSSE3 and AVX2 versions on x86 picked at run time.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "codec.h"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CODEC_X86 1
+#include <immintrin.h>
+#define CODEC_SSSE3 __attribute__((target("ssse3")))
+#define CODEC_AVX2  __attribute__((target("avx2")))
+#endif
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* 0xff marks characters that are not hex digits */
+static const unsigned char hex_values[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+/*************** CPU DISPATCH ***************/
+
+enum { CODEC_SCALAR, CODEC_USE_SSSE3, CODEC_USE_AVX2 };
+
+#ifdef CODEC_X86
+static int codec_selected = CODEC_SCALAR;
+
+static void codec_detect(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    codec_selected = CODEC_USE_AVX2;
+  else if (__builtin_cpu_supports("ssse3"))
+    codec_selected = CODEC_USE_SSSE3;
+}
+
+/*
+** Pool workers reach the codecs too, so the CPU is probed exactly once.
+** On Windows the pool runs everything on the calling thread.
+*/
+#ifndef _WIN32
+#include <pthread.h>
+static pthread_once_t codec_once = PTHREAD_ONCE_INIT;
+
+static int codec_level(void)
+{
+  pthread_once(&codec_once, codec_detect);
+  return codec_selected;
+}
+#else
+static int codec_level(void)
+{
+  static int detected = 0;
+  if (!detected) {
+    codec_detect();
+    detected = 1;
+  }
+  return codec_selected;
+}
+#endif
+#else
+#define codec_level() CODEC_SCALAR
+#endif
+
+/*************** HEX ***************/
+
+static void hex_encode_scalar(char *dst, const unsigned char *src, size_t len)
+{
+  size_t i;
+  for (i = 0; i < len; i++) {
+    dst[2*i] = hex_digits[src[i] >> 4];
+    dst[2*i + 1] = hex_digits[src[i] & 0x0f];
+  }
+}
+
+static int hex_decode_scalar(unsigned char *dst, const char *src, size_t len)
+{
+  unsigned char bad = 0;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    unsigned char hi = hex_values[(unsigned char)src[2*i]];
+    unsigned char lo = hex_values[(unsigned char)src[2*i + 1]];
+    bad |= hi | lo;
+    dst[i] = (unsigned char)((hi << 4) | (lo & 0x0f));
+  }
+  return (bad & 0xf0) == 0;
+}
+
+#ifdef CODEC_X86
+
+/*
+** Maps the 16 hex digit characters of v to their values. Returns in
+** *ok a mask with 0xff for every valid character.
+*/
+CODEC_SSSE3 static __m128i hex_values_128(__m128i v, __m128i *ok)
+{
+  __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+  __m128i a = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+  __m128i is_d = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+  __m128i is_a = _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8(5)), a);
+  *ok = _mm_or_si128(is_d, is_a);
+  return _mm_or_si128(_mm_and_si128(is_d, d),
+                      _mm_and_si128(is_a, _mm_add_epi8(a, _mm_set1_epi8(10))));
+}
+
+CODEC_SSSE3 static void hex_encode_ssse3(char *dst, const unsigned char *src, size_t len)
+{
+  const __m128i lut = _mm_loadu_si128((const __m128i *)hex_digits);
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+    _mm_storeu_si128((__m128i *)(dst + 2*i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(dst + 2*i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  hex_encode_scalar(dst + 2*i, src + i, len - i);
+}
+
+CODEC_SSSE3 static int hex_decode_ssse3(unsigned char *dst, const char *src, size_t len)
+{
+  const __m128i weights = _mm_set1_epi16(0x0110);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i ok0, ok1;
+    __m128i v0 = hex_values_128(_mm_loadu_si128((const __m128i *)(src + 2*i)), &ok0);
+    __m128i v1 = hex_values_128(_mm_loadu_si128((const __m128i *)(src + 2*i + 16)), &ok1);
+    if (_mm_movemask_epi8(_mm_and_si128(ok0, ok1)) != 0xffff)
+      return 0;
+    /* each pair of nibbles becomes hi*16 + lo in a 16-bit word */
+    v0 = _mm_maddubs_epi16(v0, weights);
+    v1 = _mm_maddubs_epi16(v1, weights);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(v0, v1));
+  }
+  return hex_decode_scalar(dst + i, src + 2*i, len - i);
+}
+
+CODEC_AVX2 static __m256i hex_values_256(__m256i v, __m256i *ok)
+{
+  __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+  __m256i a = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+  __m256i is_d = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+  __m256i is_a = _mm256_cmpeq_epi8(_mm256_min_epu8(a, _mm256_set1_epi8(5)), a);
+  *ok = _mm256_or_si256(is_d, is_a);
+  return _mm256_or_si256(_mm256_and_si256(is_d, d),
+                         _mm256_and_si256(is_a, _mm256_add_epi8(a, _mm256_set1_epi8(10))));
+}
+
+CODEC_AVX2 static void hex_encode_avx2(char *dst, const unsigned char *src, size_t len)
+{
+  const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hex_digits));
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+    /* unpack works within 128-bit lanes, so swap the middle quarters back */
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i *)(dst + 2*i), _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 2*i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  hex_encode_ssse3(dst + 2*i, src + i, len - i);
+}
+
+CODEC_AVX2 static int hex_decode_avx2(unsigned char *dst, const char *src, size_t len)
+{
+  const __m256i weights = _mm256_set1_epi16(0x0110);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i ok0, ok1;
+    __m256i v0 = hex_values_256(_mm256_loadu_si256((const __m256i *)(src + 2*i)), &ok0);
+    __m256i v1 = hex_values_256(_mm256_loadu_si256((const __m256i *)(src + 2*i + 32)), &ok1);
+    if (_mm256_movemask_epi8(_mm256_and_si256(ok0, ok1)) != -1)
+      return 0;
+    v0 = _mm256_maddubs_epi16(v0, weights);
+    v1 = _mm256_maddubs_epi16(v1, weights);
+    /* packus interleaves the 128-bit lanes of its operands */
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_permute4x64_epi64(_mm256_packus_epi16(v0, v1), 0xd8));
+  }
+  return hex_decode_ssse3(dst + i, src + 2*i, len - i);
+}
+
+#endif
+
+void codec_hex_encode(char *dst, const unsigned char *src, size_t len)
+{
+  switch (codec_level()) {
+#ifdef CODEC_X86
+  case CODEC_USE_AVX2:
+    hex_encode_avx2(dst, src, len);
+    break;
+  case CODEC_USE_SSSE3:
+    hex_encode_ssse3(dst, src, len);
+    break;
+#endif
+  default:
+    hex_encode_scalar(dst, src, len);
+  }
+}
+
+int codec_hex_decode(unsigned char *dst, const char *src, size_t len)
+{
+  switch (codec_level()) {
+#ifdef CODEC_X86
+  case CODEC_USE_AVX2:
+    return hex_decode_avx2(dst, src, len);
+  case CODEC_USE_SSSE3:
+    return hex_decode_ssse3(dst, src, len);
+#endif
+  default:
+    return hex_decode_scalar(dst, src, len);
+  }
+}
+
+/*************** BASE64 ***************/
+
+static const char b64_std_digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char b64_url_digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* 0xff marks characters outside the alphabet */
+static const unsigned char b64_std_values[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+static const unsigned char b64_url_values[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0x3f,
+  0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+static void b64_encode_scalar(char *dst, const unsigned char *src, size_t len, const char *digits)
+{
+  size_t i;
+  for (i = 0; i + 3 <= len; i += 3) {
+    uint32_t v = ((uint32_t)src[i] << 16) | ((uint32_t)src[i + 1] << 8) | src[i + 2];
+    *dst++ = digits[v >> 18];
+    *dst++ = digits[(v >> 12) & 0x3f];
+    *dst++ = digits[(v >> 6) & 0x3f];
+    *dst++ = digits[v & 0x3f];
+  }
+}
+
+/*
+** Decodes len characters, a multiple of 4, without padding. Returns 0
+** on a character outside the alphabet.
+*/
+static int b64_decode_scalar(unsigned char *dst, const char *src, size_t len, const unsigned char *values)
+{
+  unsigned char bad = 0;
+  size_t i;
+  for (i = 0; i + 4 <= len; i += 4) {
+    unsigned char a = values[(unsigned char)src[i]];
+    unsigned char b = values[(unsigned char)src[i + 1]];
+    unsigned char c = values[(unsigned char)src[i + 2]];
+    unsigned char d = values[(unsigned char)src[i + 3]];
+    uint32_t v = ((uint32_t)a << 18) | ((uint32_t)b << 12) | ((uint32_t)c << 6) | d;
+    bad |= a | b | c | d;
+    *dst++ = (unsigned char)(v >> 16);
+    *dst++ = (unsigned char)(v >> 8);
+    *dst++ = (unsigned char)v;
+  }
+  return (bad & 0xc0) == 0;
+}
+
+#ifdef CODEC_X86
+
+/*
+** Base64 kernels after W. Mula and D. Lemire, "Faster Base64 Encoding
+** and Decoding Using AVX2 Instructions". Every 32-bit word holds three
+** input bytes, spread to four 6-bit indices by multiplications.
+*/
+
+CODEC_SSSE3 static __m128i b64_indices_128(__m128i in)
+{
+  __m128i t0, t1, t2, t3;
+  in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+  t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(t1, t3);
+}
+
+/* maps 6-bit indices to characters: one offset per range of the alphabet */
+CODEC_SSSE3 static __m128i b64_chars_128(__m128i idx, __m128i offsets)
+{
+  __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+  __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+  r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, r), idx);
+}
+
+CODEC_SSSE3 static __m128i b64_offsets_128(const char *digits)
+{
+  return _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                       '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                       (char)(digits[62] - 62), (char)(digits[63] - 63), 'A', 0, 0);
+}
+
+/*
+** Maps 16 characters to their 6-bit values. Returns in *ok a mask with
+** 0xff for every character of the alphabet.
+*/
+CODEC_SSSE3 static __m128i b64_values_128(__m128i v, const char *digits, __m128i *ok)
+{
+#define IN_RANGE(lo, hi) _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(v, _mm_set1_epi8(lo)), \
+                           _mm_set1_epi8((hi) - (lo))), _mm_sub_epi8(v, _mm_set1_epi8(lo)))
+  __m128i upper = IN_RANGE('A', 'Z');
+  __m128i lower = IN_RANGE('a', 'z');
+  __m128i digit = IN_RANGE('0', '9');
+#undef IN_RANGE
+  __m128i c62 = _mm_cmpeq_epi8(v, _mm_set1_epi8(digits[62]));
+  __m128i c63 = _mm_cmpeq_epi8(v, _mm_set1_epi8(digits[63]));
+  __m128i r;
+  *ok = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(c62, c63)));
+  r = _mm_and_si128(upper, _mm_sub_epi8(v, _mm_set1_epi8('A')));
+  r = _mm_or_si128(r, _mm_and_si128(lower, _mm_sub_epi8(v, _mm_set1_epi8('a' - 26))));
+  r = _mm_or_si128(r, _mm_and_si128(digit, _mm_add_epi8(v, _mm_set1_epi8(52 - '0'))));
+  r = _mm_or_si128(r, _mm_and_si128(c62, _mm_set1_epi8(62)));
+  return _mm_or_si128(r, _mm_and_si128(c63, _mm_set1_epi8(63)));
+}
+
+/* packs four 6-bit values per 32-bit word back into three bytes */
+CODEC_SSSE3 static __m128i b64_pack_128(__m128i v)
+{
+  v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+  v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+CODEC_SSSE3 static size_t b64_encode_ssse3(char *dst, const unsigned char *src, size_t len, const char *digits)
+{
+  const __m128i offsets = b64_offsets_128(digits);
+  size_t i = 0;
+  /* each step reads 16 bytes but consumes only 12 */
+  for (; i + 16 <= len; i += 12) {
+    __m128i idx = b64_indices_128(_mm_loadu_si128((const __m128i *)(src + i)));
+    _mm_storeu_si128((__m128i *)dst, b64_chars_128(idx, offsets));
+    dst += 16;
+  }
+  return i;
+}
+
+CODEC_SSSE3 static size_t b64_decode_ssse3(unsigned char *dst, const char *src, size_t len, const char *digits)
+{
+  size_t i = 0;
+  /* each step writes 16 bytes but produces only 12, so keep 8 characters spare */
+  for (; i + 24 <= len; i += 16) {
+    __m128i ok;
+    __m128i v = b64_values_128(_mm_loadu_si128((const __m128i *)(src + i)), digits, &ok);
+    if (_mm_movemask_epi8(ok) != 0xffff)
+      break;
+    _mm_storeu_si128((__m128i *)dst, b64_pack_128(v));
+    dst += 12;
+  }
+  return i;
+}
+
+CODEC_AVX2 static size_t b64_encode_avx2(char *dst, const unsigned char *src, size_t len, const char *digits)
+{
+  const __m128i offsets = b64_offsets_128(digits);
+  const __m256i offsets2 = _mm256_broadcastsi128_si256(offsets);
+  const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  size_t i = 0;
+  for (; i + 28 <= len; i += 24) {
+    __m256i in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + i))),
+        _mm_loadu_si128((const __m128i *)(src + i + 12)), 1);
+    __m256i t0, t1, t2, t3, idx, r, less;
+    in = _mm256_shuffle_epi8(in, shuf);
+    t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    idx = _mm256_or_si256(t1, t3);
+    r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+    r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    _mm256_storeu_si256((__m256i *)dst, _mm256_add_epi8(_mm256_shuffle_epi8(offsets2, r), idx));
+    dst += 32;
+  }
+  return i + b64_encode_ssse3(dst, src + i, len - i, digits);
+}
+
+CODEC_AVX2 static size_t b64_decode_avx2(unsigned char *dst, const char *src, size_t len, const char *digits)
+{
+#define IN_RANGE(lo, hi) _mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8(v, _mm256_set1_epi8(lo)), \
+                           _mm256_set1_epi8((hi) - (lo))), _mm256_sub_epi8(v, _mm256_set1_epi8(lo)))
+  const __m256i shuf = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  size_t i = 0;
+  /* each step writes 32 bytes but produces only 24, so keep 12 characters spare */
+  for (; i + 44 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i upper = IN_RANGE('A', 'Z');
+    __m256i lower = IN_RANGE('a', 'z');
+    __m256i digit = IN_RANGE('0', '9');
+    __m256i c62 = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(digits[62]));
+    __m256i c63 = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(digits[63]));
+    __m256i ok = _mm256_or_si256(_mm256_or_si256(upper, lower),
+                                 _mm256_or_si256(digit, _mm256_or_si256(c62, c63)));
+    __m256i r;
+    if (_mm256_movemask_epi8(ok) != -1)
+      break;
+    r = _mm256_and_si256(upper, _mm256_sub_epi8(v, _mm256_set1_epi8('A')));
+    r = _mm256_or_si256(r, _mm256_and_si256(lower, _mm256_sub_epi8(v, _mm256_set1_epi8('a' - 26))));
+    r = _mm256_or_si256(r, _mm256_and_si256(digit, _mm256_add_epi8(v, _mm256_set1_epi8(52 - '0'))));
+    r = _mm256_or_si256(r, _mm256_and_si256(c62, _mm256_set1_epi8(62)));
+    r = _mm256_or_si256(r, _mm256_and_si256(c63, _mm256_set1_epi8(63)));
+    r = _mm256_maddubs_epi16(r, _mm256_set1_epi32(0x01400140));
+    r = _mm256_madd_epi16(r, _mm256_set1_epi32(0x00011000));
+    r = _mm256_shuffle_epi8(r, shuf);
+    r = _mm256_permutevar8x32_epi32(r, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm256_storeu_si256((__m256i *)dst, r);
+    dst += 24;
+  }
+#undef IN_RANGE
+  return i + b64_decode_ssse3(dst, src + i, len - i, digits);
+}
+
+#endif
+
+size_t codec_base64_encode(char *dst, const unsigned char *src, size_t len, int flags)
+{
+  const char *digits = flags & CODEC_BASE64_URL ? b64_url_digits : b64_std_digits;
+  char *start = dst;
+  size_t i = 0, rem;
+
+  switch (codec_level()) {
+#ifdef CODEC_X86
+  case CODEC_USE_AVX2:
+    i = b64_encode_avx2(dst, src, len, digits);
+    break;
+  case CODEC_USE_SSSE3:
+    i = b64_encode_ssse3(dst, src, len, digits);
+    break;
+#endif
+  default:
+    break;
+  }
+  dst += i / 3 * 4;
+  rem = (len - i) % 3;
+  b64_encode_scalar(dst, src + i, len - i - rem, digits);
+  dst += (len - i - rem) / 3 * 4;
+  src += len - rem;
+
+  if (rem) {
+    uint32_t v = (uint32_t)src[0] << 16;
+    if (rem == 2)
+      v |= (uint32_t)src[1] << 8;
+    *dst++ = digits[v >> 18];
+    *dst++ = digits[(v >> 12) & 0x3f];
+    if (rem == 2)
+      *dst++ = digits[(v >> 6) & 0x3f];
+    if (!(flags & CODEC_BASE64_NOPAD)) {
+      if (rem == 1)
+        *dst++ = '=';
+      *dst++ = '=';
+    }
+  }
+  return dst - start;
+}
+
+int codec_base64_decode(unsigned char *dst, size_t *dlen, const char *src, size_t len, int flags)
+{
+  const char *digits = flags & CODEC_BASE64_URL ? b64_url_digits : b64_std_digits;
+  const unsigned char *values = flags & CODEC_BASE64_URL ? b64_url_values : b64_std_values;
+  unsigned char *start = dst;
+  unsigned char a, b, c = 0;
+  size_t i = 0, tail;
+
+  /* strip the padding; what is left may end in a partial group */
+  if (len % 4 == 0 && len > 0 && src[len - 1] == '=')
+    len -= src[len - 2] == '=' ? 2 : 1;
+  tail = len % 4;
+  if (tail == 1)
+    return 0;
+
+  switch (codec_level()) {
+#ifdef CODEC_X86
+  case CODEC_USE_AVX2:
+    i = b64_decode_avx2(dst, src, len, digits);
+    break;
+  case CODEC_USE_SSSE3:
+    i = b64_decode_ssse3(dst, src, len, digits);
+    break;
+#endif
+  default:
+    (void)digits;
+    break;
+  }
+  dst += i / 4 * 3;
+  if (!b64_decode_scalar(dst, src + i, len - i - tail, values))
+    return 0;
+  dst += (len - i - tail) / 4 * 3;
+  src += len - tail;
+
+  if (tail) {
+    a = values[(unsigned char)src[0]];
+    b = values[(unsigned char)src[1]];
+    if (tail == 3)
+      c = values[(unsigned char)src[2]];
+    if ((a | b | c) & 0xc0)
+      return 0;
+    /* the bits past the last byte must be zero, or "QR==" would decode like "QQ==" */
+    if (tail == 2 ? (b & 0x0f) : (c & 0x03))
+      return 0;
+    *dst++ = (unsigned char)((a << 2) | (b >> 4));
+    if (tail == 3)
+      *dst++ = (unsigned char)((b << 4) | (c >> 2));
+  }
+  *dlen = dst - start;
+  return 1;
+}
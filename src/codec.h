@@ -0,0 +1,44 @@
+/*
+** Binary-to-text encoders shared by the LuaCrypto bindings.
+** See Copyright Notice in license.html
+*/
+
+#ifndef _LUACRYPTO_CODEC_
+#define _LUACRYPTO_CODEC_
+
+#include <stddef.h>
+
+/*
+** Writes the 2*len lowercase hex digits of src to dst (not terminated).
+*/
+void codec_hex_encode (char *dst, const unsigned char *src, size_t len);
+
+/*
+** Decodes the 2*len hex digits of src (either case) into len bytes at
+** dst. Returns 0 if src holds a non-hex character, 1 otherwise.
+*/
+int codec_hex_decode (unsigned char *dst, const char *src, size_t len);
+
+#define CODEC_BASE64_URL    1  /* "-_" instead of "+/" as the last two digits */
+#define CODEC_BASE64_NOPAD  2  /* no trailing '=' when encoding */
+
+/*
+** Worst-case number of characters produced by codec_base64_encode.
+*/
+#define CODEC_BASE64_ENCODED_LEN(len)  (((len) + 2) / 3 * 4)
+
+/*
+** Writes the base64 encoding of src to dst (not terminated) and returns
+** the number of characters written.
+*/
+size_t codec_base64_encode (char *dst, const unsigned char *src, size_t len, int flags);
+
+/*
+** Decodes the base64 text src, with or without padding, into dst, which
+** must hold len / 4 * 3 + 2 bytes. Stores the decoded length in *dlen.
+** Returns 0 if src is not valid base64 for the alphabet in flags,
+** including a last digit with non-zero bits past the final byte.
+*/
+int codec_base64_decode (unsigned char *dst, size_t *dlen, const char *src, size_t len, int flags);
+
+#endif
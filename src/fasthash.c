@@ -0,0 +1,727 @@
+/*
+** Non-cryptographic hashes: XXH3 (64 and 128 bits) and SipHash-2-4.
+** See Copyright Notice in license.html
+**
+** XXH3 follows the xxHash 0.8 specification by Yann Collet. Long inputs
+** go through 64 byte stripes mixed into eight 64-bit accumulators, with
+** scalar, SSE2 and AVX2 versions of the stripe loop picked at run time.
+** SipHash-2-4 is the reference construction of Aumasson and Bernstein.
+*/
+
+#include <string.h>
+
+#include "fasthash.h"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define FASTHASH_X86 1
+#include <immintrin.h>
+#define FASTHASH_SSE2 __attribute__((target("sse2")))
+#define FASTHASH_AVX2 __attribute__((target("avx2")))
+#endif
+
+#define P32_1 UINT32_C(0x9E3779B1)
+#define P32_2 UINT32_C(0x85EBCA77)
+#define P32_3 UINT32_C(0xC2B2AE3D)
+#define P64_1 UINT64_C(0x9E3779B185EBCA87)
+#define P64_2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define P64_3 UINT64_C(0x165667B19E3779F9)
+#define P64_4 UINT64_C(0x85EBCA77C2B2AE63)
+#define P64_5 UINT64_C(0x27D4EB2F165667C5)
+
+static uint32_t read32(const unsigned char *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+  return (uint64_t)read32(p) | (uint64_t)read32(p + 4) << 32;
+}
+
+static void write64le(unsigned char *p, uint64_t v)
+{
+  int i;
+  for (i = 0; i < 8; i++)
+    p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void write64be(unsigned char *p, uint64_t v)
+{
+  int i;
+  for (i = 0; i < 8; i++)
+    p[i] = (unsigned char)(v >> (56 - 8 * i));
+}
+
+static uint64_t rotl64(uint64_t v, int n)
+{
+  return v << n | v >> (64 - n);
+}
+
+static uint64_t swap64(uint64_t v)
+{
+  v = (v & UINT64_C(0x00FF00FF00FF00FF)) << 8 | (v >> 8 & UINT64_C(0x00FF00FF00FF00FF));
+  v = (v & UINT64_C(0x0000FFFF0000FFFF)) << 16 | (v >> 16 & UINT64_C(0x0000FFFF0000FFFF));
+  return v << 32 | v >> 32;
+}
+
+static uint32_t swap32(uint32_t v)
+{
+  return v << 24 | (v & 0xff00) << 8 | (v >> 8 & 0xff00) | v >> 24;
+}
+
+static void mul128(uint64_t a, uint64_t b, uint64_t *lo, uint64_t *hi)
+{
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 p = (unsigned __int128)a * b;
+  *lo = (uint64_t)p;
+  *hi = (uint64_t)(p >> 64);
+#else
+  uint64_t ll = (a & 0xffffffff) * (b & 0xffffffff);
+  uint64_t hl = (a >> 32) * (b & 0xffffffff);
+  uint64_t lh = (a & 0xffffffff) * (b >> 32);
+  uint64_t hh = (a >> 32) * (b >> 32);
+  uint64_t cross = (ll >> 32) + (hl & 0xffffffff) + lh;
+  *hi = (hl >> 32) + (cross >> 32) + hh;
+  *lo = cross << 32 | (ll & 0xffffffff);
+#endif
+}
+
+static uint64_t mul128_fold64(uint64_t a, uint64_t b)
+{
+  uint64_t lo, hi;
+  mul128(a, b, &lo, &hi);
+  return lo ^ hi;
+}
+
+/*************** XXH3 ***************/
+
+#define STRIPE_LEN      64
+#define SECRET_LEN      192
+#define BUFFER_LEN      256
+#define STRIPES_PER_BLOCK ((SECRET_LEN - STRIPE_LEN) / 8)
+#define MIDSIZE_MAX     240
+
+static const unsigned char xxh3_secret[SECRET_LEN] = {
+  0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+  0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+  0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+  0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+  0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+  0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+  0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+  0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+  0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+  0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+  0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+  0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+static const uint64_t xxh3_init_acc[8] = {
+  P32_3, P64_1, P64_2, P64_3, P64_4, P32_2, P64_5, P32_1
+};
+
+static uint64_t xxh64_avalanche(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= P64_2;
+  h ^= h >> 29;
+  h *= P64_3;
+  return h ^ (h >> 32);
+}
+
+static uint64_t xxh3_avalanche(uint64_t h)
+{
+  h ^= h >> 37;
+  h *= UINT64_C(0x165667919E3779F9);
+  return h ^ (h >> 32);
+}
+
+static uint64_t xxh3_rrmxmx(uint64_t h, uint64_t len)
+{
+  h ^= rotl64(h, 49) ^ rotl64(h, 24);
+  h *= UINT64_C(0x9FB21C651E98DF25);
+  h ^= (h >> 35) + len;
+  h *= UINT64_C(0x9FB21C651E98DF25);
+  return h ^ (h >> 28);
+}
+
+static uint64_t xxh3_mix16(const unsigned char *in, const unsigned char *secret, uint64_t seed)
+{
+  return mul128_fold64(read64(in) ^ (read64(secret) + seed),
+                       read64(in + 8) ^ (read64(secret + 8) - seed));
+}
+
+/* the secret the seed stands for on inputs over MIDSIZE_MAX bytes */
+static void xxh3_derive_secret(unsigned char *secret, uint64_t seed)
+{
+  int i;
+  for (i = 0; i < SECRET_LEN; i += 16) {
+    write64le(secret + i, read64(xxh3_secret + i) + seed);
+    write64le(secret + i + 8, read64(xxh3_secret + i + 8) - seed);
+  }
+}
+
+/* stripe loops: accumulate nstripes stripes, the secret moving 8 bytes per stripe */
+
+static void xxh3_accumulate_scalar(uint64_t *acc, const unsigned char *in,
+                                   const unsigned char *secret, size_t nstripes)
+{
+  size_t n;
+  int i;
+  for (n = 0; n < nstripes; n++, in += STRIPE_LEN, secret += 8) {
+    for (i = 0; i < 8; i++) {
+      uint64_t v = read64(in + 8 * i);
+      uint64_t k = v ^ read64(secret + 8 * i);
+      acc[i ^ 1] += v;
+      acc[i] += (k & 0xffffffff) * (k >> 32);
+    }
+  }
+}
+
+static void xxh3_scramble_scalar(uint64_t *acc, const unsigned char *secret)
+{
+  int i;
+  for (i = 0; i < 8; i++) {
+    uint64_t a = acc[i];
+    a ^= a >> 47;
+    a ^= read64(secret + 8 * i);
+    acc[i] = a * P32_1;
+  }
+}
+
+#ifdef FASTHASH_X86
+
+FASTHASH_SSE2 static void xxh3_accumulate_sse2(uint64_t *acc, const unsigned char *in,
+                                               const unsigned char *secret, size_t nstripes)
+{
+  __m128i a[4];
+  size_t n;
+  int i;
+  for (i = 0; i < 4; i++)
+    a[i] = _mm_loadu_si128((const __m128i *)acc + i);
+  for (n = 0; n < nstripes; n++, in += STRIPE_LEN, secret += 8) {
+    for (i = 0; i < 4; i++) {
+      __m128i v = _mm_loadu_si128((const __m128i *)in + i);
+      __m128i k = _mm_xor_si128(v, _mm_loadu_si128((const __m128i *)secret + i));
+      __m128i p = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+      a[i] = _mm_add_epi64(a[i], _mm_add_epi64(p, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2))));
+    }
+  }
+  for (i = 0; i < 4; i++)
+    _mm_storeu_si128((__m128i *)acc + i, a[i]);
+}
+
+FASTHASH_SSE2 static void xxh3_scramble_sse2(uint64_t *acc, const unsigned char *secret)
+{
+  const __m128i prime = _mm_set1_epi32((int)P32_1);
+  int i;
+  for (i = 0; i < 4; i++) {
+    __m128i a = _mm_loadu_si128((const __m128i *)acc + i);
+    __m128i k = _mm_xor_si128(_mm_xor_si128(a, _mm_srli_epi64(a, 47)),
+                              _mm_loadu_si128((const __m128i *)secret + i));
+    __m128i lo = _mm_mul_epu32(k, prime);
+    __m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+    _mm_storeu_si128((__m128i *)acc + i, _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+  }
+}
+
+FASTHASH_AVX2 static void xxh3_accumulate_avx2(uint64_t *acc, const unsigned char *in,
+                                               const unsigned char *secret, size_t nstripes)
+{
+  __m256i a0 = _mm256_loadu_si256((const __m256i *)acc);
+  __m256i a1 = _mm256_loadu_si256((const __m256i *)acc + 1);
+  size_t n;
+  for (n = 0; n < nstripes; n++, in += STRIPE_LEN, secret += 8) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)in);
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)in + 1);
+    __m256i k0 = _mm256_xor_si256(v0, _mm256_loadu_si256((const __m256i *)secret));
+    __m256i k1 = _mm256_xor_si256(v1, _mm256_loadu_si256((const __m256i *)secret + 1));
+    __m256i p0 = _mm256_mul_epu32(k0, _mm256_srli_epi64(k0, 32));
+    __m256i p1 = _mm256_mul_epu32(k1, _mm256_srli_epi64(k1, 32));
+    a0 = _mm256_add_epi64(a0, _mm256_add_epi64(p0, _mm256_shuffle_epi32(v0, _MM_SHUFFLE(1, 0, 3, 2))));
+    a1 = _mm256_add_epi64(a1, _mm256_add_epi64(p1, _mm256_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2))));
+  }
+  _mm256_storeu_si256((__m256i *)acc, a0);
+  _mm256_storeu_si256((__m256i *)acc + 1, a1);
+}
+
+FASTHASH_AVX2 static void xxh3_scramble_avx2(uint64_t *acc, const unsigned char *secret)
+{
+  const __m256i prime = _mm256_set1_epi32((int)P32_1);
+  int i;
+  for (i = 0; i < 2; i++) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)acc + i);
+    __m256i k = _mm256_xor_si256(_mm256_xor_si256(a, _mm256_srli_epi64(a, 47)),
+                                 _mm256_loadu_si256((const __m256i *)secret + i));
+    __m256i lo = _mm256_mul_epu32(k, prime);
+    __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(k, 32), prime);
+    _mm256_storeu_si256((__m256i *)acc + i, _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)));
+  }
+}
+
+#endif
+
+/*************** CPU DISPATCH ***************/
+
+typedef void (*xxh3_accumulate_fn)(uint64_t *, const unsigned char *, const unsigned char *, size_t);
+typedef void (*xxh3_scramble_fn)(uint64_t *, const unsigned char *);
+
+static xxh3_accumulate_fn xxh3_accumulate = NULL;
+static xxh3_scramble_fn xxh3_scramble = NULL;
+
+static void xxh3_pick(void)
+{
+  xxh3_accumulate_fn accumulate = xxh3_accumulate_scalar;
+  xxh3_scramble_fn scramble = xxh3_scramble_scalar;
+#ifdef FASTHASH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    accumulate = xxh3_accumulate_avx2;
+    scramble = xxh3_scramble_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2")) {
+    accumulate = xxh3_accumulate_sse2;
+    scramble = xxh3_scramble_sse2;
+  }
+#endif
+  /* racing threads store the same pointers */
+  xxh3_scramble = scramble;
+  xxh3_accumulate = accumulate;
+}
+
+#define XXH3_READY() do { if (xxh3_accumulate == NULL) xxh3_pick(); } while (0)
+
+/*************** XXH3 SHORT INPUTS ***************/
+
+static uint64_t xxh3_64_0to16(const unsigned char *in, size_t len, const unsigned char *s, uint64_t seed)
+{
+  if (len > 8) {
+    uint64_t lo = read64(in) ^ ((read64(s + 24) ^ read64(s + 32)) + seed);
+    uint64_t hi = read64(in + len - 8) ^ ((read64(s + 40) ^ read64(s + 48)) - seed);
+    return xxh3_avalanche(len + swap64(lo) + hi + mul128_fold64(lo, hi));
+  }
+  if (len >= 4) {
+    uint64_t in64, flip;
+    seed ^= (uint64_t)swap32((uint32_t)seed) << 32;
+    in64 = read32(in + len - 4) + ((uint64_t)read32(in) << 32);
+    flip = (read64(s + 8) ^ read64(s + 16)) - seed;
+    return xxh3_rrmxmx(in64 ^ flip, len);
+  }
+  if (len > 0) {
+    uint32_t combo = (uint32_t)in[0] << 16 | (uint32_t)in[len >> 1] << 24 |
+                     (uint32_t)in[len - 1] | (uint32_t)len << 8;
+    return xxh64_avalanche(combo ^ ((uint64_t)(read32(s) ^ read32(s + 4)) + seed));
+  }
+  return xxh64_avalanche(seed ^ read64(s + 56) ^ read64(s + 64));
+}
+
+static uint64_t xxh3_64_17to128(const unsigned char *in, size_t len, const unsigned char *s, uint64_t seed)
+{
+  uint64_t acc = len * P64_1;
+  if (len > 32) {
+    if (len > 64) {
+      if (len > 96) {
+        acc += xxh3_mix16(in + 48, s + 96, seed);
+        acc += xxh3_mix16(in + len - 64, s + 112, seed);
+      }
+      acc += xxh3_mix16(in + 32, s + 64, seed);
+      acc += xxh3_mix16(in + len - 48, s + 80, seed);
+    }
+    acc += xxh3_mix16(in + 16, s + 32, seed);
+    acc += xxh3_mix16(in + len - 32, s + 48, seed);
+  }
+  acc += xxh3_mix16(in, s, seed);
+  acc += xxh3_mix16(in + len - 16, s + 16, seed);
+  return xxh3_avalanche(acc);
+}
+
+static uint64_t xxh3_64_129to240(const unsigned char *in, size_t len, const unsigned char *s, uint64_t seed)
+{
+  uint64_t acc = len * P64_1;
+  size_t i, rounds = len / 16;
+  for (i = 0; i < 8; i++)
+    acc += xxh3_mix16(in + 16 * i, s + 16 * i, seed);
+  acc = xxh3_avalanche(acc);
+  for (i = 8; i < rounds; i++)
+    acc += xxh3_mix16(in + 16 * i, s + 16 * (i - 8) + 3, seed);
+  acc += xxh3_mix16(in + len - 16, s + 136 - 17, seed);
+  return xxh3_avalanche(acc);
+}
+
+static void xxh3_mix32(uint64_t *lo, uint64_t *hi, const unsigned char *a, const unsigned char *b,
+                       const unsigned char *s, uint64_t seed)
+{
+  *lo += xxh3_mix16(a, s, seed);
+  *lo ^= read64(b) + read64(b + 8);
+  *hi += xxh3_mix16(b, s + 16, seed);
+  *hi ^= read64(a) + read64(a + 8);
+}
+
+static void xxh3_128_finish(uint64_t lo, uint64_t hi, size_t len, uint64_t seed, uint64_t *h)
+{
+  h[0] = xxh3_avalanche(lo + hi);
+  h[1] = 0 - xxh3_avalanche(lo * P64_1 + hi * P64_4 + (len - seed) * P64_2);
+}
+
+/* h[0] is the low half, h[1] the high one */
+static void xxh3_128_0to16(const unsigned char *in, size_t len, const unsigned char *s, uint64_t seed, uint64_t *h)
+{
+  if (len > 8) {
+    uint64_t flip_lo = (read64(s + 32) ^ read64(s + 40)) - seed;
+    uint64_t flip_hi = (read64(s + 48) ^ read64(s + 56)) + seed;
+    uint64_t in_lo = read64(in), in_hi = read64(in + len - 8);
+    uint64_t mlo, mhi, rlo, rhi;
+    mul128(in_lo ^ in_hi ^ flip_lo, P64_1, &mlo, &mhi);
+    mlo += (uint64_t)(len - 1) << 54;
+    in_hi ^= flip_hi;
+    mhi += in_hi + (uint64_t)(uint32_t)in_hi * (P32_2 - 1);
+    mlo ^= swap64(mhi);
+    mul128(mlo, P64_2, &rlo, &rhi);
+    rhi += mhi * P64_2;
+    h[0] = xxh3_avalanche(rlo);
+    h[1] = xxh3_avalanche(rhi);
+    return;
+  }
+  if (len >= 4) {
+    uint64_t in64, lo, hi;
+    seed ^= (uint64_t)swap32((uint32_t)seed) << 32;
+    in64 = read32(in) + ((uint64_t)read32(in + len - 4) << 32);
+    mul128(in64 ^ ((read64(s + 16) ^ read64(s + 24)) + seed), P64_1 + ((uint64_t)len << 2), &lo, &hi);
+    hi += lo << 1;
+    lo ^= hi >> 3;
+    lo ^= lo >> 35;
+    lo *= UINT64_C(0x9FB21C651E98DF25);
+    lo ^= lo >> 28;
+    h[0] = lo;
+    h[1] = xxh3_avalanche(hi);
+    return;
+  }
+  if (len > 0) {
+    uint32_t in_lo = (uint32_t)in[0] << 16 | (uint32_t)in[len >> 1] << 24 |
+                     (uint32_t)in[len - 1] | (uint32_t)len << 8;
+    uint32_t in_hi = swap32(in_lo);
+    in_hi = in_hi << 13 | in_hi >> 19;
+    h[0] = xxh64_avalanche(in_lo ^ ((uint64_t)(read32(s) ^ read32(s + 4)) + seed));
+    h[1] = xxh64_avalanche(in_hi ^ ((uint64_t)(read32(s + 8) ^ read32(s + 12)) - seed));
+    return;
+  }
+  h[0] = xxh64_avalanche(seed ^ read64(s + 64) ^ read64(s + 72));
+  h[1] = xxh64_avalanche(seed ^ read64(s + 80) ^ read64(s + 88));
+}
+
+static void xxh3_128_17to128(const unsigned char *in, size_t len, const unsigned char *s, uint64_t seed, uint64_t *h)
+{
+  uint64_t lo = len * P64_1, hi = 0;
+  if (len > 32) {
+    if (len > 64) {
+      if (len > 96)
+        xxh3_mix32(&lo, &hi, in + 48, in + len - 64, s + 96, seed);
+      xxh3_mix32(&lo, &hi, in + 32, in + len - 48, s + 64, seed);
+    }
+    xxh3_mix32(&lo, &hi, in + 16, in + len - 32, s + 32, seed);
+  }
+  xxh3_mix32(&lo, &hi, in, in + len - 16, s, seed);
+  xxh3_128_finish(lo, hi, len, seed, h);
+}
+
+static void xxh3_128_129to240(const unsigned char *in, size_t len, const unsigned char *s, uint64_t seed, uint64_t *h)
+{
+  uint64_t lo = len * P64_1, hi = 0;
+  size_t i, rounds = len / 32;
+  for (i = 0; i < 4; i++)
+    xxh3_mix32(&lo, &hi, in + 32 * i, in + 32 * i + 16, s + 32 * i, seed);
+  lo = xxh3_avalanche(lo);
+  hi = xxh3_avalanche(hi);
+  for (i = 4; i < rounds; i++)
+    xxh3_mix32(&lo, &hi, in + 32 * i, in + 32 * i + 16, s + 3 + 32 * (i - 4), seed);
+  xxh3_mix32(&lo, &hi, in + len - 16, in + len - 32, s + 136 - 17 - 16, 0 - seed);
+  xxh3_128_finish(lo, hi, len, seed, h);
+}
+
+/*************** XXH3 LONG INPUTS ***************/
+
+static uint64_t xxh3_merge(const uint64_t *acc, const unsigned char *s, uint64_t start)
+{
+  int i;
+  for (i = 0; i < 4; i++)
+    start += mul128_fold64(acc[2 * i] ^ read64(s + 16 * i), acc[2 * i + 1] ^ read64(s + 16 * i + 8));
+  return xxh3_avalanche(start);
+}
+
+static void xxh3_long_final(const uint64_t *acc, const unsigned char *secret, uint64_t len, int alg, uint64_t *h)
+{
+  h[0] = xxh3_merge(acc, secret + 11, len * P64_1);
+  if (alg == FASTHASH_XXH128)
+    h[1] = xxh3_merge(acc, secret + SECRET_LEN - 64 - 11, ~(len * P64_2));
+}
+
+static void xxh3_long(const unsigned char *in, size_t len, const unsigned char *secret, int alg, uint64_t *h)
+{
+  uint64_t acc[8];
+  size_t block = STRIPE_LEN * STRIPES_PER_BLOCK;
+  size_t i, blocks = (len - 1) / block;
+
+  memcpy(acc, xxh3_init_acc, sizeof(acc));
+  for (i = 0; i < blocks; i++) {
+    xxh3_accumulate(acc, in + i * block, secret, STRIPES_PER_BLOCK);
+    xxh3_scramble(acc, secret + SECRET_LEN - STRIPE_LEN);
+  }
+  xxh3_accumulate(acc, in + blocks * block, secret, (len - 1 - blocks * block) / STRIPE_LEN);
+  /* the last stripe, overlapping the previous one */
+  xxh3_accumulate(acc, in + len - STRIPE_LEN, secret + SECRET_LEN - STRIPE_LEN - 7, 1);
+  xxh3_long_final(acc, secret, len, alg, h);
+}
+
+static void xxh3_hash(int alg, const unsigned char *in, size_t len, uint64_t seed,
+                      const unsigned char *derived, uint64_t *h)
+{
+  const unsigned char *s = xxh3_secret;
+  if (alg == FASTHASH_XXH3) {
+    if (len <= 16)
+      h[0] = xxh3_64_0to16(in, len, s, seed);
+    else if (len <= 128)
+      h[0] = xxh3_64_17to128(in, len, s, seed);
+    else if (len <= MIDSIZE_MAX)
+      h[0] = xxh3_64_129to240(in, len, s, seed);
+    else
+      xxh3_long(in, len, derived, alg, h);
+  }
+  else {
+    if (len <= 16)
+      xxh3_128_0to16(in, len, s, seed, h);
+    else if (len <= 128)
+      xxh3_128_17to128(in, len, s, seed, h);
+    else if (len <= MIDSIZE_MAX)
+      xxh3_128_129to240(in, len, s, seed, h);
+    else
+      xxh3_long(in, len, derived, alg, h);
+  }
+}
+
+/*
+** Accumulates nstripes stripes of in, scrambling at the end of each
+** block. Returns the stripes accumulated in the last block.
+*/
+static size_t xxh3_consume(uint64_t *acc, size_t done, const unsigned char *in, size_t nstripes,
+                           const unsigned char *secret)
+{
+  if (STRIPES_PER_BLOCK - done <= nstripes) {
+    size_t first = STRIPES_PER_BLOCK - done;
+    xxh3_accumulate(acc, in, secret + 8 * done, first);
+    xxh3_scramble(acc, secret + SECRET_LEN - STRIPE_LEN);
+    xxh3_accumulate(acc, in + first * STRIPE_LEN, secret, nstripes - first);
+    return nstripes - first;
+  }
+  xxh3_accumulate(acc, in, secret + 8 * done, nstripes);
+  return done + nstripes;
+}
+
+/*
+** The buffer holds at most BUFFER_LEN bytes, and is only consumed when
+** more input follows, so the last stripe is always left for the final.
+** Inputs of up to MIDSIZE_MAX bytes thus stay whole in the buffer.
+*/
+static void xxh3_update(fasthash_ctx *c, const unsigned char *in, size_t len)
+{
+  size_t nstripes = BUFFER_LEN / STRIPE_LEN;
+
+  if (c->buffered + len <= BUFFER_LEN) {
+    memcpy(c->u.xxh3.buffer + c->buffered, in, len);
+    c->buffered += len;
+    return;
+  }
+  if (c->buffered > 0) {
+    size_t fill = BUFFER_LEN - c->buffered;
+    memcpy(c->u.xxh3.buffer + c->buffered, in, fill);
+    in += fill;
+    len -= fill;
+    c->u.xxh3.stripes = xxh3_consume(c->u.xxh3.acc, c->u.xxh3.stripes, c->u.xxh3.buffer,
+                                     nstripes, c->u.xxh3.secret);
+    c->buffered = 0;
+  }
+  if (len > BUFFER_LEN) {
+    do {
+      c->u.xxh3.stripes = xxh3_consume(c->u.xxh3.acc, c->u.xxh3.stripes, in,
+                                       nstripes, c->u.xxh3.secret);
+      in += BUFFER_LEN;
+      len -= BUFFER_LEN;
+    } while (len > BUFFER_LEN);
+    /* kept for a last stripe that reaches back before the buffered bytes */
+    memcpy(c->u.xxh3.buffer + BUFFER_LEN - STRIPE_LEN, in - STRIPE_LEN, STRIPE_LEN);
+  }
+  memcpy(c->u.xxh3.buffer, in, len);
+  c->buffered = len;
+}
+
+static void xxh3_final(const fasthash_ctx *c, uint64_t *h)
+{
+  const unsigned char *buffer = c->u.xxh3.buffer;
+  const unsigned char *secret = c->u.xxh3.secret;
+  uint64_t acc[8];
+
+  if (c->total <= MIDSIZE_MAX) {
+    xxh3_hash(c->alg, buffer, c->buffered, c->u.xxh3.seed, secret, h);
+    return;
+  }
+  memcpy(acc, c->u.xxh3.acc, sizeof(acc));
+  if (c->buffered >= STRIPE_LEN) {
+    xxh3_consume(acc, c->u.xxh3.stripes, buffer, (c->buffered - 1) / STRIPE_LEN, secret);
+    xxh3_accumulate(acc, buffer + c->buffered - STRIPE_LEN, secret + SECRET_LEN - STRIPE_LEN - 7, 1);
+  }
+  else {
+    unsigned char last[STRIPE_LEN];
+    size_t catchup = STRIPE_LEN - c->buffered;
+    memcpy(last, buffer + BUFFER_LEN - catchup, catchup);
+    memcpy(last + catchup, buffer, c->buffered);
+    xxh3_accumulate(acc, last, secret + SECRET_LEN - STRIPE_LEN - 7, 1);
+  }
+  xxh3_long_final(acc, secret, c->total, c->alg, h);
+}
+
+/*************** SIPHASH ***************/
+
+#define SIPROUND(v) do { \
+    v[0] += v[1]; v[1] = rotl64(v[1], 13); v[1] ^= v[0]; v[0] = rotl64(v[0], 32); \
+    v[2] += v[3]; v[3] = rotl64(v[3], 16); v[3] ^= v[2]; \
+    v[0] += v[3]; v[3] = rotl64(v[3], 21); v[3] ^= v[0]; \
+    v[2] += v[1]; v[1] = rotl64(v[1], 17); v[1] ^= v[2]; v[2] = rotl64(v[2], 32); \
+  } while (0)
+
+static void sip_init(uint64_t *v, const unsigned char *key)
+{
+  uint64_t k0 = read64(key), k1 = read64(key + 8);
+  v[0] = k0 ^ UINT64_C(0x736f6d6570736575);
+  v[1] = k1 ^ UINT64_C(0x646f72616e646f6d);
+  v[2] = k0 ^ UINT64_C(0x6c7967656e657261);
+  v[3] = k1 ^ UINT64_C(0x7465646279746573);
+}
+
+static void sip_blocks(uint64_t *v, const unsigned char *in, size_t nblocks)
+{
+  uint64_t s[4];
+  size_t i;
+  memcpy(s, v, sizeof(s));
+  for (i = 0; i < nblocks; i++, in += 8) {
+    uint64_t m = read64(in);
+    s[3] ^= m;
+    SIPROUND(s);
+    SIPROUND(s);
+    s[0] ^= m;
+  }
+  memcpy(v, s, sizeof(s));
+}
+
+/* tail holds the last total % 8 bytes */
+static uint64_t sip_final(const uint64_t *state, const unsigned char *tail, uint64_t total)
+{
+  uint64_t v[4], b = total << 56;
+  int i;
+  memcpy(v, state, sizeof(v));
+  for (i = (int)(total & 7) - 1; i >= 0; i--)
+    b |= (uint64_t)tail[i] << (8 * i);
+  v[3] ^= b;
+  SIPROUND(v);
+  SIPROUND(v);
+  v[0] ^= b;
+  v[2] ^= 0xff;
+  SIPROUND(v);
+  SIPROUND(v);
+  SIPROUND(v);
+  SIPROUND(v);
+  return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+static void sip_update(fasthash_ctx *c, const unsigned char *in, size_t len)
+{
+  if (c->buffered > 0) {
+    size_t fill = 8 - c->buffered < len ? 8 - c->buffered : len;
+    memcpy(c->u.sip.buffer + c->buffered, in, fill);
+    c->buffered += fill;
+    in += fill;
+    len -= fill;
+    if (c->buffered < 8)
+      return;
+    sip_blocks(c->u.sip.v, c->u.sip.buffer, 1);
+    c->buffered = 0;
+  }
+  sip_blocks(c->u.sip.v, in, len / 8);
+  memcpy(c->u.sip.buffer, in + (len & ~(size_t)7), len & 7);
+  c->buffered = len & 7;
+}
+
+/*************** INTERFACE ***************/
+
+size_t fasthash_size(int alg)
+{
+  return alg == FASTHASH_XXH128 ? 16 : 8;
+}
+
+void fasthash_init(fasthash_ctx *c, int alg, uint64_t seed, const unsigned char *key)
+{
+  c->alg = alg;
+  c->total = 0;
+  c->buffered = 0;
+  if (alg == FASTHASH_SIPHASH) {
+    sip_init(c->u.sip.v, key);
+    return;
+  }
+  XXH3_READY();
+  memcpy(c->u.xxh3.acc, xxh3_init_acc, sizeof(c->u.xxh3.acc));
+  c->u.xxh3.stripes = 0;
+  c->u.xxh3.seed = seed;
+  xxh3_derive_secret(c->u.xxh3.secret, seed);
+}
+
+void fasthash_update(fasthash_ctx *c, const unsigned char *data, size_t len)
+{
+  c->total += len;
+  if (c->alg == FASTHASH_SIPHASH)
+    sip_update(c, data, len);
+  else
+    xxh3_update(c, data, len);
+}
+
+static void fasthash_write(int alg, const uint64_t *h, unsigned char *out)
+{
+  if (alg == FASTHASH_SIPHASH)
+    write64le(out, h[0]);
+  else if (alg == FASTHASH_XXH3)
+    write64be(out, h[0]);
+  else {
+    write64be(out, h[1]);
+    write64be(out + 8, h[0]);
+  }
+}
+
+void fasthash_final(const fasthash_ctx *c, unsigned char *out)
+{
+  uint64_t h[2];
+  if (c->alg == FASTHASH_SIPHASH)
+    h[0] = sip_final(c->u.sip.v, c->u.sip.buffer, c->total);
+  else
+    xxh3_final(c, h);
+  fasthash_write(c->alg, h, out);
+}
+
+void fasthash_oneshot(int alg, uint64_t seed, const unsigned char *key,
+                      const unsigned char *data, size_t len, unsigned char *out)
+{
+  uint64_t h[2];
+  if (alg == FASTHASH_SIPHASH) {
+    uint64_t v[4];
+    sip_init(v, key);
+    sip_blocks(v, data, len / 8);
+    h[0] = sip_final(v, data + (len & ~(size_t)7), len);
+  }
+  else if (len <= MIDSIZE_MAX)
+    xxh3_hash(alg, data, len, seed, xxh3_secret, h);
+  else {
+    unsigned char secret[SECRET_LEN];
+    XXH3_READY();
+    if (seed != 0)
+      xxh3_derive_secret(secret, seed);
+    xxh3_hash(alg, data, len, seed, seed != 0 ? secret : xxh3_secret, h);
+  }
+  fasthash_write(alg, h, out);
+}
@@ -0,0 +1,66 @@
+/*
+** Non-cryptographic hashes: XXH3 (64 and 128 bits) and SipHash-2-4.
+** See Copyright Notice in license.html
+**
+** XXH3 is meant for hash tables, sharding and checksums of data nobody
+** is trying to collide; SipHash-2-4 is a keyed PRF for hash tables fed
+** with untrusted keys. Outputs are written in the canonical byte order
+** of each reference: big-endian for XXH3, little-endian for SipHash.
+*/
+
+#ifndef _LUACRYPTO_FASTHASH_
+#define _LUACRYPTO_FASTHASH_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum { FASTHASH_XXH3 = 1, FASTHASH_XXH128, FASTHASH_SIPHASH };
+
+#define FASTHASH_MAX_SIZE    16
+#define FASTHASH_SIPHASH_KEY 16
+
+typedef struct fasthash_ctx {
+  int alg;
+  uint64_t total;              /* bytes hashed so far */
+  size_t buffered;
+  union {
+    struct {
+      uint64_t acc[8];
+      size_t stripes;          /* stripes accumulated in the current block */
+      uint64_t seed;
+      unsigned char secret[192];
+      unsigned char buffer[256];
+    } xxh3;
+    struct {
+      uint64_t v[4];
+      unsigned char buffer[8];
+    } sip;
+  } u;
+} fasthash_ctx;
+
+/*
+** Size in bytes of the hash alg.
+*/
+size_t fasthash_size (int alg);
+
+/*
+** Starts a hash. XXH3 and XXH128 take seed, SipHash the 16 byte key.
+*/
+void fasthash_init (fasthash_ctx *c, int alg, uint64_t seed, const unsigned char *key);
+
+void fasthash_update (fasthash_ctx *c, const unsigned char *data, size_t len);
+
+/*
+** Writes the hash of the data so far to out. The context is left as it
+** was, so more data can follow.
+*/
+void fasthash_final (const fasthash_ctx *c, unsigned char *out);
+
+/*
+** Same as fasthash_init, fasthash_update and fasthash_final, without the
+** buffering.
+*/
+void fasthash_oneshot (int alg, uint64_t seed, const unsigned char *key,
+                       const unsigned char *data, size_t len, unsigned char *out);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+** Reading files straight into native consumers, without Lua strings.
+** See Copyright Notice in license.html
+**
+** Mapped windows are handed to the consumer as they are, so file data
+** is only read by the consumer itself. Like any mmap reader this does
+** not protect against the file being truncated while it is hashed.
+*/
+
+#if !defined(_WIN32) && !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fileio.h"
+
+/* size of the read buffer, and of each mapped window */
+#define FILEIO_BUFFER (1 << 20)
+#define FILEIO_WINDOW (64 << 20)
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+** Reads length bytes of fd starting at offset, without mapping it. fd
+** does not need to be seekable.
+*/
+static int fileio_readfd(int fd, uint64_t offset, uint64_t length, fileio_consumer fn, void *ud)
+{
+  unsigned char *buffer = malloc(FILEIO_BUFFER);
+  int err = 0;
+
+  if (buffer == NULL)
+    return ENOMEM;
+#if defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(fd, (off_t)offset, length == FILEIO_TO_END ? 0 : (off_t)length, POSIX_FADV_SEQUENTIAL);
+#endif
+  if (offset > 0 && lseek(fd, (off_t)offset, SEEK_SET) == (off_t)-1) {
+    /* not seekable: skip the bytes before offset */
+    while (offset > 0) {
+      ssize_t n = read(fd, buffer, offset < FILEIO_BUFFER ? (size_t)offset : FILEIO_BUFFER);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        err = n < 0 ? errno : 0;
+        length = 0;
+        break;
+      }
+      offset -= n;
+    }
+  }
+  while (err == 0 && length > 0) {
+    ssize_t n = read(fd, buffer, length < FILEIO_BUFFER ? (size_t)length : FILEIO_BUFFER);
+    if (n < 0) {
+      if (errno != EINTR)
+        err = errno;
+      continue;
+    }
+    if (n == 0)
+      break;
+    if (!fn(ud, buffer, (size_t)n))
+      err = FILEIO_ECONSUMER;
+    if (length != FILEIO_TO_END)
+      length -= n;
+  }
+  free(buffer);
+  return err;
+}
+
+int fileio_read(const char *path, uint64_t offset, uint64_t length, fileio_consumer fn, void *ud)
+{
+  struct stat st;
+  uint64_t end;
+  uint64_t page;
+  int err = 0;
+  int fd;
+
+  do {
+    fd = open(path, O_RDONLY);
+  } while (fd < 0 && errno == EINTR);
+  if (fd < 0)
+    return errno;
+  if (fstat(fd, &st) != 0) {
+    err = errno;
+    close(fd);
+    return err;
+  }
+  if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+    /* pipes, devices and files like those in /proc report no useful size */
+    err = fileio_readfd(fd, offset, length, fn, ud);
+    close(fd);
+    return err;
+  }
+
+  if (offset >= (uint64_t)st.st_size) {
+    close(fd);
+    return 0;
+  }
+  end = length == FILEIO_TO_END || length > (uint64_t)st.st_size - offset
+        ? (uint64_t)st.st_size : offset + length;
+  page = (uint64_t)sysconf(_SC_PAGESIZE);
+
+  while (offset < end) {
+    /* windows start on a page boundary at or before offset */
+    uint64_t base = offset - offset % page;
+    size_t map_len = end - base < FILEIO_WINDOW ? (size_t)(end - base) : FILEIO_WINDOW;
+    unsigned char *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, (off_t)base);
+    size_t skip = (size_t)(offset - base);
+    int ok;
+
+    if (map == MAP_FAILED) {
+      err = fileio_readfd(fd, offset, end - offset, fn, ud);
+      break;
+    }
+#if defined(POSIX_MADV_SEQUENTIAL)
+    posix_madvise(map, map_len, POSIX_MADV_SEQUENTIAL);
+#endif
+    ok = fn(ud, map + skip, map_len - skip);
+    munmap(map, map_len);
+    if (!ok) {
+      err = FILEIO_ECONSUMER;
+      break;
+    }
+    offset = base + map_len;
+  }
+  close(fd);
+  return err;
+}
+
+#else
+
+int fileio_read(const char *path, uint64_t offset, uint64_t length, fileio_consumer fn, void *ud)
+{
+  FILE *f = fopen(path, "rb");
+  unsigned char *buffer;
+  int err = 0;
+
+  if (f == NULL)
+    return errno;
+  buffer = malloc(FILEIO_BUFFER);
+  if (buffer == NULL) {
+    fclose(f);
+    return ENOMEM;
+  }
+  if (offset > 0 && _fseeki64(f, (__int64)offset, SEEK_SET) != 0)
+    err = errno;
+  while (err == 0 && length > 0) {
+    size_t n = fread(buffer, 1, length < FILEIO_BUFFER ? (size_t)length : FILEIO_BUFFER, f);
+    if (n == 0) {
+      if (ferror(f))
+        err = EIO;
+      break;
+    }
+    if (!fn(ud, buffer, n))
+      err = FILEIO_ECONSUMER;
+    if (length != FILEIO_TO_END)
+      length -= n;
+  }
+  free(buffer);
+  fclose(f);
+  return err;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/*
+** Reading files straight into native consumers, without Lua strings.
+** See Copyright Notice in license.html
+*/
+
+#ifndef _LUACRYPTO_FILEIO_
+#define _LUACRYPTO_FILEIO_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* length meaning "up to the end of the file" */
+#define FILEIO_TO_END ((uint64_t)-1)
+
+/* returned by fileio_read when the consumer failed */
+#define FILEIO_ECONSUMER (-1)
+
+/*
+** Receives consecutive pieces of the file. Returns 0 to stop with
+** FILEIO_ECONSUMER, non-zero to continue.
+*/
+typedef int (*fileio_consumer) (void *ud, const unsigned char *data, size_t len);
+
+/*
+** Feeds length bytes of the file at path, starting at offset, to fn.
+** The range is clipped to the end of the file. Regular files are
+** memory mapped in large windows with sequential access advice; other
+** files, or files that cannot be mapped, are read through a large
+** buffer. Returns 0 on success, an errno value on I/O errors or
+** FILEIO_ECONSUMER if fn failed.
+*/
+int fileio_read (const char *path, uint64_t offset, uint64_t length, fileio_consumer fn, void *ud);
+
+#endif
@@ -0,0 +1,285 @@
+/*
+** Key derivation functions: PBKDF2 (RFC 8018), HKDF (RFC 5869) and
+** scrypt (RFC 7914).
+** See Copyright Notice in license.html
+**
+** PBKDF2 keys one HMAC context per output block and resets it to the
+** keyed state for every iteration, so the key is hashed once per block
+** rather than once per iteration. scrypt is implemented here rather
+** than taken from OpenSSL, which only has it from 1.1.0 and runs the
+** lanes one after the other.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+
+#include "kdf.h"
+#include "pool.h"
+
+/*************** PBKDF2 ***************/
+
+typedef struct kdf_pbkdf2_job {
+  const EVP_MD *md;
+  const unsigned char *pass, *salt;
+  size_t passlen, saltlen, outlen;
+  unsigned long iter;
+  unsigned char *out;
+  volatile int failed;
+} kdf_pbkdf2_job;
+
+/*
+** Computes output block i (counting from 0) of a PBKDF2 job.
+*/
+static void kdf_pbkdf2_block(void *ud, size_t i)
+{
+  kdf_pbkdf2_job *j = ud;
+  size_t size = EVP_MD_size(j->md);
+  size_t len = j->outlen - i * size < size ? j->outlen - i * size : size;
+  unsigned char u[EVP_MAX_MD_SIZE], t[EVP_MAX_MD_SIZE], counter[4];
+  unsigned long n;
+  size_t k;
+  HMAC_CTX h;
+  int ok;
+
+  counter[0] = (unsigned char)((i + 1) >> 24);
+  counter[1] = (unsigned char)((i + 1) >> 16);
+  counter[2] = (unsigned char)((i + 1) >> 8);
+  counter[3] = (unsigned char)(i + 1);
+  HMAC_CTX_init(&h);
+  ok = HMAC_Init_ex(&h, j->pass, (int)j->passlen, j->md, NULL)
+    && HMAC_Update(&h, j->salt, j->saltlen)
+    && HMAC_Update(&h, counter, 4)
+    && HMAC_Final(&h, u, NULL);
+  memcpy(t, u, size);
+  for (n = 1; ok && n < j->iter; n++) {
+    ok = HMAC_Init_ex(&h, NULL, 0, NULL, NULL)
+      && HMAC_Update(&h, u, size)
+      && HMAC_Final(&h, u, NULL);
+    for (k = 0; k < size; k++)
+      t[k] ^= u[k];
+  }
+  HMAC_CTX_cleanup(&h);
+  if (ok)
+    memcpy(j->out + i * size, t, len);
+  else
+    j->failed = 1;
+  OPENSSL_cleanse(u, sizeof(u));
+  OPENSSL_cleanse(t, sizeof(t));
+}
+
+int kdf_pbkdf2(const EVP_MD *md, const unsigned char *pass, size_t passlen,
+               const unsigned char *salt, size_t saltlen, unsigned long iter,
+               unsigned char *out, size_t outlen, int threads)
+{
+  size_t size = EVP_MD_size(md);
+  kdf_pbkdf2_job j;
+
+  j.md = md;
+  j.pass = pass;
+  j.passlen = passlen;
+  j.salt = salt;
+  j.saltlen = saltlen;
+  j.iter = iter;
+  j.out = out;
+  j.outlen = outlen;
+  j.failed = 0;
+  pool_for(threads, (outlen + size - 1) / size, kdf_pbkdf2_block, &j);
+  return !j.failed;
+}
+
+/*************** HKDF ***************/
+
+int kdf_hkdf(const EVP_MD *md, const unsigned char *key, size_t keylen,
+             const unsigned char *salt, size_t saltlen,
+             const unsigned char *info, size_t infolen,
+             unsigned char *out, size_t outlen)
+{
+  size_t size = EVP_MD_size(md);
+  unsigned char prk[EVP_MAX_MD_SIZE], t[EVP_MAX_MD_SIZE];
+  unsigned char counter;
+  size_t done;
+  HMAC_CTX h;
+  int ok;
+
+  if (outlen > 255 * size)
+    return 0;
+  /* an absent salt is size zero bytes, which HMAC pads an empty key to anyway */
+  HMAC_CTX_init(&h);
+  ok = HMAC_Init_ex(&h, salt ? salt : (const unsigned char *)"", (int)saltlen, md, NULL)
+    && HMAC_Update(&h, key, keylen)
+    && HMAC_Final(&h, prk, NULL)
+    && HMAC_Init_ex(&h, prk, (int)size, md, NULL);
+  for (done = 0, counter = 1; ok && done < outlen; done += size, counter++) {
+    size_t len = outlen - done < size ? outlen - done : size;
+    ok = HMAC_Init_ex(&h, NULL, 0, NULL, NULL)
+      && (counter == 1 || HMAC_Update(&h, t, size))
+      && HMAC_Update(&h, info, infolen)
+      && HMAC_Update(&h, &counter, 1)
+      && HMAC_Final(&h, t, NULL);
+    if (ok)
+      memcpy(out + done, t, len);
+  }
+  HMAC_CTX_cleanup(&h);
+  OPENSSL_cleanse(prk, sizeof(prk));
+  OPENSSL_cleanse(t, sizeof(t));
+  return ok;
+}
+
+/*************** scrypt ***************/
+
+#define KDF_ROTL(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+
+static void kdf_salsa20_8(uint32_t b[16])
+{
+  uint32_t x[16];
+  int i;
+
+  memcpy(x, b, sizeof(x));
+  for (i = 0; i < 8; i += 2) {
+    x[ 4] ^= KDF_ROTL(x[ 0] + x[12],  7);  x[ 8] ^= KDF_ROTL(x[ 4] + x[ 0],  9);
+    x[12] ^= KDF_ROTL(x[ 8] + x[ 4], 13);  x[ 0] ^= KDF_ROTL(x[12] + x[ 8], 18);
+    x[ 9] ^= KDF_ROTL(x[ 5] + x[ 1],  7);  x[13] ^= KDF_ROTL(x[ 9] + x[ 5],  9);
+    x[ 1] ^= KDF_ROTL(x[13] + x[ 9], 13);  x[ 5] ^= KDF_ROTL(x[ 1] + x[13], 18);
+    x[14] ^= KDF_ROTL(x[10] + x[ 6],  7);  x[ 2] ^= KDF_ROTL(x[14] + x[10],  9);
+    x[ 6] ^= KDF_ROTL(x[ 2] + x[14], 13);  x[10] ^= KDF_ROTL(x[ 6] + x[ 2], 18);
+    x[ 3] ^= KDF_ROTL(x[15] + x[11],  7);  x[ 7] ^= KDF_ROTL(x[ 3] + x[15],  9);
+    x[11] ^= KDF_ROTL(x[ 7] + x[ 3], 13);  x[15] ^= KDF_ROTL(x[11] + x[ 7], 18);
+    x[ 1] ^= KDF_ROTL(x[ 0] + x[ 3],  7);  x[ 2] ^= KDF_ROTL(x[ 1] + x[ 0],  9);
+    x[ 3] ^= KDF_ROTL(x[ 2] + x[ 1], 13);  x[ 0] ^= KDF_ROTL(x[ 3] + x[ 2], 18);
+    x[ 6] ^= KDF_ROTL(x[ 5] + x[ 4],  7);  x[ 7] ^= KDF_ROTL(x[ 6] + x[ 5],  9);
+    x[ 4] ^= KDF_ROTL(x[ 7] + x[ 6], 13);  x[ 5] ^= KDF_ROTL(x[ 4] + x[ 7], 18);
+    x[11] ^= KDF_ROTL(x[10] + x[ 9],  7);  x[ 8] ^= KDF_ROTL(x[11] + x[10],  9);
+    x[ 9] ^= KDF_ROTL(x[ 8] + x[11], 13);  x[10] ^= KDF_ROTL(x[ 9] + x[ 8], 18);
+    x[12] ^= KDF_ROTL(x[15] + x[14],  7);  x[13] ^= KDF_ROTL(x[12] + x[15],  9);
+    x[14] ^= KDF_ROTL(x[13] + x[12], 13);  x[15] ^= KDF_ROTL(x[14] + x[13], 18);
+  }
+  for (i = 0; i < 16; i++)
+    b[i] += x[i];
+}
+
+/*
+** scryptBlockMix of the 2r 64-byte blocks in, written to out.
+*/
+static void kdf_blockmix(const uint32_t *in, uint32_t *out, uint32_t r)
+{
+  uint32_t x[16];
+  uint32_t i;
+  int k;
+
+  memcpy(x, in + (2 * r - 1) * 16, sizeof(x));
+  for (i = 0; i < 2 * r; i++) {
+    for (k = 0; k < 16; k++)
+      x[k] ^= in[i * 16 + k];
+    kdf_salsa20_8(x);
+    /* even blocks go to the first half of the output, odd ones to the second */
+    memcpy(out + ((i & 1) * r + i / 2) * 16, x, sizeof(x));
+  }
+}
+
+/*
+** scryptROMix of one lane, b being 128*r bytes; v holds N*32*r words
+** and xy 64*r.
+*/
+static void kdf_romix(unsigned char *b, uint32_t r, uint64_t N, uint32_t *v, uint32_t *xy)
+{
+  size_t words = 32 * (size_t)r;
+  uint32_t *x = xy, *y = xy + words;
+  uint64_t i;
+  size_t k;
+
+  for (k = 0; k < words; k++) {
+    const unsigned char *p = b + 4 * k;
+    x[k] = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+  }
+  for (i = 0; i < N; i++) {
+    memcpy(v + i * words, x, words * 4);
+    kdf_blockmix(x, y, r);
+    memcpy(x, y, words * 4);
+  }
+  for (i = 0; i < N; i++) {
+    /* Integerify: the first word of the last block, N being a power of two */
+    const uint32_t *last = x + (2 * r - 1) * 16;
+    uint64_t j = (((uint64_t)last[1] << 32) | last[0]) & (N - 1);
+    for (k = 0; k < words; k++)
+      x[k] ^= v[j * words + k];
+    kdf_blockmix(x, y, r);
+    memcpy(x, y, words * 4);
+  }
+  for (k = 0; k < words; k++) {
+    unsigned char *p = b + 4 * k;
+    p[0] = (unsigned char)x[k];
+    p[1] = (unsigned char)(x[k] >> 8);
+    p[2] = (unsigned char)(x[k] >> 16);
+    p[3] = (unsigned char)(x[k] >> 24);
+  }
+}
+
+typedef struct kdf_scrypt_job {
+  unsigned char *b;
+  uint64_t N;
+  uint32_t r;
+  volatile int failed;
+} kdf_scrypt_job;
+
+static void kdf_scrypt_lane(void *ud, size_t i)
+{
+  kdf_scrypt_job *j = ud;
+  size_t vlen = (size_t)j->N * 128 * j->r;
+  uint32_t *v = malloc(vlen);
+  uint32_t *xy = malloc(256 * (size_t)j->r);
+
+  if (v != NULL && xy != NULL)
+    kdf_romix(j->b + i * 128 * (size_t)j->r, j->r, j->N, v, xy);
+  else
+    j->failed = 1;
+  if (v != NULL) {
+    OPENSSL_cleanse(v, vlen);
+    free(v);
+  }
+  if (xy != NULL) {
+    OPENSSL_cleanse(xy, 256 * (size_t)j->r);
+    free(xy);
+  }
+}
+
+size_t kdf_scrypt_memory(uint64_t N, uint32_t r, uint32_t p, int threads)
+{
+  /* the p lanes, plus a table of N and a scratch of two blocks for each running one */
+  size_t lane = 128 * (size_t)r;
+  size_t running;
+
+  if (N > SIZE_MAX / lane || (size_t)N * lane > SIZE_MAX - 2 * lane)
+    return SIZE_MAX;
+  running = (size_t)N * lane + 2 * lane;
+  if ((size_t)threads > SIZE_MAX / running || (size_t)threads * running > SIZE_MAX - (size_t)p * lane)
+    return SIZE_MAX;
+  return (size_t)p * lane + (size_t)threads * running;
+}
+
+int kdf_scrypt(const unsigned char *pass, size_t passlen,
+               const unsigned char *salt, size_t saltlen,
+               uint64_t N, uint32_t r, uint32_t p,
+               unsigned char *out, size_t outlen, int threads)
+{
+  size_t blen = (size_t)p * 128 * r;
+  const EVP_MD *md = EVP_sha256();
+  kdf_scrypt_job j;
+  int ok;
+
+  j.b = malloc(blen);
+  if (j.b == NULL)
+    return 0;
+  j.N = N;
+  j.r = r;
+  j.failed = 0;
+  ok = kdf_pbkdf2(md, pass, passlen, salt, saltlen, 1, j.b, blen, 1);
+  if (ok) {
+    pool_for(threads, p, kdf_scrypt_lane, &j);
+    ok = !j.failed && kdf_pbkdf2(md, pass, passlen, j.b, blen, 1, out, outlen, 1);
+  }
+  OPENSSL_cleanse(j.b, blen);
+  free(j.b);
+  return ok;
+}
@@ -0,0 +1,51 @@
+/*
+** Key derivation functions: PBKDF2 (RFC 8018), HKDF (RFC 5869) and
+** scrypt (RFC 7914).
+** See Copyright Notice in license.html
+**
+** The output does not depend on the thread count: PBKDF2 spreads its
+** output blocks and scrypt its p lanes over the thread pool, both of
+** which are independent of each other by construction.
+*/
+
+#ifndef _LUACRYPTO_KDF_
+#define _LUACRYPTO_KDF_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+/*
+** Writes outlen bytes of PBKDF2 with HMAC over md to out, using up to
+** threads threads. Returns 0 on failure.
+*/
+int kdf_pbkdf2 (const EVP_MD *md, const unsigned char *pass, size_t passlen,
+                const unsigned char *salt, size_t saltlen, unsigned long iter,
+                unsigned char *out, size_t outlen, int threads);
+
+/*
+** Writes outlen bytes of HKDF over md to out; outlen must be at most
+** 255 times the digest size. Returns 0 on failure.
+*/
+int kdf_hkdf (const EVP_MD *md, const unsigned char *key, size_t keylen,
+              const unsigned char *salt, size_t saltlen,
+              const unsigned char *info, size_t infolen,
+              unsigned char *out, size_t outlen);
+
+/*
+** Bytes of memory scrypt uses with threads lanes running at once, or
+** SIZE_MAX if that does not fit in a size_t.
+*/
+size_t kdf_scrypt_memory (uint64_t N, uint32_t r, uint32_t p, int threads);
+
+/*
+** Writes outlen bytes of scrypt to out, running up to threads of the p
+** lanes at once. N must be a power of two greater than 1, and r and p
+** at least 1 with r*p below 2^30. Returns 0 if memory is short.
+*/
+int kdf_scrypt (const unsigned char *pass, size_t passlen,
+                const unsigned char *salt, size_t saltlen,
+                uint64_t N, uint32_t r, uint32_t p,
+                unsigned char *out, size_t outlen, int threads);
+
+#endif
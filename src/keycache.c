@@ -0,0 +1,259 @@
+/*
+** Process-wide cache of parsed public keys.
+** See Copyright Notice in license.html
+**
+** A chained hash table indexed by the leading bytes of the fingerprint,
+** with the entries also on a list from most to least recently used.
+** Keys are parsed outside the lock; if two threads miss on the same key
+** at once, the second to finish keeps the first one's copy.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+
+#include "keycache.h"
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_PKEY_up_ref(k) CRYPTO_add(&(k)->references, 1, CRYPTO_LOCK_EVP_PKEY)
+#endif
+
+#ifndef _WIN32
+#include <pthread.h>
+static pthread_mutex_t keycache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define keycache_lock() pthread_mutex_lock(&keycache_mutex)
+#define keycache_unlock() pthread_mutex_unlock(&keycache_mutex)
+#else
+#include <windows.h>
+static SRWLOCK keycache_mutex = SRWLOCK_INIT;
+#define keycache_lock() AcquireSRWLockExclusive(&keycache_mutex)
+#define keycache_unlock() ReleaseSRWLockExclusive(&keycache_mutex)
+#endif
+
+typedef struct keycache_entry {
+  unsigned char id[SHA256_DIGEST_LENGTH];
+  EVP_PKEY *pkey;
+  struct keycache_entry *chain;         /* next in the bucket */
+  struct keycache_entry *newer, *older;
+} keycache_entry;
+
+static keycache_entry **keycache_buckets = NULL;
+static size_t keycache_nbuckets = 0;    /* a power of two, or 0 before the first insert */
+static keycache_entry *keycache_newest = NULL;
+static keycache_entry *keycache_oldest = NULL;
+static keycache_stats keycache_counts = {0, 0, 0, 0, KEYCACHE_DEFAULT_CAPACITY};
+
+static size_t keycache_index(const unsigned char *id)
+{
+  size_t h = 0;
+  int i;
+  for (i = 0; i < (int)sizeof(size_t); i++)
+    h = (h << 8) | id[i];
+  return h & (keycache_nbuckets - 1);
+}
+
+/* the functions below are called with the lock held */
+
+static keycache_entry *keycache_find(const unsigned char *id)
+{
+  keycache_entry *e;
+  if (keycache_nbuckets == 0)
+    return NULL;
+  for (e = keycache_buckets[keycache_index(id)]; e != NULL; e = e->chain)
+    if (memcmp(e->id, id, sizeof(e->id)) == 0)
+      return e;
+  return NULL;
+}
+
+static void keycache_unlink(keycache_entry *e)
+{
+  if (e->newer)
+    e->newer->older = e->older;
+  else
+    keycache_newest = e->older;
+  if (e->older)
+    e->older->newer = e->newer;
+  else
+    keycache_oldest = e->newer;
+}
+
+static void keycache_link(keycache_entry *e)
+{
+  e->newer = NULL;
+  e->older = keycache_newest;
+  if (keycache_newest)
+    keycache_newest->newer = e;
+  else
+    keycache_oldest = e;
+  keycache_newest = e;
+}
+
+/* takes e out of its bucket and the list */
+static void keycache_remove(keycache_entry *e)
+{
+  keycache_entry **p = &keycache_buckets[keycache_index(e->id)];
+  while (*p != e)
+    p = &(*p)->chain;
+  *p = e->chain;
+  keycache_unlink(e);
+  keycache_counts.entries--;
+}
+
+/*
+** Resizes the table to the smallest power of two holding capacity
+** entries. Keeps the old table if memory is short.
+*/
+static void keycache_rehash(size_t capacity)
+{
+  size_t n = 16;
+  keycache_entry **buckets;
+  keycache_entry *e;
+
+  while (n < capacity)
+    n <<= 1;
+  if (n == keycache_nbuckets)
+    return;
+  buckets = calloc(n, sizeof(*buckets));
+  if (buckets == NULL)
+    return;
+  free(keycache_buckets);
+  keycache_buckets = buckets;
+  keycache_nbuckets = n;
+  for (e = keycache_oldest; e != NULL; e = e->newer) {
+    size_t i = keycache_index(e->id);
+    e->chain = buckets[i];
+    buckets[i] = e;
+  }
+}
+
+/*
+** Removes the least recently used entries until at most capacity are
+** left, and returns them chained through e->chain so their keys can be
+** freed once the lock is released.
+*/
+static keycache_entry *keycache_trim(size_t capacity)
+{
+  keycache_entry *dropped = NULL;
+  while (keycache_counts.entries > capacity) {
+    keycache_entry *e = keycache_oldest;
+    keycache_remove(e);
+    e->chain = dropped;
+    dropped = e;
+  }
+  return dropped;
+}
+
+static void keycache_free(keycache_entry *dropped)
+{
+  while (dropped != NULL) {
+    keycache_entry *next = dropped->chain;
+    EVP_PKEY_free(dropped->pkey);
+    free(dropped);
+    dropped = next;
+  }
+}
+
+static size_t keycache_count(keycache_entry *dropped)
+{
+  size_t n = 0;
+  for (; dropped != NULL; dropped = dropped->chain)
+    n++;
+  return n;
+}
+
+EVP_PKEY *keycache_get(const unsigned char *der, size_t len)
+{
+  unsigned char id[SHA256_DIGEST_LENGTH];
+  const unsigned char *p = der;
+  keycache_entry *e, *dropped;
+  EVP_PKEY *pkey;
+
+  SHA256(der, len, id);
+  keycache_lock();
+  e = keycache_find(id);
+  if (e != NULL) {
+    keycache_counts.hits++;
+    keycache_unlink(e);
+    keycache_link(e);
+    pkey = e->pkey;
+    EVP_PKEY_up_ref(pkey);
+    keycache_unlock();
+    return pkey;
+  }
+  keycache_counts.misses++;
+  keycache_unlock();
+
+  pkey = d2i_PUBKEY(NULL, &p, (long)len);
+  if (pkey == NULL)
+    return NULL;
+
+  keycache_lock();
+  if (keycache_counts.capacity == 0) {
+    keycache_unlock();
+    return pkey;
+  }
+  e = keycache_find(id);
+  if (e != NULL) {
+    /* another thread got there first */
+    EVP_PKEY *ours = pkey;
+    pkey = e->pkey;
+    EVP_PKEY_up_ref(pkey);
+    keycache_unlock();
+    EVP_PKEY_free(ours);
+    return pkey;
+  }
+  if (keycache_nbuckets == 0)
+    keycache_rehash(keycache_counts.capacity);
+  e = keycache_nbuckets ? malloc(sizeof(*e)) : NULL;
+  if (e == NULL) {
+    keycache_unlock();
+    return pkey;
+  }
+  memcpy(e->id, id, sizeof(id));
+  e->pkey = pkey;
+  EVP_PKEY_up_ref(pkey);
+  e->chain = keycache_buckets[keycache_index(id)];
+  keycache_buckets[keycache_index(id)] = e;
+  keycache_link(e);
+  keycache_counts.entries++;
+  dropped = keycache_trim(keycache_counts.capacity);
+  keycache_counts.evictions += keycache_count(dropped);
+  keycache_unlock();
+  keycache_free(dropped);
+  return pkey;
+}
+
+size_t keycache_set_capacity(size_t capacity)
+{
+  size_t old;
+  keycache_entry *dropped;
+
+  keycache_lock();
+  old = keycache_counts.capacity;
+  keycache_counts.capacity = capacity;
+  dropped = keycache_trim(capacity);
+  keycache_counts.evictions += keycache_count(dropped);
+  if (keycache_nbuckets != 0 && capacity > 0)
+    keycache_rehash(capacity);
+  keycache_unlock();
+  keycache_free(dropped);
+  return old;
+}
+
+void keycache_clear(void)
+{
+  keycache_entry *dropped;
+  keycache_lock();
+  dropped = keycache_trim(0);
+  keycache_unlock();
+  keycache_free(dropped);
+}
+
+void keycache_get_stats(keycache_stats *stats)
+{
+  keycache_lock();
+  *stats = keycache_counts;
+  keycache_unlock();
+}
@@ -0,0 +1,46 @@
+/*
+** Process-wide cache of parsed public keys.
+** See Copyright Notice in license.html
+**
+** Keys are looked up by the SHA-256 of their SubjectPublicKeyInfo DER,
+** so the same key reaches the same EVP_PKEY whatever Lua state or
+** encoding it was loaded from, and keeps the state OpenSSL caches on it
+** (Montgomery contexts and the like). Every key returned is a new
+** reference; EVP_PKEY_free drops it. The least recently used keys are
+** dropped once the cache is full.
+*/
+
+#ifndef _LUACRYPTO_KEYCACHE_
+#define _LUACRYPTO_KEYCACHE_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+#define KEYCACHE_DEFAULT_CAPACITY 512
+
+typedef struct keycache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t entries;
+  size_t capacity;
+} keycache_stats;
+
+/*
+** Returns the public key encoded by len bytes of DER, parsing it only
+** if it is not cached, or NULL if it does not parse.
+*/
+EVP_PKEY *keycache_get (const unsigned char *der, size_t len);
+
+/*
+** Sets the most keys kept, evicting as needed; 0 disables the cache.
+** Returns the previous capacity.
+*/
+size_t keycache_set_capacity (size_t capacity);
+
+void keycache_clear (void);
+
+void keycache_get_stats (keycache_stats *stats);
+
+#endif
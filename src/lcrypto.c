@@ -3,6 +3,9 @@
 ** See Copyright Notice in license.html
 */
 
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
 #include <string.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
@@ -10,7 +13,14 @@
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
 #include <openssl/dsa.h>
+#include <openssl/ec.h>
 #include <openssl/pem.h>
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -19,6 +29,16 @@
 #endif
 
 #include "lcrypto.h"
+#include "codec.h"
+#include "fileio.h"
+#include "mbsha.h"
+#include "pool.h"
+#include "treehash.h"
+#include "keycache.h"
+#include "kdf.h"
+#include "mdstate.h"
+#include "cdc.h"
+#include "fasthash.h"
 
 LUACRYPTO_API int luaopen_crypto(lua_State *L);
 
@@ -32,6 +52,413 @@ static int crypto_error(lua_State *L)
   return 2;
 }
 
+/*
+** Pushes len bytes of data as a lowercase hex string.
+*/
+static void luacrypto_pushhex(lua_State *L, const unsigned char *data, size_t len)
+{
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  while (len > 0) {
+    size_t n = len < LUAL_BUFFERSIZE/2 ? len : LUAL_BUFFERSIZE/2;
+    codec_hex_encode(luaL_prepbuffer(&b), data, n);
+    luaL_addsize(&b, 2*n);
+    data += n;
+    len -= n;
+  }
+  luaL_pushresult(&b);
+}
+
+/*
+** Appends the base64 encoding of len bytes of data to b.
+*/
+static void luacrypto_addbase64(luaL_Buffer *b, const unsigned char *data, size_t len, int flags)
+{
+  while (len > 0) {
+    /* whole groups of 3 bytes, so only the last chunk gets padded */
+    size_t n = len < LUAL_BUFFERSIZE/4*3 ? len : LUAL_BUFFERSIZE/4*3;
+    luaL_addsize(b, codec_base64_encode(luaL_prepbuffer(b), data, n, flags));
+    data += n;
+    len -= n;
+  }
+}
+
+/*
+** Pushes len bytes of data as a base64 string.
+*/
+static void luacrypto_pushbase64(lua_State *L, const unsigned char *data, size_t len, int flags)
+{
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  luacrypto_addbase64(&b, data, len, flags);
+  luaL_pushresult(&b);
+}
+
+/*
+** Appends the decoded base64 text s to b. Returns 0 if s is not valid
+** base64; b is then left half filled. Sets *padded if s ended in padding.
+*/
+static int luacrypto_addunbase64(luaL_Buffer *b, const char *s, size_t len, int flags, int *padded)
+{
+  *padded = 0;
+  while (len > 0) {
+    /* whole groups of 4 characters, decoding to at most LUAL_BUFFERSIZE bytes */
+    size_t n = len < (LUAL_BUFFERSIZE/3 - 1)*4 ? len : (LUAL_BUFFERSIZE/3 - 1)*4;
+    size_t written = 0;
+    if (!codec_base64_decode((unsigned char *)luaL_prepbuffer(b), &written, s, n, flags))
+      return 0;
+    *padded = n % 4 == 0 && written < n/4*3;
+    if (*padded && n < len)
+      return 0;  /* padding in the middle of the text */
+    luaL_addsize(b, written);
+    s += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/*
+** Output formats for digests, MACs, signatures and ciphertexts.
+*/
+enum { LUACRYPTO_HEX, LUACRYPTO_RAW, LUACRYPTO_BASE64, LUACRYPTO_BASE64URL };
+
+/*
+** Reads an optional output format: a boolean (true meaning raw, as in
+** the original API) or one of "hex", "raw", "base64" and "base64url".
+*/
+static int luacrypto_optformat(lua_State *L, int arg, int def)
+{
+  static const char *const formats[] = {"hex", "raw", "base64", "base64url", NULL};
+  if (lua_isnoneornil(L, arg))
+    return def;
+  if (lua_isboolean(L, arg))
+    return lua_toboolean(L, arg) ? LUACRYPTO_RAW : LUACRYPTO_HEX;
+  return luaL_checkoption(L, arg, NULL, formats);
+}
+
+/*
+** Pushes a digest, MAC or other binary result in the given format.
+*/
+static void luacrypto_pushformatted(lua_State *L, const unsigned char *data, size_t len, int format)
+{
+  switch (format) {
+  case LUACRYPTO_RAW:
+    lua_pushlstring(L, (const char *)data, len);
+    break;
+  case LUACRYPTO_BASE64:
+    luacrypto_pushbase64(L, data, len, 0);
+    break;
+  case LUACRYPTO_BASE64URL:
+    luacrypto_pushbase64(L, data, len, CODEC_BASE64_URL | CODEC_BASE64_NOPAD);
+    break;
+  default:
+    luacrypto_pushhex(L, data, len);
+  }
+}
+
+/*
+** Returns the userdata at index arg if its metatable is tname, NULL
+** otherwise.
+*/
+static void *luacrypto_testudata(lua_State *L, int arg, const char *tname)
+{
+  void *p = lua_touserdata(L, arg);
+  if (p != NULL && lua_getmetatable(L, arg)) {
+    luaL_getmetatable(L, tname);
+    if (!lua_rawequal(L, -1, -2))
+      p = NULL;
+    lua_pop(L, 2);
+    return p;
+  }
+  return NULL;
+}
+
+/*
+** Reads the optional offset and length of a file range at stack
+** positions arg and arg+1.
+*/
+static void luacrypto_optrange(lua_State *L, int arg, uint64_t *offset, uint64_t *length)
+{
+  lua_Number o = luaL_optnumber(L, arg, 0);
+  lua_Number l = luaL_optnumber(L, arg + 1, -1);
+  luaL_argcheck(L, o >= 0, arg, "negative offset");
+  luaL_argcheck(L, l >= 0 || lua_isnoneornil(L, arg + 1), arg + 1, "negative length");
+  *offset = (uint64_t)o;
+  *length = lua_isnoneornil(L, arg + 1) ? FILEIO_TO_END : (uint64_t)l;
+}
+
+/*
+** Pushes nil and a message for a failed fileio_read; consumer failures
+** are OpenSSL errors.
+*/
+static int luacrypto_fileerror(lua_State *L, const char *path, int err)
+{
+  if (err == FILEIO_ECONSUMER)
+    return crypto_error(L);
+  lua_pushnil(L);
+  lua_pushfstring(L, "%s: %s", path, strerror(err));
+  return 2;
+}
+
+/*
+** Reads the threads field of the optional options table at index arg:
+** the most threads a call may use, one per processor by default.
+*/
+static int luacrypto_optthreads(lua_State *L, int arg)
+{
+  int threads = pool_cpus();
+  if (lua_isnoneornil(L, arg))
+    return threads;
+  luaL_checktype(L, arg, LUA_TTABLE);
+  lua_getfield(L, arg, "threads");
+  if (!lua_isnil(L, -1)) {
+    lua_Number n = lua_tonumber(L, -1);
+    luaL_argcheck(L, n >= 1, arg, "threads must be at least 1");
+    threads = n > POOL_MAX_THREADS ? POOL_MAX_THREADS : (int)n;
+  }
+  lua_pop(L, 1);
+  return threads;
+}
+
+/*************** ALGORITHM API ***************/
+
+/* registry keys of the name -> handle caches */
+static char md_cache;
+static char cipher_cache;
+
+/*
+** Pushes the handle for the algorithm at index arg, which is either a
+** handle or a name, and returns it; pushes nil and returns NULL for an
+** unknown name. Handles are kept in a per-kind cache keyed by name, so
+** OpenSSL's name lookup runs once per name instead of once per call.
+*/
+static const void **luacrypto_pushhandle(lua_State *L, int arg, char *cache, const char *tname)
+{
+  const void **h = luacrypto_testudata(L, arg, tname);
+  if (h != NULL) {
+    lua_pushvalue(L, arg);
+    return h;
+  }
+  luaL_checkstring(L, arg);
+  lua_pushlightuserdata(L, cache);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, arg);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1)) {
+    const char *name = lua_tostring(L, arg);
+    const void *alg = cache == &md_cache ? (const void *)EVP_get_digestbyname(name)
+                                         : (const void *)EVP_get_cipherbyname(name);
+    if (alg != NULL) {
+      lua_pop(L, 1);
+      h = lua_newuserdata(L, sizeof(const void *));
+      *h = alg;
+      luaL_getmetatable(L, tname);
+      lua_setmetatable(L, -2);
+      lua_pushvalue(L, arg);
+      lua_pushvalue(L, -2);
+      lua_rawset(L, -4);
+    }
+  }
+  lua_remove(L, -2);
+  return lua_touserdata(L, -1);
+}
+
+/*
+** Returns the digest named or held by the value at index arg, or NULL.
+** The handle stays anchored in the cache, so the pointer outlives the pop.
+*/
+static const EVP_MD *luacrypto_tomd(lua_State *L, int arg)
+{
+  const void **h = luacrypto_pushhandle(L, arg, &md_cache, LUACRYPTO_MDNAME);
+  lua_pop(L, 1);
+  return h ? *h : NULL;
+}
+
+static const EVP_CIPHER *luacrypto_tocipher(lua_State *L, int arg)
+{
+  const void **h = luacrypto_pushhandle(L, arg, &cipher_cache, LUACRYPTO_CIPHERNAME);
+  lua_pop(L, 1);
+  return h ? *h : NULL;
+}
+
+static int luacrypto_fmd(lua_State *L)
+{
+  if (luacrypto_pushhandle(L, 1, &md_cache, LUACRYPTO_MDNAME) == NULL)
+    luaL_argerror(L, 1, "invalid digest type");
+  return 1;
+}
+
+static int luacrypto_fcipher(lua_State *L)
+{
+  if (luacrypto_pushhandle(L, 1, &cipher_cache, LUACRYPTO_CIPHERNAME) == NULL)
+    luaL_argerror(L, 1, "invalid cipher");
+  return 1;
+}
+
+/*************** BUFFER API ***************/
+
+static luacrypto_buffer *buffer_pnew(lua_State *L)
+{
+  luacrypto_buffer *b = lua_newuserdata(L, sizeof(luacrypto_buffer));
+  b->data = NULL;
+  b->len = 0;
+  b->capacity = 0;
+  luaL_getmetatable(L, LUACRYPTO_BUFFERNAME);
+  lua_setmetatable(L, -2);
+  return b;
+}
+
+/*
+** Returns the buffer at index arg, or NULL if the value is not a buffer.
+*/
+static luacrypto_buffer *buffer_test(lua_State *L, int arg)
+{
+  return luacrypto_testudata(L, arg, LUACRYPTO_BUFFERNAME);
+}
+
+/*
+** Makes room for extra more bytes after the contents of b and returns
+** a pointer to the first free byte.
+*/
+static unsigned char *buffer_reserve(lua_State *L, luacrypto_buffer *b, size_t extra)
+{
+  if (extra > b->capacity - b->len) {
+    size_t capacity = b->capacity ? b->capacity : 64;
+    unsigned char *data;
+    if (extra > (size_t)-1 - b->len)
+      luaL_error(L, "buffer too large");
+    while (capacity < b->len + extra)
+      capacity = capacity > (size_t)-1 / 2 ? b->len + extra : capacity * 2;
+    data = realloc(b->data, capacity);
+    if (data == NULL)
+      luaL_error(L, "out of memory");
+    b->data = data;
+    b->capacity = capacity;
+  }
+  return b->data + b->len;
+}
+
+/*
+** Returns the bytes of the string or buffer at index arg.
+*/
+static const unsigned char *luacrypto_checkbytes(lua_State *L, int arg, size_t *len)
+{
+  luacrypto_buffer *b = buffer_test(L, arg);
+  if (b != NULL) {
+    *len = b->len;
+    return b->data;
+  }
+  return (const unsigned char *) luaL_checklstring(L, arg, len);
+}
+
+static int buffer_fnew(lua_State *L)
+{
+  lua_Integer capacity = luaL_optinteger(L, 1, 0);
+  luacrypto_buffer *b;
+  luaL_argcheck(L, capacity >= 0, 1, "negative capacity");
+  b = buffer_pnew(L);
+  buffer_reserve(L, b, (size_t)capacity);
+  return 1;
+}
+
+static int buffer_append(lua_State *L)
+{
+  luacrypto_buffer *b = luaL_checkudata(L, 1, LUACRYPTO_BUFFERNAME);
+  size_t len = 0;
+  const unsigned char *s = luacrypto_checkbytes(L, 2, &len);
+  if (len > 0) {
+    /* reserve first: appending a buffer to itself may move its data */
+    unsigned char *p = buffer_reserve(L, b, len);
+    if (lua_rawequal(L, 1, 2))
+      s = b->data;
+    memcpy(p, s, len);
+    b->len += len;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int buffer_data(lua_State *L)
+{
+  luacrypto_buffer *b = luaL_checkudata(L, 1, LUACRYPTO_BUFFERNAME);
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+  lua_Integer j = luaL_optinteger(L, 3, -1);
+  lua_Integer len = (lua_Integer)b->len;
+  /* same index rules as string.sub */
+  if (i < 0) i = len + i + 1;
+  if (j < 0) j = len + j + 1;
+  if (i < 1) i = 1;
+  if (j > len) j = len;
+  if (i > j)
+    lua_pushliteral(L, "");
+  else
+    lua_pushlstring(L, (const char *)b->data + i - 1, (size_t)(j - i + 1));
+  return 1;
+}
+
+static int buffer_len(lua_State *L)
+{
+  luacrypto_buffer *b = luaL_checkudata(L, 1, LUACRYPTO_BUFFERNAME);
+  lua_pushinteger(L, (lua_Integer)b->len);
+  return 1;
+}
+
+static int buffer_capacity(lua_State *L)
+{
+  luacrypto_buffer *b = luaL_checkudata(L, 1, LUACRYPTO_BUFFERNAME);
+  lua_pushinteger(L, (lua_Integer)b->capacity);
+  return 1;
+}
+
+static int buffer_reserve_method(lua_State *L)
+{
+  luacrypto_buffer *b = luaL_checkudata(L, 1, LUACRYPTO_BUFFERNAME);
+  lua_Integer n = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, n >= 0, 2, "negative size");
+  if ((size_t)n > b->len)
+    buffer_reserve(L, b, (size_t)n - b->len);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int buffer_resize(lua_State *L)
+{
+  luacrypto_buffer *b = luaL_checkudata(L, 1, LUACRYPTO_BUFFERNAME);
+  lua_Integer n = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, n >= 0, 2, "negative size");
+  if ((size_t)n > b->len)
+    memset(buffer_reserve(L, b, (size_t)n - b->len), 0, (size_t)n - b->len);
+  b->len = (size_t)n;
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int buffer_clear(lua_State *L)
+{
+  luacrypto_buffer *b = luaL_checkudata(L, 1, LUACRYPTO_BUFFERNAME);
+  b->len = 0;
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int buffer_tostring(lua_State *L)
+{
+  luacrypto_buffer *b = luaL_checkudata(L, 1, LUACRYPTO_BUFFERNAME);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_BUFFERNAME, (void *)b);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+static int buffer_gc(lua_State *L)
+{
+  luacrypto_buffer *b = luaL_checkudata(L, 1, LUACRYPTO_BUFFERNAME);
+  free(b->data);
+  b->data = NULL;
+  b->len = b->capacity = 0;
+  return 0;
+}
+
 /*************** DIGEST API ***************/
 
 static EVP_MD_CTX *digest_pnew(lua_State *L)
@@ -44,8 +471,7 @@ static EVP_MD_CTX *digest_pnew(lua_State *L)
 
 static int digest_fnew(lua_State *L)
 {
-  const char *s = luaL_checkstring(L, 1);
-  const EVP_MD *digest = EVP_get_digestbyname(s);
+  const EVP_MD *digest = luacrypto_tomd(L, 1);
   
   if (digest == NULL) {
     luaL_argerror(L, 1, "invalid digest/cipher type");
@@ -94,8 +520,6 @@ static int digest_final(lua_State *L)
   EVP_MD_CTX *d = NULL;
   unsigned char digest[EVP_MAX_MD_SIZE];
   unsigned int written = 0;
-  unsigned int i;
-  char *hex;
   
   if (lua_isstring(L, 2))
   {  
@@ -108,20 +532,59 @@ static int digest_final(lua_State *L)
   EVP_DigestFinal_ex(d, digest, &written);
   EVP_MD_CTX_destroy(d);
   
-  if (lua_toboolean(L, 3))
-    lua_pushlstring(L, (char *)digest, written);
-  else
-  {
-    hex = calloc(sizeof(char), written*2 + 1);
-    for (i = 0; i < written; i++)
-      sprintf(hex + 2*i, "%02x", digest[i]);
-    lua_pushlstring(L, hex, written*2);
-    free(hex);
-  }
+  luacrypto_pushformatted(L, digest, written, luacrypto_optformat(L, 3, LUACRYPTO_HEX));
   
   return 1;
 }
 
+/*
+** Returns the intermediate state of the digest as a string that
+** crypto.digest.import resumes, here or in another process. Only MD5,
+** SHA-1 and SHA-2 states can be exported.
+*/
+static int digest_export(lua_State *L)
+{
+  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_DIGESTNAME);
+  unsigned char state[MDSTATE_MAX_LEN];
+  size_t len = mdstate_export(EVP_MD_type(EVP_MD_CTX_md(c)), c->md_data, state);
+
+  if (len == 0) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "digest state cannot be exported");
+    return 2;
+  }
+  lua_pushlstring(L, (const char *)state, len);
+  OPENSSL_cleanse(state, len);
+  return 1;
+}
+
+/*
+** crypto.digest.import(dtype, state): a digest object resuming an
+** exported state.
+*/
+static int digest_fimport(lua_State *L)
+{
+  const EVP_MD *md = luacrypto_tomd(L, 1);
+  size_t len = 0;
+  const unsigned char *state = (const unsigned char *) luaL_checklstring(L, 2, &len);
+  EVP_MD_CTX *c;
+
+  if (md == NULL)
+    return luaL_argerror(L, 1, "invalid digest type");
+  if (!mdstate_supported(EVP_MD_type(md)))
+    return luaL_argerror(L, 1, "digest state cannot be imported");
+  c = digest_pnew(L);
+  EVP_MD_CTX_init(c);
+  if (!EVP_DigestInit_ex(c, md, NULL))
+    return crypto_error(L);
+  if (!mdstate_import(EVP_MD_type(md), c->md_data, state, len)) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid digest state");
+    return 2;
+  }
+  return 1;
+}
+
 static int digest_tostring(lua_State *L)
 {
   EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_DIGESTNAME);
@@ -141,13 +604,10 @@ static int digest_gc(lua_State *L)
 static int digest_fdigest(lua_State *L)
 {
   EVP_MD_CTX *c = NULL;
-  const char *type_name = luaL_checkstring(L, 2);
+  const EVP_MD *type = luacrypto_tomd(L, 2);
   const char *s = luaL_checkstring(L, 3);
-  const EVP_MD *type = EVP_get_digestbyname(type_name);
   unsigned char digest[EVP_MAX_MD_SIZE];
   unsigned int written = 0;
-  unsigned int i;
-  char *hex;
   
   if (type == NULL) {
     luaL_argerror(L, 1, "invalid digest type");
@@ -158,107 +618,570 @@ static int digest_fdigest(lua_State *L)
   EVP_DigestInit_ex(c, type, NULL);
   EVP_DigestUpdate(c, s, lua_strlen(L, 3));
   EVP_DigestFinal_ex(c, digest, &written);
+  EVP_MD_CTX_destroy(c);
   
-  if (lua_toboolean(L, 4))
-    lua_pushlstring(L, (char *)digest, written);
-  else
-  {
-    hex = calloc(sizeof(char), written*2 + 1);
-    for (i = 0; i < written; i++)
-      sprintf(hex + 2*i, "%02x", digest[i]);
-    lua_pushlstring(L, hex, written*2);
-    free(hex);
-  }
+  luacrypto_pushformatted(L, digest, written, luacrypto_optformat(L, 4, LUACRYPTO_HEX));
   
   return 1;
 }
 
-/*************** ENCRYPT API ***************/
-
-static EVP_CIPHER_CTX *encrypt_pnew(lua_State *L)
+/*
+** Batch path for SHA-1/SHA-256: hashes the strings of the table at index 2
+** in parallel SIMD lanes. The strings stay anchored in that table, so
+** their contents can be handed to the kernel directly.
+*/
+static int digest_batch_mb(lua_State *L, int alg, int size, int n, int format)
 {
-  EVP_CIPHER_CTX *c = lua_newuserdata(L, sizeof(EVP_CIPHER_CTX));
-  luaL_getmetatable(L, LUACRYPTO_ENCRYPTNAME);
-  lua_setmetatable(L, -2);
-  return c;
+  const unsigned char **data;
+  size_t *len;
+  unsigned char *out;
+  int i;
+
+  /* scratch space is a userdata so the GC reclaims it on any error */
+  data = lua_newuserdata(L, n * (sizeof(*data) + sizeof(*len) + size));
+  len = (size_t *)(data + n);
+  out = (unsigned char *)(len + n);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    data[i] = (const unsigned char *)lua_tolstring(L, -1, &len[i]);
+    lua_pop(L, 1);
+  }
+  mbsha_digest(alg, n, data, len, out);
+
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    luacrypto_pushformatted(L, out + i*size, size, format);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
 }
 
-static int encrypt_fnew(lua_State *L)
+static int digest_fbatch(lua_State *L)
 {
-  const char *s = luaL_checkstring(L, 1);
-  const EVP_CIPHER *cipher = EVP_get_cipherbyname(s);
-  if (cipher == NULL) {
-    luaL_argerror(L, 1, "invalid encrypt cipher");
+  EVP_MD_CTX *c = NULL;
+  const EVP_MD *type = luacrypto_tomd(L, 1);
+  int format = luacrypto_optformat(L, 3, LUACRYPTO_HEX);
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int written = 0;
+  int i, n;
+  int all_strings = 1;
+
+  if (type == NULL) {
+    luaL_argerror(L, 1, "invalid digest type");
     return 0;
-  } else {
-    size_t key_len = 0;
-    const char *key = luaL_checklstring(L, 2, &key_len);
-    unsigned char evp_key[EVP_MAX_KEY_LENGTH] = {0};
-  
-    size_t iv_len = 0;
-    const char *iv = lua_tolstring(L, 3, &iv_len); /* can be NULL */
-    unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
-  
-    memcpy(evp_key, key, key_len);
-    if (iv) {
-      memcpy(evp_iv, iv, iv_len);      
-    }
-    
-    EVP_CIPHER_CTX *c = encrypt_pnew(L);
-    EVP_CIPHER_CTX_init(c);
-    EVP_EncryptInit_ex(c, cipher, NULL, evp_key, iv ? evp_iv : NULL);
-    return 1;
   }
-}
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = lua_objlen(L, 2);
 
-static int encrypt_update(lua_State *L)
-{
-  EVP_CIPHER_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_ENCRYPTNAME);
-  size_t input_len = 0;
-  const unsigned char *input = (unsigned char *) luaL_checklstring(L, 2, &input_len);
-  int output_len = 0;
-  unsigned char *buffer = NULL;
+  /* every item is checked up front, so the context can never leak on error */
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 2, i);
+    if (!lua_isstring(L, -1))
+      return luaL_error(L, "bad item #%d in digest batch (string expected, got %s)",
+                        i, luaL_typename(L, -1));
+    if (lua_type(L, -1) != LUA_TSTRING)
+      all_strings = 0;
+    lua_pop(L, 1);
+  }
 
-  buffer = malloc(input_len + EVP_CIPHER_CTX_block_size(c));
-  EVP_EncryptUpdate(c, buffer, &output_len, input, input_len);
-  lua_pushlstring(L, (char*) buffer, output_len);
-  free(buffer);
+  if (n > 1 && all_strings && mbsha_lanes() > 0 &&
+      (EVP_MD_type(type) == NID_sha1 || EVP_MD_type(type) == NID_sha256))
+    return digest_batch_mb(L, EVP_MD_type(type) == NID_sha1 ? MBSHA_SHA1 : MBSHA_SHA256,
+                           EVP_MD_size(type), n, format);
 
-  return 1;
-}
+  lua_createtable(L, n, 0);
+  c = EVP_MD_CTX_create();
+  for (i = 1; i <= n; i++) {
+    size_t len = 0;
+    const char *s;
+
+    lua_rawgeti(L, 2, i);
+    s = lua_tolstring(L, -1, &len);
+    /* re-initializing with the same type keeps the context's md_data */
+    EVP_DigestInit_ex(c, type, NULL);
+    EVP_DigestUpdate(c, s, len);
+    EVP_DigestFinal_ex(c, digest, &written);
+    lua_pop(L, 1);
+
+    luacrypto_pushformatted(L, digest, written, format);
+    lua_rawseti(L, -2, i);
+  }
+  EVP_MD_CTX_destroy(c);
 
-static int encrypt_final(lua_State *L) 
-{
-  EVP_CIPHER_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_ENCRYPTNAME);
-  int output_len = 0;
-  unsigned char buffer[EVP_MAX_BLOCK_LENGTH];
-  
-  EVP_EncryptFinal(c, buffer, &output_len);
-  lua_pushlstring(L, (char*) buffer, output_len);
   return 1;
 }
 
-static int encrypt_tostring(lua_State *L)
+static int digest_fileconsumer(void *ud, const unsigned char *data, size_t len)
 {
-  EVP_CIPHER_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_ENCRYPTNAME);
-  char s[64];
-  sprintf(s, "%s %p", LUACRYPTO_ENCRYPTNAME, (void *)c);
-  lua_pushstring(L, s);
-  return 1;
+  return EVP_DigestUpdate((EVP_MD_CTX *)ud, data, len);
 }
 
-static int encrypt_gc(lua_State *L)
+static int digest_ffile(lua_State *L)
 {
-  EVP_CIPHER_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_ENCRYPTNAME);
+  const EVP_MD *type = luacrypto_tomd(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  int format = luacrypto_optformat(L, 5, LUACRYPTO_HEX);
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int written = 0;
+  uint64_t offset, length;
+  EVP_MD_CTX *c;
+  int err;
+
+  if (type == NULL) {
+    luaL_argerror(L, 1, "invalid digest type");
+    return 0;
+  }
+  luacrypto_optrange(L, 3, &offset, &length);
+
+  c = EVP_MD_CTX_create();
+  EVP_DigestInit_ex(c, type, NULL);
+  err = fileio_read(path, offset, length, digest_fileconsumer, c);
+  if (err == 0)
+    EVP_DigestFinal_ex(c, digest, &written);
+  EVP_MD_CTX_destroy(c);
+  if (err != 0)
+    return luacrypto_fileerror(L, path, err);
+
+  luacrypto_pushformatted(L, digest, written, format);
+  return 1;
+}
+
+/* one file of a digest.files call; filled in by a pool thread */
+typedef struct digest_filejob {
+  const char *path;
+  int err;
+  unsigned char digest[EVP_MAX_MD_SIZE];
+} digest_filejob;
+
+typedef struct digest_filebatch {
+  const EVP_MD *type;
+  digest_filejob *jobs;
+} digest_filebatch;
+
+static void digest_filetask(void *ud, size_t i)
+{
+  digest_filebatch *b = ud;
+  digest_filejob *job = &b->jobs[i];
+  EVP_MD_CTX *c = EVP_MD_CTX_create();
+
+  if (c == NULL || !EVP_DigestInit_ex(c, b->type, NULL))
+    job->err = FILEIO_ECONSUMER;
+  else {
+    job->err = fileio_read(job->path, 0, FILEIO_TO_END, digest_fileconsumer, c);
+    if (job->err == 0 && !EVP_DigestFinal_ex(c, job->digest, NULL))
+      job->err = FILEIO_ECONSUMER;
+  }
+  if (c != NULL)
+    EVP_MD_CTX_destroy(c);
+}
+
+/*
+** Hashes every file of the array at index 2 on the thread pool. Pushes
+** a table of path -> digest and, if some files could not be read, a
+** table of path -> error message.
+*/
+static int digest_ffiles(lua_State *L)
+{
+  const EVP_MD *type = luacrypto_tomd(L, 1);
+  int format = luacrypto_optformat(L, 3, LUACRYPTO_HEX);
+  int threads = luacrypto_optthreads(L, 4);
+  digest_filebatch b;
+  int i, n, failed = 0;
+
+  if (type == NULL) {
+    luaL_argerror(L, 1, "invalid digest type");
+    return 0;
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = lua_objlen(L, 2);
+
+  /* the jobs live in a userdata so an error below cannot leak them */
+  b.type = type;
+  b.jobs = lua_newuserdata(L, (n > 0 ? n : 1) * sizeof(digest_filejob));
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      return luaL_error(L, "bad item #%d in file list (string expected, got %s)",
+                        i + 1, luaL_typename(L, -1));
+    /* the paths table keeps the strings alive */
+    b.jobs[i].path = lua_tostring(L, -1);
+    lua_pop(L, 1);
+  }
+
+  pool_for(threads, (size_t)n, digest_filetask, &b);
+
+  lua_newtable(L);
+  for (i = 0; i < n; i++) {
+    if (b.jobs[i].err != 0)
+      continue;
+    lua_pushstring(L, b.jobs[i].path);
+    luacrypto_pushformatted(L, b.jobs[i].digest, EVP_MD_size(type), format);
+    lua_rawset(L, -3);
+  }
+  for (i = 0; i < n; i++) {
+    if (b.jobs[i].err == 0)
+      continue;
+    if (!failed++)
+      lua_newtable(L);
+    lua_pushstring(L, b.jobs[i].path);
+    if (b.jobs[i].err == FILEIO_ECONSUMER)
+      lua_pushstring(L, "digest failed");
+    else
+      lua_pushfstring(L, "%s: %s", b.jobs[i].path, strerror(b.jobs[i].err));
+    lua_rawset(L, -3);
+  }
+  return failed ? 2 : 1;
+}
+
+/*
+** Reads the optional tree hashing options table at index arg: chunk,
+** the chunk size in bytes, and threads, the most threads to use.
+*/
+static void digest_opttree(lua_State *L, int arg, size_t *chunk, int *threads)
+{
+  *chunk = TREEHASH_DEFAULT_CHUNK;
+  *threads = luacrypto_optthreads(L, arg);
+  if (lua_isnoneornil(L, arg))
+    return;
+  lua_getfield(L, arg, "chunk");
+  if (!lua_isnil(L, -1)) {
+    lua_Number n = lua_tonumber(L, -1);
+    luaL_argcheck(L, n >= 1 && n <= (1 << 30), arg, "chunk must be between 1 and 2^30");
+    *chunk = (size_t)n;
+  }
+  lua_pop(L, 1);
+}
+
+static int digest_ftree(lua_State *L)
+{
+  const EVP_MD *type = luacrypto_tomd(L, 1);
+  size_t input_len = 0;
+  const unsigned char *input = luacrypto_checkbytes(L, 2, &input_len);
+  int format = luacrypto_optformat(L, 3, LUACRYPTO_HEX);
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  size_t chunk;
+  int threads;
+  treehash t;
+  int ok;
+
+  if (type == NULL) {
+    luaL_argerror(L, 1, "invalid digest type");
+    return 0;
+  }
+  digest_opttree(L, 4, &chunk, &threads);
+
+  ok = treehash_init(&t, type, chunk, threads)
+    && treehash_update(&t, input, input_len)
+    && treehash_final(&t, digest);
+  treehash_cleanup(&t);
+  if (!ok)
+    return crypto_error(L);
+
+  luacrypto_pushformatted(L, digest, EVP_MD_size(type), format);
+  return 1;
+}
+
+static int digest_treeconsumer(void *ud, const unsigned char *data, size_t len)
+{
+  return treehash_update((treehash *)ud, data, len);
+}
+
+static int digest_ftree_file(lua_State *L)
+{
+  const EVP_MD *type = luacrypto_tomd(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  int format = luacrypto_optformat(L, 5, LUACRYPTO_HEX);
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  uint64_t offset, length;
+  size_t chunk;
+  int threads;
+  treehash t;
+  int err = FILEIO_ECONSUMER;
+
+  if (type == NULL) {
+    luaL_argerror(L, 1, "invalid digest type");
+    return 0;
+  }
+  luacrypto_optrange(L, 3, &offset, &length);
+  digest_opttree(L, 6, &chunk, &threads);
+
+  if (treehash_init(&t, type, chunk, threads)) {
+    err = fileio_read(path, offset, length, digest_treeconsumer, &t);
+    if (err == 0 && !treehash_final(&t, digest))
+      err = FILEIO_ECONSUMER;
+  }
+  treehash_cleanup(&t);
+  if (err != 0)
+    return luacrypto_fileerror(L, path, err);
+
+  luacrypto_pushformatted(L, digest, EVP_MD_size(type), format);
+  return 1;
+}
+
+/*************** ENCRYPT API ***************/
+
+/*
+** Encrypt and decrypt objects keep the iv they were started with:
+** OpenSSL only reloads a CBC iv by itself, a CTR or stream cipher
+** given a NULL iv would carry on from its current counter.
+*/
+typedef struct luacrypto_cipher {
+  EVP_CIPHER_CTX c;
+  unsigned char iv[EVP_MAX_IV_LENGTH];
+} luacrypto_cipher;
+
+/*
+** Reinitializes a cipher context in place with the optional key and iv
+** at stack positions 2 and 3. A missing key keeps the expanded key
+** schedule, a missing iv restarts from the one kept in last_iv.
+** Returns 0 on an OpenSSL failure.
+*/
+static int cipher_reset(lua_State *L, EVP_CIPHER_CTX *c, unsigned char *last_iv, int enc)
+{
+  size_t key_len = 0;
+  const char *key = lua_tolstring(L, 2, &key_len); /* can be NULL */
+  unsigned char evp_key[EVP_MAX_KEY_LENGTH] = {0};
+
+  size_t iv_len = 0;
+  const char *iv = lua_tolstring(L, 3, &iv_len); /* can be NULL */
+  unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
+
+  luaL_argcheck(L, key_len <= EVP_MAX_KEY_LENGTH, 2, "key too long");
+  luaL_argcheck(L, iv_len <= EVP_MAX_IV_LENGTH, 3, "iv too long");
+  if (key) {
+    memcpy(evp_key, key, key_len);
+  }
+  if (iv) {
+    memcpy(evp_iv, iv, iv_len);
+    memcpy(last_iv, evp_iv, EVP_MAX_IV_LENGTH);
+  }
+
+  return EVP_CipherInit_ex(c, NULL, NULL, key ? evp_key : NULL, last_iv, enc);
+}
+
+static luacrypto_cipher *encrypt_pnew(lua_State *L)
+{
+  luacrypto_cipher *c = lua_newuserdata(L, sizeof(luacrypto_cipher));
+  luaL_getmetatable(L, LUACRYPTO_ENCRYPTNAME);
+  lua_setmetatable(L, -2);
+  return c;
+}
+
+static int encrypt_fnew(lua_State *L)
+{
+  const EVP_CIPHER *cipher = luacrypto_tocipher(L, 1);
+  if (cipher == NULL) {
+    luaL_argerror(L, 1, "invalid encrypt cipher");
+    return 0;
+  } else {
+    size_t key_len = 0;
+    const char *key = luaL_checklstring(L, 2, &key_len);
+    unsigned char evp_key[EVP_MAX_KEY_LENGTH] = {0};
+  
+    size_t iv_len = 0;
+    const char *iv = lua_tolstring(L, 3, &iv_len); /* can be NULL */
+    unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
+  
+    luaL_argcheck(L, key_len <= EVP_MAX_KEY_LENGTH, 2, "key too long");
+    luaL_argcheck(L, iv_len <= EVP_MAX_IV_LENGTH, 3, "iv too long");
+    memcpy(evp_key, key, key_len);
+    if (iv) {
+      memcpy(evp_iv, iv, iv_len);      
+    }
+    
+    luacrypto_cipher *c = encrypt_pnew(L);
+    memcpy(c->iv, evp_iv, sizeof(c->iv));
+    EVP_CIPHER_CTX_init(&c->c);
+    EVP_EncryptInit_ex(&c->c, cipher, NULL, evp_key, iv ? evp_iv : NULL);
+    return 1;
+  }
+}
+
+static int encrypt_reset(lua_State *L)
+{
+  luacrypto_cipher *c = luaL_checkudata(L, 1, LUACRYPTO_ENCRYPTNAME);
+  if (!cipher_reset(L, &c->c, c->iv, 1))
+    return crypto_error(L);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int encrypt_update(lua_State *L)
+{
+  EVP_CIPHER_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_ENCRYPTNAME);
+  size_t input_len = 0;
+  const unsigned char *input = luacrypto_checkbytes(L, 2, &input_len);
+  luacrypto_buffer *out = buffer_test(L, 3);
+  int output_len = 0;
+  unsigned char *buffer = NULL;
+
+  if (out != NULL) {
+    luaL_argcheck(L, !lua_rawequal(L, 2, 3), 3, "output buffer is also the input");
+    buffer = buffer_reserve(L, out, input_len + EVP_CIPHER_CTX_block_size(c));
+    EVP_EncryptUpdate(c, buffer, &output_len, input, input_len);
+    out->len += output_len;
+    lua_settop(L, 3);
+    return 1;
+  }
+
+  buffer = malloc(input_len + EVP_CIPHER_CTX_block_size(c));
+  EVP_EncryptUpdate(c, buffer, &output_len, input, input_len);
+  lua_pushlstring(L, (char*) buffer, output_len);
+  free(buffer);
+
+  return 1;
+}
+
+static int encrypt_final(lua_State *L) 
+{
+  EVP_CIPHER_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_ENCRYPTNAME);
+  luacrypto_buffer *out = buffer_test(L, 2);
+  int output_len = 0;
+  unsigned char buffer[EVP_MAX_BLOCK_LENGTH];
+  
+  if (out != NULL) {
+    EVP_EncryptFinal(c, buffer_reserve(L, out, EVP_MAX_BLOCK_LENGTH), &output_len);
+    out->len += output_len;
+    lua_settop(L, 2);
+    return 1;
+  }
+
+  EVP_EncryptFinal(c, buffer, &output_len);
+  lua_pushlstring(L, (char*) buffer, output_len);
+  return 1;
+}
+
+static int encrypt_tostring(lua_State *L)
+{
+  EVP_CIPHER_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_ENCRYPTNAME);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_ENCRYPTNAME, (void *)c);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+static int encrypt_gc(lua_State *L)
+{
+  EVP_CIPHER_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_ENCRYPTNAME);
   EVP_CIPHER_CTX_cleanup(c);
   return 1;
 }
 
+/* smallest slice of input worth a thread of its own, a multiple of every counter block */
+#define CIPHER_SLICE (256 << 10)
+
+/*
+** A counter mode or ChaCha20 one-shot call split into slices, each
+** started at the counter of its first block.
+*/
+typedef struct cipher_slices {
+  const EVP_CIPHER *type;
+  const unsigned char *key;
+  const unsigned char *iv;
+  const unsigned char *input;
+  unsigned char *output;
+  size_t len, slice;
+  int enc;
+  volatile int failed;
+} cipher_slices;
+
+/*
+** Sets iv to the counter of block k: a 128-bit big-endian counter for
+** CTR, and for ChaCha20 the 32-bit little-endian block counter in front
+** of the nonce.
+*/
+static void cipher_seek(const EVP_CIPHER *type, const unsigned char *iv, uint64_t k, unsigned char *out)
+{
+  int i;
+  memcpy(out, iv, 16);
+  if (EVP_CIPHER_mode(type) == EVP_CIPH_CTR_MODE) {
+    for (i = 15; i >= 0 && k > 0; i--) {
+      k += out[i];
+      out[i] = (unsigned char)k;
+      k >>= 8;
+    }
+  } else {
+    for (i = 0; i < 4; i++) {
+      k += out[i];
+      out[i] = (unsigned char)k;
+      k >>= 8;
+    }
+  }
+}
+
+static void cipher_slice(void *ud, size_t i)
+{
+  cipher_slices *s = ud;
+  size_t offset = i * s->slice;
+  size_t len = s->len - offset < s->slice ? s->len - offset : s->slice;
+  unsigned char iv[16];
+  EVP_CIPHER_CTX c;
+  int written = 0;
+
+  cipher_seek(s->type, s->iv, offset / (EVP_CIPHER_mode(s->type) == EVP_CIPH_CTR_MODE ? 16 : 64), iv);
+  EVP_CIPHER_CTX_init(&c);
+  if (!EVP_CipherInit_ex(&c, s->type, NULL, s->key, iv, s->enc)
+      || !EVP_CipherUpdate(&c, s->output + offset, &written, s->input + offset, (int)len)
+      || (size_t)written != len)
+    s->failed = 1;
+  EVP_CIPHER_CTX_cleanup(&c);
+}
+
+/*
+** Encrypts or decrypts len bytes of input on up to threads threads when
+** the cipher is AES-CTR or ChaCha20; the output is the same as a single
+** EVP_CipherUpdate. Returns 0, without touching output, when the call is
+** not worth splitting or the cipher has no seekable counter.
+*/
+static int cipher_parallel(const EVP_CIPHER *type, const unsigned char *key, const unsigned char *iv,
+                           const unsigned char *input, size_t len, unsigned char *output,
+                           int enc, int threads)
+{
+  cipher_slices s;
+  size_t n;
+
+  if (threads <= 1 || iv == NULL || len < 2 * CIPHER_SLICE || len > INT_MAX
+      || EVP_CIPHER_iv_length(type) != 16)
+    return 0;
+  if (EVP_CIPHER_mode(type) != EVP_CIPH_CTR_MODE) {
+#ifdef NID_chacha20
+    uint32_t counter = iv[0] | iv[1] << 8 | iv[2] << 16 | (uint32_t)iv[3] << 24;
+    /* OpenSSL carries a wrapping block counter into the nonce: leave that to it */
+    if (EVP_CIPHER_nid(type) != NID_chacha20 || (len + 63) / 64 > (uint64_t)0xffffffff - counter)
+      return 0;
+#else
+    return 0;
+#endif
+  }
+
+  /* about one slice per thread, but no smaller than CIPHER_SLICE */
+  s.slice = (len / threads + CIPHER_SLICE - 1) / CIPHER_SLICE * CIPHER_SLICE;
+  n = (len + s.slice - 1) / s.slice;
+  s.type = type;
+  s.key = key;
+  s.iv = iv;
+  s.input = input;
+  s.output = output;
+  s.len = len;
+  s.enc = enc;
+  s.failed = 0;
+  pool_for(threads, n, cipher_slice, &s);
+  return !s.failed;
+}
+
+/*
+** Reads the options table of a one-shot encrypt or decrypt: splitting
+** the work over threads is opt-in.
+*/
+static int cipher_optthreads(lua_State *L, int arg)
+{
+  return lua_isnoneornil(L, arg) ? 1 : luacrypto_optthreads(L, arg);
+}
+
 static int encrypt_fencrypt(lua_State *L)
 {
   /* parameter 1 is the 'crypto.encrypt' table */
-  const char *type_name = luaL_checkstring(L, 2);
-  const EVP_CIPHER *type = EVP_get_cipherbyname(type_name);
+  const EVP_CIPHER *type = luacrypto_tocipher(L, 2);
 
   if (type == NULL) {
     luaL_argerror(L, 1, "invalid encrypt cipher");
@@ -277,6 +1200,8 @@ static int encrypt_fencrypt(lua_State *L)
     const char *iv = lua_tolstring(L, 5, &iv_len); /* can be NULL */
     unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
   
+    luaL_argcheck(L, key_len <= EVP_MAX_KEY_LENGTH, 4, "key too long");
+    luaL_argcheck(L, iv_len <= EVP_MAX_IV_LENGTH, 5, "iv too long");
     memcpy(evp_key, key, key_len);
     if (iv) {
       memcpy(evp_iv, iv, iv_len);      
@@ -285,16 +1210,23 @@ static int encrypt_fencrypt(lua_State *L)
     int output_len = 0;
     int len = 0;
     unsigned char *buffer = NULL;
+    int format = luacrypto_optformat(L, 6, LUACRYPTO_RAW);
+    int threads = cipher_optthreads(L, 7);
     
     EVP_CIPHER_CTX_init(&c);
     EVP_EncryptInit_ex(&c, type, NULL, evp_key, iv ? evp_iv : NULL);
     buffer = malloc(input_len + EVP_CIPHER_CTX_block_size(&c));
-    EVP_EncryptUpdate(&c, buffer, &len, input, input_len);
-    output_len += len;
-    EVP_EncryptFinal(&c, &buffer[len], &len);
-    output_len += len;
+    if (cipher_parallel(type, evp_key, iv ? evp_iv : NULL, input, input_len, buffer, 1, threads)) {
+      output_len = input_len;
+    } else {
+      EVP_EncryptUpdate(&c, buffer, &len, input, input_len);
+      output_len += len;
+      EVP_EncryptFinal(&c, &buffer[len], &len);
+      output_len += len;
+    }
+    EVP_CIPHER_CTX_cleanup(&c);
     
-    lua_pushlstring(L, (char*) buffer, output_len);
+    luacrypto_pushformatted(L, buffer, output_len, format);
     free(buffer);
     return 1;
   }
@@ -302,9 +1234,9 @@ static int encrypt_fencrypt(lua_State *L)
 
 /*************** DECRYPT API ***************/
 
-static EVP_CIPHER_CTX *decrypt_pnew(lua_State *L)
+static luacrypto_cipher *decrypt_pnew(lua_State *L)
 {
-  EVP_CIPHER_CTX *c = lua_newuserdata(L, sizeof(EVP_CIPHER_CTX));
+  luacrypto_cipher *c = lua_newuserdata(L, sizeof(luacrypto_cipher));
   luaL_getmetatable(L, LUACRYPTO_DECRYPTNAME);
   lua_setmetatable(L, -2);
   return c;
@@ -312,8 +1244,7 @@ static EVP_CIPHER_CTX *decrypt_pnew(lua_State *L)
 
 static int decrypt_fnew(lua_State *L)
 {
-  const char *s = luaL_checkstring(L, 1);
-  const EVP_CIPHER *cipher = EVP_get_cipherbyname(s);
+  const EVP_CIPHER *cipher = luacrypto_tocipher(L, 1);
   if (cipher == NULL) {
     luaL_argerror(L, 1, "invalid digest/cipher type");
     return 0;
@@ -326,26 +1257,48 @@ static int decrypt_fnew(lua_State *L)
     const char *iv = lua_tolstring(L, 3, &iv_len); /* can be NULL */
     unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
   
+    luaL_argcheck(L, key_len <= EVP_MAX_KEY_LENGTH, 2, "key too long");
+    luaL_argcheck(L, iv_len <= EVP_MAX_IV_LENGTH, 3, "iv too long");
     memcpy(evp_key, key, key_len);
     if (iv) {
       memcpy(evp_iv, iv, iv_len);      
     }
     
-    EVP_CIPHER_CTX *c = decrypt_pnew(L);
-    EVP_CIPHER_CTX_init(c);
-    EVP_DecryptInit_ex(c, cipher, NULL, evp_key, iv ? evp_iv : NULL);
+    luacrypto_cipher *c = decrypt_pnew(L);
+    memcpy(c->iv, evp_iv, sizeof(c->iv));
+    EVP_CIPHER_CTX_init(&c->c);
+    EVP_DecryptInit_ex(&c->c, cipher, NULL, evp_key, iv ? evp_iv : NULL);
     return 1;
   }
 }
 
+static int decrypt_reset(lua_State *L)
+{
+  luacrypto_cipher *c = luaL_checkudata(L, 1, LUACRYPTO_DECRYPTNAME);
+  if (!cipher_reset(L, &c->c, c->iv, 0))
+    return crypto_error(L);
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int decrypt_update(lua_State *L)
 {
   EVP_CIPHER_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_DECRYPTNAME);
   size_t input_len = 0;
-  const unsigned char *input = (unsigned char *) luaL_checklstring(L, 2, &input_len);
+  const unsigned char *input = luacrypto_checkbytes(L, 2, &input_len);
+  luacrypto_buffer *out = buffer_test(L, 3);
   int output_len = 0;
   unsigned char *buffer = NULL;
 
+  if (out != NULL) {
+    luaL_argcheck(L, !lua_rawequal(L, 2, 3), 3, "output buffer is also the input");
+    buffer = buffer_reserve(L, out, input_len + EVP_CIPHER_CTX_block_size(c));
+    EVP_DecryptUpdate(c, buffer, &output_len, input, input_len);
+    out->len += output_len;
+    lua_settop(L, 3);
+    return 1;
+  }
+
   buffer = malloc(input_len + EVP_CIPHER_CTX_block_size(c));
   EVP_DecryptUpdate(c, buffer, &output_len, input, input_len);
   lua_pushlstring(L, (char*) buffer, output_len);
@@ -357,9 +1310,17 @@ static int decrypt_update(lua_State *L)
 static int decrypt_final(lua_State *L) 
 {
   EVP_CIPHER_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_DECRYPTNAME);
+  luacrypto_buffer *out = buffer_test(L, 2);
   int output_len = 0;
   unsigned char buffer[EVP_MAX_BLOCK_LENGTH];
   
+  if (out != NULL) {
+    EVP_DecryptFinal(c, buffer_reserve(L, out, EVP_MAX_BLOCK_LENGTH), &output_len);
+    out->len += output_len;
+    lua_settop(L, 2);
+    return 1;
+  }
+
   EVP_DecryptFinal(c, buffer, &output_len);
   lua_pushlstring(L, (char*) buffer, output_len);
   return 1;
@@ -384,8 +1345,7 @@ static int decrypt_gc(lua_State *L)
 static int decrypt_fdecrypt(lua_State *L)
 {
   /* parameter 1 is the 'crypto.decrypt' table */
-  const char *type_name = luaL_checkstring(L, 2);
-  const EVP_CIPHER *type = EVP_get_cipherbyname(type_name);
+  const EVP_CIPHER *type = luacrypto_tocipher(L, 2);
 
   if (type == NULL) {
     luaL_argerror(L, 1, "invalid decrypt cipher");
@@ -404,6 +1364,8 @@ static int decrypt_fdecrypt(lua_State *L)
     const char *iv = lua_tolstring(L, 5, &iv_len); /* can be NULL */
     unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
   
+    luaL_argcheck(L, key_len <= EVP_MAX_KEY_LENGTH, 4, "key too long");
+    luaL_argcheck(L, iv_len <= EVP_MAX_IV_LENGTH, 5, "iv too long");
     memcpy(evp_key, key, key_len);
     if (iv) {
       memcpy(evp_iv, iv, iv_len);      
@@ -412,14 +1374,20 @@ static int decrypt_fdecrypt(lua_State *L)
     int output_len = 0;
     int len = 0;
     unsigned char *buffer = NULL;
+    int threads = cipher_optthreads(L, 6);
     
     EVP_CIPHER_CTX_init(&c);
     EVP_DecryptInit_ex(&c, type, NULL, evp_key, iv ? evp_iv : NULL);
     buffer = malloc(input_len + EVP_CIPHER_CTX_block_size(&c));
-    EVP_DecryptUpdate(&c, buffer, &len, input, input_len);
-    output_len += len;
-    EVP_DecryptFinal(&c, &buffer[len], &len);
-    output_len += len;
+    if (cipher_parallel(type, evp_key, iv ? evp_iv : NULL, input, input_len, buffer, 0, threads)) {
+      output_len = input_len;
+    } else {
+      EVP_DecryptUpdate(&c, buffer, &len, input, input_len);
+      output_len += len;
+      EVP_DecryptFinal(&c, &buffer[len], &len);
+      output_len += len;
+    }
+    EVP_CIPHER_CTX_cleanup(&c);
     
     lua_pushlstring(L, (char*) buffer, output_len);
     free(buffer);
@@ -427,52 +1395,418 @@ static int decrypt_fdecrypt(lua_State *L)
   }
 }
 
-/*************** HMAC API ***************/
+/*************** AEAD API ***************/
 
-static HMAC_CTX *hmac_pnew(lua_State *L)
-{
-  HMAC_CTX *c = lua_newuserdata(L, sizeof(HMAC_CTX));
-  luaL_getmetatable(L, LUACRYPTO_HMACNAME);
-  lua_setmetatable(L, -2);
-  return c;
-}
+/* OpenSSL 1.0.1 only knows the GCM specific names */
+#ifndef EVP_CTRL_AEAD_SET_IVLEN
+#define EVP_CTRL_AEAD_SET_IVLEN EVP_CTRL_GCM_SET_IVLEN
+#define EVP_CTRL_AEAD_GET_TAG EVP_CTRL_GCM_GET_TAG
+#define EVP_CTRL_AEAD_SET_TAG EVP_CTRL_GCM_SET_TAG
+#endif
 
-static int hmac_fnew(lua_State *L)
-{
-  HMAC_CTX *c = hmac_pnew(L);
-  const char *s = luaL_checkstring(L, 1);
-  const char *k = luaL_checkstring(L, 2);
-  const EVP_MD *type = EVP_get_digestbyname(s);
+/*
+** Tags are 16 bytes unless the caller asks for a shorter one, and never
+** below 12. Openers fix the length up front and refuse any other, so a
+** forger cannot pick a short tag to guess.
+*/
+#define AEAD_MAX_TAG_LENGTH 16
+#define AEAD_MIN_TAG_LENGTH 12
 
-  if (type == NULL) {
-    luaL_argerror(L, 1, "invalid digest type");
-    return 0;
-  }
+typedef struct aead_ctx {
+  EVP_CIPHER_CTX c;
+  int tag_len;
+} aead_ctx;
 
-  HMAC_CTX_init(c);
-  HMAC_Init_ex(c, k, lua_strlen(L, 2), type, NULL);
+/* ChaCha20-Poly1305 (RFC 8439) comes with OpenSSL 1.1.0 */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305)
+#define AEAD_CHACHA20_POLY1305 1
+#endif
 
-  return 1;
+/*
+** Returns the AEAD cipher named at index arg. Ciphers that need the
+** message length up front (CCM) cannot be streamed and are refused.
+*/
+static const EVP_CIPHER *aead_checkcipher(lua_State *L, int arg)
+{
+  const EVP_CIPHER *cipher = luacrypto_tocipher(L, arg);
+#ifdef AEAD_CHACHA20_POLY1305
+  if (cipher != NULL && EVP_CIPHER_nid(cipher) == NID_chacha20_poly1305)
+    return cipher;
+#endif
+  if (cipher == NULL || !(EVP_CIPHER_flags(cipher) & EVP_CIPH_FLAG_AEAD_CIPHER)
+      || EVP_CIPHER_mode(cipher) == EVP_CIPH_CCM_MODE)
+    luaL_argerror(L, arg, "invalid aead cipher");
+  return cipher;
 }
 
-static int hmac_clone(lua_State *L)
+static int aead_checktaglen(lua_State *L, int arg)
 {
- HMAC_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_HMACNAME);
- HMAC_CTX *d = hmac_pnew(L);
- *d = *c;
- return 1;
+  int tag_len = luaL_optint(L, arg, AEAD_MAX_TAG_LENGTH);
+  luaL_argcheck(L, tag_len >= AEAD_MIN_TAG_LENGTH && tag_len <= AEAD_MAX_TAG_LENGTH, arg, "invalid tag length");
+  return tag_len;
 }
 
-static int hmac_reset(lua_State *L)
+/*
+** Sets up c for cipher with the key and nonce at stack positions arg
+** and arg+1. The key must have the exact length the cipher expects.
+*/
+static int aead_init(lua_State *L, EVP_CIPHER_CTX *c, const EVP_CIPHER *cipher, int arg, int enc)
 {
-  HMAC_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_HMACNAME);
-  HMAC_Init_ex(c, NULL, 0, NULL, NULL);
-  return 0;
+  size_t key_len = 0;
+  const unsigned char *key = (unsigned char *) luaL_checklstring(L, arg, &key_len);
+  size_t nonce_len = 0;
+  const unsigned char *nonce = (unsigned char *) luaL_checklstring(L, arg + 1, &nonce_len);
+
+  luaL_argcheck(L, key_len == (size_t)EVP_CIPHER_key_length(cipher), arg, "invalid key length");
+  luaL_argcheck(L, nonce_len > 0 && nonce_len <= EVP_MAX_IV_LENGTH, arg + 1, "invalid nonce length");
+
+  return EVP_CipherInit_ex(c, cipher, NULL, NULL, NULL, enc)
+      && ((int)nonce_len == EVP_CIPHER_iv_length(cipher)
+          || EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_SET_IVLEN, (int)nonce_len, NULL))
+      && EVP_CipherInit_ex(c, NULL, NULL, key, nonce, -1);
 }
 
-static int hmac_update(lua_State *L)
+static int aead_addaad(EVP_CIPHER_CTX *c, const unsigned char *aad, size_t len)
 {
-  HMAC_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_HMACNAME);
+  int output_len = 0;
+  return len == 0 || EVP_CipherUpdate(c, NULL, &output_len, aad, (int)len);
+}
+
+/*
+** Runs len bytes of input through c, appending the output to b in
+** pieces that fit the Lua buffer so nothing is copied twice.
+*/
+static int aead_addupdate(luaL_Buffer *b, EVP_CIPHER_CTX *c, const unsigned char *input, size_t len)
+{
+  while (len > 0) {
+    size_t n = len < LUAL_BUFFERSIZE - EVP_MAX_BLOCK_LENGTH ? len : LUAL_BUFFERSIZE - EVP_MAX_BLOCK_LENGTH;
+    int output_len = 0;
+    if (!EVP_CipherUpdate(c, (unsigned char *)luaL_prepbuffer(b), &output_len, input, (int)n))
+      return 0;
+    luaL_addsize(b, output_len);
+    input += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static int aead_addfinal(luaL_Buffer *b, EVP_CIPHER_CTX *c)
+{
+  int output_len = 0;
+  if (!EVP_CipherFinal_ex(c, (unsigned char *)luaL_prepbuffer(b), &output_len))
+    return 0;
+  luaL_addsize(b, output_len);
+  return 1;
+}
+
+static int aead_autherror(lua_State *L)
+{
+  lua_pushnil(L);
+  lua_pushliteral(L, "authentication failed");
+  return 2;
+}
+
+static int aead_fseal(lua_State *L)
+{
+  const EVP_CIPHER *cipher = aead_checkcipher(L, 1);
+  size_t input_len = 0;
+  const unsigned char *input = luacrypto_checkbytes(L, 4, &input_len);
+  size_t aad_len = 0;
+  const unsigned char *aad = (unsigned char *) luaL_optlstring(L, 5, "", &aad_len);
+  int tag_len = aead_checktaglen(L, 6);
+  unsigned char tag[AEAD_MAX_TAG_LENGTH];
+  EVP_CIPHER_CTX c;
+  luaL_Buffer b;
+  int ok;
+
+  EVP_CIPHER_CTX_init(&c);
+  ok = aead_init(L, &c, cipher, 2, 1) && aead_addaad(&c, aad, aad_len);
+  if (ok) {
+    luaL_buffinit(L, &b);
+    ok = aead_addupdate(&b, &c, input, input_len) && aead_addfinal(&b, &c)
+      && EVP_CIPHER_CTX_ctrl(&c, EVP_CTRL_AEAD_GET_TAG, tag_len, tag);
+  }
+  EVP_CIPHER_CTX_cleanup(&c);
+  if (!ok)
+    return crypto_error(L);
+  luaL_pushresult(&b);
+  lua_pushlstring(L, (char *) tag, tag_len);
+  return 2;
+}
+
+static int aead_fopen(lua_State *L)
+{
+  const EVP_CIPHER *cipher = aead_checkcipher(L, 1);
+  size_t input_len = 0;
+  const unsigned char *input = luacrypto_checkbytes(L, 4, &input_len);
+  size_t tag_len = 0;
+  const char *tag = luaL_checklstring(L, 5, &tag_len);
+  size_t aad_len = 0;
+  const unsigned char *aad = (unsigned char *) luaL_optlstring(L, 6, "", &aad_len);
+  int expected_len = aead_checktaglen(L, 7);
+  EVP_CIPHER_CTX c;
+  luaL_Buffer b;
+  int ok;
+
+  if (tag_len != (size_t)expected_len)
+    return aead_autherror(L);
+  EVP_CIPHER_CTX_init(&c);
+  ok = aead_init(L, &c, cipher, 2, 0)
+    && EVP_CIPHER_CTX_ctrl(&c, EVP_CTRL_AEAD_SET_TAG, (int)tag_len, (void *)tag)
+    && aead_addaad(&c, aad, aad_len);
+  if (!ok) {
+    EVP_CIPHER_CTX_cleanup(&c);
+    return crypto_error(L);
+  }
+  luaL_buffinit(L, &b);
+  ok = aead_addupdate(&b, &c, input, input_len) && aead_addfinal(&b, &c);
+  EVP_CIPHER_CTX_cleanup(&c);
+  if (!ok)
+    return aead_autherror(L);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static aead_ctx *aead_pnew(lua_State *L, const char *name)
+{
+  aead_ctx *a = lua_newuserdata(L, sizeof(aead_ctx));
+  luaL_getmetatable(L, name);
+  lua_setmetatable(L, -2);
+  EVP_CIPHER_CTX_init(&a->c);
+  a->tag_len = AEAD_MAX_TAG_LENGTH;
+  return a;
+}
+
+static int aead_fsealer(lua_State *L)
+{
+  const EVP_CIPHER *cipher = aead_checkcipher(L, 1);
+  int tag_len = aead_checktaglen(L, 4);
+  aead_ctx *a = aead_pnew(L, LUACRYPTO_SEALERNAME);
+  a->tag_len = tag_len;
+  if (!aead_init(L, &a->c, cipher, 2, 1))
+    return crypto_error(L);
+  return 1;
+}
+
+static int aead_fopener(lua_State *L)
+{
+  const EVP_CIPHER *cipher = aead_checkcipher(L, 1);
+  int tag_len = aead_checktaglen(L, 4);
+  aead_ctx *a = aead_pnew(L, LUACRYPTO_OPENERNAME);
+  a->tag_len = tag_len;
+  if (!aead_init(L, &a->c, cipher, 2, 0))
+    return crypto_error(L);
+  return 1;
+}
+
+/*
+** Methods shared by sealers and openers.
+*/
+static int aead_reset(lua_State *L, aead_ctx *a)
+{
+  size_t key_len = 0;
+  const char *key = lua_tolstring(L, 2, &key_len); /* can be NULL */
+  size_t nonce_len = 0;
+  const char *nonce = luaL_checklstring(L, 3, &nonce_len);
+
+  luaL_argcheck(L, !key || key_len == (size_t)EVP_CIPHER_CTX_key_length(&a->c), 2, "invalid key length");
+  luaL_argcheck(L, nonce_len == (size_t)EVP_CIPHER_CTX_iv_length(&a->c), 3, "invalid nonce length");
+  if (!EVP_CipherInit_ex(&a->c, NULL, NULL, (unsigned char *)key, (unsigned char *)nonce, -1))
+    return crypto_error(L);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int aead_aad(lua_State *L, aead_ctx *a)
+{
+  size_t aad_len = 0;
+  const unsigned char *aad = luacrypto_checkbytes(L, 2, &aad_len);
+  if (!aead_addaad(&a->c, aad, aad_len))
+    return crypto_error(L);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int aead_update(lua_State *L, aead_ctx *a)
+{
+  size_t input_len = 0;
+  const unsigned char *input = luacrypto_checkbytes(L, 2, &input_len);
+  luacrypto_buffer *out = buffer_test(L, 3);
+  int output_len = 0;
+
+  if (out != NULL) {
+    luaL_argcheck(L, !lua_rawequal(L, 2, 3), 3, "output buffer is also the input");
+    if (!EVP_CipherUpdate(&a->c, buffer_reserve(L, out, input_len + EVP_MAX_BLOCK_LENGTH),
+                          &output_len, input, (int)input_len))
+      return crypto_error(L);
+    out->len += output_len;
+    lua_settop(L, 3);
+  } else {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    if (!aead_addupdate(&b, &a->c, input, input_len))
+      return crypto_error(L);
+    luaL_pushresult(&b);
+  }
+  return 1;
+}
+
+/*
+** Finishes the message, appending the last output to the buffer at
+** index arg or pushing it as a string. Returns 0 on failure, with
+** nothing pushed.
+*/
+static int aead_final(lua_State *L, aead_ctx *a, int arg)
+{
+  luacrypto_buffer *out = buffer_test(L, arg);
+  unsigned char buffer[EVP_MAX_BLOCK_LENGTH];
+  int output_len = 0;
+
+  if (!EVP_CipherFinal_ex(&a->c, out ? buffer_reserve(L, out, EVP_MAX_BLOCK_LENGTH) : buffer, &output_len))
+    return 0;
+  if (out != NULL) {
+    out->len += output_len;
+    lua_pushvalue(L, arg);
+  } else
+    lua_pushlstring(L, (char *) buffer, output_len);
+  return 1;
+}
+
+static int sealer_reset(lua_State *L)
+{
+  return aead_reset(L, luaL_checkudata(L, 1, LUACRYPTO_SEALERNAME));
+}
+
+static int sealer_aad(lua_State *L)
+{
+  return aead_aad(L, luaL_checkudata(L, 1, LUACRYPTO_SEALERNAME));
+}
+
+static int sealer_update(lua_State *L)
+{
+  return aead_update(L, luaL_checkudata(L, 1, LUACRYPTO_SEALERNAME));
+}
+
+static int sealer_final(lua_State *L)
+{
+  aead_ctx *a = luaL_checkudata(L, 1, LUACRYPTO_SEALERNAME);
+  unsigned char tag[AEAD_MAX_TAG_LENGTH];
+
+  if (!aead_final(L, a, 2))
+    return crypto_error(L);
+  if (!EVP_CIPHER_CTX_ctrl(&a->c, EVP_CTRL_AEAD_GET_TAG, a->tag_len, tag))
+    return crypto_error(L);
+  lua_pushlstring(L, (char *) tag, a->tag_len);
+  return 2;
+}
+
+static int sealer_tostring(lua_State *L)
+{
+  aead_ctx *a = luaL_checkudata(L, 1, LUACRYPTO_SEALERNAME);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_SEALERNAME, (void *)a);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+static int sealer_gc(lua_State *L)
+{
+  aead_ctx *a = luaL_checkudata(L, 1, LUACRYPTO_SEALERNAME);
+  EVP_CIPHER_CTX_cleanup(&a->c);
+  return 0;
+}
+
+static int opener_reset(lua_State *L)
+{
+  return aead_reset(L, luaL_checkudata(L, 1, LUACRYPTO_OPENERNAME));
+}
+
+static int opener_aad(lua_State *L)
+{
+  return aead_aad(L, luaL_checkudata(L, 1, LUACRYPTO_OPENERNAME));
+}
+
+static int opener_update(lua_State *L)
+{
+  return aead_update(L, luaL_checkudata(L, 1, LUACRYPTO_OPENERNAME));
+}
+
+static int opener_final(lua_State *L)
+{
+  aead_ctx *a = luaL_checkudata(L, 1, LUACRYPTO_OPENERNAME);
+  size_t tag_len = 0;
+  const char *tag = luaL_checklstring(L, 2, &tag_len);
+
+  if (tag_len != (size_t)a->tag_len)
+    return aead_autherror(L);
+  if (!EVP_CIPHER_CTX_ctrl(&a->c, EVP_CTRL_AEAD_SET_TAG, (int)tag_len, (void *)tag))
+    return crypto_error(L);
+  if (!aead_final(L, a, 3))
+    return aead_autherror(L);
+  return 1;
+}
+
+static int opener_tostring(lua_State *L)
+{
+  aead_ctx *a = luaL_checkudata(L, 1, LUACRYPTO_OPENERNAME);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_OPENERNAME, (void *)a);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+static int opener_gc(lua_State *L)
+{
+  aead_ctx *a = luaL_checkudata(L, 1, LUACRYPTO_OPENERNAME);
+  EVP_CIPHER_CTX_cleanup(&a->c);
+  return 0;
+}
+
+/*************** HMAC API ***************/
+
+static HMAC_CTX *hmac_pnew(lua_State *L)
+{
+  HMAC_CTX *c = lua_newuserdata(L, sizeof(HMAC_CTX));
+  luaL_getmetatable(L, LUACRYPTO_HMACNAME);
+  lua_setmetatable(L, -2);
+  return c;
+}
+
+static int hmac_fnew(lua_State *L)
+{
+  HMAC_CTX *c = hmac_pnew(L);
+  const EVP_MD *type = luacrypto_tomd(L, 1);
+  const char *k = luaL_checkstring(L, 2);
+
+  if (type == NULL) {
+    luaL_argerror(L, 1, "invalid digest type");
+    return 0;
+  }
+
+  HMAC_CTX_init(c);
+  HMAC_Init_ex(c, k, lua_strlen(L, 2), type, NULL);
+
+  return 1;
+}
+
+static int hmac_clone(lua_State *L)
+{
+ HMAC_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_HMACNAME);
+ HMAC_CTX *d = hmac_pnew(L);
+ *d = *c;
+ return 1;
+}
+
+static int hmac_reset(lua_State *L)
+{
+  HMAC_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_HMACNAME);
+  HMAC_Init_ex(c, NULL, 0, NULL, NULL);
+  return 0;
+}
+
+static int hmac_update(lua_State *L)
+{
+  HMAC_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_HMACNAME);
   const char *s = luaL_checkstring(L, 2);
 
   HMAC_Update(c, (unsigned char *)s, lua_strlen(L, 2));
@@ -486,8 +1820,6 @@ static int hmac_final(lua_State *L)
   HMAC_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_HMACNAME);
   unsigned char digest[EVP_MAX_MD_SIZE];
   unsigned int written = 0;
-  unsigned int i;
-  char *hex;
 
   if (lua_isstring(L, 2))
   {
@@ -497,16 +1829,7 @@ static int hmac_final(lua_State *L)
 
   HMAC_Final(c, digest, &written);
 
-  if (lua_toboolean(L, 3))
-    lua_pushlstring(L, (char *)digest, written);
-  else
-  {
-    hex = calloc(sizeof(char), written*2 + 1);
-    for (i = 0; i < written; i++)
-      sprintf(hex + 2*i, "%02x", digest[i]);
-    lua_pushlstring(L, hex, written*2);
-    free(hex);
-  }
+  luacrypto_pushformatted(L, digest, written, luacrypto_optformat(L, 3, LUACRYPTO_HEX));
 
   return 1;
 }
@@ -532,12 +1855,9 @@ static int hmac_fdigest(lua_State *L)
   HMAC_CTX c;
   unsigned char digest[EVP_MAX_MD_SIZE];
   unsigned int written = 0;
-  unsigned int i;
-  char *hex;
-  const char *t = luaL_checkstring(L, 1);
+  const EVP_MD *type = luacrypto_tomd(L, 1);
   const char *s = luaL_checkstring(L, 2);
   const char *k = luaL_checkstring(L, 3);
-  const EVP_MD *type = EVP_get_digestbyname(t);
 
   if (type == NULL) {
     luaL_argerror(L, 1, "invalid digest type");
@@ -548,394 +1868,2900 @@ static int hmac_fdigest(lua_State *L)
   HMAC_Init_ex(&c, k, lua_strlen(L, 3), type, NULL);
   HMAC_Update(&c, (unsigned char *)s, lua_strlen(L, 2));
   HMAC_Final(&c, digest, &written);
+  HMAC_CTX_cleanup(&c);
 
-  if (lua_toboolean(L, 4))
-    lua_pushlstring(L, (char *)digest, written);
-  else
-  {
-    hex = calloc(sizeof(char), written*2 + 1);
-    for (i = 0; i < written; i++)
-      sprintf(hex + 2*i, "%02x", digest[i]);
-    lua_pushlstring(L, hex, written*2);
-    free(hex);
-  }
+  luacrypto_pushformatted(L, digest, written, luacrypto_optformat(L, 4, LUACRYPTO_HEX));
 
   return 1;
 }
 
-/*************** SIGN API ***************/
-
-static EVP_MD_CTX *sign_pnew(lua_State *L)
+static int hmac_fileconsumer(void *ud, const unsigned char *data, size_t len)
 {
-  EVP_MD_CTX *c = lua_newuserdata(L, sizeof(EVP_MD_CTX));
-  luaL_getmetatable(L, LUACRYPTO_SIGNNAME);
-  lua_setmetatable(L, -2);
-  return c;
+  return HMAC_Update((HMAC_CTX *)ud, data, len);
 }
 
-static int sign_fnew(lua_State *L)
+static int hmac_ffile(lua_State *L)
 {
-  const char *s = luaL_checkstring(L, 1);
-  const EVP_MD *md = EVP_get_digestbyname(s);
-  if (md == NULL) {
+  HMAC_CTX c;
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int written = 0;
+  const EVP_MD *type = luacrypto_tomd(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  size_t key_len = 0;
+  const char *k = luaL_checklstring(L, 3, &key_len);
+  int format = luacrypto_optformat(L, 6, LUACRYPTO_HEX);
+  uint64_t offset, length;
+  int err;
+
+  if (type == NULL) {
     luaL_argerror(L, 1, "invalid digest type");
     return 0;
-  } else {
-    EVP_MD_CTX *c = sign_pnew(L);
-    EVP_MD_CTX_init(c);
-    EVP_SignInit_ex(c, md, NULL);
-    return 1;
   }
+  luacrypto_optrange(L, 4, &offset, &length);
+
+  HMAC_CTX_init(&c);
+  HMAC_Init_ex(&c, k, key_len, type, NULL);
+  err = fileio_read(path, offset, length, hmac_fileconsumer, &c);
+  if (err == 0)
+    HMAC_Final(&c, digest, &written);
+  HMAC_CTX_cleanup(&c);
+  if (err != 0)
+    return luacrypto_fileerror(L, path, err);
+
+  luacrypto_pushformatted(L, digest, written, format);
+  return 1;
 }
 
-static int sign_update(lua_State *L)
-{
-  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_SIGNNAME);
-  size_t input_len = 0;
-  const unsigned char *input = (unsigned char *) luaL_checklstring(L, 2, &input_len);
+/*************** FASTHASH API ***************/
 
-  EVP_SignUpdate(c, input, input_len);
-  return 0;
+/*
+** A fast hash object keeps its seed and key so reset can start over.
+*/
+typedef struct luacrypto_fasthash {
+  fasthash_ctx ctx;
+  uint64_t seed;
+  unsigned char key[FASTHASH_SIPHASH_KEY];
+} luacrypto_fasthash;
+
+static int fhash_checkalg(lua_State *L, int arg)
+{
+  static const char *const names[] = {"xxh3", "xxh128", "siphash", NULL};
+  static const int algs[] = {FASTHASH_XXH3, FASTHASH_XXH128, FASTHASH_SIPHASH};
+  return algs[luaL_checkoption(L, arg, NULL, names)];
 }
 
-static int sign_final(lua_State *L) 
+/*
+** Reads the XXH3 seed or the SipHash key at index arg. A seed is an
+** integer below 2^53 or 8 bytes read big-endian, and defaults to 0; the
+** key is a 16 byte string. key points into the Lua string.
+*/
+static void fhash_checkkey(lua_State *L, int alg, int arg, uint64_t *seed, const unsigned char **key)
 {
-  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_SIGNNAME);
-  unsigned int output_len = 0;
-  unsigned char *buffer;
-  EVP_PKEY **pkey = luaL_checkudata(L, 2, LUACRYPTO_PKEYNAME);
-  
-  buffer = malloc(EVP_PKEY_size(*pkey));
-  if (!EVP_SignFinal(c, buffer, &output_len, *pkey)) {
-    free(buffer);
-    return crypto_error(L);
+  size_t len = 0;
+  *seed = 0;
+  *key = NULL;
+  if (alg == FASTHASH_SIPHASH) {
+    *key = (const unsigned char *) luaL_checklstring(L, arg, &len);
+    luaL_argcheck(L, len == FASTHASH_SIPHASH_KEY, arg, "SipHash key must be 16 bytes");
   }
-  lua_pushlstring(L, (char*) buffer, output_len);
-  free(buffer);
-  
+  else if (lua_type(L, arg) == LUA_TSTRING) {
+    const unsigned char *s = (const unsigned char *) lua_tolstring(L, arg, &len);
+    size_t i;
+    luaL_argcheck(L, len == 8, arg, "seed string must be 8 bytes");
+    for (i = 0; i < len; i++)
+      *seed = (*seed << 8) | s[i];
+  }
+  else if (!lua_isnoneornil(L, arg)) {
+    lua_Number n = luaL_checknumber(L, arg);
+    luaL_argcheck(L, n >= 0 && n < 9007199254740992.0 && n == (lua_Number)(int64_t)n, arg,
+                  "seed must be a non-negative integer below 2^53");
+    *seed = (uint64_t)n;
+  }
+}
+
+/*
+** crypto.fasthash.new(alg [, key])
+*/
+static int fhash_fnew(lua_State *L)
+{
+  int alg = fhash_checkalg(L, 1);
+  const unsigned char *key;
+  uint64_t seed;
+  luacrypto_fasthash *h;
+
+  fhash_checkkey(L, alg, 2, &seed, &key);
+  h = lua_newuserdata(L, sizeof(luacrypto_fasthash));
+  luacrypto_setmeta(L, LUACRYPTO_FASTHASHNAME);
+  h->seed = seed;
+  memset(h->key, 0, sizeof(h->key));
+  if (key != NULL)
+    memcpy(h->key, key, FASTHASH_SIPHASH_KEY);
+  fasthash_init(&h->ctx, alg, seed, h->key);
   return 1;
 }
 
-static int sign_tostring(lua_State *L)
+static int fhash_clone(lua_State *L)
 {
-  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_SIGNNAME);
-  char s[64];
-  sprintf(s, "%s %p", LUACRYPTO_SIGNNAME, (void *)c);
-  lua_pushstring(L, s);
+  luacrypto_fasthash *h = luaL_checkudata(L, 1, LUACRYPTO_FASTHASHNAME);
+  luacrypto_fasthash *d = lua_newuserdata(L, sizeof(luacrypto_fasthash));
+  luacrypto_setmeta(L, LUACRYPTO_FASTHASHNAME);
+  *d = *h;
   return 1;
 }
 
-static int sign_gc(lua_State *L)
+static int fhash_reset(lua_State *L)
 {
-  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_SIGNNAME);
-  EVP_MD_CTX_cleanup(c);
+  luacrypto_fasthash *h = luaL_checkudata(L, 1, LUACRYPTO_FASTHASHNAME);
+  fasthash_init(&h->ctx, h->ctx.alg, h->seed, h->key);
+  lua_settop(L, 1);
   return 1;
 }
 
-static int sign_fsign(lua_State *L)
+static int fhash_update(lua_State *L)
+{
+  luacrypto_fasthash *h = luaL_checkudata(L, 1, LUACRYPTO_FASTHASHNAME);
+  size_t len = 0;
+  const unsigned char *data = luacrypto_checkbytes(L, 2, &len);
+  fasthash_update(&h->ctx, data, len);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/*
+** hash:final([input [, raw]]): the hash of everything so far and input.
+** The object is left as it was.
+*/
+static int fhash_final(lua_State *L)
+{
+  luacrypto_fasthash *h = luaL_checkudata(L, 1, LUACRYPTO_FASTHASHNAME);
+  unsigned char out[FASTHASH_MAX_SIZE];
+  int format = luacrypto_optformat(L, 3, LUACRYPTO_HEX);
+
+  if (!lua_isnoneornil(L, 2)) {
+    fasthash_ctx c = h->ctx;
+    size_t len = 0;
+    const unsigned char *data = luacrypto_checkbytes(L, 2, &len);
+    fasthash_update(&c, data, len);
+    fasthash_final(&c, out);
+  }
+  else
+    fasthash_final(&h->ctx, out);
+  luacrypto_pushformatted(L, out, fasthash_size(h->ctx.alg), format);
+  return 1;
+}
+
+static int fhash_tostring(lua_State *L)
+{
+  luacrypto_fasthash *h = luaL_checkudata(L, 1, LUACRYPTO_FASTHASHNAME);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_FASTHASHNAME, (void *)h);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+/*
+** crypto.fasthash(alg, input [, key [, raw]])
+*/
+static int fhash_ffasthash(lua_State *L)
+{
+  int alg = fhash_checkalg(L, 2);
+  size_t len = 0;
+  const unsigned char *data = luacrypto_checkbytes(L, 3, &len);
+  int format = luacrypto_optformat(L, 5, LUACRYPTO_HEX);
+  unsigned char out[FASTHASH_MAX_SIZE];
+  const unsigned char *key;
+  uint64_t seed;
+
+  fhash_checkkey(L, alg, 4, &seed, &key);
+  fasthash_oneshot(alg, seed, key, data, len, out);
+  luacrypto_pushformatted(L, out, fasthash_size(alg), format);
+  return 1;
+}
+
+/*
+** crypto.fasthash.batch(alg, inputs [, key [, raw]]): the hashes of the
+** strings in the array inputs.
+*/
+static int fhash_fbatch(lua_State *L)
+{
+  int alg = fhash_checkalg(L, 1);
+  int format = luacrypto_optformat(L, 4, LUACRYPTO_HEX);
+  size_t size = fasthash_size(alg);
+  unsigned char out[FASTHASH_MAX_SIZE];
+  const unsigned char *key;
+  uint64_t seed;
+  int i, n;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  fhash_checkkey(L, alg, 3, &seed, &key);
+  n = lua_objlen(L, 2);
+  lua_createtable(L, n, 0);
+  for (i = 1; i <= n; i++) {
+    size_t len = 0;
+    const unsigned char *s;
+
+    lua_rawgeti(L, 2, i);
+    if (!lua_isstring(L, -1))
+      return luaL_error(L, "bad item #%d in fasthash batch (string expected, got %s)",
+                        i, luaL_typename(L, -1));
+    s = (const unsigned char *) lua_tolstring(L, -1, &len);
+    fasthash_oneshot(alg, seed, key, s, len, out);
+    lua_pop(L, 1);
+    luacrypto_pushformatted(L, out, size, format);
+    lua_rawseti(L, -2, i);
+  }
+  return 1;
+}
+
+/*************** KDF API ***************/
+
+/*
+** Reads a derived key length at stack position arg.
+*/
+static size_t kdf_checklength(lua_State *L, int arg)
+{
+  lua_Number n = luaL_checknumber(L, arg);
+  luaL_argcheck(L, n >= 1 && n <= INT_MAX, arg, "invalid length");
+  return (size_t)n;
+}
+
+/*
+** Pushes the derived key in the given format and wipes it.
+*/
+static void kdf_pushkey(lua_State *L, unsigned char *key, size_t len, int format)
+{
+  luacrypto_pushformatted(L, key, len, format);
+  OPENSSL_cleanse(key, len);
+}
+
+/*
+** crypto.kdf.pbkdf2(dtype, password, salt, iterations, length [, raw [, options]])
+** The output blocks of a long key are computed on up to options.threads
+** threads.
+*/
+static int kdf_fpbkdf2(lua_State *L)
+{
+  const EVP_MD *md = luacrypto_tomd(L, 1);
+  size_t passlen, saltlen;
+  const char *pass = luaL_checklstring(L, 2, &passlen);
+  const char *salt = luaL_checklstring(L, 3, &saltlen);
+  lua_Number iter = luaL_checknumber(L, 4);
+  size_t len = kdf_checklength(L, 5);
+  int format = luacrypto_optformat(L, 6, LUACRYPTO_RAW);
+  int threads = luacrypto_optthreads(L, 7);
+  unsigned char *out;
+  int ok;
+
+  if (md == NULL)
+    return luaL_argerror(L, 1, "invalid digest type");
+  luaL_argcheck(L, iter >= 1 && iter <= ULONG_MAX, 4, "invalid iteration count");
+  out = lua_newuserdata(L, len);
+  ok = kdf_pbkdf2(md, (const unsigned char *)pass, passlen, (const unsigned char *)salt, saltlen,
+                  (unsigned long)iter, out, len, threads);
+  if (!ok)
+    return crypto_error(L);
+  kdf_pushkey(L, out, len, format);
+  return 1;
+}
+
+/*
+** crypto.kdf.hkdf(dtype, key, salt, info, length [, raw])
+** salt and info may be nil.
+*/
+static int kdf_fhkdf(lua_State *L)
+{
+  const EVP_MD *md = luacrypto_tomd(L, 1);
+  size_t keylen, saltlen, infolen;
+  const char *key = luaL_checklstring(L, 2, &keylen);
+  const char *salt = luaL_optlstring(L, 3, "", &saltlen);
+  const char *info = luaL_optlstring(L, 4, "", &infolen);
+  size_t len = kdf_checklength(L, 5);
+  int format = luacrypto_optformat(L, 6, LUACRYPTO_RAW);
+  unsigned char *out;
+
+  if (md == NULL)
+    return luaL_argerror(L, 1, "invalid digest type");
+  luaL_argcheck(L, len <= 255 * (size_t)EVP_MD_size(md), 5, "longer than 255 digests");
+  out = lua_newuserdata(L, len);
+  if (!kdf_hkdf(md, (const unsigned char *)key, keylen, (const unsigned char *)salt, saltlen,
+                (const unsigned char *)info, infolen, out, len))
+    return crypto_error(L);
+  kdf_pushkey(L, out, len, format);
+  return 1;
+}
+
+/* memory scrypt may use unless options.maxmem says otherwise */
+#define KDF_SCRYPT_MAXMEM (32 * 1024 * 1024)
+
+/*
+** crypto.kdf.scrypt(password, salt, N, r, p, length [, raw [, options]])
+** The p lanes run on up to options.threads threads, as many as fit in
+** options.maxmem bytes.
+*/
+static int kdf_fscrypt(lua_State *L)
+{
+  size_t passlen, saltlen;
+  const char *pass = luaL_checklstring(L, 1, &passlen);
+  const char *salt = luaL_checklstring(L, 2, &saltlen);
+  lua_Number N = luaL_checknumber(L, 3);
+  lua_Number r = luaL_checknumber(L, 4);
+  lua_Number p = luaL_checknumber(L, 5);
+  size_t len = kdf_checklength(L, 6);
+  int format = luacrypto_optformat(L, 7, LUACRYPTO_RAW);
+  int threads = luacrypto_optthreads(L, 8);
+  lua_Number maxmem = KDF_SCRYPT_MAXMEM;
+  unsigned char *out;
+
+  luaL_argcheck(L, N >= 2 && N <= 4503599627370496.0 && N == (lua_Number)(uint64_t)N
+                && ((uint64_t)N & ((uint64_t)N - 1)) == 0, 3, "must be a power of two greater than 1");
+  luaL_argcheck(L, r >= 1 && r < 1073741824.0 && r == (lua_Number)(uint32_t)r, 4, "invalid block size");
+  luaL_argcheck(L, p >= 1 && p < 1073741824.0 && p == (lua_Number)(uint32_t)p, 5, "invalid parallelism");
+  luaL_argcheck(L, r * p < 1073741824.0, 5, "r * p must be below 2^30");
+  /* RFC 7914 also bounds N by 2^(16r) */
+  luaL_argcheck(L, r >= 4 || (uint64_t)N < (uint64_t)1 << (16 * (int)r), 3, "too large for r");
+  if (!lua_isnoneornil(L, 8)) {
+    lua_getfield(L, 8, "maxmem");
+    if (!lua_isnil(L, -1)) {
+      maxmem = lua_tonumber(L, -1);
+      luaL_argcheck(L, maxmem > 0, 8, "maxmem must be positive");
+    }
+    lua_pop(L, 1);
+  }
+  if (threads > p)
+    threads = (int)p;
+  while (threads > 1 && kdf_scrypt_memory((uint64_t)N, (uint32_t)r, (uint32_t)p, threads) > maxmem)
+    threads--;
+  if (kdf_scrypt_memory((uint64_t)N, (uint32_t)r, (uint32_t)p, 1) > maxmem) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "scrypt parameters need more than maxmem bytes");
+    return 2;
+  }
+  out = lua_newuserdata(L, len);
+  if (!kdf_scrypt((const unsigned char *)pass, passlen, (const unsigned char *)salt, saltlen,
+                  (uint64_t)N, (uint32_t)r, (uint32_t)p, out, len, threads)) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "not enough memory");
+    return 2;
+  }
+  kdf_pushkey(L, out, len, format);
+  return 1;
+}
+
+/*************** ETM API ***************/
+
+/*
+** Encrypt-then-MAC: a cipher context and an HMAC over the ciphertext,
+** fed together so every tile of data is still in cache for the second
+** operation. By default the MAC is a plain HMAC of the ciphertext, as
+** crypto.encrypt followed by crypto.hmac.digest computes it. With the
+** bind option it covers
+**
+**   len(name) || name || len(iv) || iv || ciphertext || len(ciphertext)
+**
+** instead, with name the OpenSSL short name of the cipher, lengths of
+** 4 bytes and the ciphertext length of 8, all big-endian, so a
+** ciphertext cannot be replayed under another iv or cipher or cut short.
+*/
+#define ETM_TILE 16384
+
+/* default bound on the ciphertext a streaming verifier holds */
+#define ETM_VERIFY_MAXMEM (32 * 1024 * 1024)
+
+typedef struct etm_ctx {
+  EVP_CIPHER_CTX c;
+  HMAC_CTX h;
+  unsigned char iv[EVP_MAX_IV_LENGTH];
+  int bind;                    /* MAC the cipher name, iv and length too */
+  uint64_t length;             /* ciphertext MACed so far */
+  size_t maxmem;               /* most ciphertext a verifier holds */
+  luacrypto_buffer held;       /* verifier input waiting for final */
+} etm_ctx;
+
+static void etm_putbe(unsigned char *p, uint64_t v, int n)
+{
+  while (n-- > 0) {
+    p[n] = (unsigned char)v;
+    v >>= 8;
+  }
+}
+
+static int etm_mac(etm_ctx *e, const unsigned char *data, size_t len)
+{
+  e->length += len;
+  return HMAC_Update(&e->h, data, len);
+}
+
+/*
+** Starts the MAC of a new message, with the cipher name and the iv
+** when they are bound.
+*/
+static int etm_machead(etm_ctx *e)
+{
+  const char *name = EVP_CIPHER_name(EVP_CIPHER_CTX_cipher(&e->c));
+  size_t name_len = strlen(name);
+  int iv_len = EVP_CIPHER_CTX_iv_length(&e->c);
+  unsigned char n[4];
+
+  e->length = 0;
+  e->held.len = 0;
+  if (!HMAC_Init_ex(&e->h, NULL, 0, NULL, NULL))
+    return 0;
+  if (!e->bind)
+    return 1;
+  etm_putbe(n, name_len, 4);
+  if (!HMAC_Update(&e->h, n, 4) || !HMAC_Update(&e->h, (unsigned char *)name, name_len))
+    return 0;
+  etm_putbe(n, iv_len, 4);
+  return HMAC_Update(&e->h, n, 4) && HMAC_Update(&e->h, e->iv, iv_len);
+}
+
+static int etm_macfinal(etm_ctx *e, unsigned char *mac, unsigned int *mac_len)
+{
+  unsigned char n[8];
+  etm_putbe(n, e->length, 8);
+  return (!e->bind || HMAC_Update(&e->h, n, 8)) && HMAC_Final(&e->h, mac, mac_len);
+}
+
+/*
+** Reads the optional options table at index arg: bind, and for a
+** verifier maxmem, the most ciphertext it holds until final.
+*/
+static void etm_options(lua_State *L, etm_ctx *e, int arg)
+{
+  e->bind = 0;
+  e->maxmem = ETM_VERIFY_MAXMEM;
+  if (lua_isnoneornil(L, arg))
+    return;
+  luaL_checktype(L, arg, LUA_TTABLE);
+  lua_getfield(L, arg, "bind");
+  e->bind = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  lua_getfield(L, arg, "maxmem");
+  if (!lua_isnil(L, -1)) {
+    lua_Number n = lua_tonumber(L, -1);
+    luaL_argcheck(L, n > 0, arg, "maxmem must be positive");
+    e->maxmem = n < (lua_Number)(size_t)-1 ? (size_t)n : (size_t)-1;
+  }
+  lua_pop(L, 1);
+}
+
+/*
+** Sets up e from (cipher, key, iv, md, mackey) at stack positions
+** arg to arg+4, once etm_options has run. Keys and ivs are zero padded
+** as in crypto.encrypt.
+*/
+static int etm_init(lua_State *L, etm_ctx *e, int arg, int enc)
+{
+  const EVP_CIPHER *cipher = luacrypto_tocipher(L, arg);
+  size_t key_len = 0;
+  const char *key = luaL_checklstring(L, arg + 1, &key_len);
+  unsigned char evp_key[EVP_MAX_KEY_LENGTH] = {0};
+  size_t iv_len = 0;
+  const char *iv = lua_tolstring(L, arg + 2, &iv_len); /* can be NULL */
+  unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
+  const EVP_MD *md = luacrypto_tomd(L, arg + 3);
+  size_t mackey_len = 0;
+  const char *mackey = luaL_checklstring(L, arg + 4, &mackey_len);
+
+  luaL_argcheck(L, cipher != NULL, arg, "invalid cipher");
+  luaL_argcheck(L, key_len <= EVP_MAX_KEY_LENGTH, arg + 1, "key too long");
+  luaL_argcheck(L, iv_len <= EVP_MAX_IV_LENGTH, arg + 2, "iv too long");
+  luaL_argcheck(L, md != NULL, arg + 3, "invalid digest type");
+  memcpy(evp_key, key, key_len);
+  if (iv) {
+    memcpy(evp_iv, iv, iv_len);
+  }
+  memcpy(e->iv, evp_iv, sizeof(e->iv));
+
+  return EVP_CipherInit_ex(&e->c, cipher, NULL, evp_key, iv ? evp_iv : NULL, enc)
+      && HMAC_Init_ex(&e->h, mackey, (int)mackey_len, md, NULL)
+      && etm_machead(e);
+}
+
+/*
+** Encrypts and MACs len bytes of input into out, one tile at a time.
+** out needs room for len plus a cipher block.
+*/
+static int etm_process(etm_ctx *e, unsigned char *out, size_t *out_len,
+                       const unsigned char *input, size_t len)
+{
+  *out_len = 0;
+  while (len > 0) {
+    size_t n = len < ETM_TILE ? len : ETM_TILE;
+    int written = 0;
+    if (!EVP_CipherUpdate(&e->c, out, &written, input, (int)n)
+        || !etm_mac(e, out, written))
+      return 0;
+    out += written;
+    *out_len += written;
+    input += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/*
+** Like etm_process, but appends the output to a Lua buffer.
+*/
+static int etm_addprocess(luaL_Buffer *b, etm_ctx *e, const unsigned char *input, size_t len)
+{
+  while (len > 0) {
+    size_t n = len < LUAL_BUFFERSIZE - EVP_MAX_BLOCK_LENGTH ? len : LUAL_BUFFERSIZE - EVP_MAX_BLOCK_LENGTH;
+    size_t written = 0;
+    if (!etm_process(e, (unsigned char *)luaL_prepbuffer(b), &written, input, n))
+      return 0;
+    luaL_addsize(b, written);
+    input += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/*
+** Checks the MAC of everything seen so far against the one at index
+** arg.
+*/
+static int etm_checkmac(lua_State *L, etm_ctx *e, int arg)
+{
+  size_t mac_len = 0;
+  const char *mac = luaL_checklstring(L, arg, &mac_len);
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int written = 0;
+
+  return etm_macfinal(e, digest, &written)
+      && mac_len == written
+      && CRYPTO_memcmp(digest, mac, written) == 0;
+}
+
+static int etm_autherror(lua_State *L)
+{
+  lua_pushnil(L);
+  lua_pushliteral(L, "authentication failed");
+  return 2;
+}
+
+static etm_ctx *etm_pnew(lua_State *L, const char *name)
+{
+  etm_ctx *e = lua_newuserdata(L, sizeof(etm_ctx));
+  luaL_getmetatable(L, name);
+  lua_setmetatable(L, -2);
+  EVP_CIPHER_CTX_init(&e->c);
+  HMAC_CTX_init(&e->h);
+  e->held.data = NULL;
+  e->held.len = e->held.capacity = 0;
+  return e;
+}
+
+static void etm_cleanup(etm_ctx *e)
+{
+  EVP_CIPHER_CTX_cleanup(&e->c);
+  HMAC_CTX_cleanup(&e->h);
+  free(e->held.data);
+  e->held.data = NULL;
+  e->held.len = e->held.capacity = 0;
+}
+
+static int etm_fnew(lua_State *L)
+{
+  etm_ctx *e;
+  lua_settop(L, 6);  /* the object goes above the options */
+  e = etm_pnew(L, LUACRYPTO_ETMNAME);
+  etm_options(L, e, 6);
+  if (!etm_init(L, e, 1, 1))
+    return crypto_error(L);
+  return 1;
+}
+
+static int etm_fverifier(lua_State *L)
+{
+  etm_ctx *e;
+  lua_settop(L, 6);  /* the object goes above the options */
+  e = etm_pnew(L, LUACRYPTO_ETMVERIFYNAME);
+  etm_options(L, e, 6);
+  if (!etm_init(L, e, 1, 0))
+    return crypto_error(L);
+  return 1;
+}
+
+static int etm_fencrypt(lua_State *L)
+{
+  etm_ctx e;
+  unsigned char mac[EVP_MAX_MD_SIZE];
+  unsigned int mac_len = 0;
+  size_t input_len = 0;
+  const unsigned char *input = luacrypto_checkbytes(L, 6, &input_len);
+  luaL_Buffer b;
+  int ok;
+
+  etm_options(L, &e, 7);
+  EVP_CIPHER_CTX_init(&e.c);
+  HMAC_CTX_init(&e.h);
+  e.held.data = NULL;
+  e.held.len = e.held.capacity = 0;
+  ok = etm_init(L, &e, 1, 1);
+  if (ok) {
+    luaL_buffinit(L, &b);
+    ok = etm_addprocess(&b, &e, input, input_len);
+    if (ok) {
+      int output_len = 0;
+      unsigned char *p = (unsigned char *)luaL_prepbuffer(&b);
+      ok = EVP_CipherFinal_ex(&e.c, p, &output_len)
+        && etm_mac(&e, p, output_len)
+        && etm_macfinal(&e, mac, &mac_len);
+      luaL_addsize(&b, output_len);
+    }
+  }
+  etm_cleanup(&e);
+  if (!ok)
+    return crypto_error(L);
+  luaL_pushresult(&b);
+  lua_pushlstring(L, (char *) mac, mac_len);
+  return 2;
+}
+
+/*
+** Checks the MAC over the whole input before decrypting any of it, so
+** nothing is released and no padding is examined for forged input.
+*/
+static int etm_fdecrypt(lua_State *L)
+{
+  etm_ctx e;
+  size_t input_len = 0;
+  const unsigned char *input = luacrypto_checkbytes(L, 6, &input_len);
+  luaL_Buffer b;
+  int ok;
+
+  luaL_checkstring(L, 7);
+  etm_options(L, &e, 8);
+  EVP_CIPHER_CTX_init(&e.c);
+  HMAC_CTX_init(&e.h);
+  e.held.data = NULL;
+  e.held.len = e.held.capacity = 0;
+  if (!etm_init(L, &e, 1, 0)) {
+    etm_cleanup(&e);
+    return crypto_error(L);
+  }
+  if (!etm_mac(&e, input, input_len) || !etm_checkmac(L, &e, 7)) {
+    etm_cleanup(&e);
+    return etm_autherror(L);
+  }
+  luaL_buffinit(L, &b);
+  ok = aead_addupdate(&b, &e.c, input, input_len) && aead_addfinal(&b, &e.c);
+  etm_cleanup(&e);
+  if (!ok)
+    return crypto_error(L);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+/*
+** Restarts both contexts; a new key and iv may be given as for
+** encrypt:reset, the MAC key is kept.
+*/
+static int etm_reset(lua_State *L, etm_ctx *e, int enc)
+{
+  if (!cipher_reset(L, &e->c, e->iv, enc) || !etm_machead(e))
+    return crypto_error(L);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int etmenc_update(lua_State *L)
+{
+  etm_ctx *e = luaL_checkudata(L, 1, LUACRYPTO_ETMNAME);
+  size_t input_len = 0;
+  const unsigned char *input = luacrypto_checkbytes(L, 2, &input_len);
+  luacrypto_buffer *out = buffer_test(L, 3);
+
+  if (out != NULL) {
+    size_t written = 0;
+    luaL_argcheck(L, !lua_rawequal(L, 2, 3), 3, "output buffer is also the input");
+    if (!etm_process(e, buffer_reserve(L, out, input_len + EVP_MAX_BLOCK_LENGTH),
+                     &written, input, input_len))
+      return crypto_error(L);
+    out->len += written;
+    lua_settop(L, 3);
+  } else {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    if (!etm_addprocess(&b, e, input, input_len))
+      return crypto_error(L);
+    luaL_pushresult(&b);
+  }
+  return 1;
+}
+
+static int etmenc_final(lua_State *L)
+{
+  etm_ctx *e = luaL_checkudata(L, 1, LUACRYPTO_ETMNAME);
+  luacrypto_buffer *out = buffer_test(L, 2);
+  unsigned char buffer[EVP_MAX_BLOCK_LENGTH];
+  unsigned char *p = out ? buffer_reserve(L, out, EVP_MAX_BLOCK_LENGTH) : buffer;
+  int output_len = 0;
+  unsigned char mac[EVP_MAX_MD_SIZE];
+  unsigned int mac_len = 0;
+
+  if (!EVP_CipherFinal_ex(&e->c, p, &output_len)
+      || !etm_mac(e, p, output_len)
+      || !etm_macfinal(e, mac, &mac_len))
+    return crypto_error(L);
+  if (out != NULL) {
+    out->len += output_len;
+    lua_pushvalue(L, 2);
+  } else
+    lua_pushlstring(L, (char *) buffer, output_len);
+  lua_pushlstring(L, (char *) mac, mac_len);
+  return 2;
+}
+
+static int etmenc_reset(lua_State *L)
+{
+  return etm_reset(L, luaL_checkudata(L, 1, LUACRYPTO_ETMNAME), 1);
+}
+
+static int etmenc_tostring(lua_State *L)
+{
+  etm_ctx *e = luaL_checkudata(L, 1, LUACRYPTO_ETMNAME);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_ETMNAME, (void *)e);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+static int etmenc_gc(lua_State *L)
+{
+  etm_cleanup(luaL_checkudata(L, 1, LUACRYPTO_ETMNAME));
+  return 0;
+}
+
+/*
+** A verifier only MACs and keeps the ciphertext: nothing is decrypted
+** before final has checked the MAC. It holds at most maxmem bytes.
+*/
+static int etmdec_update(lua_State *L)
+{
+  etm_ctx *e = luaL_checkudata(L, 1, LUACRYPTO_ETMVERIFYNAME);
+  size_t input_len = 0;
+  const unsigned char *input = luacrypto_checkbytes(L, 2, &input_len);
+  unsigned char *p;
+
+  if (input_len > e->maxmem - e->held.len)
+    return luaL_error(L, "ciphertext longer than the verifier's maxmem of %f bytes", (lua_Number)e->maxmem);
+  p = buffer_reserve(L, &e->held, input_len);
+  if (!etm_mac(e, input, input_len))
+    return crypto_error(L);
+  memcpy(p, input, input_len);
+  e->held.len += input_len;
+  lua_settop(L, 1);
+  return 1;
+}
+
+/*
+** Decrypts the held ciphertext once the MAC matches, so a forged message
+** never reaches the padding check and no plaintext leaks out of it.
+*/
+static int etmdec_final(lua_State *L)
+{
+  etm_ctx *e = luaL_checkudata(L, 1, LUACRYPTO_ETMVERIFYNAME);
+  luacrypto_buffer *out = buffer_test(L, 3);
+  int ok;
+
+  if (!etm_checkmac(L, e, 2)) {
+    e->held.len = 0;
+    return etm_autherror(L);
+  }
+  if (out != NULL) {
+    unsigned char *p = buffer_reserve(L, out, e->held.len + EVP_MAX_BLOCK_LENGTH);
+    size_t done = 0;
+    int written = 0;
+    ok = 1;
+    while (ok && done < e->held.len) {
+      size_t n = e->held.len - done < ETM_TILE ? e->held.len - done : ETM_TILE;
+      ok = EVP_CipherUpdate(&e->c, p, &written, e->held.data + done, (int)n);
+      p += written;
+      done += n;
+    }
+    if (ok && EVP_CipherFinal_ex(&e->c, p, &written))
+      out->len = p + written - out->data;
+    else
+      ok = 0;
+    lua_pushvalue(L, 3);
+  } else {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    ok = aead_addupdate(&b, &e->c, e->held.data, e->held.len) && aead_addfinal(&b, &e->c);
+    luaL_pushresult(&b);
+  }
+  e->held.len = 0;
+  if (!ok)
+    return crypto_error(L);
+  return 1;
+}
+
+static int etmdec_reset(lua_State *L)
+{
+  return etm_reset(L, luaL_checkudata(L, 1, LUACRYPTO_ETMVERIFYNAME), 0);
+}
+
+static int etmdec_tostring(lua_State *L)
+{
+  etm_ctx *e = luaL_checkudata(L, 1, LUACRYPTO_ETMVERIFYNAME);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_ETMVERIFYNAME, (void *)e);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+static int etmdec_gc(lua_State *L)
+{
+  etm_cleanup(luaL_checkudata(L, 1, LUACRYPTO_ETMVERIFYNAME));
+  return 0;
+}
+
+/*************** SIGN API ***************/
+
+/* Ed25519 and X25519 keys come with OpenSSL 1.1.1 */
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define LUACRYPTO_ED25519 1
+
+/* EdDSA signs the message itself: it cannot go through EVP_Sign* */
+static int luacrypto_iseddsa(EVP_PKEY *pkey)
+{
+  int id = EVP_PKEY_id(pkey);
+#ifdef EVP_PKEY_ED448
+  if (id == EVP_PKEY_ED448)
+    return 1;
+#endif
+  return id == EVP_PKEY_ED25519;
+}
+#endif
+
+/*
+** OpenSSL 1.0 signs with whatever an RSA or DSA key holds and
+** dereferences the missing private half of a public key, so that is
+** checked first and reported as an OpenSSL error.
+*/
+static int luacrypto_cansign(EVP_PKEY *pkey)
+{
+  switch (EVP_PKEY_type(pkey->type)) {
+  case EVP_PKEY_RSA:
+    if (pkey->pkey.rsa->d == NULL) {
+      RSAerr(RSA_F_RSA_SIGN, RSA_R_VALUE_MISSING);
+      return 0;
+    }
+    break;
+  case EVP_PKEY_DSA:
+    if (pkey->pkey.dsa->priv_key == NULL) {
+      DSAerr(DSA_F_DSA_DO_SIGN, DSA_R_MISSING_PARAMETERS);
+      return 0;
+    }
+    break;
+  }
+  return 1;
+}
+
+/*
+** Signs len bytes of input with pkey into out, which has room for
+** EVP_PKEY_size(pkey) bytes. RSA, DSA and ECDSA keys sign the md digest
+** of the input; EdDSA keys sign the input and ignore md. Returns 0 on
+** failure. Safe to call from pool threads.
+*/
+static int luacrypto_sign(EVP_PKEY *pkey, const EVP_MD *md, const unsigned char *input, size_t len,
+                          unsigned char *out, size_t *out_len)
+{
+  EVP_MD_CTX *c;
+  int ok;
+
+  if (!luacrypto_cansign(pkey) || (c = EVP_MD_CTX_create()) == NULL)
+    return 0;
+#ifdef LUACRYPTO_ED25519
+  if (luacrypto_iseddsa(pkey)) {
+    *out_len = EVP_PKEY_size(pkey);
+    ok = EVP_DigestSignInit(c, NULL, NULL, NULL, pkey)
+      && EVP_DigestSign(c, out, out_len, input, len);
+  } else
+#endif
+  {
+    unsigned int n = 0;
+    ok = EVP_SignInit_ex(c, md, NULL)
+      && EVP_SignUpdate(c, input, len)
+      && EVP_SignFinal(c, out, &n, pkey);
+    *out_len = n;
+  }
+  EVP_MD_CTX_destroy(c);
+  return ok;
+}
+
+/*
+** Checks sig against len bytes of input as luacrypto_sign made it.
+** Returns 1 if valid, 0 if not, -1 if it could not be checked.
+*/
+static int luacrypto_verify(EVP_PKEY *pkey, const EVP_MD *md, const unsigned char *input, size_t len,
+                            const unsigned char *sig, size_t sig_len)
+{
+  EVP_MD_CTX *c = EVP_MD_CTX_create();
+  int ret = -1;
+
+  if (c == NULL)
+    return -1;
+#ifdef LUACRYPTO_ED25519
+  if (luacrypto_iseddsa(pkey)) {
+    if (EVP_DigestVerifyInit(c, NULL, NULL, NULL, pkey)) {
+      /* any signature that does not check, even a malformed one, is just invalid */
+      ret = EVP_DigestVerify(c, sig, sig_len, input, len) == 1;
+      ERR_clear_error();
+    }
+  } else
+#endif
+  if (EVP_VerifyInit_ex(c, md, NULL) && EVP_VerifyUpdate(c, input, len))
+    ret = EVP_VerifyFinal(c, sig, sig_len, pkey);
+  EVP_MD_CTX_destroy(c);
+  return ret;
+}
+
+static EVP_MD_CTX *sign_pnew(lua_State *L)
+{
+  EVP_MD_CTX *c = lua_newuserdata(L, sizeof(EVP_MD_CTX));
+  luaL_getmetatable(L, LUACRYPTO_SIGNNAME);
+  lua_setmetatable(L, -2);
+  return c;
+}
+
+static int sign_fnew(lua_State *L)
+{
+  const EVP_MD *md = luacrypto_tomd(L, 1);
+  if (md == NULL) {
+    luaL_argerror(L, 1, "invalid digest type");
+    return 0;
+  } else {
+    EVP_MD_CTX *c = sign_pnew(L);
+    EVP_MD_CTX_init(c);
+    EVP_SignInit_ex(c, md, NULL);
+    return 1;
+  }
+}
+
+static int sign_update(lua_State *L)
+{
+  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_SIGNNAME);
+  size_t input_len = 0;
+  const unsigned char *input = (unsigned char *) luaL_checklstring(L, 2, &input_len);
+
+  EVP_SignUpdate(c, input, input_len);
+  return 0;
+}
+
+static int sign_final(lua_State *L) 
+{
+  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_SIGNNAME);
+  unsigned int output_len = 0;
+  unsigned char *buffer;
+  EVP_PKEY **pkey = luaL_checkudata(L, 2, LUACRYPTO_PKEYNAME);
+  
+  if (!luacrypto_cansign(*pkey))
+    return crypto_error(L);
+  buffer = malloc(EVP_PKEY_size(*pkey));
+  if (!EVP_SignFinal(c, buffer, &output_len, *pkey)) {
+    free(buffer);
+    return crypto_error(L);
+  }
+  lua_pushlstring(L, (char*) buffer, output_len);
+  free(buffer);
+  
+  return 1;
+}
+
+static int sign_tostring(lua_State *L)
+{
+  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_SIGNNAME);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_SIGNNAME, (void *)c);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+static int sign_gc(lua_State *L)
+{
+  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_SIGNNAME);
+  EVP_MD_CTX_cleanup(c);
+  return 1;
+}
+
+static int sign_fsign(lua_State *L)
 {
   /* parameter 1 is the 'crypto.sign' table */
-  const char *type_name = luaL_checkstring(L, 2);
-  const EVP_MD *type = EVP_get_digestbyname(type_name);
+  const EVP_MD *type = luacrypto_tomd(L, 2);
+
+  if (type == NULL) {
+    luaL_argerror(L, 2, "invalid digest type");
+    return 0;
+  } else {
+    size_t input_len = 0;
+    const unsigned char *input = (unsigned char *) luaL_checklstring(L, 3, &input_len);
+    size_t output_len = 0;
+    unsigned char *buffer = NULL;
+    EVP_PKEY **pkey = luaL_checkudata(L, 4, LUACRYPTO_PKEYNAME);
+    int format = luacrypto_optformat(L, 5, LUACRYPTO_RAW);
+   
+    buffer = malloc(EVP_PKEY_size(*pkey));
+    if (!luacrypto_sign(*pkey, type, input, input_len, buffer, &output_len)) {
+      free(buffer);
+      return crypto_error(L);
+    }
+
+    luacrypto_pushformatted(L, buffer, output_len, format);
+    free(buffer);
+    return 1;
+  }
+}
+
+/* one message of a sign.batch or verify.batch call */
+typedef struct sig_item {
+  const unsigned char *input;
+  size_t input_len;
+  const unsigned char *sig;  /* verify only */
+  size_t sig_len;
+  EVP_PKEY *pkey;
+  unsigned char *out;        /* sign only: room for EVP_PKEY_size bytes */
+  size_t out_len;
+  int result;                /* 1 signed or valid, 0 invalid, -1 failed */
+} sig_item;
+
+typedef struct sig_batch {
+  const EVP_MD *md;
+  int sign;
+  sig_item *items;
+} sig_batch;
+
+static void sig_task(void *ud, size_t i)
+{
+  sig_batch *b = ud;
+  sig_item *it = &b->items[i];
+
+  if (b->sign)
+    it->result = luacrypto_sign(it->pkey, b->md, it->input, it->input_len, it->out, &it->out_len) ? 1 : -1;
+  else
+    it->result = luacrypto_verify(it->pkey, b->md, it->input, it->input_len, it->sig, it->sig_len);
+  if (it->result == -1)
+    ERR_clear_error();
+}
+
+/*
+** Collects the messages of the array at index inputs, the signatures
+** of the array at index sigs (0 when signing) and the key or array of
+** keys at index keys into a userdata of sig_items pushed on the stack.
+** Signing also reserves the output room for every item there. The Lua
+** strings stay referenced by the argument tables.
+*/
+static sig_item *sig_collect(lua_State *L, int inputs, int sigs, int keys, int *count)
+{
+  EVP_PKEY **single = luacrypto_testudata(L, keys, LUACRYPTO_PKEYNAME);
+  size_t room = 0;
+  sig_item *items;
+  unsigned char *out;
+  int i, n;
+
+  luaL_checktype(L, inputs, LUA_TTABLE);
+  n = lua_objlen(L, inputs);
+  if (sigs != 0) {
+    luaL_checktype(L, sigs, LUA_TTABLE);
+    luaL_argcheck(L, (int)lua_objlen(L, sigs) == n, sigs, "not one signature per message");
+  }
+  if (single == NULL) {
+    luaL_argcheck(L, lua_istable(L, keys), keys, "pkey or array of pkeys expected");
+    luaL_argcheck(L, (int)lua_objlen(L, keys) == n, keys, "not one pkey per message");
+  }
+
+  items = lua_newuserdata(L, (n > 0 ? n : 1) * sizeof(sig_item));
+  for (i = 0; i < n; i++) {
+    sig_item *it = &items[i];
+    memset(it, 0, sizeof(*it));
+    lua_rawgeti(L, inputs, i + 1);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      luaL_error(L, "bad message #%d in batch (string expected, got %s)", i + 1, luaL_typename(L, -1));
+    it->input = (const unsigned char *) lua_tolstring(L, -1, &it->input_len);
+    lua_pop(L, 1);
+    if (sigs != 0) {
+      lua_rawgeti(L, sigs, i + 1);
+      if (lua_type(L, -1) != LUA_TSTRING)
+        luaL_error(L, "bad signature #%d in batch (string expected, got %s)", i + 1, luaL_typename(L, -1));
+      it->sig = (const unsigned char *) lua_tolstring(L, -1, &it->sig_len);
+      lua_pop(L, 1);
+    }
+    if (single != NULL)
+      it->pkey = *single;
+    else {
+      EVP_PKEY **pkey;
+      lua_rawgeti(L, keys, i + 1);
+      pkey = luacrypto_testudata(L, -1, LUACRYPTO_PKEYNAME);
+      if (pkey == NULL)
+        luaL_error(L, "bad pkey #%d in batch (crypto.pkey expected, got %s)", i + 1, luaL_typename(L, -1));
+      it->pkey = *pkey;
+      lua_pop(L, 1);
+    }
+    if (sigs == 0)
+      room += EVP_PKEY_size(it->pkey);
+  }
+
+  if (sigs == 0) {
+    out = lua_newuserdata(L, room > 0 ? room : 1);
+    for (i = 0; i < n; i++) {
+      items[i].out = out;
+      out += EVP_PKEY_size(items[i].pkey);
+    }
+  }
+  *count = n;
+  return items;
+}
+
+/*
+** Signs every message of an array, on up to options.threads threads
+** when options are given. Every signer of the batch shares the key's
+** cached Montgomery contexts.
+*/
+static int sign_fbatch(lua_State *L)
+{
+  const EVP_MD *type = luacrypto_tomd(L, 1);
+  int format = luacrypto_optformat(L, 4, LUACRYPTO_RAW);
+  int threads = lua_isnoneornil(L, 5) ? 1 : luacrypto_optthreads(L, 5);
+  sig_batch b;
+  int i, n;
+
+  if (type == NULL)
+    return luaL_argerror(L, 1, "invalid digest type");
+  b.md = type;
+  b.sign = 1;
+  b.items = sig_collect(L, 2, 0, 3, &n);
+  pool_for(threads, (size_t)n, sig_task, &b);
+
+  for (i = 0; i < n; i++)
+    if (b.items[i].result != 1) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "signing message #%d failed", i + 1);
+      return 2;
+    }
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    luacrypto_pushformatted(L, b.items[i].out, b.items[i].out_len, format);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+/*************** VERIFY API ***************/
+
+static EVP_MD_CTX *verify_pnew(lua_State *L)
+{
+  EVP_MD_CTX *c = lua_newuserdata(L, sizeof(EVP_MD_CTX));
+  luaL_getmetatable(L, LUACRYPTO_VERIFYNAME);
+  lua_setmetatable(L, -2);
+  return c;
+}
+
+static int verify_fnew(lua_State *L)
+{
+  const EVP_MD *md = luacrypto_tomd(L, 1);
+  if (md == NULL) {
+    luaL_argerror(L, 1, "invalid digest type");
+    return 0;
+  } else {
+    EVP_MD_CTX *c = verify_pnew(L);
+    EVP_MD_CTX_init(c);
+    EVP_VerifyInit_ex(c, md, NULL);
+    return 1;
+  }
+}
+
+static int verify_update(lua_State *L)
+{
+  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_VERIFYNAME);
+  size_t input_len = 0;
+  const unsigned char *input = (unsigned char *) luaL_checklstring(L, 2, &input_len);
+
+  EVP_VerifyUpdate(c, input, input_len);
+  return 0;
+}
+
+static int verify_final(lua_State *L) 
+{
+  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_VERIFYNAME);
+  size_t sig_len = 0;
+  const unsigned char *sig = (unsigned char *) luaL_checklstring(L, 2, &sig_len);
+  EVP_PKEY **pkey = luaL_checkudata(L, 3, LUACRYPTO_PKEYNAME);
+  int ret;
+
+  ret = EVP_VerifyFinal(c, sig, sig_len, *pkey);
+  if (ret == -1)
+    return crypto_error(L);
+
+  lua_pushboolean(L, ret);  
+  return 1;
+}
+
+static int verify_tostring(lua_State *L)
+{
+  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_VERIFYNAME);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_VERIFYNAME, (void *)c);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+static int verify_gc(lua_State *L)
+{
+  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_VERIFYNAME);
+  EVP_MD_CTX_cleanup(c);
+  return 1;
+}
+
+static int verify_fverify(lua_State *L)
+{
+  /* parameter 1 is the 'crypto.verify' table */
+  const EVP_MD *type = luacrypto_tomd(L, 2);
+
+  if (type == NULL) {
+    luaL_argerror(L, 1, "invalid digest type");
+    return 0;
+  } else {
+    size_t input_len = 0;
+    const unsigned char *input = (unsigned char *) luaL_checklstring(L, 3, &input_len);
+    size_t sig_len = 0;
+    const unsigned char *sig = (unsigned char *) luaL_checklstring(L, 4, &sig_len);
+    EVP_PKEY **pkey = luaL_checkudata(L, 5, LUACRYPTO_PKEYNAME);
+    int ret;
+
+    ret = luacrypto_verify(*pkey, type, input, input_len, sig, sig_len);
+    if (ret == -1)
+      return crypto_error(L);
+
+    lua_pushboolean(L, ret);
+    return 1;
+  }
+}
+
+/*
+** Verifies every message of an array against its signature. A
+** signature that cannot even be checked counts as invalid.
+*/
+static int verify_fbatch(lua_State *L)
+{
+  const EVP_MD *type = luacrypto_tomd(L, 1);
+  int threads = lua_isnoneornil(L, 5) ? 1 : luacrypto_optthreads(L, 5);
+  sig_batch b;
+  int i, n;
+
+  if (type == NULL)
+    return luaL_argerror(L, 1, "invalid digest type");
+  b.md = type;
+  b.sign = 0;
+  b.items = sig_collect(L, 2, 3, 4, &n);
+  pool_for(threads, (size_t)n, sig_task, &b);
+
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_pushboolean(L, b.items[i].result == 1);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+/*************** RAND API ***************/
+
+/*
+** A block of RAND_bytes output served a slice at a time, so that the
+** small requests of token and ID generators do not each go through
+** OpenSSL's locking. Bytes are wiped as they are handed out, and the
+** block is dropped in a forked child, which would otherwise repeat its
+** parent's output.
+*/
+typedef struct rand_pool {
+  size_t size;
+  size_t pos;                 /* bytes of data already used */
+  long pid;                   /* process the data was drawn in */
+  unsigned char data[1];
+} rand_pool;
+
+#define RAND_POOL_DEFAULT 4096
+
+/* most bytes asked of RAND_bytes at once */
+#define RAND_MAX_CALL (1 << 30)
+
+/* key of the pool rand.bytes draws from, set by rand.set_pool */
+static char rand_pool_key;
+
+#ifndef _WIN32
+#define rand_getpid() ((long)getpid())
+#else
+#define rand_getpid() 0L
+#endif
+
+/*
+** Returns the pool of this Lua state, or NULL if rand.bytes goes
+** straight to OpenSSL.
+*/
+static rand_pool *luacrypto_randpool(lua_State *L)
+{
+  rand_pool *p;
+  lua_pushlightuserdata(L, &rand_pool_key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  p = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return p;
+}
+
+/*
+** Writes n random bytes to out, from the pool p or, if p is NULL or n
+** would drain most of it, from OpenSSL directly. Returns 0 on failure.
+*/
+static int rand_pool_take(rand_pool *p, unsigned char *out, size_t n)
+{
+  if (p == NULL || n > p->size / 2) {
+    /* RAND_bytes counts in ints */
+    while (n > 0) {
+      int k = n > RAND_MAX_CALL ? RAND_MAX_CALL : (int)n;
+      if (RAND_bytes(out, k) != 1)
+        return 0;
+      out += k;
+      n -= k;
+    }
+    return 1;
+  }
+  if (p->pid != rand_getpid())
+    p->pos = p->size;
+  while (n > 0) {
+    size_t k;
+    if (p->pos == p->size) {
+      if (RAND_bytes(p->data, (int)p->size) != 1)
+        return 0;
+      p->pos = 0;
+      p->pid = rand_getpid();
+    }
+    k = p->size - p->pos < n ? p->size - p->pos : n;
+    memcpy(out, p->data + p->pos, k);
+    OPENSSL_cleanse(p->data + p->pos, k);
+    p->pos += k;
+    out += k;
+    n -= k;
+  }
+  return 1;
+}
+
+/*
+** Draws a uniform integer in [0, range) by rejection sampling, so no
+** value is more likely than another. range must be at least 1.
+*/
+static int rand_pool_uniform(rand_pool *p, uint64_t range, uint64_t *out)
+{
+  /* 2^64 mod range: the low values a 64-bit draw would favour */
+  uint64_t skew = (0 - range) % range;
+  uint64_t x;
+  do {
+    unsigned char b[8];
+    int i;
+    if (!rand_pool_take(p, b, sizeof(b)))
+      return 0;
+    for (i = 0, x = 0; i < 8; i++)
+      x = (x << 8) | b[i];
+  } while (x < skew);
+  *out = x % range;
+  return 1;
+}
+
+/*
+** Pushes an array of n uniform integers in [lo, lo + range). The draws
+** are fetched a block at a time, and are 32 bits wide whenever the
+** range allows, which halves the random bytes needed.
+*/
+static int rand_pushints(lua_State *L, rand_pool *p, size_t n, lua_Number lo, uint64_t range)
+{
+  unsigned char block[2048];
+  int wide = range > ((uint64_t)1 << 32);
+  size_t width = wide ? 8 : 4;
+  uint64_t skew = wide ? (0 - range) % range : (((uint64_t)1 << 32) - range) % range;
+  size_t i = 0, pos = 0, avail = 0;
+
+  lua_createtable(L, n > INT_MAX ? INT_MAX : (int)n, 0);
+  while (i < n) {
+    uint64_t x;
+    size_t k;
+    if (pos == avail) {
+      avail = (n - i) * width < sizeof(block) ? (n - i) * width : sizeof(block);
+      if (!rand_pool_take(p, block, avail)) {
+        OPENSSL_cleanse(block, sizeof(block));
+        return crypto_error(L);
+      }
+      pos = 0;
+    }
+    for (k = 0, x = 0; k < width; k++)
+      x = (x << 8) | block[pos + k];
+    pos += width;
+    if (x < skew)
+      continue;
+    lua_pushnumber(L, lo + (lua_Number)(x % range));
+    lua_rawseti(L, -2, (int)++i);
+  }
+  OPENSSL_cleanse(block, sizeof(block));
+  return 1;
+}
+
+/*
+** Fills the buffer at stack position arg with n random bytes, replacing
+** its contents, and leaves it on top of the stack.
+*/
+static int rand_fillbuffer(lua_State *L, rand_pool *p, int arg)
+{
+  luacrypto_buffer *b = luaL_checkudata(L, arg, LUACRYPTO_BUFFERNAME);
+  lua_Number n = luaL_checknumber(L, arg + 1);
+  luaL_argcheck(L, n >= 0 && n < 9007199254740992.0 && n == (lua_Number)(size_t)n, arg + 1, "invalid size");
+  b->len = 0;
+  if (!rand_pool_take(p, buffer_reserve(L, b, (size_t)n), (size_t)n))
+    return crypto_error(L);
+  b->len = (size_t)n;
+  lua_pushvalue(L, arg);
+  return 1;
+}
+
+/*
+** Reads a byte count at stack position arg. luaL_checkint alone would
+** let a negative count wrap to a huge size_t.
+*/
+static size_t rand_checksize(lua_State *L, int arg)
+{
+  int n = luaL_checkint(L, arg);
+  luaL_argcheck(L, n >= 0, arg, "must not be negative");
+  return (size_t)n;
+}
+
+/*
+** Reads the count of rand.ints at stack position arg.
+*/
+static size_t rand_checkcount(lua_State *L, int arg)
+{
+  lua_Number n = luaL_checknumber(L, arg);
+  luaL_argcheck(L, n >= 0 && n <= INT_MAX && n == (lua_Number)(int)n, arg, "invalid count");
+  return (size_t)n;
+}
+
+/*
+** Reads the bounds at stack positions arg and arg+1: integers, exactly
+** representable as Lua numbers, with lo <= hi.
+*/
+static void rand_checkrange(lua_State *L, int arg, lua_Number *lo, uint64_t *range)
+{
+  const lua_Number limit = 9007199254740992.0;      /* 2^53 */
+  lua_Number l = luaL_checknumber(L, arg);
+  lua_Number h = luaL_checknumber(L, arg + 1);
+  luaL_argcheck(L, l > -limit && l < limit && l == (lua_Number)(int64_t)l, arg, "not an integer in range");
+  luaL_argcheck(L, h > -limit && h < limit && h == (lua_Number)(int64_t)h, arg + 1, "not an integer in range");
+  luaL_argcheck(L, l <= h, arg + 1, "less than the lower bound");
+  luaL_argcheck(L, h - l < limit, arg + 1, "range too large");
+  *lo = l;
+  *range = (uint64_t)(h - l) + 1;
+}
+
+/*
+** Pushes n random bytes from p (or OpenSSL if NULL) in the given format.
+*/
+static int rand_pushbytes(lua_State *L, rand_pool *p, size_t n, int format)
+{
+  unsigned char tmp[256], *buf = tmp;
+  if (n > sizeof(tmp))
+    buf = lua_newuserdata(L, n);
+  if (!rand_pool_take(p, buf, n))
+    return crypto_error(L);
+  luacrypto_pushformatted(L, buf, n, format);
+  OPENSSL_cleanse(buf, n);
+  return 1;
+}
+
+
+static int rand_do_bytes(lua_State *L, int (*bytes)(unsigned char *, int))
+{
+  size_t count = rand_checksize(L, 1);
+  unsigned char tmp[256], *buf = tmp;
+  if (count > sizeof tmp)
+    buf = malloc(count);
+    if (!buf)
+      return luaL_error(L, "out of memory");
+    else if (!bytes(buf, count))
+      return crypto_error(L);
+    lua_pushlstring(L, (char *)buf, count);
+    if (buf != tmp)
+      free(buf);
+    return 1;
+}
+
+static int rand_bytes(lua_State *L)
+{
+  rand_pool *p = luacrypto_randpool(L);
+  if (p != NULL)
+    return rand_pushbytes(L, p, rand_checksize(L, 1), LUACRYPTO_RAW);
+  return rand_do_bytes(L, RAND_bytes);
+}
+
+static int rand_pseudo_bytes(lua_State *L)
+{
+  return rand_do_bytes(L, RAND_pseudo_bytes);
+}
+
+static int rand_add(lua_State *L)
+{
+  size_t num;
+  const void *buf = luaL_checklstring(L, 1, &num);
+  double entropy = luaL_optnumber(L, 2, num);
+  RAND_add(buf, num, entropy);
+  return 0;
+}
+
+static int rand_status(lua_State *L)
+{
+  lua_pushboolean(L, RAND_status());
+  return 1;
+}
+
+enum { WRITE_FILE_COUNT = 1024 };
+static int rand_load(lua_State *L)
+{
+  const char *name = luaL_optstring(L, 1, 0);
+  char tmp[256];
+  int n;
+  if (!name && !(name = RAND_file_name(tmp, sizeof tmp)))
+    return crypto_error(L);
+  n = RAND_load_file(name, WRITE_FILE_COUNT);
+  if (n == 0)
+    return crypto_error(L);
+  lua_pushnumber(L, n);
+  return 1;
+}
 
-  if (type == NULL) {
-    luaL_argerror(L, 2, "invalid digest type");
+static int rand_write(lua_State *L)
+{
+  const char *name = luaL_optstring(L, 1, 0);
+  char tmp[256];
+  int n;
+  if (!name && !(name = RAND_file_name(tmp, sizeof tmp)))
+    return crypto_error(L);
+  n = RAND_write_file(name);
+  if (n == 0)
+    return crypto_error(L);
+  lua_pushnumber(L, n);
+  return 1;
+}
+
+static int rand_cleanup(lua_State *L)
+{
+  RAND_cleanup();
+  return 0;
+}
+
+/*
+** crypto.rand.pool([size]): a pool refilled size bytes at a time.
+*/
+static int rand_fpool(lua_State *L)
+{
+  lua_Number size = luaL_optnumber(L, 1, RAND_POOL_DEFAULT);
+  rand_pool *p;
+  luaL_argcheck(L, size >= 16 && size <= INT_MAX, 1, "invalid size");
+  p = lua_newuserdata(L, offsetof(rand_pool, data) + (size_t)size);
+  p->size = (size_t)size;
+  p->pos = p->size;
+  p->pid = rand_getpid();
+  luacrypto_setmeta(L, LUACRYPTO_RANDPOOLNAME);
+  return 1;
+}
+
+/*
+** crypto.rand.set_pool(pool | size | true | false): makes rand.bytes,
+** rand.token and rand.int of this Lua state draw from a pool, a new one
+** for a size or true, or from OpenSSL again for false. Returns the pool.
+*/
+static int rand_set_pool(lua_State *L)
+{
+  if (lua_isboolean(L, 1) && !lua_toboolean(L, 1)) {
+    lua_pushlightuserdata(L, &rand_pool_key);
+    lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
     return 0;
+  }
+  if (lua_isboolean(L, 1) || lua_isnumber(L, 1)) {
+    lua_settop(L, lua_isnumber(L, 1) ? 1 : 0);
+    rand_fpool(L);
+  } else
+    luaL_checkudata(L, 1, LUACRYPTO_RANDPOOLNAME);
+  lua_pushlightuserdata(L, &rand_pool_key);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+static rand_pool *rand_checkpool(lua_State *L)
+{
+  return luaL_checkudata(L, 1, LUACRYPTO_RANDPOOLNAME);
+}
+
+/*
+** crypto.rand.token(n [, format]): n random bytes, as hex by default.
+*/
+static int rand_token(lua_State *L)
+{
+  size_t n = rand_checksize(L, 1);
+  return rand_pushbytes(L, luacrypto_randpool(L), n, luacrypto_optformat(L, 2, LUACRYPTO_HEX));
+}
+
+/*
+** crypto.rand.int(lo, hi): a uniform integer in [lo, hi].
+*/
+static int rand_int(lua_State *L)
+{
+  lua_Number lo;
+  uint64_t range, x;
+  rand_checkrange(L, 1, &lo, &range);
+  if (!rand_pool_uniform(luacrypto_randpool(L), range, &x))
+    return crypto_error(L);
+  lua_pushnumber(L, lo + (lua_Number)x);
+  return 1;
+}
+
+/*
+** crypto.rand.fill(buffer, n): sets the contents of buffer to n random
+** bytes, reusing its memory.
+*/
+static int rand_fill(lua_State *L)
+{
+  return rand_fillbuffer(L, luacrypto_randpool(L), 1);
+}
+
+/*
+** crypto.rand.ints(n, lo, hi): an array of n uniform integers in [lo, hi].
+*/
+static int rand_ints(lua_State *L)
+{
+  size_t n = rand_checkcount(L, 1);
+  lua_Number lo;
+  uint64_t range;
+  rand_checkrange(L, 2, &lo, &range);
+  return rand_pushints(L, luacrypto_randpool(L), n, lo, range);
+}
+
+static int randpool_bytes(lua_State *L)
+{
+  rand_pool *p = rand_checkpool(L);
+  size_t n = rand_checksize(L, 2);
+  return rand_pushbytes(L, p, n, LUACRYPTO_RAW);
+}
+
+static int randpool_token(lua_State *L)
+{
+  rand_pool *p = rand_checkpool(L);
+  size_t n = rand_checksize(L, 2);
+  return rand_pushbytes(L, p, n, luacrypto_optformat(L, 3, LUACRYPTO_HEX));
+}
+
+static int randpool_int(lua_State *L)
+{
+  rand_pool *p = rand_checkpool(L);
+  lua_Number lo;
+  uint64_t range, x;
+  rand_checkrange(L, 2, &lo, &range);
+  if (!rand_pool_uniform(p, range, &x))
+    return crypto_error(L);
+  lua_pushnumber(L, lo + (lua_Number)x);
+  return 1;
+}
+
+static int randpool_fill(lua_State *L)
+{
+  return rand_fillbuffer(L, rand_checkpool(L), 2);
+}
+
+static int randpool_ints(lua_State *L)
+{
+  rand_pool *p = rand_checkpool(L);
+  size_t n = rand_checkcount(L, 2);
+  lua_Number lo;
+  uint64_t range;
+  rand_checkrange(L, 3, &lo, &range);
+  return rand_pushints(L, p, n, lo, range);
+}
+
+static int randpool_tostring(lua_State *L)
+{
+  rand_pool *p = rand_checkpool(L);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_RANDPOOLNAME, (void *)p);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+static int randpool_gc(lua_State *L)
+{
+  rand_pool *p = rand_checkpool(L);
+  OPENSSL_cleanse(p->data, p->size);
+  p->pos = p->size;
+  return 0;
+}
+
+/*************** PKEY API ***************/
+
+static EVP_PKEY **pkey_new(lua_State *L)
+{
+  EVP_PKEY **pkey = lua_newuserdata(L, sizeof(EVP_PKEY*));
+  *pkey = NULL;  /* collected before a key is stored */
+  luaL_getmetatable(L, LUACRYPTO_PKEYNAME);
+  lua_setmetatable(L, -2);
+  return pkey;
+}
+  
+#ifdef LUACRYPTO_ED25519
+/*
+** Generates a key of a type that needs no parameters: Ed25519, X25519.
+*/
+static int pkey_keygen(lua_State *L, int id)
+{
+  EVP_PKEY **pkey = pkey_new(L);
+  EVP_PKEY_CTX *c = EVP_PKEY_CTX_new_id(id, NULL);
+  int ok;
+
+  ok = c != NULL && EVP_PKEY_keygen_init(c) > 0 && EVP_PKEY_keygen(c, pkey) > 0;
+  EVP_PKEY_CTX_free(c);
+  return ok ? 1 : crypto_error(L);
+}
+#endif
+
+/*
+** Generates an EC key on the named curve, "P-256" by default. The
+** curve is recorded by name so written keys stay portable.
+*/
+static int pkey_generate_ec(lua_State *L)
+{
+  const char *curve = luaL_optstring(L, 2, "P-256");
+  int nid = EC_curve_nist2nid(curve);
+  EVP_PKEY **pkey = pkey_new(L);
+  EC_KEY *ec;
+
+  if (nid == NID_undef)
+    nid = OBJ_txt2nid(curve);
+  if (nid == NID_undef)
+    return luaL_argerror(L, 2, "unknown curve");
+  ec = EC_KEY_new_by_curve_name(nid);
+  if (ec == NULL)
+    return crypto_error(L);
+  EC_KEY_set_asn1_flag(ec, OPENSSL_EC_NAMED_CURVE);
+  if (!EC_KEY_generate_key(ec)) {
+    EC_KEY_free(ec);
+    return crypto_error(L);
+  }
+  *pkey = EVP_PKEY_new();
+  EVP_PKEY_assign_EC_KEY(*pkey, ec);
+  return 1;
+}
+
+static int pkey_generate(lua_State *L)
+{
+  const char *options[] = {"rsa", "dsa", "ec", "ed25519", "x25519", NULL};
+  int idx = luaL_checkoption(L, 1, NULL, options);
+  int key_len;
+  EVP_PKEY **pkey;
+
+  switch (idx) {
+  case 2:
+    return pkey_generate_ec(L);
+#ifdef LUACRYPTO_ED25519
+  case 3:
+    return pkey_keygen(L, EVP_PKEY_ED25519);
+  case 4:
+    return pkey_keygen(L, EVP_PKEY_X25519);
+#else
+  case 3:
+  case 4:
+    return luaL_argerror(L, 1, "needs OpenSSL 1.1.1 or later");
+#endif
+  }
+  key_len = luaL_checkinteger(L, 2);
+  pkey = pkey_new(L);
+  if (idx==0) {
+    RSA *rsa = RSA_generate_key(key_len, RSA_F4, NULL, NULL);
+    if (!rsa)
+      return crypto_error(L);
+    
+    *pkey = EVP_PKEY_new();
+    EVP_PKEY_assign_RSA(*pkey, rsa);
+    return 1;
+  } else {
+    DSA *dsa = DSA_generate_parameters(key_len, NULL, 0, NULL, NULL, NULL, NULL);
+    if (!DSA_generate_key(dsa))
+      return crypto_error(L);
+    
+    *pkey = EVP_PKEY_new();
+    EVP_PKEY_assign_DSA(*pkey, dsa);
+    return 1;
+  }
+}
+
+/*
+** Reads the next public key in PEM from bio through the key cache.
+*/
+static EVP_PKEY *pkey_read_pubkey(BIO *bio)
+{
+  unsigned char *der = NULL;
+  long len = 0;
+  EVP_PKEY *pkey;
+
+  if (!PEM_bytes_read_bio(&der, &len, NULL, PEM_STRING_PUBLIC, bio, NULL, NULL))
+    return NULL;
+  pkey = keycache_get(der, len);
+  OPENSSL_free(der);
+  return pkey;
+}
+
+static int pkey_read(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  int readPrivate = lua_isboolean(L, 2) && lua_toboolean(L, 2);
+  FILE *fp = fopen(filename, "r");
+  EVP_PKEY **pkey = pkey_new(L);
+  
+  if (!fp)
+    luaL_error(L, "File not found: %s", filename);
+  
+  if (readPrivate) {
+    *pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+  } else {
+    BIO *bio = BIO_new_fp(fp, BIO_NOCLOSE);
+    if (bio != NULL) {
+      *pkey = pkey_read_pubkey(bio);
+      BIO_free(bio);
+    }
+  }
+  
+  fclose(fp);
+  
+  if (! *pkey)
+    return crypto_error(L);
+  
+  return 1;
+}
+
+static int pkey_write(lua_State *L)
+{
+  EVP_PKEY **pkey = luaL_checkudata(L, 1, LUACRYPTO_PKEYNAME);
+  const char *pubfn = lua_tostring(L, 2);
+  const char *privfn = lua_tostring(L, 3);
+  if (pubfn) {
+    FILE *fp = fopen(pubfn, "w");
+    if (!fp)
+      luaL_error(L, "Unable to write to file: %s", pubfn);
+    if (!PEM_write_PUBKEY(fp, *pkey))
+      return crypto_error(L);
+    fclose(fp);
+  }
+  if (privfn) {
+    FILE *fp = fopen(privfn, "w");
+    if (!fp)
+      luaL_error(L, "Unable to write to file: %s", privfn);
+    if (!PEM_write_PrivateKey(fp, *pkey, NULL, NULL, 0, NULL, NULL))
+      return crypto_error(L);
+    fclose(fp);  
+  }
+  return 0;
+}
+
+/*
+** Parses a key from a PEM string, the private key if the optional
+** argument 2 is true and the public key otherwise.
+*/
+static int pkey_from_pem(lua_State *L)
+{
+  size_t len = 0;
+  const char *pem = luaL_checklstring(L, 1, &len);
+  int priv = lua_toboolean(L, 2);
+  BIO *bio = BIO_new_mem_buf((void *)pem, (int)len);
+  EVP_PKEY **pkey = pkey_new(L);
+
+  if (bio == NULL)
+    return crypto_error(L);
+  if (priv)
+    *pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+  else
+    *pkey = pkey_read_pubkey(bio);
+  BIO_free(bio);
+  if (*pkey == NULL)
+    return crypto_error(L);
+  return 1;
+}
+
+/*
+** Parses a key from DER: a SubjectPublicKeyInfo, or with argument 2
+** true a PKCS#8 or traditional private key. No text to decode, so this
+** is the cheap way to reload keys kept as strings.
+*/
+static int pkey_from_der(lua_State *L)
+{
+  size_t len = 0;
+  const unsigned char *der = (const unsigned char *) luaL_checklstring(L, 1, &len);
+  int priv = lua_toboolean(L, 2);
+  EVP_PKEY **pkey = pkey_new(L);
+
+  if (priv)
+    *pkey = d2i_AutoPrivateKey(NULL, &der, (long)len);
+  else
+    *pkey = keycache_get(der, len);
+  if (*pkey == NULL)
+    return crypto_error(L);
+  return 1;
+}
+
+/*
+** Returns the key as PEM text: the public key, or the private key if
+** argument 2 is true.
+*/
+static int pkey_to_pem(lua_State *L)
+{
+  EVP_PKEY **pkey = luaL_checkudata(L, 1, LUACRYPTO_PKEYNAME);
+  int priv = lua_toboolean(L, 2);
+  BIO *bio = BIO_new(BIO_s_mem());
+  char *data;
+  long len;
+  int ok;
+
+  if (bio == NULL)
+    return crypto_error(L);
+  if (priv)
+    ok = PEM_write_bio_PrivateKey(bio, *pkey, NULL, NULL, 0, NULL, NULL);
+  else
+    ok = PEM_write_bio_PUBKEY(bio, *pkey);
+  if (!ok) {
+    BIO_free(bio);
+    return crypto_error(L);
+  }
+  len = BIO_get_mem_data(bio, &data);
+  lua_pushlstring(L, data, len);
+  BIO_free(bio);
+  return 1;
+}
+
+/*
+** Returns the key as DER, in the forms pkey_from_der reads.
+*/
+static int pkey_to_der(lua_State *L)
+{
+  EVP_PKEY **pkey = luaL_checkudata(L, 1, LUACRYPTO_PKEYNAME);
+  int priv = lua_toboolean(L, 2);
+  unsigned char *der = NULL;
+  int len;
+
+  if (priv)
+    len = i2d_PrivateKey(*pkey, &der);
+  else
+    len = i2d_PUBKEY(*pkey, &der);
+  if (len < 0)
+    return crypto_error(L);
+  lua_pushlstring(L, (const char *)der, len);
+  if (priv)
+    OPENSSL_cleanse(der, len);
+  OPENSSL_free(der);
+  return 1;
+}
+
+/*
+** Public keys are parsed once per process: read, from_pem and from_der
+** hand out references to the same key while it stays in the cache.
+** Private keys are never cached.
+*/
+static int pkey_cache_stats(lua_State *L)
+{
+  keycache_stats st;
+  keycache_get_stats(&st);
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, (lua_Number)st.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, (lua_Number)st.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, (lua_Number)st.evictions);
+  lua_setfield(L, -2, "evictions");
+  lua_pushnumber(L, (lua_Number)st.entries);
+  lua_setfield(L, -2, "entries");
+  lua_pushnumber(L, (lua_Number)st.capacity);
+  lua_setfield(L, -2, "capacity");
+  return 1;
+}
+
+/*
+** Returns the capacity of the cache, setting it first if argument 1 is
+** given; 0 disables the cache.
+*/
+static int pkey_cache_capacity(lua_State *L)
+{
+  keycache_stats st;
+  if (lua_isnoneornil(L, 1)) {
+    keycache_get_stats(&st);
+    lua_pushnumber(L, (lua_Number)st.capacity);
   } else {
-    EVP_MD_CTX c;
-    size_t input_len = 0;
-    const unsigned char *input = (unsigned char *) luaL_checklstring(L, 3, &input_len);
-    unsigned int output_len = 0;
-    unsigned char *buffer = NULL;
-    EVP_PKEY **pkey = luaL_checkudata(L, 4, LUACRYPTO_PKEYNAME);
-   
-    EVP_MD_CTX_init(&c);
-    EVP_SignInit_ex(&c, type, NULL);
-    buffer = malloc(EVP_PKEY_size(*pkey));
-    EVP_SignUpdate(&c, input, input_len);
-    if (!EVP_SignFinal(&c, buffer, &output_len, *pkey)) {
-      free(buffer);
-      return crypto_error(L);
-    }
+    lua_Integer n = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, n >= 0, 1, "must not be negative");
+    lua_pushnumber(L, (lua_Number)keycache_set_capacity((size_t)n));
+  }
+  return 1;
+}
 
-    lua_pushlstring(L, (char*) buffer, output_len);
-    free(buffer);
-    return 1;
+static int pkey_cache_clear(lua_State *L)
+{
+  (void)L;
+  keycache_clear();
+  return 0;
+}
+
+static int pkey_gc(lua_State *L)
+{
+  EVP_PKEY **pkey = luaL_checkudata(L, 1, LUACRYPTO_PKEYNAME);
+  EVP_PKEY_free(*pkey);
+  return 0;
+}
+  
+static const char *pkey_typename(EVP_PKEY *pkey)
+{
+  switch (EVP_PKEY_id(pkey)) {
+  case EVP_PKEY_RSA: return "RSA";
+  case EVP_PKEY_DSA: return "DSA";
+  case EVP_PKEY_EC: return "EC";
+#ifdef LUACRYPTO_ED25519
+  case EVP_PKEY_ED25519: return "ED25519";
+  case EVP_PKEY_X25519: return "X25519";
+#endif
+  default: return "unknown";
   }
 }
 
-/*************** VERIFY API ***************/
+static int pkey_tostring(lua_State *L)
+{
+  EVP_PKEY **pkey = luaL_checkudata(L, 1, LUACRYPTO_PKEYNAME);
+  char buf[80];
+  sprintf(buf, "%s %s %d %p", LUACRYPTO_PKEYNAME, pkey_typename(*pkey), EVP_PKEY_bits(*pkey), pkey);
+  lua_pushstring(L, buf);
+  return 1;
+}
 
-static EVP_MD_CTX *verify_pnew(lua_State *L)
+static int pkey_type(lua_State *L)
 {
-  EVP_MD_CTX *c = lua_newuserdata(L, sizeof(EVP_MD_CTX));
-  luaL_getmetatable(L, LUACRYPTO_VERIFYNAME);
+  EVP_PKEY **pkey = luaL_checkudata(L, 1, LUACRYPTO_PKEYNAME);
+  lua_pushstring(L, pkey_typename(*pkey));
+  return 1;
+}
+
+/*
+** Key agreement: the secret shared between this private key and the
+** public key peer, both X25519 or both EC keys on the same curve.
+*/
+static int pkey_derive(lua_State *L)
+{
+  EVP_PKEY **pkey = luaL_checkudata(L, 1, LUACRYPTO_PKEYNAME);
+  EVP_PKEY **peer = luaL_checkudata(L, 2, LUACRYPTO_PKEYNAME);
+  int format = luacrypto_optformat(L, 3, LUACRYPTO_RAW);
+  EVP_PKEY_CTX *c = EVP_PKEY_CTX_new(*pkey, NULL);
+  unsigned char secret[512];
+  size_t len = 0;
+  int ok;
+
+  ok = c != NULL
+    && EVP_PKEY_derive_init(c) > 0
+    && EVP_PKEY_derive_set_peer(c, *peer) > 0
+    && EVP_PKEY_derive(c, NULL, &len) > 0
+    && len <= sizeof(secret)
+    && EVP_PKEY_derive(c, secret, &len) > 0;
+  EVP_PKEY_CTX_free(c);
+  if (!ok)
+    return crypto_error(L);
+  luacrypto_pushformatted(L, secret, len, format);
+  OPENSSL_cleanse(secret, len);
+  return 1;
+}
+
+/*************** BASE64 API ***************/
+
+typedef struct base64_ctx {
+  int flags;
+  int padded;                 /* decoder: the text so far ended in padding */
+  size_t pending_len;
+  unsigned char pending[4];   /* bytes (encoder) or characters (decoder) of a partial group */
+} base64_ctx;
+
+static int base64_optflags(lua_State *L, int arg)
+{
+  static const char *const alphabets[] = {"std", "url", NULL};
+  int flags = luaL_checkoption(L, arg, "std", alphabets) == 1 ? CODEC_BASE64_URL : 0;
+  if (lua_isboolean(L, arg + 1) && !lua_toboolean(L, arg + 1))
+    flags |= CODEC_BASE64_NOPAD;
+  return flags;
+}
+
+static int base64_error(lua_State *L)
+{
+  lua_pushnil(L);
+  lua_pushliteral(L, "invalid base64 string");
+  return 2;
+}
+
+static int base64_fencode(lua_State *L)
+{
+  size_t len = 0;
+  const unsigned char *input = (unsigned char *) luaL_checklstring(L, 1, &len);
+  luacrypto_pushbase64(L, input, len, base64_optflags(L, 2));
+  return 1;
+}
+
+static int base64_fdecode(lua_State *L)
+{
+  size_t len = 0;
+  const char *input = luaL_checklstring(L, 1, &len);
+  int flags = base64_optflags(L, 2);
+  int padded;
+  luaL_Buffer b;
+
+  luaL_buffinit(L, &b);
+  if (!luacrypto_addunbase64(&b, input, len, flags, &padded))
+    return base64_error(L);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static base64_ctx *base64_pnew(lua_State *L, const char *name)
+{
+  base64_ctx *c = lua_newuserdata(L, sizeof(base64_ctx));
+  luaL_getmetatable(L, name);
   lua_setmetatable(L, -2);
+  memset(c, 0, sizeof(base64_ctx));
   return c;
 }
 
-static int verify_fnew(lua_State *L)
+static int base64_fencoder(lua_State *L)
 {
-  const char *s = luaL_checkstring(L, 1);
-  const EVP_MD *md = EVP_get_digestbyname(s);
-  if (md == NULL) {
+  int flags = base64_optflags(L, 1);
+  base64_ctx *c = base64_pnew(L, LUACRYPTO_BASE64ENCNAME);
+  c->flags = flags;
+  return 1;
+}
+
+static int base64_fdecoder(lua_State *L)
+{
+  int flags = base64_optflags(L, 1);
+  base64_ctx *c = base64_pnew(L, LUACRYPTO_BASE64DECNAME);
+  c->flags = flags;
+  return 1;
+}
+
+static int base64enc_update(lua_State *L)
+{
+  base64_ctx *c = luaL_checkudata(L, 1, LUACRYPTO_BASE64ENCNAME);
+  size_t len = 0;
+  const unsigned char *input = (unsigned char *) luaL_checklstring(L, 2, &len);
+  size_t rem;
+  luaL_Buffer b;
+
+  luaL_buffinit(L, &b);
+  if (c->pending_len > 0) {
+    while (c->pending_len < 3 && len > 0) {
+      c->pending[c->pending_len++] = *input++;
+      len--;
+    }
+    if (c->pending_len < 3) {
+      luaL_pushresult(&b);
+      return 1;
+    }
+    luacrypto_addbase64(&b, c->pending, 3, c->flags);
+    c->pending_len = 0;
+  }
+  rem = len % 3;
+  luacrypto_addbase64(&b, input, len - rem, c->flags);
+  memcpy(c->pending, input + len - rem, rem);
+  c->pending_len = rem;
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int base64enc_final(lua_State *L)
+{
+  base64_ctx *c = luaL_checkudata(L, 1, LUACRYPTO_BASE64ENCNAME);
+  luacrypto_pushbase64(L, c->pending, c->pending_len, c->flags);
+  c->pending_len = 0;
+  return 1;
+}
+
+static int base64enc_tostring(lua_State *L)
+{
+  base64_ctx *c = luaL_checkudata(L, 1, LUACRYPTO_BASE64ENCNAME);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_BASE64ENCNAME, (void *)c);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+static int base64dec_update(lua_State *L)
+{
+  base64_ctx *c = luaL_checkudata(L, 1, LUACRYPTO_BASE64DECNAME);
+  size_t len = 0;
+  const char *input = luaL_checklstring(L, 2, &len);
+  size_t rem;
+  luaL_Buffer b;
+
+  if (c->padded && len > 0)
+    return base64_error(L);
+  luaL_buffinit(L, &b);
+  if (c->pending_len > 0) {
+    while (c->pending_len < 4 && len > 0) {
+      c->pending[c->pending_len++] = *input++;
+      len--;
+    }
+    if (c->pending_len < 4) {
+      luaL_pushresult(&b);
+      return 1;
+    }
+    if (!luacrypto_addunbase64(&b, (char *)c->pending, 4, c->flags, &c->padded) ||
+        (c->padded && len > 0))
+      return base64_error(L);
+    c->pending_len = 0;
+  }
+  rem = len % 4;
+  if (!luacrypto_addunbase64(&b, input, len - rem, c->flags, &c->padded) ||
+      (c->padded && rem > 0))
+    return base64_error(L);
+  memcpy(c->pending, input + len - rem, rem);
+  c->pending_len = rem;
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int base64dec_final(lua_State *L)
+{
+  base64_ctx *c = luaL_checkudata(L, 1, LUACRYPTO_BASE64DECNAME);
+  size_t len = c->pending_len;
+  int padded;
+  luaL_Buffer b;
+
+  c->pending_len = 0;
+  c->padded = 0;
+  luaL_buffinit(L, &b);
+  if (!luacrypto_addunbase64(&b, (char *)c->pending, len, c->flags, &padded))
+    return base64_error(L);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int base64dec_tostring(lua_State *L)
+{
+  base64_ctx *c = luaL_checkudata(L, 1, LUACRYPTO_BASE64DECNAME);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_BASE64DECNAME, (void *)c);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+/*************** CHUNKER API ***************/
+
+/*
+** Splits a stream into content-defined chunks and hashes each one as it
+** goes, so no input is buffered. Chunks found by a call are kept as
+** packed records (offset, length, digest) until returned to Lua.
+*/
+typedef struct chunker {
+  cdc cdc;
+  const EVP_MD *md;
+  EVP_MD_CTX *ctx;
+  int format;
+  int finished;
+  uint64_t offset;            /* of the current chunk */
+  uint64_t length;            /* of the current chunk so far */
+  unsigned char *found;
+  size_t found_len, found_cap;
+} chunker;
+
+#define CHUNKER_RECORD(ch) (16 + (size_t)EVP_MD_size((ch)->md))
+
+/*
+** Reads the min, avg and max fields of the optional options table at
+** index arg.
+*/
+static void chunker_optsizes(lua_State *L, int arg, size_t *min, size_t *avg, size_t *max)
+{
+  lua_Number n[3] = {-1, CDC_DEFAULT_AVG, -1};
+  static const char *const fields[] = {"min", "avg", "max"};
+  int i;
+  if (!lua_isnoneornil(L, arg)) {
+    luaL_checktype(L, arg, LUA_TTABLE);
+    for (i = 0; i < 3; i++) {
+      lua_getfield(L, arg, fields[i]);
+      if (!lua_isnil(L, -1))
+        n[i] = lua_tonumber(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  luaL_argcheck(L, n[1] >= 64 && n[1] <= (1 << 30), arg, "avg must be between 64 and 2^30");
+  if (n[0] < 0)
+    n[0] = n[1] / 4;
+  if (n[2] < 0)
+    n[2] = n[1] * 8 < (1 << 30) ? n[1] * 8 : (1 << 30);
+  luaL_argcheck(L, n[0] >= 1 && n[0] <= n[1] && n[1] <= n[2] && n[2] <= (1 << 30), arg,
+                "sizes must satisfy 1 <= min <= avg <= max <= 2^30");
+  *min = (size_t)n[0];
+  *avg = (size_t)n[1];
+  *max = (size_t)n[2];
+}
+
+/*
+** Pushes a new chunker for the digest at stack position 1, the format
+** at fmt and the options at fmt + 1.
+*/
+static chunker *chunker_pnew(lua_State *L, int fmt)
+{
+  const EVP_MD *md = luacrypto_tomd(L, 1);
+  int format = luacrypto_optformat(L, fmt, LUACRYPTO_HEX);
+  size_t min, avg, max;
+  chunker *ch;
+
+  if (md == NULL)
     luaL_argerror(L, 1, "invalid digest type");
+  chunker_optsizes(L, fmt + 1, &min, &avg, &max);
+  ch = lua_newuserdata(L, sizeof(chunker));
+  memset(ch, 0, sizeof(*ch));
+  luacrypto_setmeta(L, LUACRYPTO_CHUNKERNAME);
+  cdc_init(&ch->cdc, min, avg, max);
+  ch->md = md;
+  ch->format = format;
+  ch->ctx = EVP_MD_CTX_create();
+  if (ch->ctx == NULL || !EVP_DigestInit_ex(ch->ctx, md, NULL))
+    luaL_error(L, "cannot initialize the digest");
+  return ch;
+}
+
+/*
+** Ends the current chunk. Returns 0 if memory is short or the digest
+** fails.
+*/
+static int chunker_cut(chunker *ch)
+{
+  size_t size = CHUNKER_RECORD(ch);
+  unsigned char *r;
+  int i;
+
+  if (ch->found_cap - ch->found_len < size) {
+    size_t cap = ch->found_cap ? ch->found_cap * 2 : 64 * size;
+    unsigned char *found = realloc(ch->found, cap);
+    if (found == NULL)
+      return 0;
+    ch->found = found;
+    ch->found_cap = cap;
+  }
+  r = ch->found + ch->found_len;
+  for (i = 0; i < 8; i++) {
+    r[i] = (unsigned char)(ch->offset >> (8 * i));
+    r[8 + i] = (unsigned char)(ch->length >> (8 * i));
+  }
+  if (!EVP_DigestFinal_ex(ch->ctx, r + 16, NULL) || !EVP_DigestInit_ex(ch->ctx, ch->md, NULL))
     return 0;
-  } else {
-    EVP_MD_CTX *c = verify_pnew(L);
-    EVP_MD_CTX_init(c);
-    EVP_VerifyInit_ex(c, md, NULL);
-    return 1;
+  ch->found_len += size;
+  ch->offset += ch->length;
+  ch->length = 0;
+  return 1;
+}
+
+static int chunker_feed(chunker *ch, const unsigned char *data, size_t len)
+{
+  while (len > 0) {
+    int cut;
+    size_t k = cdc_scan(&ch->cdc, data, len, &cut);
+    if (k > 0 && !EVP_DigestUpdate(ch->ctx, data, k))
+      return 0;
+    ch->length += k;
+    if (cut && !chunker_cut(ch))
+      return 0;
+    data += k;
+    len -= k;
   }
+  return 1;
 }
 
-static int verify_update(lua_State *L)
+static int chunker_consumer(void *ud, const unsigned char *data, size_t len)
 {
-  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_VERIFYNAME);
-  size_t input_len = 0;
-  const unsigned char *input = (unsigned char *) luaL_checklstring(L, 2, &input_len);
+  return chunker_feed((chunker *)ud, data, len);
+}
 
-  EVP_VerifyUpdate(c, input, input_len);
+/* the last chunk, shorter than the rules would make it unless the input goes on */
+static int chunker_finish(chunker *ch)
+{
+  ch->finished = 1;
+  return ch->length == 0 || chunker_cut(ch);
+}
+
+/*
+** Pushes the chunks found so far as an array of {offset, length, digest}
+** tables and forgets them.
+*/
+static void chunker_push(lua_State *L, chunker *ch)
+{
+  size_t size = CHUNKER_RECORD(ch);
+  size_t i, n = ch->found_len / size;
+
+  lua_createtable(L, (int)n, 0);
+  for (i = 0; i < n; i++) {
+    const unsigned char *r = ch->found + i * size;
+    uint64_t offset = 0, length = 0;
+    int k;
+    for (k = 7; k >= 0; k--) {
+      offset = (offset << 8) | r[k];
+      length = (length << 8) | r[8 + k];
+    }
+    lua_createtable(L, 0, 3);
+    lua_pushnumber(L, (lua_Number)offset);
+    lua_setfield(L, -2, "offset");
+    lua_pushnumber(L, (lua_Number)length);
+    lua_setfield(L, -2, "length");
+    luacrypto_pushformatted(L, r + 16, size - 16, ch->format);
+    lua_setfield(L, -2, "digest");
+    lua_rawseti(L, -2, (int)i + 1);
+  }
+  ch->found_len = 0;
+}
+
+/*
+** crypto.chunker.new(dtype [, raw [, options]])
+*/
+static int chunker_fnew(lua_State *L)
+{
+  chunker_pnew(L, 2);
+  return 1;
+}
+
+/*
+** chunker:update(input): the chunks completed by input, a string or a
+** buffer.
+*/
+static int chunker_update(lua_State *L)
+{
+  chunker *ch = luaL_checkudata(L, 1, LUACRYPTO_CHUNKERNAME);
+  size_t len = 0;
+  const unsigned char *data = luacrypto_checkbytes(L, 2, &len);
+  if (ch->finished)
+    return luaL_error(L, "chunker already finished");
+  if (!chunker_feed(ch, data, len))
+    return crypto_error(L);
+  chunker_push(L, ch);
+  return 1;
+}
+
+/*
+** chunker:final(): the last chunk, if the input did not end on a boundary.
+*/
+static int chunker_final(lua_State *L)
+{
+  chunker *ch = luaL_checkudata(L, 1, LUACRYPTO_CHUNKERNAME);
+  if (!ch->finished && !chunker_finish(ch))
+    return crypto_error(L);
+  chunker_push(L, ch);
+  return 1;
+}
+
+/*
+** crypto.chunker.chunks(dtype, input [, raw [, options]]): all chunks of
+** a string or buffer.
+*/
+static int chunker_fchunks(lua_State *L)
+{
+  size_t len = 0;
+  const unsigned char *data = luacrypto_checkbytes(L, 2, &len);
+  chunker *ch = chunker_pnew(L, 3);
+  if (!chunker_feed(ch, data, len) || !chunker_finish(ch))
+    return crypto_error(L);
+  chunker_push(L, ch);
+  return 1;
+}
+
+/*
+** crypto.chunker.file(dtype, path [, offset [, length [, raw [, options]]]]):
+** all chunks of a file range, read as by digest.file; offsets count from
+** the start of the file.
+*/
+static int chunker_ffile(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 2);
+  uint64_t offset, length;
+  chunker *ch;
+  int err;
+
+  luacrypto_optrange(L, 3, &offset, &length);
+  ch = chunker_pnew(L, 5);
+  ch->offset = offset;
+  err = fileio_read(path, offset, length, chunker_consumer, ch);
+  if (err == 0 && !chunker_finish(ch))
+    err = FILEIO_ECONSUMER;
+  if (err != 0)
+    return luacrypto_fileerror(L, path, err);
+  chunker_push(L, ch);
+  return 1;
+}
+
+static int chunker_tostring(lua_State *L)
+{
+  chunker *ch = luaL_checkudata(L, 1, LUACRYPTO_CHUNKERNAME);
+  char s[64];
+  sprintf(s, "%s %p", LUACRYPTO_CHUNKERNAME, (void *)ch);
+  lua_pushstring(L, s);
+  return 1;
+}
+
+static int chunker_gc(lua_State *L)
+{
+  chunker *ch = luaL_checkudata(L, 1, LUACRYPTO_CHUNKERNAME);
+  if (ch->ctx != NULL)
+    EVP_MD_CTX_destroy(ch->ctx);
+  free(ch->found);
+  ch->ctx = NULL;
+  ch->found = NULL;
   return 0;
 }
 
-static int verify_final(lua_State *L) 
+/*************** JOB API ***************/
+
+enum { JOB_DIGEST, JOB_ENCRYPT, JOB_DECRYPT, JOB_SIGN, JOB_VERIFY };
+
+/*
+** A digest, cipher, sign or verify call run on a pool worker. The
+** worker only sees the fields below; the Lua values they point into are
+** kept alive by the environment of the job's userdata, and __gc waits
+** for the worker, so a job can be dropped at any time.
+*/
+typedef struct job_ctx {
+  pool_async a;
+  int kind;
+  int format;
+  const EVP_MD *md;
+  const EVP_CIPHER *cipher;
+  EVP_PKEY *pkey;
+  const unsigned char *input;
+  size_t input_len;
+  const unsigned char *sig;
+  size_t sig_len;
+  unsigned char key[EVP_MAX_KEY_LENGTH];  /* key and iv are wiped once the worker is done */
+  unsigned char iv[EVP_MAX_IV_LENGTH];
+  int has_iv;
+  unsigned char *output;
+  size_t output_len;
+  int failed;
+  int verified;
+  unsigned long err;         /* OpenSSL errors are per thread: the worker's first one */
+} job_ctx;
+
+static int job_cipher(job_ctx *j)
+{
+  EVP_CIPHER_CTX c;
+  int enc = j->kind == JOB_ENCRYPT;
+  int len = 0, final_len = 0;
+  int ok;
+
+  if (j->input_len > INT_MAX - EVP_MAX_BLOCK_LENGTH)
+    return 0;
+  EVP_CIPHER_CTX_init(&c);
+  j->output = malloc(j->input_len + EVP_MAX_BLOCK_LENGTH);
+  ok = j->output != NULL
+    && EVP_CipherInit_ex(&c, j->cipher, NULL, j->key, j->has_iv ? j->iv : NULL, enc)
+    && EVP_CipherUpdate(&c, j->output, &len, j->input, (int)j->input_len)
+    && EVP_CipherFinal_ex(&c, j->output + len, &final_len);
+  EVP_CIPHER_CTX_cleanup(&c);
+  j->output_len = (size_t)len + final_len;
+  return ok;
+}
+
+static void job_run(pool_async *a)
+{
+  job_ctx *j = (job_ctx *)a;
+  EVP_MD_CTX *c = NULL;
+  unsigned int len = 0;
+  int ok = 0;
+
+  switch (j->kind) {
+  case JOB_DIGEST:
+    c = EVP_MD_CTX_create();
+    ok = c != NULL && (j->output = malloc(EVP_MAX_MD_SIZE)) != NULL
+      && EVP_DigestInit_ex(c, j->md, NULL)
+      && EVP_DigestUpdate(c, j->input, j->input_len)
+      && EVP_DigestFinal_ex(c, j->output, &len);
+    j->output_len = len;
+    break;
+  case JOB_ENCRYPT:
+  case JOB_DECRYPT:
+    ok = job_cipher(j);
+    OPENSSL_cleanse(j->key, sizeof(j->key));
+    OPENSSL_cleanse(j->iv, sizeof(j->iv));
+    break;
+  case JOB_SIGN:
+    ok = (j->output = malloc(EVP_PKEY_size(j->pkey))) != NULL
+      && luacrypto_sign(j->pkey, j->md, j->input, j->input_len, j->output, &j->output_len);
+    break;
+  case JOB_VERIFY:
+    j->verified = luacrypto_verify(j->pkey, j->md, j->input, j->input_len, j->sig, j->sig_len);
+    ok = j->verified != -1;
+    break;
+  }
+  if (c != NULL)
+    EVP_MD_CTX_destroy(c);
+  if (!ok) {
+    j->failed = 1;
+    j->err = ERR_get_error();
+  }
+  ERR_clear_error();
+}
+
+/*
+** Creates a job of the given kind from the fields already set in
+** proto, keeps the call's arguments alive and submits it.
+*/
+static int job_submit(lua_State *L, const job_ctx *proto)
+{
+  int i, n = lua_gettop(L);
+  job_ctx *j = lua_newuserdata(L, sizeof(job_ctx));
+
+  *j = *proto;
+  lua_createtable(L, n, 0);
+  for (i = 1; i <= n; i++) {
+    lua_pushvalue(L, i);
+    lua_rawseti(L, -2, i);
+  }
+  lua_setfenv(L, -2);
+  pool_async_submit(&j->a, job_run);
+  /* only a submitted job has a __gc to wait for it */
+  luaL_getmetatable(L, LUACRYPTO_JOBHANDLENAME);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int job_fdigest(lua_State *L)
+{
+  job_ctx j;
+  memset(&j, 0, sizeof(j));
+  j.kind = JOB_DIGEST;
+  j.md = luacrypto_tomd(L, 1);
+  if (j.md == NULL)
+    return luaL_argerror(L, 1, "invalid digest type");
+  j.input = (const unsigned char *) luaL_checklstring(L, 2, &j.input_len);
+  j.format = luacrypto_optformat(L, 3, LUACRYPTO_HEX);
+  return job_submit(L, &j);
+}
+
+static int job_cipherargs(lua_State *L, int kind)
+{
+  job_ctx j;
+  size_t key_len = 0, iv_len = 0;
+  const char *key, *iv;
+  int n;
+
+  memset(&j, 0, sizeof(j));
+  j.kind = kind;
+  j.cipher = luacrypto_tocipher(L, 1);
+  if (j.cipher == NULL)
+    return luaL_argerror(L, 1, kind == JOB_ENCRYPT ? "invalid encrypt cipher" : "invalid decrypt cipher");
+  j.input = (const unsigned char *) luaL_checklstring(L, 2, &j.input_len);
+  key = luaL_checklstring(L, 3, &key_len);
+  iv = lua_tolstring(L, 4, &iv_len); /* can be NULL */
+  memcpy(j.key, key, key_len < sizeof(j.key) ? key_len : sizeof(j.key));
+  if (iv) {
+    memcpy(j.iv, iv, iv_len < sizeof(j.iv) ? iv_len : sizeof(j.iv));
+    j.has_iv = 1;
+  }
+  j.format = kind == JOB_ENCRYPT ? luacrypto_optformat(L, 5, LUACRYPTO_RAW) : LUACRYPTO_RAW;
+  n = job_submit(L, &j);
+  OPENSSL_cleanse(j.key, sizeof(j.key));
+  OPENSSL_cleanse(j.iv, sizeof(j.iv));
+  return n;
+}
+
+static int job_fencrypt(lua_State *L)
+{
+  return job_cipherargs(L, JOB_ENCRYPT);
+}
+
+static int job_fdecrypt(lua_State *L)
+{
+  return job_cipherargs(L, JOB_DECRYPT);
+}
+
+static int job_fsign(lua_State *L)
+{
+  job_ctx j;
+  memset(&j, 0, sizeof(j));
+  j.kind = JOB_SIGN;
+  j.md = luacrypto_tomd(L, 1);
+  if (j.md == NULL)
+    return luaL_argerror(L, 1, "invalid digest type");
+  j.input = (const unsigned char *) luaL_checklstring(L, 2, &j.input_len);
+  j.pkey = *(EVP_PKEY **)luaL_checkudata(L, 3, LUACRYPTO_PKEYNAME);
+  j.format = luacrypto_optformat(L, 4, LUACRYPTO_RAW);
+  return job_submit(L, &j);
+}
+
+static int job_fverify(lua_State *L)
+{
+  job_ctx j;
+  memset(&j, 0, sizeof(j));
+  j.kind = JOB_VERIFY;
+  j.md = luacrypto_tomd(L, 1);
+  if (j.md == NULL)
+    return luaL_argerror(L, 1, "invalid digest type");
+  j.input = (const unsigned char *) luaL_checklstring(L, 2, &j.input_len);
+  j.sig = (const unsigned char *) luaL_checklstring(L, 3, &j.sig_len);
+  j.pkey = *(EVP_PKEY **)luaL_checkudata(L, 4, LUACRYPTO_PKEYNAME);
+  return job_submit(L, &j);
+}
+
+static int job_done(lua_State *L)
 {
-  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_VERIFYNAME);
-  size_t sig_len = 0;
-  const unsigned char *sig = (unsigned char *) luaL_checklstring(L, 2, &sig_len);
-  EVP_PKEY **pkey = luaL_checkudata(L, 3, LUACRYPTO_PKEYNAME);
-  int ret;
+  job_ctx *j = luaL_checkudata(L, 1, LUACRYPTO_JOBHANDLENAME);
+  lua_pushboolean(L, pool_async_done(&j->a));
+  return 1;
+}
 
-  ret = EVP_VerifyFinal(c, sig, sig_len, *pkey);
-  if (ret == -1)
-    return crypto_error(L);
+/*
+** Blocks until the job is done and returns what the matching direct
+** call would: the result, a boolean for verify, or nil and a message.
+** In a forked child a job the parent had not finished never will.
+*/
+static int job_wait(lua_State *L)
+{
+  job_ctx *j = luaL_checkudata(L, 1, LUACRYPTO_JOBHANDLENAME);
+  if (!pool_async_wait(&j->a)) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "job lost in fork");
+    return 2;
+  }
+  if (j->failed) {
+    char buf[120];
+    ERR_load_crypto_strings();
+    lua_pushnil(L);
+    if (j->err != 0)
+      lua_pushstring(L, ERR_error_string(j->err, buf));
+    else
+      lua_pushstring(L, "job failed");
+    return 2;
+  }
+  if (j->kind == JOB_VERIFY)
+    lua_pushboolean(L, j->verified);
+  else
+    luacrypto_pushformatted(L, j->output, j->output_len, j->format);
+  return 1;
+}
 
-  lua_pushboolean(L, ret);  
+static int job_fd(lua_State *L)
+{
+  job_ctx *j = luaL_checkudata(L, 1, LUACRYPTO_JOBHANDLENAME);
+  int fd = pool_async_fd(&j->a);
+  if (fd < 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+  lua_pushinteger(L, fd);
   return 1;
 }
 
-static int verify_tostring(lua_State *L)
+static int job_tostring(lua_State *L)
 {
-  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_VERIFYNAME);
+  job_ctx *j = luaL_checkudata(L, 1, LUACRYPTO_JOBHANDLENAME);
   char s[64];
-  sprintf(s, "%s %p", LUACRYPTO_VERIFYNAME, (void *)c);
+  sprintf(s, "%s %p", LUACRYPTO_JOBHANDLENAME, (void *)j);
   lua_pushstring(L, s);
   return 1;
 }
 
-static int verify_gc(lua_State *L)
+static int job_gc(lua_State *L)
 {
-  EVP_MD_CTX *c = luaL_checkudata(L, 1, LUACRYPTO_VERIFYNAME);
-  EVP_MD_CTX_cleanup(c);
-  return 1;
+  job_ctx *j = luaL_checkudata(L, 1, LUACRYPTO_JOBHANDLENAME);
+  pool_async_cleanup(&j->a);
+  if (j->kind == JOB_DECRYPT && j->output != NULL)
+    OPENSSL_cleanse(j->output, j->output_len);
+  free(j->output);
+  j->output = NULL;
+  return 0;
 }
 
-static int verify_fverify(lua_State *L)
-{
-  /* parameter 1 is the 'crypto.verify' table */
-  const char *type_name = luaL_checkstring(L, 2);
-  const EVP_MD *type = EVP_get_digestbyname(type_name);
+/*************** HANDLE API ***************/
 
-  if (type == NULL) {
-    luaL_argerror(L, 1, "invalid digest type");
-    return 0;
-  } else {
-    EVP_MD_CTX c;
-    size_t input_len = 0;
-    const unsigned char *input = (unsigned char *) luaL_checklstring(L, 3, &input_len);
-    size_t sig_len = 0;
-    const unsigned char *sig = (unsigned char *) luaL_checklstring(L, 4, &sig_len);
-    EVP_PKEY **pkey = luaL_checkudata(L, 5, LUACRYPTO_PKEYNAME);
-    int ret;
+/*
+** Calls the one-shot function f, which takes its algorithm as the
+** second argument after the module table, with the handle at index 1.
+*/
+static int handle_call(lua_State *L, lua_CFunction f)
+{
+  lua_pushvalue(L, 1);
+  lua_insert(L, 1);
+  return f(L);
+}
 
-    EVP_MD_CTX_init(&c);
-    EVP_VerifyInit_ex(&c, type, NULL);
-    EVP_VerifyUpdate(&c, input, input_len);
-    ret = EVP_VerifyFinal(&c, sig, sig_len, *pkey);
-    if (ret == -1)
-      return crypto_error(L);
+static const EVP_MD *md_check(lua_State *L)
+{
+  return *(const EVP_MD **)luaL_checkudata(L, 1, LUACRYPTO_MDNAME);
+}
 
-    lua_pushboolean(L, ret);
-    return 1;
-  }
+static int md_name(lua_State *L)
+{
+  lua_pushstring(L, EVP_MD_name(md_check(L)));
+  return 1;
 }
-/*************** RAND API ***************/
 
-static int rand_do_bytes(lua_State *L, int (*bytes)(unsigned char *, int))
+static int md_size(lua_State *L)
 {
-  size_t count = luaL_checkint(L, 1);
-  unsigned char tmp[256], *buf = tmp;
-  if (count > sizeof tmp)
-    buf = malloc(count);
-    if (!buf)
-      return luaL_error(L, "out of memory");
-    else if (!bytes(buf, count))
-      return crypto_error(L);
-    lua_pushlstring(L, (char *)buf, count);
-    if (buf != tmp)
-      free(buf);
-    return 1;
+  lua_pushinteger(L, EVP_MD_size(md_check(L)));
+  return 1;
 }
 
-static int rand_bytes(lua_State *L)
+static int md_block_size(lua_State *L)
 {
-  return rand_do_bytes(L, RAND_bytes);
+  lua_pushinteger(L, EVP_MD_block_size(md_check(L)));
+  return 1;
 }
 
-static int rand_pseudo_bytes(lua_State *L)
+static int md_tostring(lua_State *L)
 {
-  return rand_do_bytes(L, RAND_pseudo_bytes);
+  lua_pushfstring(L, "%s %s", LUACRYPTO_MDNAME, EVP_MD_name(md_check(L)));
+  return 1;
 }
 
-static int rand_add(lua_State *L)
+static const EVP_CIPHER *cipher_check(lua_State *L)
 {
-  size_t num;
-  const void *buf = luaL_checklstring(L, 1, &num);
-  double entropy = luaL_optnumber(L, 2, num);
-  RAND_add(buf, num, entropy);
-  return 0;
+  return *(const EVP_CIPHER **)luaL_checkudata(L, 1, LUACRYPTO_CIPHERNAME);
 }
 
-static int rand_status(lua_State *L)
+static int cipher_name(lua_State *L)
 {
-  lua_pushboolean(L, RAND_status());
+  lua_pushstring(L, EVP_CIPHER_name(cipher_check(L)));
   return 1;
 }
 
-enum { WRITE_FILE_COUNT = 1024 };
-static int rand_load(lua_State *L)
+static int cipher_key_length(lua_State *L)
 {
-  const char *name = luaL_optstring(L, 1, 0);
-  char tmp[256];
-  int n;
-  if (!name && !(name = RAND_file_name(tmp, sizeof tmp)))
-    return crypto_error(L);
-  n = RAND_load_file(name, WRITE_FILE_COUNT);
-  if (n == 0)
-    return crypto_error(L);
-  lua_pushnumber(L, n);
+  lua_pushinteger(L, EVP_CIPHER_key_length(cipher_check(L)));
   return 1;
 }
 
-static int rand_write(lua_State *L)
+static int cipher_iv_length(lua_State *L)
 {
-  const char *name = luaL_optstring(L, 1, 0);
-  char tmp[256];
-  int n;
-  if (!name && !(name = RAND_file_name(tmp, sizeof tmp)))
-    return crypto_error(L);
-  n = RAND_write_file(name);
-  if (n == 0)
-    return crypto_error(L);
-  lua_pushnumber(L, n);
+  lua_pushinteger(L, EVP_CIPHER_iv_length(cipher_check(L)));
   return 1;
 }
 
-static int rand_cleanup(lua_State *L)
+static int cipher_block_size(lua_State *L)
 {
-  RAND_cleanup();
-  return 0;
+  lua_pushinteger(L, EVP_CIPHER_block_size(cipher_check(L)));
+  return 1;
 }
 
-/*************** PKEY API ***************/
-
-static EVP_PKEY **pkey_new(lua_State *L)
+static int cipher_tostring(lua_State *L)
 {
-  EVP_PKEY **pkey = lua_newuserdata(L, sizeof(EVP_PKEY*));
-  luaL_getmetatable(L, LUACRYPTO_PKEYNAME);
-  lua_setmetatable(L, -2);
-  return pkey;
+  lua_pushfstring(L, "%s %s", LUACRYPTO_CIPHERNAME, EVP_CIPHER_name(cipher_check(L)));
+  return 1;
 }
-  
-static int pkey_generate(lua_State *L)
+
+static int md_digest(lua_State *L)
 {
-  const char *options[] = {"rsa", "dsa"};
-  int idx = luaL_checkoption(L, 1, NULL, options);
-  int key_len = luaL_checkinteger(L, 2);
-  EVP_PKEY **pkey = pkey_new(L);
-  if (idx==0) {
-    RSA *rsa = RSA_generate_key(key_len, RSA_F4, NULL, NULL);
-    if (!rsa)
-      return crypto_error(L);
-    
-    *pkey = EVP_PKEY_new();
-    EVP_PKEY_assign_RSA(*pkey, rsa);
-    return 1;
-  } else {
-    DSA *dsa = DSA_generate_parameters(key_len, NULL, 0, NULL, NULL, NULL, NULL);
-    if (!DSA_generate_key(dsa))
-      return crypto_error(L);
-    
-    *pkey = EVP_PKEY_new();
-    EVP_PKEY_assign_DSA(*pkey, dsa);
-    return 1;
-  }
+  return handle_call(L, digest_fdigest);
 }
 
-static int pkey_read(lua_State *L)
+static int md_sign(lua_State *L)
 {
-  const char *filename = luaL_checkstring(L, 1);
-  int readPrivate = lua_isboolean(L, 2) && lua_toboolean(L, 2);
-  FILE *fp = fopen(filename, "r");
-  EVP_PKEY **pkey = pkey_new(L);
-  
-  if (!fp)
-    luaL_error(L, "File not found: %s", filename);
-  
-  if (readPrivate) {
-    *pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
-  } else {
-    *pkey = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
-  }
-  
-  fclose(fp);
-  
-  if (! *pkey)
-    return crypto_error(L);
-  
-  return 1;
+  return handle_call(L, sign_fsign);
 }
 
-static int pkey_write(lua_State *L)
+static int md_verify(lua_State *L)
 {
-  EVP_PKEY **pkey = luaL_checkudata(L, 1, LUACRYPTO_PKEYNAME);
-  const char *pubfn = lua_tostring(L, 2);
-  const char *privfn = lua_tostring(L, 3);
-  if (pubfn) {
-    FILE *fp = fopen(pubfn, "w");
-    if (!fp)
-      luaL_error(L, "Unable to write to file: %s", pubfn);
-    if (!PEM_write_PUBKEY(fp, *pkey))
-      return crypto_error(L);
-    fclose(fp);
-  }
-  if (privfn) {
-    FILE *fp = fopen(privfn, "w");
-    if (!fp)
-      luaL_error(L, "Unable to write to file: %s", privfn);
-    if (!PEM_write_PrivateKey(fp, *pkey, NULL, NULL, 0, NULL, NULL))
-      return crypto_error(L);
-    fclose(fp);  
-  }
-  return 0;
+  return handle_call(L, verify_fverify);
 }
 
-static int pkey_gc(lua_State *L)
+static int cipher_encrypt(lua_State *L)
 {
-  EVP_PKEY **pkey = luaL_checkudata(L, 1, LUACRYPTO_PKEYNAME);
-  EVP_PKEY_free(*pkey);
-  return 0;
+  return handle_call(L, encrypt_fencrypt);
 }
-  
-static int pkey_tostring(lua_State *L)
+
+static int cipher_decrypt(lua_State *L)
 {
-  EVP_PKEY **pkey = luaL_checkudata(L, 1, LUACRYPTO_PKEYNAME);
-  char buf[60];
-  sprintf(buf, "%s %s %d %p", LUACRYPTO_PKEYNAME, (*pkey)->type == EVP_PKEY_DSA ? "DSA" : "RSA", EVP_PKEY_bits(*pkey), pkey);
-  lua_pushstring(L, buf);
-  return 1;
+  return handle_call(L, decrypt_fdecrypt);
 }
+
 /*************** CORE API ***************/
   
 static void list_callback(const OBJ_NAME *obj,void *arg) {
@@ -955,14 +4781,54 @@ static int luacrypto_list(lua_State *L) {
 }
 
 static int luacrypto_hex(lua_State *L) {
-  size_t i, len = 0;
+  size_t len = 0;
   const unsigned char * input = (unsigned char *) luaL_checklstring(L, 1, &len);
-  char * hex = calloc(sizeof(char), len*2 + 1);
-  for (i = 0; i < len; i++) {
-    sprintf(hex + 2*i, "%02x", input[i]);
+  luacrypto_pushhex(L, input, len);
+  return 1;
+}
+
+/*
+** Seconds on a monotonic wall clock, for timing work that other threads
+** or I/O take part in; os.clock only counts this process's CPU time.
+*/
+static int luacrypto_clock(lua_State *L) {
+#ifndef _WIN32
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  lua_pushnumber(L, (lua_Number)ts.tv_sec + (lua_Number)ts.tv_nsec * 1e-9);
+#else
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  lua_pushnumber(L, (lua_Number)now.QuadPart / (lua_Number)freq.QuadPart);
+#endif
+  return 1;
+}
+
+static int luacrypto_unhex(lua_State *L) {
+  size_t len = 0;
+  const char * input = luaL_checklstring(L, 1, &len);
+  luaL_Buffer b;
+
+  if (len % 2 != 0) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "odd number of hex digits");
+    return 2;
+  }
+  len /= 2;
+  luaL_buffinit(L, &b);
+  while (len > 0) {
+    size_t n = len < LUAL_BUFFERSIZE ? len : LUAL_BUFFERSIZE;
+    if (!codec_hex_decode((unsigned char *)luaL_prepbuffer(&b), input, n)) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "invalid hex digit");
+      return 2;
+    }
+    luaL_addsize(&b, n);
+    input += 2*n;
+    len -= n;
   }
-  lua_pushlstring(L, hex, len*2);
-  free(hex);
+  luaL_pushresult(&b);
   return 1;
 }
   
@@ -990,11 +4856,14 @@ LUACRYPTO_API int luacrypto_createmeta (lua_State *L, const char *name, const lu
   
 
 
-static void create_call_table(lua_State *L, const char *name, lua_CFunction creator, lua_CFunction starter)
+static void create_call_table(lua_State *L, const char *name, lua_CFunction creator, lua_CFunction starter, const luaL_reg *functions)
 {
   lua_createtable(L, 0, 1);
   lua_pushcfunction(L, creator);
   lua_setfield(L, -2, "new");
+  /* extra module-level functions, e.g. crypto.digest.batch */
+  if (functions)
+    luaL_openlib(L, NULL, functions, 0);
   /* create metatable for call */
   lua_createtable(L, 0, 1);
   lua_pushcfunction(L, starter);
@@ -1018,14 +4887,82 @@ static void create_call_table(lua_State *L, const char *name, lua_CFunction crea
 */
 static void create_metatables (lua_State *L)
 {
+  int top;
   struct luaL_reg core_functions[] = {
     { "list", luacrypto_list },
+    { "md", luacrypto_fmd },
+    { "cipher", luacrypto_fcipher },
     { "hex", luacrypto_hex },
+    { "unhex", luacrypto_unhex },
+    { "clock", luacrypto_clock },
+    { NULL, NULL }
+  };
+  struct luaL_reg md_methods[] = {
+    { "__tostring", md_tostring },
+    { "batch", digest_fbatch },
+    { "block_size", md_block_size },
+    { "digest", md_digest },
+    { "file", digest_ffile },
+    { "files", digest_ffiles },
+    { "hmac", hmac_fdigest },
+    { "hmac_new", hmac_fnew },
+    { "name", md_name },
+    { "new", digest_fnew },
+    { "sign", md_sign },
+    { "size", md_size },
+    { "tostring", md_tostring },
+    { "tree", digest_ftree },
+    { "tree_file", digest_ftree_file },
+    { "verify", md_verify },
+    { NULL, NULL }
+  };
+  struct luaL_reg cipher_methods[] = {
+    { "__tostring", cipher_tostring },
+    { "block_size", cipher_block_size },
+    { "decrypt", cipher_decrypt },
+    { "decrypt_new", decrypt_fnew },
+    { "encrypt", cipher_encrypt },
+    { "encrypt_new", encrypt_fnew },
+    { "iv_length", cipher_iv_length },
+    { "key_length", cipher_key_length },
+    { "name", cipher_name },
+    { "tostring", cipher_tostring },
+    { NULL, NULL }
+  };
+  struct luaL_reg digest_functions[] = {
+    { "batch", digest_fbatch },
+    { "file", digest_ffile },
+    { "files", digest_ffiles },
+    { "import", digest_fimport },
+    { "tree", digest_ftree },
+    { "tree_file", digest_ftree_file },
+    { NULL, NULL }
+  };
+  struct luaL_reg fhash_functions[] = {
+    { "batch", fhash_fbatch },
+    { NULL, NULL }
+  };
+  struct luaL_reg fhash_methods[] = {
+    { "__tostring", fhash_tostring },
+    { "clone", fhash_clone },
+    { "final", fhash_final },
+    { "reset", fhash_reset },
+    { "tostring", fhash_tostring },
+    { "update", fhash_update },
+    { NULL, NULL }
+  };
+  struct luaL_reg sign_functions[] = {
+    { "batch", sign_fbatch },
+    { NULL, NULL }
+  };
+  struct luaL_reg verify_functions[] = {
+    { "batch", verify_fbatch },
     { NULL, NULL }
   };
   struct luaL_reg digest_methods[] = {
     { "__tostring", digest_tostring },
     { "__gc", digest_gc },
+    { "export", digest_export },
     { "final", digest_final },
     { "tostring", digest_tostring },
     { "update", digest_update },
@@ -1033,8 +4970,24 @@ static void create_metatables (lua_State *L)
     { "clone", digest_clone },
     {NULL, NULL}
   };
-  EVP_METHODS(encrypt);
-  EVP_METHODS(decrypt);
+  struct luaL_reg encrypt_methods[] = {
+    { "__tostring", encrypt_tostring },
+    { "__gc", encrypt_gc },
+    { "final", encrypt_final },
+    { "tostring", encrypt_tostring },
+    { "update", encrypt_update },
+    { "reset", encrypt_reset },
+    {NULL, NULL}
+  };
+  struct luaL_reg decrypt_methods[] = {
+    { "__tostring", decrypt_tostring },
+    { "__gc", decrypt_gc },
+    { "final", decrypt_final },
+    { "tostring", decrypt_tostring },
+    { "update", decrypt_update },
+    { "reset", decrypt_reset },
+    {NULL, NULL}
+  };
   EVP_METHODS(sign);
   EVP_METHODS(verify);
   /* TODO:
@@ -1043,6 +4996,7 @@ static void create_metatables (lua_State *L)
   */
   struct luaL_reg hmac_functions[] = {
     { "digest", hmac_fdigest },
+    { "file", hmac_ffile },
     { "new", hmac_fnew },
     { NULL, NULL }
   };
@@ -1056,6 +5010,37 @@ static void create_metatables (lua_State *L)
     { "update", hmac_update },
     { NULL, NULL }
   };
+  struct luaL_reg kdf_functions[] = {
+    { "hkdf", kdf_fhkdf },
+    { "pbkdf2", kdf_fpbkdf2 },
+    { "scrypt", kdf_fscrypt },
+    { NULL, NULL }
+  };
+  struct luaL_reg etm_functions[] = {
+    { "new", etm_fnew },
+    { "verifier", etm_fverifier },
+    { "encrypt", etm_fencrypt },
+    { "decrypt", etm_fdecrypt },
+    { NULL, NULL }
+  };
+  struct luaL_reg etmenc_methods[] = {
+    { "__tostring", etmenc_tostring },
+    { "__gc", etmenc_gc },
+    { "final", etmenc_final },
+    { "reset", etmenc_reset },
+    { "tostring", etmenc_tostring },
+    { "update", etmenc_update },
+    { NULL, NULL }
+  };
+  struct luaL_reg etmdec_methods[] = {
+    { "__tostring", etmdec_tostring },
+    { "__gc", etmdec_gc },
+    { "final", etmdec_final },
+    { "reset", etmdec_reset },
+    { "tostring", etmdec_tostring },
+    { "update", etmdec_update },
+    { NULL, NULL }
+  };
   struct luaL_reg rand_functions[] = {
     { "bytes", rand_bytes },
     { "pseudo_bytes", rand_pseudo_bytes },
@@ -1065,9 +5050,127 @@ static void create_metatables (lua_State *L)
     { "load", rand_load },
     { "write", rand_write },
     { "cleanup", rand_cleanup },
+    { "pool", rand_fpool },
+    { "set_pool", rand_set_pool },
+    { "token", rand_token },
+    { "int", rand_int },
+    { "ints", rand_ints },
+    { "fill", rand_fill },
+    { NULL, NULL }
+  };
+  struct luaL_reg randpool_methods[] = {
+    { "__tostring", randpool_tostring },
+    { "__gc", randpool_gc },
+    { "bytes", randpool_bytes },
+    { "fill", randpool_fill },
+    { "int", randpool_int },
+    { "ints", randpool_ints },
+    { "token", randpool_token },
+    { NULL, NULL }
+  };
+  struct luaL_reg aead_functions[] = {
+    { "seal", aead_fseal },
+    { "open", aead_fopen },
+    { "sealer", aead_fsealer },
+    { "opener", aead_fopener },
+    { NULL, NULL }
+  };
+  struct luaL_reg job_functions[] = {
+    { "digest", job_fdigest },
+    { "encrypt", job_fencrypt },
+    { "decrypt", job_fdecrypt },
+    { "sign", job_fsign },
+    { "verify", job_fverify },
+    { NULL, NULL }
+  };
+  struct luaL_reg job_methods[] = {
+    { "__tostring", job_tostring },
+    { "__gc", job_gc },
+    { "done", job_done },
+    { "fd", job_fd },
+    { "tostring", job_tostring },
+    { "wait", job_wait },
+    { NULL, NULL }
+  };
+  struct luaL_reg sealer_methods[] = {
+    { "__tostring", sealer_tostring },
+    { "__gc", sealer_gc },
+    { "aad", sealer_aad },
+    { "final", sealer_final },
+    { "reset", sealer_reset },
+    { "tostring", sealer_tostring },
+    { "update", sealer_update },
+    { NULL, NULL }
+  };
+  struct luaL_reg opener_methods[] = {
+    { "__tostring", opener_tostring },
+    { "__gc", opener_gc },
+    { "aad", opener_aad },
+    { "final", opener_final },
+    { "reset", opener_reset },
+    { "tostring", opener_tostring },
+    { "update", opener_update },
+    { NULL, NULL }
+  };
+  struct luaL_reg buffer_functions[] = {
+    { "new", buffer_fnew },
+    { NULL, NULL }
+  };
+  struct luaL_reg buffer_methods[] = {
+    { "__tostring", buffer_tostring },
+    { "__gc", buffer_gc },
+    { "__len", buffer_len },
+    { "append", buffer_append },
+    { "capacity", buffer_capacity },
+    { "clear", buffer_clear },
+    { "data", buffer_data },
+    { "len", buffer_len },
+    { "reserve", buffer_reserve_method },
+    { "resize", buffer_resize },
+    { "tostring", buffer_tostring },
+    { NULL, NULL }
+  };
+  struct luaL_reg base64_functions[] = {
+    { "encode", base64_fencode },
+    { "decode", base64_fdecode },
+    { "encoder", base64_fencoder },
+    { "decoder", base64_fdecoder },
+    { NULL, NULL }
+  };
+  struct luaL_reg base64enc_methods[] = {
+    { "__tostring", base64enc_tostring },
+    { "final", base64enc_final },
+    { "tostring", base64enc_tostring },
+    { "update", base64enc_update },
+    { NULL, NULL }
+  };
+  struct luaL_reg base64dec_methods[] = {
+    { "__tostring", base64dec_tostring },
+    { "final", base64dec_final },
+    { "tostring", base64dec_tostring },
+    { "update", base64dec_update },
+    { NULL, NULL }
+  };
+  struct luaL_reg chunker_functions[] = {
+    { "chunks", chunker_fchunks },
+    { "file", chunker_ffile },
+    { "new", chunker_fnew },
+    { NULL, NULL }
+  };
+  struct luaL_reg chunker_methods[] = {
+    { "__tostring", chunker_tostring },
+    { "__gc", chunker_gc },
+    { "final", chunker_final },
+    { "tostring", chunker_tostring },
+    { "update", chunker_update },
     { NULL, NULL }
   };
   struct luaL_reg pkey_functions[] = {
+    { "cache_capacity", pkey_cache_capacity },
+    { "cache_clear", pkey_cache_clear },
+    { "cache_stats", pkey_cache_stats },
+    { "from_der", pkey_from_der },
+    { "from_pem", pkey_from_pem },
     { "generate", pkey_generate },
     { "read", pkey_read },
     { NULL, NULL }
@@ -1075,31 +5178,67 @@ static void create_metatables (lua_State *L)
   struct luaL_reg pkey_methods[] = {
     { "__tostring", pkey_tostring },
     { "__gc", pkey_gc },
+    { "derive", pkey_derive },
+    { "to_der", pkey_to_der },
+    { "to_pem", pkey_to_pem },
+    { "type", pkey_type },
     { "write", pkey_write },
     { NULL, NULL }
   };
   
   luaL_register (L, LUACRYPTO_CORENAME, core_functions);
-#define CALLTABLE(n) create_call_table(L, #n, n##_fnew, n##_f##n)
-  CALLTABLE(digest);
+#define CALLTABLE(n) create_call_table(L, #n, n##_fnew, n##_f##n, NULL)
+  create_call_table(L, "digest", digest_fnew, digest_fdigest, digest_functions);
   CALLTABLE(encrypt);
   CALLTABLE(decrypt);
-  CALLTABLE(verify);
-  CALLTABLE(sign);
+  create_call_table(L, "verify", verify_fnew, verify_fverify, verify_functions);
+  create_call_table(L, "sign", sign_fnew, sign_fsign, sign_functions);
+  create_call_table(L, "fasthash", fhash_fnew, fhash_ffasthash, fhash_functions);
 
+  /* each metatable is left on the stack, which only has LUA_MINSTACK free slots */
+  top = lua_gettop(L);
+  luacrypto_createmeta(L, LUACRYPTO_MDNAME, md_methods);
+  luacrypto_createmeta(L, LUACRYPTO_CIPHERNAME, cipher_methods);
   luacrypto_createmeta(L, LUACRYPTO_DIGESTNAME, digest_methods);
+  luacrypto_createmeta(L, LUACRYPTO_FASTHASHNAME, fhash_methods);
   luacrypto_createmeta(L, LUACRYPTO_ENCRYPTNAME, encrypt_methods);
   luacrypto_createmeta(L, LUACRYPTO_DECRYPTNAME, decrypt_methods);
   luacrypto_createmeta(L, LUACRYPTO_HMACNAME, hmac_methods);
+  luacrypto_createmeta(L, LUACRYPTO_ETMNAME, etmenc_methods);
+  luacrypto_createmeta(L, LUACRYPTO_ETMVERIFYNAME, etmdec_methods);
   luacrypto_createmeta(L, LUACRYPTO_SIGNNAME, sign_methods);
   luacrypto_createmeta(L, LUACRYPTO_VERIFYNAME, verify_methods);
   luacrypto_createmeta(L, LUACRYPTO_PKEYNAME, pkey_methods);
+  luacrypto_createmeta(L, LUACRYPTO_SEALERNAME, sealer_methods);
+  luacrypto_createmeta(L, LUACRYPTO_OPENERNAME, opener_methods);
+  luacrypto_createmeta(L, LUACRYPTO_BUFFERNAME, buffer_methods);
+  luacrypto_createmeta(L, LUACRYPTO_JOBHANDLENAME, job_methods);
+  luacrypto_createmeta(L, LUACRYPTO_CHUNKERNAME, chunker_methods);
+  luacrypto_createmeta(L, LUACRYPTO_RANDPOOLNAME, randpool_methods);
+  luacrypto_createmeta(L, LUACRYPTO_BASE64ENCNAME, base64enc_methods);
+  luacrypto_createmeta(L, LUACRYPTO_BASE64DECNAME, base64dec_methods);
+  lua_settop(L, top);
 
   luaL_register (L, LUACRYPTO_RANDNAME, rand_functions);
   luaL_register (L, LUACRYPTO_HMACNAME, hmac_functions);
+  luaL_register (L, LUACRYPTO_KDFNAME, kdf_functions);
   luaL_register (L, LUACRYPTO_PKEYNAME, pkey_functions);
+  luaL_register (L, LUACRYPTO_BASE64NAME, base64_functions);
+  luaL_register (L, LUACRYPTO_BUFFERNAME, buffer_functions);
+  luaL_register (L, LUACRYPTO_AEADNAME, aead_functions);
+  luaL_register (L, LUACRYPTO_ETMNAME, etm_functions);
+  luaL_register (L, LUACRYPTO_JOBNAME, job_functions);
+  luaL_register (L, LUACRYPTO_CHUNKERNAME, chunker_functions);
   
-  lua_pop (L, 3);
+  lua_pop (L, 10);
+
+  /* name -> handle caches */
+  lua_pushlightuserdata (L, &md_cache);
+  lua_newtable (L);
+  lua_rawset (L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata (L, &cipher_cache);
+  lua_newtable (L);
+  lua_rawset (L, LUA_REGISTRYINDEX);
 }
 
 /*
@@ -12,6 +12,8 @@
 
 #define LUACRYPTO_PREFIX      "LuaCrypto: "
 #define LUACRYPTO_CORENAME    "crypto"
+#define LUACRYPTO_MDNAME      "crypto.md"
+#define LUACRYPTO_CIPHERNAME  "crypto.cipher"
 #define LUACRYPTO_DIGESTNAME  "crypto.digest"
 #define LUACRYPTO_ENCRYPTNAME "crypto.encrypt"
 #define LUACRYPTO_DECRYPTNAME "crypto.decrypt"
@@ -21,9 +23,31 @@
 #define LUACRYPTO_SEALNAME    "crypto.seal"
 #define LUACRYPTO_OPENNAME    "crypto.open"
 */
+#define LUACRYPTO_AEADNAME    "crypto.aead"
+#define LUACRYPTO_SEALERNAME  "crypto.aead.sealer"
+#define LUACRYPTO_OPENERNAME  "crypto.aead.opener"
 #define LUACRYPTO_HMACNAME    "crypto.hmac"
+#define LUACRYPTO_FASTHASHNAME "crypto.fasthash"
+#define LUACRYPTO_KDFNAME     "crypto.kdf"
+#define LUACRYPTO_ETMNAME     "crypto.etm"
+#define LUACRYPTO_ETMVERIFYNAME "crypto.etm.verifier"
 #define LUACRYPTO_RANDNAME    "crypto.rand"
+#define LUACRYPTO_RANDPOOLNAME "crypto.rand.pool"
 #define LUACRYPTO_PKEYNAME    "crypto.pkey"
+#define LUACRYPTO_BUFFERNAME  "crypto.buffer"
+#define LUACRYPTO_CHUNKERNAME "crypto.chunker"
+#define LUACRYPTO_JOBNAME     "crypto.job"
+#define LUACRYPTO_JOBHANDLENAME "crypto.job.handle"
+#define LUACRYPTO_BASE64NAME  "crypto.base64"
+#define LUACRYPTO_BASE64ENCNAME "crypto.base64.encoder"
+#define LUACRYPTO_BASE64DECNAME "crypto.base64.decoder"
+
+/* growable byte buffer, the userdata behind crypto.buffer */
+typedef struct luacrypto_buffer {
+  unsigned char *data;
+  size_t len;
+  size_t capacity;
+} luacrypto_buffer;
 
 LUACRYPTO_API int luacrypto_createmeta (lua_State *L, const char *name, const luaL_reg *methods);
 LUACRYPTO_API void luacrypto_setmeta (lua_State *L, const char *name);
@@ -0,0 +1,264 @@
+/*
+** Multi-buffer SHA-1/SHA-256.
+** See Copyright Notice in license.html
+**
+** Each SIMD lane runs an independent message through the compression
+** function. Lanes are refilled from the input list as soon as their
+** message is done, so short messages of different lengths keep all
+** lanes busy. Kernels are written with GCC vector extensions and picked
+** at run time from the CPU features; without compiler support
+** mbsha_digest() just reports that no kernel is available.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mbsha.h"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define MBSHA_VECTOR 1
+#if defined(__x86_64__) || defined(__i386__)
+#define MBSHA_X86 1
+#endif
+#endif
+
+#ifdef MBSHA_VECTOR
+
+#define MBSHA_MAX_LANES 16
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha1_iv[5] = {
+  0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static uint32_t load_be32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* portable 128-bit kernel: SSE2 on x86-64, NEON/AltiVec elsewhere */
+#define MB_LANES 4
+#define MB_NAME(f) mb4_##f
+#define MB_TARGET
+#include "mbsha_kernel.h"
+#undef MB_LANES
+#undef MB_NAME
+#undef MB_TARGET
+
+#ifdef MBSHA_X86
+#define MB_LANES 8
+#define MB_NAME(f) mb8_##f
+#define MB_TARGET __attribute__((target("avx2")))
+#include "mbsha_kernel.h"
+#undef MB_LANES
+#undef MB_NAME
+#undef MB_TARGET
+
+#define MB_LANES 16
+#define MB_NAME(f) mb16_##f
+#define MB_TARGET __attribute__((target("avx512f")))
+#include "mbsha_kernel.h"
+#undef MB_LANES
+#undef MB_NAME
+#undef MB_TARGET
+#endif
+
+typedef void (*mb_blocks) (uint32_t *st, const unsigned char *const *blk);
+
+typedef struct mb_kernel {
+  const char *name;
+  int lanes;
+  mb_blocks sha1;
+  mb_blocks sha256;
+} mb_kernel;
+
+static const mb_kernel mb_kernels[] = {
+#ifdef MBSHA_X86
+  { "avx512", 16, mb16_sha1_blocks, mb16_sha256_blocks },
+  { "avx2", 8, mb8_sha1_blocks, mb8_sha256_blocks },
+  { "sse2", 4, mb4_sha1_blocks, mb4_sha256_blocks },
+#else
+  { "vec128", 4, mb4_sha1_blocks, mb4_sha256_blocks },
+#endif
+};
+
+#ifdef MBSHA_X86
+static const mb_kernel *mb_selected;
+
+static void mb_detect(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    mb_selected = &mb_kernels[0];
+  else if (__builtin_cpu_supports("avx2"))
+    mb_selected = &mb_kernels[1];
+  else
+    mb_selected = &mb_kernels[2];
+}
+
+/* probed once: digest.tree and the pool workers call in concurrently */
+#ifndef _WIN32
+#include <pthread.h>
+static pthread_once_t mb_once = PTHREAD_ONCE_INIT;
+
+static const mb_kernel *mb_select(void)
+{
+  pthread_once(&mb_once, mb_detect);
+  return mb_selected;
+}
+#else
+static const mb_kernel *mb_select(void)
+{
+  if (mb_selected == NULL)
+    mb_detect();
+  return mb_selected;
+}
+#endif
+#else
+#define mb_select() (&mb_kernels[0])
+#endif
+
+/* per-lane bookkeeping: which message it holds and how far it got */
+typedef struct mb_lane {
+  int busy;
+  const unsigned char *data;
+  unsigned char *out;
+  size_t block;
+  size_t full;      /* blocks read straight from the message */
+  size_t total;     /* full blocks plus the one or two padded tail blocks */
+  unsigned char tail[128];
+} mb_lane;
+
+static void mb_assign(mb_lane *lane, const unsigned char *data, size_t len, unsigned char *out)
+{
+  size_t rem = len % 64;
+  size_t tail_len = rem + 9 <= 64 ? 64 : 128;
+  uint64_t bits = (uint64_t)len << 3;
+  int i;
+
+  lane->busy = 1;
+  lane->data = data;
+  lane->out = out;
+  lane->block = 0;
+  lane->full = len / 64;
+  lane->total = lane->full + tail_len / 64;
+  memset(lane->tail, 0, sizeof lane->tail);
+  if (rem)
+    memcpy(lane->tail, data + len - rem, rem);
+  lane->tail[rem] = 0x80;
+  for (i = 0; i < 8; i++)
+    lane->tail[tail_len - 1 - i] = (unsigned char)(bits >> (8*i));
+}
+
+static void mb_run(const mb_kernel *k, int alg, size_t n, const unsigned char *const *data,
+                   const size_t *len, unsigned char *out)
+{
+  static const unsigned char zero[64] = {0};
+  const uint32_t *iv = alg == MBSHA_SHA256 ? sha256_iv : sha1_iv;
+  int words = alg == MBSHA_SHA256 ? 8 : 5;
+  mb_blocks fn = alg == MBSHA_SHA256 ? k->sha256 : k->sha1;
+  uint32_t st[8 * MBSHA_MAX_LANES];
+  const unsigned char *blk[MBSHA_MAX_LANES];
+  mb_lane lanes[MBSHA_MAX_LANES];
+  size_t next = 0;
+  int active = 0;
+  int l, i;
+
+  for (l = 0; l < k->lanes; l++)
+    lanes[l].busy = 0;
+
+  for (;;) {
+    /* refill idle lanes with the next messages */
+    for (l = 0; l < k->lanes && next < n; l++) {
+      if (lanes[l].busy)
+        continue;
+      mb_assign(&lanes[l], data[next], len[next], out + next * (size_t)(4*words));
+      for (i = 0; i < words; i++)
+        st[i*k->lanes + l] = iv[i];
+      next++;
+      active++;
+    }
+    if (active == 0)
+      break;
+
+    for (l = 0; l < k->lanes; l++) {
+      mb_lane *lane = &lanes[l];
+      if (!lane->busy)
+        blk[l] = zero;
+      else if (lane->block < lane->full)
+        blk[l] = lane->data + 64*lane->block;
+      else
+        blk[l] = lane->tail + 64*(lane->block - lane->full);
+    }
+    fn(st, blk);
+
+    for (l = 0; l < k->lanes; l++) {
+      mb_lane *lane = &lanes[l];
+      if (!lane->busy || ++lane->block < lane->total)
+        continue;
+      for (i = 0; i < words; i++) {
+        uint32_t v = st[i*k->lanes + l];
+        lane->out[4*i] = (unsigned char)(v >> 24);
+        lane->out[4*i + 1] = (unsigned char)(v >> 16);
+        lane->out[4*i + 2] = (unsigned char)(v >> 8);
+        lane->out[4*i + 3] = (unsigned char)v;
+      }
+      lane->busy = 0;
+      active--;
+    }
+  }
+}
+
+int mbsha_lanes(void)
+{
+  return mb_select()->lanes;
+}
+
+const char *mbsha_kernel(void)
+{
+  return mb_select()->name;
+}
+
+int mbsha_digest(int alg, size_t n, const unsigned char *const *data,
+                 const size_t *len, unsigned char *out)
+{
+  if (alg != MBSHA_SHA1 && alg != MBSHA_SHA256)
+    return 0;
+  mb_run(mb_select(), alg, n, data, len, out);
+  return 1;
+}
+
+#else
+
+int mbsha_lanes(void)
+{
+  return 0;
+}
+
+const char *mbsha_kernel(void)
+{
+  return NULL;
+}
+
+int mbsha_digest(int alg, size_t n, const unsigned char *const *data,
+                 const size_t *len, unsigned char *out)
+{
+  (void)alg; (void)n; (void)data; (void)len; (void)out;
+  return 0;
+}
+
+#endif
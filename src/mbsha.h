@@ -0,0 +1,35 @@
+/*
+** Multi-buffer SHA-1/SHA-256.
+** Hashes independent messages in parallel, one message per SIMD lane.
+** See Copyright Notice in license.html
+*/
+
+#ifndef _LUACRYPTO_MBSHA_
+#define _LUACRYPTO_MBSHA_
+
+#include <stddef.h>
+
+#define MBSHA_SHA1    1
+#define MBSHA_SHA256  2
+
+/*
+** Returns the number of lanes of the kernel selected for this CPU,
+** or 0 if no multi-buffer kernel is available.
+*/
+int mbsha_lanes (void);
+
+/*
+** Returns the name of the kernel selected for this CPU ("avx512",
+** "avx2", "sse2", "vec128"), or NULL if none is available.
+*/
+const char *mbsha_kernel (void);
+
+/*
+** Hashes the n messages data[i] of len[i] bytes, writing the packed
+** digests (20 bytes for SHA-1, 32 for SHA-256) to out. Returns 0 if
+** no multi-buffer kernel is available, in which case nothing is written.
+*/
+int mbsha_digest (int alg, size_t n, const unsigned char *const *data,
+                  const size_t *len, unsigned char *out);
+
+#endif
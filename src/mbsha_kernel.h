@@ -0,0 +1,108 @@
+/*
+** Multi-buffer SHA-1/SHA-256 block functions, instantiated by mbsha.c
+** once per lane width. Before including this file define:
+**   MB_LANES   number of 32-bit lanes of the vector type
+**   MB_NAME(f) function name mangling for this width
+**   MB_TARGET  function attributes enabling the instruction set (may be empty)
+** See Copyright Notice in license.html
+*/
+
+typedef uint32_t MB_NAME(vec) __attribute__((vector_size(4 * MB_LANES)));
+
+#define V     MB_NAME(vec)
+#define ROL(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+/*
+** Loads word t of every lane's block, converting from big endian.
+*/
+MB_TARGET static V MB_NAME(load_word) (const unsigned char *const *blk, int t)
+{
+  uint32_t w[MB_LANES];
+  V v;
+  int l;
+  for (l = 0; l < MB_LANES; l++)
+    w[l] = load_be32(blk[l] + 4*t);
+  memcpy(&v, w, sizeof v);
+  return v;
+}
+
+/*
+** Compresses one 64-byte block per lane into the transposed state
+** st[word * MB_LANES + lane].
+*/
+MB_TARGET static void MB_NAME(sha256_blocks) (uint32_t *st, const unsigned char *const *blk)
+{
+  V a, b, c, d, e, f, g, h, t1, t2;
+  V w[16];
+  int t;
+
+  memcpy(&a, st + 0*MB_LANES, sizeof a);
+  memcpy(&b, st + 1*MB_LANES, sizeof b);
+  memcpy(&c, st + 2*MB_LANES, sizeof c);
+  memcpy(&d, st + 3*MB_LANES, sizeof d);
+  memcpy(&e, st + 4*MB_LANES, sizeof e);
+  memcpy(&f, st + 5*MB_LANES, sizeof f);
+  memcpy(&g, st + 6*MB_LANES, sizeof g);
+  memcpy(&h, st + 7*MB_LANES, sizeof h);
+
+  for (t = 0; t < 64; t++) {
+    if (t < 16)
+      w[t] = MB_NAME(load_word)(blk, t);
+    else {
+      V w2 = w[(t - 2) & 15], w15 = w[(t - 15) & 15];
+      w[t & 15] += (ROR(w2, 17) ^ ROR(w2, 19) ^ (w2 >> 10))
+                 + w[(t - 7) & 15]
+                 + (ROR(w15, 7) ^ ROR(w15, 18) ^ (w15 >> 3));
+    }
+    t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g))
+           + sha256_k[t] + w[t & 15];
+    t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+
+#define MB_ADD(i, x) do { V s_; memcpy(&s_, st + (i)*MB_LANES, sizeof s_); \
+    s_ += (x); memcpy(st + (i)*MB_LANES, &s_, sizeof s_); } while (0)
+  MB_ADD(0, a); MB_ADD(1, b); MB_ADD(2, c); MB_ADD(3, d);
+  MB_ADD(4, e); MB_ADD(5, f); MB_ADD(6, g); MB_ADD(7, h);
+}
+
+MB_TARGET static void MB_NAME(sha1_blocks) (uint32_t *st, const unsigned char *const *blk)
+{
+  V a, b, c, d, e, tmp;
+  V w[16];
+  int t;
+
+  memcpy(&a, st + 0*MB_LANES, sizeof a);
+  memcpy(&b, st + 1*MB_LANES, sizeof b);
+  memcpy(&c, st + 2*MB_LANES, sizeof c);
+  memcpy(&d, st + 3*MB_LANES, sizeof d);
+  memcpy(&e, st + 4*MB_LANES, sizeof e);
+
+  for (t = 0; t < 80; t++) {
+    if (t < 16)
+      w[t] = MB_NAME(load_word)(blk, t);
+    else {
+      tmp = w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15];
+      w[t & 15] = ROL(tmp, 1);
+    }
+    if (t < 20)
+      tmp = ((b & c) | (~b & d)) + 0x5a827999u;
+    else if (t < 40)
+      tmp = (b ^ c ^ d) + 0x6ed9eba1u;
+    else if (t < 60)
+      tmp = ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdcu;
+    else
+      tmp = (b ^ c ^ d) + 0xca62c1d6u;
+    tmp += ROL(a, 5) + e + w[t & 15];
+    e = d; d = c; c = ROL(b, 30); b = a; a = tmp;
+  }
+
+  MB_ADD(0, a); MB_ADD(1, b); MB_ADD(2, c); MB_ADD(3, d); MB_ADD(4, e);
+#undef MB_ADD
+}
+
+#undef V
+#undef ROL
+#undef ROR
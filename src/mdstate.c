@@ -0,0 +1,187 @@
+/*
+** Serialized intermediate state of MD5, SHA-1 and SHA-2 digests.
+** See Copyright Notice in license.html
+**
+** The low-level contexts count the message in bits, split over two
+** words (Nl and Nh), and keep the incomplete block as bytes at the start
+** of their data array, num of them.
+*/
+
+#include <string.h>
+#include <openssl/md5.h>
+#include <openssl/objects.h>
+#include <openssl/sha.h>
+
+#include "mdstate.h"
+
+#define MDSTATE_VERSION 1
+
+enum { MDSTATE_MD5 = 1, MDSTATE_SHA1, MDSTATE_SHA224, MDSTATE_SHA256, MDSTATE_SHA384, MDSTATE_SHA512 };
+
+static int mdstate_alg(int nid)
+{
+  switch (nid) {
+  case NID_md5: return MDSTATE_MD5;
+  case NID_sha1: return MDSTATE_SHA1;
+  case NID_sha224: return MDSTATE_SHA224;
+  case NID_sha256: return MDSTATE_SHA256;
+  case NID_sha384: return MDSTATE_SHA384;
+  case NID_sha512: return MDSTATE_SHA512;
+  }
+  return 0;
+}
+
+int mdstate_supported(int nid)
+{
+  return mdstate_alg(nid) != 0;
+}
+
+static unsigned char *mdstate_put(unsigned char *p, unsigned long long v, int bytes)
+{
+  int i;
+  for (i = bytes - 1; i >= 0; i--) {
+    p[i] = (unsigned char)v;
+    v >>= 8;
+  }
+  return p + bytes;
+}
+
+static const unsigned char *mdstate_get(const unsigned char *p, unsigned long long *v, int bytes)
+{
+  int i;
+  *v = 0;
+  for (i = 0; i < bytes; i++)
+    *v = (*v << 8) | p[i];
+  return p + bytes;
+}
+
+size_t mdstate_export(int nid, const void *md_data, unsigned char *out)
+{
+  int alg = mdstate_alg(nid);
+  unsigned char *p = out;
+  unsigned long long count;
+  int i;
+
+  if (alg == 0)
+    return 0;
+  *p++ = MDSTATE_VERSION;
+  *p++ = (unsigned char)alg;
+  switch (alg) {
+  case MDSTATE_MD5: {
+    const MD5_CTX *c = md_data;
+    count = ((unsigned long long)c->Nh << 32 | c->Nl) >> 3;
+    p = mdstate_put(p, count, 8);
+    p = mdstate_put(p, c->A, 4);
+    p = mdstate_put(p, c->B, 4);
+    p = mdstate_put(p, c->C, 4);
+    p = mdstate_put(p, c->D, 4);
+    memcpy(p, c->data, c->num);
+    return p + c->num - out;
+  }
+  case MDSTATE_SHA1: {
+    const SHA_CTX *c = md_data;
+    count = ((unsigned long long)c->Nh << 32 | c->Nl) >> 3;
+    p = mdstate_put(p, count, 8);
+    p = mdstate_put(p, c->h0, 4);
+    p = mdstate_put(p, c->h1, 4);
+    p = mdstate_put(p, c->h2, 4);
+    p = mdstate_put(p, c->h3, 4);
+    p = mdstate_put(p, c->h4, 4);
+    memcpy(p, c->data, c->num);
+    return p + c->num - out;
+  }
+  case MDSTATE_SHA224:
+  case MDSTATE_SHA256: {
+    const SHA256_CTX *c = md_data;
+    count = ((unsigned long long)c->Nh << 32 | c->Nl) >> 3;
+    p = mdstate_put(p, count, 8);
+    for (i = 0; i < 8; i++)
+      p = mdstate_put(p, c->h[i], 4);
+    memcpy(p, c->data, c->num);
+    return p + c->num - out;
+  }
+  default: {
+    const SHA512_CTX *c = md_data;
+    /* byte counts of 2^64 and beyond are not representable */
+    if (c->Nh >> 3 != 0)
+      return 0;
+    count = (unsigned long long)c->Nh << 61 | c->Nl >> 3;
+    p = mdstate_put(p, count, 8);
+    for (i = 0; i < 8; i++)
+      p = mdstate_put(p, c->h[i], 8);
+    memcpy(p, c->u.p, c->num);
+    return p + c->num - out;
+  }
+  }
+}
+
+int mdstate_import(int nid, void *md_data, const unsigned char *in, size_t len)
+{
+  int alg = mdstate_alg(nid);
+  const unsigned char *p = in + 10;
+  unsigned long long count, v;
+  size_t words, block, num;
+  int i;
+
+  if (alg == 0 || len < 10 || in[0] != MDSTATE_VERSION || in[1] != alg)
+    return 0;
+  mdstate_get(in + 2, &count, 8);
+  words = alg == MDSTATE_MD5 ? 16 : alg == MDSTATE_SHA1 ? 20 : alg <= MDSTATE_SHA256 ? 32 : 64;
+  block = alg <= MDSTATE_SHA256 ? 64 : 128;
+  num = (size_t)(count % block);
+  /* the bit count must fit in the 64 bits of MD5, SHA-1 and SHA-256 */
+  if (len != 10 + words + num || (block == 64 && count >> 61 != 0))
+    return 0;
+  switch (alg) {
+  case MDSTATE_MD5: {
+    MD5_CTX *c = md_data;
+    p = mdstate_get(p, &v, 4); c->A = (MD5_LONG)v;
+    p = mdstate_get(p, &v, 4); c->B = (MD5_LONG)v;
+    p = mdstate_get(p, &v, 4); c->C = (MD5_LONG)v;
+    p = mdstate_get(p, &v, 4); c->D = (MD5_LONG)v;
+    c->Nl = (MD5_LONG)(count << 3);
+    c->Nh = (MD5_LONG)(count >> 29);
+    memcpy(c->data, p, num);
+    c->num = (unsigned int)num;
+    return 1;
+  }
+  case MDSTATE_SHA1: {
+    SHA_CTX *c = md_data;
+    p = mdstate_get(p, &v, 4); c->h0 = (SHA_LONG)v;
+    p = mdstate_get(p, &v, 4); c->h1 = (SHA_LONG)v;
+    p = mdstate_get(p, &v, 4); c->h2 = (SHA_LONG)v;
+    p = mdstate_get(p, &v, 4); c->h3 = (SHA_LONG)v;
+    p = mdstate_get(p, &v, 4); c->h4 = (SHA_LONG)v;
+    c->Nl = (SHA_LONG)(count << 3);
+    c->Nh = (SHA_LONG)(count >> 29);
+    memcpy(c->data, p, num);
+    c->num = (unsigned int)num;
+    return 1;
+  }
+  case MDSTATE_SHA224:
+  case MDSTATE_SHA256: {
+    SHA256_CTX *c = md_data;
+    for (i = 0; i < 8; i++) {
+      p = mdstate_get(p, &v, 4);
+      c->h[i] = (SHA_LONG)v;
+    }
+    c->Nl = (SHA_LONG)(count << 3);
+    c->Nh = (SHA_LONG)(count >> 29);
+    memcpy(c->data, p, num);
+    c->num = (unsigned int)num;
+    return 1;
+  }
+  default: {
+    SHA512_CTX *c = md_data;
+    for (i = 0; i < 8; i++) {
+      p = mdstate_get(p, &v, 8);
+      c->h[i] = v;
+    }
+    c->Nl = count << 3;
+    c->Nh = count >> 61;
+    memcpy(c->u.p, p, num);
+    c->num = (unsigned int)num;
+    return 1;
+  }
+  }
+}
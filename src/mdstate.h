@@ -0,0 +1,43 @@
+/*
+** Serialized intermediate state of MD5, SHA-1 and SHA-2 digests.
+** See Copyright Notice in license.html
+**
+** The state is written field by field in a fixed byte order, so it can
+** be saved and resumed by another process, on another machine or with
+** another OpenSSL version:
+**
+**   version (1 byte, 1), algorithm (1 byte),
+**   bytes hashed so far (8 bytes, big-endian),
+**   chaining value (4 to 8 words, big-endian),
+**   bytes of the incomplete block (the byte count modulo the block size)
+*/
+
+#ifndef _LUACRYPTO_MDSTATE_
+#define _LUACRYPTO_MDSTATE_
+
+#include <stddef.h>
+
+/* longest state: SHA-512 with 127 pending bytes */
+#define MDSTATE_MAX_LEN (10 + 64 + 127)
+
+/*
+** Returns nonzero if states of the digest with the given NID can be
+** exported and imported.
+*/
+int mdstate_supported (int nid);
+
+/*
+** Writes the state held in md_data, the low-level context of a digest
+** of the given NID, to out. Returns its length, or 0 if the digest is
+** not supported.
+*/
+size_t mdstate_export (int nid, const void *md_data, unsigned char *out);
+
+/*
+** Loads a state written by mdstate_export into md_data, a context just
+** initialized for the digest with the given NID. Returns 0 if the state
+** is malformed or belongs to another digest.
+*/
+int mdstate_import (int nid, void *md_data, const unsigned char *in, size_t len);
+
+#endif
@@ -0,0 +1,458 @@
+/*
+** Process-wide worker thread pool.
+** See Copyright Notice in license.html
+**
+** Workers are started on demand and then wait for jobs on a single
+** FIFO queue. pool_for queues helper jobs that pull indices from a
+** shared atomic counter while the caller does the same, so the caller never
+** waits for a helper that has not started: once the indices run out it
+** takes its unstarted helpers back off the queue.
+**
+** Async jobs share the queue; whoever waits for one sleeps on a single
+** condition broadcast whenever any of them completes.
+**
+** Workers live until the process exits, so the first one pins this
+** module: unloading it (lua_close does) would pull their code away.
+** With OpenSSL before 1.1 the first one also installs the locking
+** callbacks every job relies on.
+**
+** A forked child has none of the workers, so it starts with an empty
+** pool that grows again on first use. Jobs queued or running at the
+** fork are dropped from the child's queue and never complete there.
+*/
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* dladdr */
+#endif
+
+#include <errno.h>
+
+#include "pool.h"
+
+#ifndef _WIN32
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#include <openssl/crypto.h>
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_finished = PTHREAD_COND_INITIALIZER;
+static pool_job *pool_head = NULL;
+static pool_job *pool_tail = NULL;
+static int pool_workers = 0;
+static int pool_pinned = 0;     /* 1 once pinned, -1 if it cannot be */
+static unsigned pool_generation = 0;  /* bumped in every forked child */
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/*
+** OpenSSL before 1.1 is only thread safe with locking callbacks. They
+** are left alone if the host application installed its own.
+*/
+static pthread_mutex_t *pool_ssl_locks;
+
+static void pool_ssl_lock(int mode, int n, const char *file, int line)
+{
+  (void)file;
+  (void)line;
+  if (mode & CRYPTO_LOCK)
+    pthread_mutex_lock(&pool_ssl_locks[n]);
+  else
+    pthread_mutex_unlock(&pool_ssl_locks[n]);
+}
+
+static unsigned long pool_ssl_thread_id(void)
+{
+  return (unsigned long)pthread_self();
+}
+
+static void pool_ssl_init(void)
+{
+  int i, n = CRYPTO_num_locks();
+  if (CRYPTO_get_locking_callback() != NULL || pool_ssl_locks != NULL)
+    return;
+  pool_ssl_locks = malloc(n * sizeof(pthread_mutex_t));
+  if (pool_ssl_locks == NULL)
+    return;
+  for (i = 0; i < n; i++)
+    pthread_mutex_init(&pool_ssl_locks[i], NULL);
+  CRYPTO_set_id_callback(pool_ssl_thread_id);
+  CRYPTO_set_locking_callback(pool_ssl_lock);
+}
+
+/* the child's only thread owns nothing: locks held by others are reset */
+static void pool_ssl_atfork(void)
+{
+  int i, n = CRYPTO_num_locks();
+  if (pool_ssl_locks != NULL)
+    for (i = 0; i < n; i++)
+      pthread_mutex_init(&pool_ssl_locks[i], NULL);
+}
+#else
+#define pool_ssl_init() ((void)0)
+#define pool_ssl_atfork() ((void)0)
+#endif
+
+/*
+** The lock is held across fork so the child gets a consistent queue,
+** which it then drops along with the workers that served it. Jobs
+** left unfinished are recognized by their older generation.
+*/
+static void pool_prefork(void)
+{
+  pthread_mutex_lock(&pool_lock);
+}
+
+static void pool_postfork_parent(void)
+{
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static void pool_postfork_child(void)
+{
+  pthread_mutex_init(&pool_lock, NULL);
+  pthread_cond_init(&pool_work, NULL);
+  pthread_cond_init(&pool_finished, NULL);
+  pool_head = pool_tail = NULL;
+  pool_workers = 0;
+  pool_generation++;
+  pool_ssl_atfork();
+}
+
+int pool_cpus(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : n > POOL_MAX_THREADS ? POOL_MAX_THREADS : (int)n;
+}
+
+static void *pool_worker(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    pool_job *job;
+    while (pool_head == NULL)
+      pthread_cond_wait(&pool_work, &pool_lock);
+    job = pool_head;
+    pool_head = job->next;
+    if (pool_head == NULL)
+      pool_tail = NULL;
+    pthread_mutex_unlock(&pool_lock);
+    job->run(job);
+    pthread_mutex_lock(&pool_lock);
+  }
+  return NULL;
+}
+
+/*
+** Pins this module and installs the OpenSSL callbacks and the fork
+** handlers, once, before the first worker starts. All of them point
+** into the module's code, so none is installed unless the pin holds.
+** Called with the lock held.
+*/
+static int pool_pin(void)
+{
+  if (pool_pinned == 0) {
+    Dl_info info;
+    pool_pinned = dladdr((void *)pool_worker, &info) && info.dli_fname != NULL
+               && dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE) != NULL ? 1 : -1;
+    if (pool_pinned == 1) {
+      pool_ssl_init();
+      pthread_atfork(pool_prefork, pool_postfork_parent, pool_postfork_child);
+    }
+  }
+  return pool_pinned == 1;
+}
+
+/*
+** Starts workers until there are n of them. Called with the lock held.
+** Failing to start one is not an error, the caller just gets less help;
+** if the module cannot be pinned everything runs on the caller.
+*/
+static void pool_grow(int n)
+{
+  if (n > pool_workers && !pool_pin())
+    return;
+  while (pool_workers < n && pool_workers < POOL_MAX_THREADS) {
+    pthread_t t;
+    pthread_attr_t attr;
+    int failed;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    failed = pthread_create(&t, &attr, pool_worker, NULL);
+    pthread_attr_destroy(&attr);
+    if (failed)
+      break;
+    pool_workers++;
+  }
+}
+
+/* called with the lock held */
+static void pool_push(pool_job *job)
+{
+  job->next = NULL;
+  if (pool_tail)
+    pool_tail->next = job;
+  else
+    pool_head = job;
+  pool_tail = job;
+  pthread_cond_signal(&pool_work);
+}
+
+typedef struct pool_batch pool_batch;
+
+/* a queued helper of a pool_for call; the job comes first so it can be cast back */
+typedef struct pool_helper {
+  pool_job job;
+  pool_batch *batch;
+} pool_helper;
+
+struct pool_batch {
+  pool_helper helpers[POOL_MAX_THREADS - 1];
+  int nhelpers;
+  int pending;          /* helpers queued or running */
+  size_t next, n;       /* next is handed out atomically, without the lock */
+  void (*fn) (void *ud, size_t i);
+  void *ud;
+  pthread_cond_t done;
+};
+
+/*
+** Runs items until none are left. The counter may overshoot n by one
+** per thread; the results reach the caller through the lock it waits
+** on, so the increment itself needs no ordering.
+*/
+static void pool_batch_loop(pool_batch *b)
+{
+  for (;;) {
+    size_t i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+    if (i >= b->n)
+      break;
+    b->fn(b->ud, i);
+  }
+}
+
+static void pool_batch_helper(pool_job *job)
+{
+  pool_batch *b = ((pool_helper *)job)->batch;
+  pool_batch_loop(b);
+  pthread_mutex_lock(&pool_lock);
+  if (--b->pending == 0)
+    pthread_cond_signal(&b->done);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void pool_for(int threads, size_t n, void (*fn) (void *ud, size_t i), void *ud)
+{
+  pool_batch b;
+  pool_job **p;
+  int k;
+
+  if (threads > POOL_MAX_THREADS)
+    threads = POOL_MAX_THREADS;
+  if ((size_t)threads > n)
+    threads = (int)n;
+  if (threads <= 1) {
+    size_t i;
+    for (i = 0; i < n; i++)
+      fn(ud, i);
+    return;
+  }
+
+  b.nhelpers = threads - 1;
+  b.pending = b.nhelpers;
+  b.next = 0;
+  b.n = n;
+  b.fn = fn;
+  b.ud = ud;
+  pthread_cond_init(&b.done, NULL);
+
+  pthread_mutex_lock(&pool_lock);
+  pool_grow(b.nhelpers);
+  for (k = 0; k < b.nhelpers; k++) {
+    b.helpers[k].job.run = pool_batch_helper;
+    b.helpers[k].batch = &b;
+    pool_push(&b.helpers[k].job);
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  pool_batch_loop(&b);
+
+  /* take back the helpers nobody picked up, then wait for the others */
+  pthread_mutex_lock(&pool_lock);
+  pool_tail = NULL;
+  for (p = &pool_head; *p != NULL; ) {
+    if ((*p)->run == pool_batch_helper && ((pool_helper *)*p)->batch == &b) {
+      *p = (*p)->next;
+      b.pending--;
+    } else {
+      pool_tail = *p;
+      p = &(*p)->next;
+    }
+  }
+  while (b.pending > 0)
+    pthread_cond_wait(&b.done, &pool_lock);
+  pthread_mutex_unlock(&pool_lock);
+  pthread_cond_destroy(&b.done);
+}
+
+/* called with the lock held */
+static void pool_async_signal(pool_async *a)
+{
+  uint64_t one = 1;
+  ssize_t n;
+  do {
+    n = write(a->fd[1], &one, a->fd[0] == a->fd[1] ? sizeof(one) : 1);
+  } while (n < 0 && errno == EINTR);
+}
+
+static void pool_async_run(pool_job *job)
+{
+  pool_async *a = (pool_async *)job;
+  a->fn(a);
+  pthread_mutex_lock(&pool_lock);
+  a->done = 1;
+  if (a->fd[1] >= 0)
+    pool_async_signal(a);
+  pthread_cond_broadcast(&pool_finished);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/* called with the lock held: unfinished, and submitted before a fork */
+#define pool_async_lost(a) (!(a)->done && (a)->generation != pool_generation)
+
+void pool_async_submit(pool_async *a, void (*fn) (pool_async *a))
+{
+  a->fn = fn;
+  a->done = 0;
+  a->fd[0] = a->fd[1] = -1;
+  a->job.run = pool_async_run;
+  pthread_mutex_lock(&pool_lock);
+  a->generation = pool_generation;
+  pool_grow(pool_cpus());
+  if (pool_workers == 0) {
+    /* no thread could be started: run it now */
+    pthread_mutex_unlock(&pool_lock);
+    pool_async_run(&a->job);
+    return;
+  }
+  pool_push(&a->job);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+int pool_async_done(pool_async *a)
+{
+  int done;
+  pthread_mutex_lock(&pool_lock);
+  done = a->done || pool_async_lost(a);
+  pthread_mutex_unlock(&pool_lock);
+  return done;
+}
+
+int pool_async_wait(pool_async *a)
+{
+  int done;
+  pthread_mutex_lock(&pool_lock);
+  while (!a->done && !pool_async_lost(a))
+    pthread_cond_wait(&pool_finished, &pool_lock);
+  done = a->done;
+  pthread_mutex_unlock(&pool_lock);
+  return done;
+}
+
+int pool_async_fd(pool_async *a)
+{
+  int fd;
+  pthread_mutex_lock(&pool_lock);
+  if (pool_async_lost(a)) {
+    /* an inherited descriptor is shared with the parent's worker */
+    pthread_mutex_unlock(&pool_lock);
+    errno = ECANCELED;
+    return -1;
+  }
+  if (a->fd[0] < 0) {
+#if defined(__linux__)
+    a->fd[0] = a->fd[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+#else
+    if (pipe(a->fd) == 0) {
+      int i;
+      for (i = 0; i < 2; i++) {
+        fcntl(a->fd[i], F_SETFD, FD_CLOEXEC);
+        fcntl(a->fd[i], F_SETFL, fcntl(a->fd[i], F_GETFL) | O_NONBLOCK);
+      }
+    } else
+      a->fd[0] = a->fd[1] = -1;
+#endif
+    if (a->fd[0] >= 0 && a->done)
+      pool_async_signal(a);
+  }
+  fd = a->fd[0];
+  pthread_mutex_unlock(&pool_lock);
+  return fd;
+}
+
+void pool_async_cleanup(pool_async *a)
+{
+  pool_async_wait(a);
+  if (a->fd[0] >= 0)
+    close(a->fd[0]);
+  if (a->fd[1] >= 0 && a->fd[1] != a->fd[0])
+    close(a->fd[1]);
+  a->fd[0] = a->fd[1] = -1;
+}
+
+#else
+
+int pool_cpus(void)
+{
+  return 1;
+}
+
+void pool_for(int threads, size_t n, void (*fn) (void *ud, size_t i), void *ud)
+{
+  size_t i;
+  (void)threads;
+  for (i = 0; i < n; i++)
+    fn(ud, i);
+}
+
+void pool_async_submit(pool_async *a, void (*fn) (pool_async *a))
+{
+  a->fn = fn;
+  a->generation = 0;
+  a->fd[0] = a->fd[1] = -1;
+  fn(a);
+  a->done = 1;
+}
+
+int pool_async_done(pool_async *a)
+{
+  return a->done;
+}
+
+int pool_async_wait(pool_async *a)
+{
+  (void)a;
+  return 1;
+}
+
+int pool_async_fd(pool_async *a)
+{
+  (void)a;
+  errno = ENOSYS;
+  return -1;
+}
+
+void pool_async_cleanup(pool_async *a)
+{
+  (void)a;
+}
+
+#endif
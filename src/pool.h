@@ -0,0 +1,70 @@
+/*
+** Process-wide worker thread pool.
+** See Copyright Notice in license.html
+**
+** Workers never touch a Lua state: they only run native jobs handed to
+** them by the bindings. Without thread support everything runs on the
+** calling thread.
+*/
+
+#ifndef _LUACRYPTO_POOL_
+#define _LUACRYPTO_POOL_
+
+#include <stddef.h>
+
+/* upper bound on worker threads, and on the threads of one pool_for */
+#define POOL_MAX_THREADS 64
+
+typedef struct pool_job {
+  void (*run) (struct pool_job *job);
+  struct pool_job *next;
+} pool_job;
+
+/*
+** Number of online processors, at least 1.
+*/
+int pool_cpus (void);
+
+/*
+** Calls fn(ud, i) for every i in [0, n), spread over up to threads
+** threads including the caller, and returns when all calls are done.
+*/
+void pool_for (int threads, size_t n, void (*fn) (void *ud, size_t i), void *ud);
+
+/*
+** A job the caller does not wait for: once submitted, fn runs on a
+** worker and completion can be polled, waited for, or watched through
+** a file descriptor from an event loop. A job still queued or running
+** when the process forks never completes in the child, whose pool
+** starts empty: there it counts as done and waiting returns at once.
+*/
+typedef struct pool_async {
+  pool_job job;
+  void (*fn) (struct pool_async *a);
+  int done;
+  unsigned generation;  /* fork generation it was submitted in */
+  int fd[2];            /* read and write end of the completion signal, -1 until asked for */
+} pool_async;
+
+void pool_async_submit (pool_async *a, void (*fn) (pool_async *a));
+
+/* nonzero once fn has returned, or in a child the job was lost to */
+int pool_async_done (pool_async *a);
+
+/* returns 1 once fn has returned, 0 if the job was lost to a fork */
+int pool_async_wait (pool_async *a);
+
+/*
+** Returns a descriptor that becomes readable when the job is done (an
+** eventfd on Linux, a pipe elsewhere), or -1 with errno set; ECANCELED
+** for a job lost to a fork.
+*/
+int pool_async_fd (pool_async *a);
+
+/*
+** Waits for the job and releases the descriptor. Must be called before
+** the memory of a submitted job is reused.
+*/
+void pool_async_cleanup (pool_async *a);
+
+#endif
@@ -0,0 +1,164 @@
+/*
+** Parallel Merkle tree hashing.
+** See Copyright Notice in license.html
+**
+** Whole chunks are hashed as leaves in batches spread over the thread
+** pool; the leaf hashes are then pushed in order onto a stack of
+** subtree roots, merging equal sized subtrees as they complete, so
+** memory stays bounded for inputs of any length. Bytes are copied only
+** for a chunk that straddles two updates.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "treehash.h"
+
+/* leaves hashed per pool_for call */
+#define TREEHASH_BATCH 1024
+
+static int treehash_node(EVP_MD_CTX *c, const EVP_MD *md, unsigned char prefix,
+                         const unsigned char *a, size_t alen,
+                         const unsigned char *b, size_t blen, unsigned char *out)
+{
+  return EVP_DigestInit_ex(c, md, NULL)
+      && EVP_DigestUpdate(c, &prefix, 1)
+      && EVP_DigestUpdate(c, a, alen)
+      && (blen == 0 || EVP_DigestUpdate(c, b, blen))
+      && EVP_DigestFinal_ex(c, out, NULL);
+}
+
+/*
+** Pushes the hash of the next leaf, merging the subtrees it completes.
+*/
+static int treehash_push(treehash *t, const unsigned char *leaf)
+{
+  size_t size = EVP_MD_size(t->md);
+  uint64_t n;
+
+  memcpy(t->stack[t->depth++], leaf, size);
+  for (n = ++t->leaves; (n & 1) == 0; n >>= 1) {
+    if (!treehash_node(t->ctx, t->md, 1, t->stack[t->depth - 2], size,
+                       t->stack[t->depth - 1], size, t->stack[t->depth - 2]))
+      return 0;
+    t->depth--;
+  }
+  return 1;
+}
+
+typedef struct treehash_batch {
+  treehash *t;
+  const unsigned char *data;
+  volatile int failed;
+} treehash_batch;
+
+static void treehash_leaf(void *ud, size_t i)
+{
+  treehash_batch *b = ud;
+  treehash *t = b->t;
+  EVP_MD_CTX *c = EVP_MD_CTX_create();
+  if (c == NULL || !treehash_node(c, t->md, 0, b->data + i * t->chunk, t->chunk, NULL, 0,
+                                  t->hashes + i * EVP_MD_size(t->md)))
+    b->failed = 1;
+  if (c != NULL)
+    EVP_MD_CTX_destroy(c);
+}
+
+/*
+** Hashes n whole chunks starting at data and pushes their leaves.
+*/
+static int treehash_chunks(treehash *t, const unsigned char *data, size_t n)
+{
+  size_t size = EVP_MD_size(t->md);
+  while (n > 0) {
+    size_t k = n < TREEHASH_BATCH ? n : TREEHASH_BATCH;
+    treehash_batch b;
+    size_t i;
+
+    b.t = t;
+    b.data = data;
+    b.failed = 0;
+    pool_for(t->threads, k, treehash_leaf, &b);
+    if (b.failed)
+      return 0;
+    for (i = 0; i < k; i++)
+      if (!treehash_push(t, t->hashes + i * size))
+        return 0;
+    data += k * t->chunk;
+    n -= k;
+  }
+  return 1;
+}
+
+int treehash_init(treehash *t, const EVP_MD *md, size_t chunk, int threads)
+{
+  memset(t, 0, sizeof(*t));
+  t->md = md;
+  t->chunk = chunk;
+  t->threads = threads < 1 ? 1 : threads;
+  t->ctx = EVP_MD_CTX_create();
+  t->hashes = malloc(TREEHASH_BATCH * (size_t)EVP_MD_size(md));
+  return t->ctx != NULL && t->hashes != NULL;
+}
+
+int treehash_update(treehash *t, const unsigned char *data, size_t len)
+{
+  if (t->pending_len > 0) {
+    size_t take = t->chunk - t->pending_len < len ? t->chunk - t->pending_len : len;
+    memcpy(t->pending + t->pending_len, data, take);
+    t->pending_len += take;
+    data += take;
+    len -= take;
+    if (t->pending_len < t->chunk)
+      return 1;
+    t->pending_len = 0;
+    if (!treehash_node(t->ctx, t->md, 0, t->pending, t->chunk, NULL, 0, t->hashes)
+        || !treehash_push(t, t->hashes))
+      return 0;
+  }
+  if (!treehash_chunks(t, data, len / t->chunk))
+    return 0;
+  data += len / t->chunk * t->chunk;
+  len %= t->chunk;
+  if (len > 0) {
+    if (t->pending == NULL && (t->pending = malloc(t->chunk)) == NULL)
+      return 0;
+    memcpy(t->pending, data, len);
+    t->pending_len = len;
+  }
+  return 1;
+}
+
+int treehash_final(treehash *t, unsigned char *out)
+{
+  size_t size = EVP_MD_size(t->md);
+
+  if (t->pending_len > 0 || t->leaves == 0) {
+    if (!treehash_node(t->ctx, t->md, 0, t->pending ? t->pending : (const unsigned char *)"",
+                       t->pending_len, NULL, 0, t->hashes)
+        || !treehash_push(t, t->hashes))
+      return 0;
+    t->pending_len = 0;
+  }
+  /* the right edge of the tree: merge the remaining subtrees right to left */
+  while (t->depth > 1) {
+    if (!treehash_node(t->ctx, t->md, 1, t->stack[t->depth - 2], size,
+                       t->stack[t->depth - 1], size, t->stack[t->depth - 2]))
+      return 0;
+    t->depth--;
+  }
+  memcpy(out, t->stack[0], size);
+  return 1;
+}
+
+void treehash_cleanup(treehash *t)
+{
+  if (t->ctx != NULL)
+    EVP_MD_CTX_destroy(t->ctx);
+  free(t->pending);
+  free(t->hashes);
+  t->ctx = NULL;
+  t->pending = NULL;
+  t->hashes = NULL;
+}
@@ -0,0 +1,58 @@
+/*
+** Parallel Merkle tree hashing.
+** See Copyright Notice in license.html
+**
+** The input is split into chunks of a fixed size (the last one may be
+** shorter; empty input is a single empty chunk) and hashed as the
+** Merkle tree of RFC 6962, section 2.1:
+**
+**   leaf = H(0x00 || chunk)
+**   node = H(0x01 || left || right)
+**
+** where the left subtree of a node holds the largest power of two of
+** chunks smaller than the node's total. The result depends only on the
+** digest, the chunk size and the input, never on the thread count.
+*/
+
+#ifndef _LUACRYPTO_TREEHASH_
+#define _LUACRYPTO_TREEHASH_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+#define TREEHASH_DEFAULT_CHUNK 65536
+
+typedef struct treehash {
+  const EVP_MD *md;
+  size_t chunk;
+  int threads;
+  EVP_MD_CTX *ctx;             /* for the chunks and nodes hashed on the caller */
+  uint64_t leaves;            /* leaves pushed so far */
+  int depth;                   /* subtrees on the stack */
+  unsigned char stack[64][EVP_MAX_MD_SIZE];
+  unsigned char *pending;      /* start of a chunk seen only in part */
+  size_t pending_len;
+  unsigned char *hashes;       /* leaf hashes of the chunks being hashed in parallel */
+} treehash;
+
+/*
+** Prepares t; threads is the most threads used for one update.
+** Returns 0 if memory is short.
+*/
+int treehash_init (treehash *t, const EVP_MD *md, size_t chunk, int threads);
+
+/*
+** Adds len bytes of input. Returns 0 on failure.
+*/
+int treehash_update (treehash *t, const unsigned char *data, size_t len);
+
+/*
+** Writes the root hash, EVP_MD_size(md) bytes, to out. Returns 0 on
+** failure. t must then be cleaned up.
+*/
+int treehash_final (treehash *t, unsigned char *out);
+
+void treehash_cleanup (treehash *t);
+
+#endif
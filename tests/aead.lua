@@ -0,0 +1,113 @@
+require 'crypto'
+
+local aead = crypto.aead
+assert(aead, "missing crypto.aead")
+
+local unhex = crypto.unhex
+
+-- TESTING ONE-SHOT
+
+-- GCM specification, test case 4
+local key = unhex("feffe9928665731c6d6a8f9467308308")
+local nonce = unhex("cafebabefacedbaddecaf888")
+local plain = unhex("d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72" ..
+                    "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39")
+local aad = unhex("feedfacedeadbeeffeedfacedeadbeefabaddad2")
+local cipher = unhex("42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e" ..
+                     "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091")
+local tag = unhex("5bc94fbc3221a5db94fae95ae7121a47")
+
+local c, t = aead.seal("aes-128-gcm", key, nonce, plain, aad)
+assert(c == cipher, "wrong gcm ciphertext")
+assert(t == tag, "wrong gcm tag")
+assert(aead.open("aes-128-gcm", key, nonce, c, t, aad) == plain, "gcm open")
+
+local c12, t12 = aead.seal("aes-128-gcm", key, nonce, plain, aad, 12)
+assert(t12 == tag:sub(1, 12), "short tag")
+assert(aead.open("aes-128-gcm", key, nonce, c12, t12, aad, 12) == plain, "open with short tag")
+assert(not pcall(aead.seal, "aes-128-gcm", key, nonce, plain, aad, 8), "8 byte tag accepted")
+
+-- a truncated tag must fail unless its length was asked for
+local res, err = aead.open("aes-128-gcm", key, nonce, c, tag:sub(1, 12), aad)
+assert(res == nil and err == "authentication failed", "truncated tag accepted")
+assert(aead.open("aes-128-gcm", key, nonce, c, tag:sub(1, 1), aad) == nil, "1 byte tag accepted")
+assert(aead.open("aes-128-gcm", key, nonce, c, tag, aad, 12) == nil, "long tag accepted")
+
+local bad = string.char((c:byte(1) + 1) % 256) .. c:sub(2)
+local res, err = aead.open("aes-128-gcm", key, nonce, bad, t, aad)
+assert(res == nil and err == "authentication failed", "tampered ciphertext accepted")
+assert(aead.open("aes-128-gcm", key, nonce, c, t, "other aad") == nil, "wrong aad accepted")
+assert(aead.open("aes-128-gcm", key, nonce, c, t) == nil, "missing aad accepted")
+
+-- non-default nonce length
+local c1, t1 = aead.seal("aes-128-gcm", key, "1234567890123456", plain)
+assert(aead.open("aes-128-gcm", key, "1234567890123456", c1, t1) == plain, "16 byte nonce")
+
+assert(not pcall(aead.seal, "aes-128-cbc", key, nonce, plain), "non-aead cipher accepted")
+assert(not pcall(aead.seal, "aes-128-gcm", "short", nonce, plain), "short key accepted")
+
+-- RFC 8439, section 2.8.2; only with OpenSSL 1.1.0 or later
+if pcall(crypto.cipher, "chacha20-poly1305") then
+  local key = unhex("808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f")
+  local nonce = unhex("070000004041424344454647")
+  local aad = unhex("50515253c0c1c2c3c4c5c6c7")
+  local plain = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it."
+  local c, t = aead.seal("chacha20-poly1305", key, nonce, plain, aad)
+  assert(crypto.hex(c:sub(1, 16)) == "d31a8d34648e60db7b86afbc53ef7ec2", "wrong chacha20-poly1305 ciphertext")
+  assert(crypto.hex(t) == "1ae10b594f09e26a7e902ecbd0600691", "wrong chacha20-poly1305 tag")
+  assert(aead.open("chacha20-poly1305", key, nonce, c, t, aad) == plain, "chacha20-poly1305 open")
+  assert(aead.open("chacha20-poly1305", key, nonce, c, t:sub(1, 12), aad) == nil, "chacha20-poly1305 truncated tag")
+  local o = aead.opener("chacha20-poly1305", key, nonce)
+  o:aad(aad)
+  assert(o:update(c) .. o:final(t) == plain, "chacha20-poly1305 streaming open")
+end
+
+-- TESTING STREAMING
+
+local big = crypto.rand.pseudo_bytes(100003)
+local bc, bt = aead.seal("aes-256-gcm", string.rep("K", 32), nonce, big, aad)
+
+local s = aead.sealer("aes-256-gcm", string.rep("K", 32), nonce)
+assert(s:aad(aad) == s, "aad should return the object")
+local parts = {}
+for i = 1, #big, 4096 do
+  parts[#parts + 1] = s:update(big:sub(i, i + 4095))
+end
+local last, st = s:final()
+parts[#parts + 1] = last
+assert(table.concat(parts) == bc, "streaming seal")
+assert(st == bt, "streaming tag")
+
+local o = aead.opener("aes-256-gcm", string.rep("K", 32), nonce)
+o:aad(aad)
+local out = crypto.buffer.new()
+o:update(bc, out)
+assert(o:final(bt, out) == out, "final should return the buffer")
+assert(out:data() == big, "streaming open")
+
+o:reset(nil, nonce)
+o:aad(aad)
+o:update(bc)
+local res, err = o:final(bt:sub(1, 15) .. "x")
+assert(res == nil and err == "authentication failed", "bad tag accepted")
+
+o:reset(nil, nonce)
+o:aad(aad)
+o:update(bc)
+assert(o:final(bt:sub(1, 12)) == nil, "truncated tag accepted by opener")
+
+local o12 = aead.opener("aes-256-gcm", string.rep("K", 32), nonce, 12)
+local _, bt12 = aead.seal("aes-256-gcm", string.rep("K", 32), nonce, big, aad, 12)
+o12:aad(aad)
+assert(o12:update(bc) .. o12:final(bt12) == big, "opener with 12 byte tags")
+assert(not pcall(aead.opener, "aes-256-gcm", string.rep("K", 32), nonce, 4), "4 byte opener tag accepted")
+
+s:reset(nil, nonce)
+s:aad(aad)
+local buf = crypto.buffer.new()
+s:update(big, buf)
+local _, st2 = s:final(buf)
+assert(buf:data() == bc and st2 == bt, "seal into buffer after reset")
+assert(not pcall(s.reset, s, nil, "short"), "nonce length change accepted")
+
+print("OK")
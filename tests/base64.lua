@@ -0,0 +1,77 @@
+require 'crypto'
+
+local base64 = crypto.base64
+assert(base64, "missing crypto.base64")
+
+-- TESTING ONE-SHOT
+
+-- RFC 4648 test vectors
+local vectors = {
+  [""] = "", f = "Zg==", fo = "Zm8=", foo = "Zm9v",
+  foob = "Zm9vYg==", fooba = "Zm9vYmE=", foobar = "Zm9vYmFy",
+}
+for plain, encoded in pairs(vectors) do
+  assert(base64.encode(plain) == encoded, "wrong encoding of " .. plain)
+  assert(base64.decode(encoded) == plain, "wrong decoding of " .. encoded)
+  local unpadded = encoded:gsub("=", "")
+  assert(base64.encode(plain, "std", false) == unpadded, "wrong unpadded encoding of " .. plain)
+  assert(base64.decode(unpadded) == plain, "wrong decoding of " .. unpadded)
+end
+
+assert(base64.encode("\251\255", "url") == "-_8=")
+assert(base64.encode("\251\255", "url", false) == "-_8")
+assert(base64.decode("-_8", "url") == "\251\255")
+assert(base64.decode("-_8") == nil, "url alphabet accepted by std decoder")
+assert(base64.decode("Zm9v=g==") == nil, "padding in the middle accepted")
+assert(base64.decode("Zm9vY") == nil, "truncated group accepted")
+assert(base64.decode("QR==") == nil and base64.decode("QR") == nil, "non-zero padding bits accepted")
+assert(base64.decode("QUI=") == "AB" and base64.decode("QUJ=") == nil, "non-zero padding bits accepted")
+
+-- long enough for the vector paths and several buffer chunks
+local big = crypto.rand.pseudo_bytes(100003)
+local encoded = base64.encode(big)
+assert(#encoded == 133340)
+assert(base64.decode(encoded) == big, "round trip failed")
+assert(base64.decode(base64.encode(big, "url", false), "url") == big, "url round trip failed")
+
+-- TESTING STREAMING
+
+local enc = base64.encoder()
+local dec = base64.decoder()
+local parts, plain = {}, {}
+local i = 1
+while i <= #big do
+  local n = math.random(1, 5000)
+  parts[#parts + 1] = enc:update(big:sub(i, i + n - 1))
+  i = i + n
+end
+parts[#parts + 1] = enc:final()
+assert(table.concat(parts) == encoded, "streamed encoding differs")
+
+i = 1
+while i <= #encoded do
+  local n = math.random(1, 5000)
+  plain[#plain + 1] = assert(dec:update(encoded:sub(i, i + n - 1)))
+  i = i + n
+end
+plain[#plain + 1] = assert(dec:final())
+assert(table.concat(plain) == big, "streamed decoding differs")
+
+assert(dec:update("QQ==") == "A")
+assert(dec:update("QQ") == nil, "data after padding accepted")
+assert(dec:final() == "")
+assert(base64.decoder():update("QR==") == nil, "streamed non-zero padding bits accepted")
+
+-- TESTING OUTPUT FORMATS
+
+local sha1 = crypto.digest("sha1", "abc", true)
+assert(crypto.digest("sha1", "abc", "raw") == sha1)
+assert(crypto.digest("sha1", "abc", "hex") == crypto.hex(sha1))
+assert(crypto.digest("sha1", "abc", "base64") == "qZk+NkcGgWq6PiVxeFDCbJzQ2J0=")
+assert(crypto.digest("sha1", "abc", "base64url") == "qZk-NkcGgWq6PiVxeFDCbJzQ2J0")
+assert(crypto.hmac.digest("sha1", "abc", "key", "base64") ==
+       base64.encode(crypto.hmac.digest("sha1", "abc", "key", true)))
+assert(crypto.encrypt("aes128", "Hello world!", "abcd", "1234", "base64") ==
+       base64.encode(crypto.encrypt("aes128", "Hello world!", "abcd", "1234")))
+
+print("OK")
@@ -0,0 +1,86 @@
+require 'crypto'
+
+local chunker = crypto.chunker
+assert(chunker, "missing crypto.chunker")
+
+-- deterministic pseudo-random input
+local function data(n, seed)
+  local t, x = {}, seed or 1
+  for i = 1, n do
+    x = (x * 1103515245 + 12345) % 2147483648
+    t[i] = string.char(math.floor(x / 65536) % 256)
+  end
+  return table.concat(t)
+end
+
+local input = data(300000)
+local opts = { min = 1024, avg = 4096, max = 16384 }
+
+-- chunks cover the input in order, respect the size limits and hash their slices
+local chunks = chunker.chunks("sha256", input, nil, opts)
+assert(#chunks > 10, "too few chunks")
+local pos = 0
+for i, c in ipairs(chunks) do
+  assert(c.offset == pos, "gap before chunk " .. i)
+  assert(c.length <= opts.max, "chunk " .. i .. " too long")
+  assert(c.length >= opts.min or i == #chunks, "chunk " .. i .. " too short")
+  assert(c.digest == crypto.digest("sha256", input:sub(pos + 1, pos + c.length)), "digest of chunk " .. i)
+  pos = pos + c.length
+end
+assert(pos == #input, "chunks do not cover the input")
+
+local function same(a, b)
+  if #a ~= #b then return false end
+  for i = 1, #a do
+    if a[i].offset ~= b[i].offset or a[i].length ~= b[i].length or a[i].digest ~= b[i].digest then
+      return false
+    end
+  end
+  return true
+end
+
+-- boundaries do not depend on how the input is split over update calls
+for _, step in ipairs({ 1000, 4096, 77777 }) do
+  local c, all = chunker.new("sha256", nil, opts), {}
+  for i = 1, #input, step do
+    for _, x in ipairs(c:update(input:sub(i, i + step - 1))) do table.insert(all, x) end
+  end
+  for _, x in ipairs(c:final()) do table.insert(all, x) end
+  assert(same(all, chunks), "update in steps of " .. step)
+  assert(not pcall(c.update, c, "x"), "update after final accepted")
+end
+
+-- buffers, raw digests and default sizes
+local buf = crypto.buffer.new()
+buf:append(input)
+local raw = chunker.chunks("sha256", buf, true)
+assert(#raw[1].digest == 32)
+assert(#chunker.chunks("md5", "") == 0, "chunks of empty input")
+
+-- an insertion only changes the chunks around it
+local edited = input:sub(1, 150000) .. "inserted" .. input:sub(150001)
+local known = {}
+for _, c in ipairs(chunks) do known[c.digest] = true end
+local changed = 0
+for _, c in ipairs(chunker.chunks("sha256", edited, nil, opts)) do
+  if not known[c.digest] then changed = changed + 1 end
+end
+assert(changed >= 1 and changed <= 3, "insertion changed " .. changed .. " chunks")
+
+-- files give the same chunks; ranges keep file offsets
+local f = assert(io.open("chunker.tmp", "wb"))
+f:write(input)
+f:close()
+assert(same(chunker.file("sha256", "chunker.tmp", nil, nil, nil, opts), chunks), "file chunks")
+local part = chunker.file("sha256", "chunker.tmp", 1000, 20000, nil, opts)
+assert(part[1].offset == 1000)
+assert(part[#part].offset + part[#part].length == 21000)
+assert(part[1].digest == chunker.chunks("sha256", input:sub(1001, 21000), nil, opts)[1].digest)
+os.remove("chunker.tmp")
+assert(chunker.file("sha256", "no/such/file") == nil)
+
+assert(not pcall(chunker.new, "sha256", nil, { avg = 32 }), "tiny average accepted")
+assert(not pcall(chunker.new, "sha256", nil, { min = 8192, avg = 4096 }), "min above avg accepted")
+assert(not pcall(chunker.new, "nosuchdigest"), "bad digest accepted")
+
+print("OK")
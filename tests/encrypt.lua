@@ -15,6 +15,26 @@ local actual = crypto.hex(tst)
 local expected = tohex(tst)
 assert(actual == expected, "different hex results")
 
+assert(crypto.unhex, "missing crypto.unhex")
+assert(crypto.unhex(actual) == tst, "unhex does not invert hex")
+assert(crypto.unhex("DEADbeef") == "\222\173\190\239", "unhex should accept both cases")
+assert(crypto.unhex("") == "")
+assert(crypto.unhex("abc") == nil, "odd length accepted")
+assert(crypto.unhex("zz") == nil, "invalid digit accepted")
+
+-- long enough to go through the vector paths and several buffer chunks
+local long = {}
+for i = 1, 20000 do long[i] = string.char(i % 256) end
+long = table.concat(long)
+assert(crypto.hex(long) == tohex(long), "different hex results on long input")
+assert(crypto.unhex(crypto.hex(long)) == long, "hex round trip failed on long input")
+assert(crypto.unhex(crypto.hex(long) .. "0g") == nil, "invalid trailing digit accepted")
+
+-- TESTING CLOCK
+
+local t0 = crypto.clock()
+assert(type(t0) == "number" and crypto.clock() >= t0, "clock is not monotonic")
+
 -- TESTING ENCRYPT
 
 assert(crypto.encrypt, "missing crypto.encrypt")
@@ -58,3 +78,132 @@ local p2 = ctx:final()
 local dec2 = p1 .. p2
 
 assert(dec2 == text, "different partial result")
+
+-- TESTING RESET
+
+local ctx = crypto.encrypt.new(cipher, key, iv)
+local first = ctx:update(text) .. ctx:final()
+ctx:reset()
+assert(ctx:update(text) .. ctx:final() == first, "reset does not restart the cipher")
+
+local key2, iv2 = 'efgh', '5678'
+ctx:reset(key2, iv2)
+assert(ctx:update(text) .. ctx:final() == crypto.encrypt(cipher, text, key2, iv2), "reset with new key and iv")
+ctx:reset(nil, iv)
+assert(ctx:update(text) .. ctx:final() == crypto.encrypt(cipher, text, key2, iv), "reset with new iv only")
+
+local dctx = crypto.decrypt.new(cipher, key, iv)
+assert(dctx:update(res) .. dctx:final() == text)
+assert(dctx:reset(key2, iv2) == dctx, "reset should return the object")
+assert(dctx:update(crypto.encrypt(cipher, text, key2, iv2)) .. dctx:final() == text, "decrypt reset")
+
+-- CTR keeps its counter in the context, reset has to reload the iv
+local ctr = crypto.encrypt.new("aes-128-ctr", "0123456789abcdef", "fedcba9876543210")
+local c1 = ctr:update(text) .. ctr:final()
+ctr:reset()
+assert(ctr:update(text) .. ctr:final() == c1, "CTR reset does not restart the keystream")
+ctr:reset("0123456789abcdef")
+assert(ctr:update(text) .. ctr:final() == c1, "CTR reset with key only")
+ctr:reset(nil, iv2)
+ctr:reset()
+assert(ctr:update(text) .. ctr:final() == crypto.encrypt("aes-128-ctr", text, "0123456789abcdef", iv2),
+       "CTR reset should keep the last iv given")
+local dctr = crypto.decrypt.new("aes-128-ctr", "0123456789abcdef", "fedcba9876543210")
+assert(dctr:update(c1) .. dctr:final() == text)
+dctr:reset()
+assert(dctr:update(c1) .. dctr:final() == text, "CTR decrypt reset")
+
+local long_key = string.rep("k", 4096)
+assert(not pcall(crypto.encrypt.new, cipher, long_key, iv), "overlong key accepted")
+assert(not pcall(crypto.decrypt.new, cipher, key, long_key), "overlong iv accepted")
+assert(not pcall(crypto.encrypt, "aes-128-ctr", text, long_key, iv, nil, {threads = 2}), "overlong key accepted")
+assert(not pcall(crypto.decrypt, "aes-128-ctr", text, key, long_key, {threads = 2}), "overlong iv accepted")
+
+-- TESTING BUFFERS
+
+assert(crypto.buffer, "missing crypto.buffer")
+
+local buf = crypto.buffer.new(16)
+assert(#buf == 0 and buf:capacity() >= 16)
+buf:append("abc"):append("def")
+assert(buf:len() == 6 and buf:data() == "abcdef")
+assert(buf:data(2, 3) == "bc" and buf:data(-2) == "ef" and buf:data(5, 2) == "")
+buf:append(buf)
+assert(buf:data() == "abcdefabcdef", "self append")
+buf:resize(2)
+assert(buf:data() == "ab")
+buf:resize(4)
+assert(buf:data() == "ab\0\0", "resize should zero new bytes")
+buf:clear()
+assert(#buf == 0)
+buf:reserve(1000)
+assert(buf:capacity() >= 1000 and #buf == 0)
+
+local ctx = crypto.encrypt.new(cipher, key, iv)
+local out = crypto.buffer.new()
+assert(ctx:update(text, out) == out, "update should return the buffer")
+ctx:final(out)
+assert(out:data() == res, "buffer encrypt result")
+
+local big = string.rep("0123456789abcdef", 4097)
+ctx:reset()
+out:clear()
+for i = 1, #big, 1000 do
+  ctx:update(big:sub(i, i + 999), out)
+end
+ctx:final(out)
+assert(out:data() == crypto.encrypt(cipher, big, key, iv), "chunked buffer encrypt")
+
+local dctx = crypto.decrypt.new(cipher, key, iv)
+local plain = crypto.buffer.new()
+dctx:update(out, plain)
+dctx:final(plain)
+assert(plain:data() == big, "buffer decrypt result")
+assert(not pcall(dctx.update, dctx, plain, plain), "aliased input and output")
+
+-- TESTING HANDLES
+
+local h = crypto.cipher(cipher)
+assert(h == crypto.cipher(cipher), "handles are not cached")
+assert(h:key_length() == 16 and h:iv_length() == 16 and h:block_size() == 16)
+assert(h:encrypt(text, key, iv) == res, "handle encrypt")
+assert(h:decrypt(res, key, iv) == text, "handle decrypt")
+assert(crypto.encrypt(h, text, key, iv) == res, "handle in place of the name")
+local ctx = h:encrypt_new(key, iv)
+assert(ctx:update(text) .. ctx:final() == res, "handle encrypt object")
+local dctx = h:decrypt_new(key, iv)
+assert(dctx:update(res) .. dctx:final() == text, "handle decrypt object")
+assert(not pcall(crypto.encrypt, crypto.md("sha1"), text, key, iv), "digest handle accepted as cipher")
+
+-- TESTING THREADS
+
+-- a serial EVP_EncryptUpdate over the whole input is the reference
+local function serial(name, input, k, v)
+  local e = crypto.encrypt.new(name, k, v)
+  return e:update(input) .. e:final()
+end
+
+local huge = string.rep("0123456789abcdef", 70000) .. "tail"
+local ivs = {
+  ["aes-128-ctr"] = { iv, string.rep("\255", 16), string.rep("\0", 12) .. "\255\255\255\250" },
+  ["aes-256-ctr"] = { iv },
+}
+if pcall(crypto.cipher, "chacha20") then
+  -- the last IV makes the block counter wrap, which stays serial
+  ivs["chacha20"] = { iv, "\0\0\255\255" .. string.rep("n", 12), "\255\255\255\255" .. string.rep("n", 12) }
+end
+for name, list in pairs(ivs) do
+  local k = string.rep("K", crypto.cipher(name):key_length())
+  for _, v in ipairs(list) do
+    local want = serial(name, huge, k, v)
+    for threads = 1, 5 do
+      local got = crypto.encrypt(name, huge, k, v, nil, {threads = threads})
+      assert(got == want, "threaded " .. name .. " with " .. threads .. " threads")
+      assert(crypto.decrypt(name, got, k, v, {threads = threads}) == huge, "threaded decrypt " .. name)
+    end
+    assert(crypto.encrypt(name, huge:sub(1, 600001), k, v, "hex", {}) == crypto.hex(serial(name, huge:sub(1, 600001), k, v)))
+  end
+end
+-- ciphers without a counter ignore the option
+assert(crypto.encrypt(cipher, huge, key, iv, nil, {threads = 4}) == crypto.encrypt(cipher, huge, key, iv), "threaded cbc")
+assert(h:decrypt(h:encrypt(huge, key, iv), key, iv, {threads = 4}) == huge, "threaded handle decrypt")
@@ -0,0 +1,127 @@
+require 'crypto'
+
+local etm = crypto.etm
+assert(etm, "missing crypto.etm")
+
+local cipher, key, iv = "aes-128-cbc", "0123456789abcdef", "fedcba9876543210"
+local md, mackey = "sha256", "mac key"
+local text = crypto.rand.pseudo_bytes(70001)
+
+local function be(v, n)
+  local t = {}
+  for i = n, 1, -1 do
+    t[i] = string.char(v % 256)
+    v = math.floor(v / 256)
+  end
+  return table.concat(t)
+end
+
+-- with bind, the MAC also covers the cipher name, the iv and the ciphertext length
+local function etm_mac(md, ciphername, iv, c, mackey)
+  return crypto.hmac.digest(md, be(#ciphername, 4) .. ciphername .. be(#iv, 4) .. iv ..
+                            c .. be(#c, 8), mackey, true)
+end
+
+-- same result as encrypting and then MACing the ciphertext separately
+local expected = crypto.encrypt(cipher, text, key, iv)
+local expected_mac = crypto.hmac.digest(md, expected, mackey, true)
+local bound_mac = etm_mac(md, "AES-128-CBC", iv, expected, mackey)
+local bind = {bind = true}
+
+-- TESTING ONE-SHOT
+
+local c, mac = etm.encrypt(cipher, key, iv, md, mackey, text)
+assert(c == expected, "wrong ciphertext")
+assert(mac == expected_mac, "wrong mac")
+assert(etm.decrypt(cipher, key, iv, md, mackey, c, mac) == text, "decrypt")
+
+local bad = c:sub(1, -2) .. string.char((c:byte(-1) + 1) % 256)
+local res, err = etm.decrypt(cipher, key, iv, md, mackey, bad, mac)
+assert(res == nil and err == "authentication failed", "forged ciphertext accepted")
+assert(etm.decrypt(cipher, key, iv, md, "other key", c, mac) == nil, "wrong mac key accepted")
+assert(etm.decrypt(cipher, key, iv, md, mackey, c, mac:sub(1, 16)) == nil, "short mac accepted")
+
+assert(etm.decrypt(cipher, key, iv, md, mackey, c:sub(1, 16), mac) == nil, "truncated ciphertext accepted")
+
+-- bound: the iv is authenticated, flipping one bit must fail rather
+-- than just garble the first block
+local bc, bm = etm.encrypt(cipher, key, iv, md, mackey, text, bind)
+assert(bc == expected and bm == bound_mac, "wrong bound mac")
+assert(etm.decrypt(cipher, key, iv, md, mackey, bc, bm, bind) == text, "bound decrypt")
+assert(etm.decrypt(cipher, key, iv, md, mackey, bc, bm) == nil, "bound mac checked as plain")
+local b1 = iv:byte(1)
+local badiv = string.char(b1 % 2 == 0 and b1 + 1 or b1 - 1) .. iv:sub(2)
+assert(etm.decrypt(cipher, key, badiv, md, mackey, bc, bm, bind) == nil, "forged iv accepted")
+assert(etm.decrypt("aes-128-ofb", key, iv, md, mackey, bc, bm, bind) == nil, "other cipher accepted")
+assert(etm.decrypt(cipher, key, iv, md, mackey, bc:sub(1, 16), bm, bind) == nil, "truncated ciphertext accepted")
+
+-- TESTING STREAMING
+
+local e = etm.new(cipher, key, iv, md, mackey)
+local parts = {}
+for i = 1, #text, 5000 do
+  parts[#parts + 1] = e:update(text:sub(i, i + 4999))
+end
+local last, smac = e:final()
+parts[#parts + 1] = last
+assert(table.concat(parts) == expected, "streaming ciphertext")
+assert(smac == expected_mac, "streaming mac")
+
+e:reset()
+local buf = crypto.buffer.new()
+assert(e:update(text, buf) == buf, "update should return the buffer")
+local _, bmac = e:final(buf)
+assert(buf:data() == expected and bmac == expected_mac, "encrypt into buffer")
+
+local v = etm.verifier(cipher, key, iv, md, mackey)
+local plain = crypto.buffer.new()
+for i = 1, #c, 5000 do
+  assert(v:update(c:sub(i, i + 4999)) == v, "verifier update should return the object")
+end
+assert(v:final(mac, plain) == plain, "final should return the buffer")
+assert(plain:data() == text, "streaming decrypt")
+
+v:reset()
+v:update(buf)
+assert(v:final(bmac) == text, "streaming decrypt to string")
+
+v:reset()
+v:update(bad)
+local res, err = v:final(mac)
+assert(res == nil and err == "authentication failed", "streaming forgery accepted")
+
+local bv = etm.verifier(cipher, key, iv, md, mackey, bind)
+assert(bv:update(bc):final(bm) == text, "bound streaming decrypt")
+bv:reset(nil, badiv)
+bv:update(bc)
+assert(bv:final(bm) == nil, "streaming forged iv accepted")
+local eb = etm.new(cipher, key, iv, md, mackey, bind)
+local sc = eb:update(text)
+local last, sm = eb:final()
+assert(sc .. last == expected and sm == bound_mac, "bound streaming mac")
+
+-- a verifier holds the ciphertext until final, up to maxmem bytes
+local small = etm.verifier(cipher, key, iv, md, mackey, {maxmem = 70000})
+small:update(c:sub(1, 70000))
+local ok, err = pcall(small.update, small, c:sub(70001))
+assert(not ok and err:find("maxmem", 1, true), "verifier maxmem exceeded")
+small:reset()
+assert(small:update(c:sub(1, 16)):final(mac) == nil, "reset verifier")
+assert(not pcall(etm.verifier, cipher, key, iv, md, mackey, {maxmem = 0}), "zero maxmem accepted")
+
+-- stream cipher, new iv on reset
+local e2 = etm.new("aes-256-ctr", string.rep("k", 32), iv, "sha1", mackey)
+local c2 = e2:update(text) .. e2:final()
+e2:reset(nil, "another iv......")
+local c3 = e2:update(text)
+local _, m3 = e2:final()
+assert(c3 == crypto.encrypt("aes-256-ctr", text, string.rep("k", 32), "another iv......"), "reset with new iv")
+assert(m3 == crypto.hmac.digest("sha1", c3, mackey, true))
+local e3 = etm.new("aes-256-ctr", string.rep("k", 32), iv, "sha1", mackey, bind)
+e3:update(text)
+e3:reset(nil, "another iv......")
+e3:update(text)
+assert(select(2, e3:final()) == etm_mac("sha1", "AES-256-CTR", "another iv......", c3, mackey), "bound reset with new iv")
+assert(c2 ~= c3)
+
+print("OK")
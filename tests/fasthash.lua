@@ -0,0 +1,100 @@
+require 'crypto'
+
+local fasthash = crypto.fasthash
+assert(fasthash, "missing crypto.fasthash")
+
+-- bytes (7*i + 3) % 256, so every length path of XXH3 sees distinct data
+local function pattern(n)
+  local t = {}
+  for i = 0, n - 1 do t[#t + 1] = string.char((i * 7 + 3) % 256) end
+  return table.concat(t)
+end
+
+-- TESTING XXH3
+
+-- length, XXH3-64, XXH128, then both with seed 42, from the reference implementation
+local vectors = {
+  { 0, "2d06800538d394c2", "99aa06d3014798d86001c324468d497f",
+       "b029411ff43d84d2", "16c20acd33f7af2f3c1d09e9fe249164" },
+  { 3, "a9088dda485b481c", "ce31763cbf8245a5a9088dda485b481c",
+       "3a6eb7a191052c81", "916a24e287718a053a6eb7a191052c81" },
+  { 8, "60539db630471163", "e3bc8a5f461715553cd024e3d63a1588",
+       "53a895ca319fab31", "db7aaf40cd2508fdfcef9d87275abd57" },
+  { 16, "b8c859b0f030b585", "ce0b9647ab24f88460d75c5e47d40a24",
+        "6b1b54f65d114c69", "ca2421404d5d2d31cd35a6b186e354d5" },
+  { 100, "b5937857f0d78c9f", "2207ed96998d91f20cc97f05750182b2",
+         "223ce4409957d0ce", "5e8e7ced7c51485bbe8dc3486451d9b5" },
+  { 200, "746cd0025327bf5b", "32200a52a918beaf380142cdd5843bbd",
+         "b04cc37ae5a4a48d", "7d487fb64647cb0afef64d3bed0600ed" },
+  { 1000, "6c4f14bd97bd9e82", "6bcc7eff62da44c26c4f14bd97bd9e82",
+          "f0f163846cbf0c33", "c281146f104d47f7f0f163846cbf0c33" },
+  { 5000, "799aaddd7339581d", "c98ae385d09887cc799aaddd7339581d",
+          "ab56be339593b1ce", "33e1d8cda9ca18f8ab56be339593b1ce" },
+}
+for _, v in ipairs(vectors) do
+  local s = pattern(v[1])
+  assert(fasthash("xxh3", s) == v[2], "xxh3 of " .. v[1] .. " bytes")
+  assert(fasthash("xxh128", s) == v[3], "xxh128 of " .. v[1] .. " bytes")
+  assert(fasthash("xxh3", s, 42) == v[4], "seeded xxh3 of " .. v[1] .. " bytes")
+  assert(fasthash("xxh128", s, 42) == v[5], "seeded xxh128 of " .. v[1] .. " bytes")
+  assert(fasthash("xxh3", s, 0) == v[2], "seed 0 is the default")
+end
+-- a full 64-bit seed as 8 big-endian bytes
+assert(fasthash("xxh3", pattern(1000), crypto.unhex("0123456789abcdef")) == "dc23779751d183b1", "string seed")
+assert(#fasthash("xxh128", "abc", nil, true) == 16)
+assert(fasthash("xxh3", "abc", nil, "base64") == crypto.base64.encode(fasthash("xxh3", "abc", nil, true)))
+
+-- TESTING SIPHASH
+
+-- the test vector of the SipHash paper, appendix A
+local key = crypto.unhex("000102030405060708090a0b0c0d0e0f")
+local msg = crypto.unhex("000102030405060708090a0b0c0d0e")
+assert(fasthash("siphash", msg, key) == "e545be4961ca29a1", "SipHash-2-4 vector")
+assert(fasthash("siphash", "", key) == "310e0edd47db6f72", "SipHash-2-4 of nothing")
+assert(not pcall(fasthash, "siphash", "x"), "missing key accepted")
+assert(not pcall(fasthash, "siphash", "x", "short"), "short key accepted")
+
+-- TESTING STREAMING
+
+-- any split gives the one-shot hash, and final leaves the object usable
+local long = pattern(3000)
+for _, alg in ipairs({ "xxh3", "xxh128", "siphash" }) do
+  local k = alg == "siphash" and key or 7
+  local whole = fasthash(alg, long, k)
+  for _, step in ipairs({ 1, 7, 64, 100, 256, 1000 }) do
+    local h = fasthash.new(alg, k)
+    for i = 1, #long, step do h:update(long:sub(i, i + step - 1)) end
+    assert(h:final() == whole, alg .. " in steps of " .. step)
+    assert(h:final() == whole, alg .. " final twice")
+  end
+  local h = fasthash.new(alg, k):update(long:sub(1, 1500))
+  local c = h:clone()
+  assert(h:final(long:sub(1501)) == whole, alg .. " final with data")
+  assert(c:update(long:sub(1501)):final() == whole, alg .. " clone")
+  assert(h:reset():update("abc"):final() == fasthash(alg, "abc", k), alg .. " reset")
+  local buf = crypto.buffer.new()
+  buf:append(long)
+  assert(fasthash.new(alg, k):update(buf):final() == whole, alg .. " buffer")
+  assert(fasthash(alg, buf, k) == whole, alg .. " one-shot buffer")
+end
+
+-- TESTING BATCH
+
+local keys = { "", "a", pattern(17), pattern(129), pattern(241), pattern(5000) }
+for _, alg in ipairs({ "xxh3", "xxh128", "siphash" }) do
+  local k = alg == "siphash" and key or nil
+  local hashes = fasthash.batch(alg, keys, k)
+  assert(#hashes == #keys)
+  for i, s in ipairs(keys) do
+    assert(hashes[i] == fasthash(alg, s, k), alg .. " batch item " .. i)
+  end
+  assert(#fasthash.batch(alg, {}, k) == 0)
+end
+assert(fasthash.batch("xxh3", { "a" }, nil, true)[1] == fasthash("xxh3", "a", nil, true))
+assert(not pcall(fasthash.batch, "xxh3", { "a", {} }), "non-string item accepted")
+
+assert(not pcall(fasthash, "md5", "x"), "unknown algorithm accepted")
+assert(not pcall(fasthash, "xxh3", "x", -1), "negative seed accepted")
+assert(not pcall(fasthash, "xxh3", "x", 1.5), "fractional seed accepted")
+
+print("OK")
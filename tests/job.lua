@@ -0,0 +1,62 @@
+require 'crypto'
+
+local job = crypto.job
+assert(job, "missing crypto.job")
+
+local message = string.rep("the quick brown fox ", 5000)
+local key = string.rep("k", 16)
+local iv = string.rep("i", 16)
+
+-- TESTING RESULTS
+
+local j = job.digest("sha256", message)
+assert(j:wait() == crypto.digest("sha256", message), "digest job")
+assert(j:done(), "waited job not done")
+assert(j:wait() == crypto.digest("sha256", message), "second wait")
+assert(job.digest("sha1", message, "base64"):wait() == crypto.digest("sha1", message, "base64"))
+assert(job.digest(crypto.md("md5"), message, true):wait() == crypto.digest("md5", message, true))
+
+local c = job.encrypt("aes-128-cbc", message, key, iv):wait()
+assert(c == crypto.encrypt("aes-128-cbc", message, key, iv), "encrypt job")
+assert(job.decrypt("aes-128-cbc", c, key, iv):wait() == message, "decrypt job")
+assert(job.encrypt("aes-128-ctr", message, key, iv, "hex"):wait() ==
+       crypto.encrypt("aes-128-ctr", message, key, iv, "hex"))
+local res, err = job.decrypt("aes-128-cbc", c:sub(1, -2), key, iv):wait()
+assert(res == nil and type(err) == "string", "bad padding not reported")
+
+local k = crypto.pkey.generate("rsa", 1024)
+local sig = job.sign("sha256", message, k):wait()
+assert(crypto.verify("sha256", message, sig, k), "sign job")
+assert(job.verify("sha256", message, sig, k):wait() == true, "verify job")
+assert(job.verify("sha256", message .. "!", sig, k):wait() == false, "verify job accepted a bad signature")
+
+assert(not pcall(job.digest, "no such digest", message))
+assert(not pcall(job.sign, "sha256", message, "not a key"))
+
+-- TESTING MANY JOBS
+
+local jobs = {}
+for i = 1, 64 do
+  jobs[i] = job.digest("sha1", message .. i)
+end
+for i = 1, 64 do
+  assert(jobs[i]:wait() == crypto.digest("sha1", message .. i), "job " .. i)
+end
+
+-- jobs dropped before they finish, and the inputs they hold on to
+for i = 1, 32 do
+  job.encrypt("aes-128-cbc", string.rep("x", 100000) .. i, key, iv)
+end
+collectgarbage()
+collectgarbage()
+
+-- TESTING FD
+
+j = job.digest("sha256", message)
+local fd = j:fd()
+assert(type(fd) == "number" and fd >= 0, "no fd")
+assert(j:fd() == fd, "fd changed")
+j:wait()
+assert(tostring(j):find("crypto.job.handle", 1, true))
+
+print("OK")
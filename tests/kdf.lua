@@ -0,0 +1,71 @@
+require 'crypto'
+
+local kdf = crypto.kdf
+assert(kdf, "missing crypto.kdf")
+
+local function hex(s) return crypto.hex(s) end
+
+-- TESTING PBKDF2
+
+-- RFC 6070
+assert(hex(kdf.pbkdf2("sha1", "password", "salt", 1, 20)) == "0c60c80f961f0e71f3a9b524af6012062fe037a6", "RFC 6070 1")
+assert(hex(kdf.pbkdf2("sha1", "password", "salt", 4096, 20)) == "4b007901b765489abead49d926f721d065a429c1", "RFC 6070 3")
+assert(kdf.pbkdf2("sha1", "pass\0word", "sa\0lt", 4096, 16, "hex") == "56fa6aa75548099dcc37d7f03425e0c3", "RFC 6070 6")
+-- RFC 7914, section 11
+local long = "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc" ..
+             "49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783"
+assert(kdf.pbkdf2("sha256", "passwd", "salt", 1, 64, "hex") == long, "RFC 7914 PBKDF2")
+
+-- several output blocks give the same key on any number of threads
+local one = kdf.pbkdf2("sha512", "pw", "salt", 1000, 200, true, { threads = 1 })
+assert(#one == 200)
+assert(hex(one):sub(1, 32) == "dba2956d5d8f05e6f06dc9732ca6037d", "multi-block PBKDF2")
+for _, threads in ipairs({ 2, 3, 8 }) do
+  assert(kdf.pbkdf2("sha512", "pw", "salt", 1000, 200, true, { threads = threads }) == one, "threads " .. threads)
+end
+assert(kdf.pbkdf2("sha512", "pw", "salt", 1000, 200) == one, "default threads")
+
+assert(not pcall(kdf.pbkdf2, "sha1", "p", "s", 0, 20), "zero iterations accepted")
+assert(not pcall(kdf.pbkdf2, "sha1", "p", "s", 1, 0), "empty key accepted")
+assert(not pcall(kdf.pbkdf2, "nosuchdigest", "p", "s", 1, 20), "bad digest accepted")
+
+-- TESTING HKDF
+
+-- RFC 5869, test cases 1 and 3
+local ikm = string.rep("\11", 22)
+assert(kdf.hkdf("sha256", ikm, crypto.unhex("000102030405060708090a0b0c"),
+                crypto.unhex("f0f1f2f3f4f5f6f7f8f9"), 42, "hex") ==
+       "3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf34007208d5b887185865", "RFC 5869 1")
+local okm = "8da4e775a563c18f715f802a063c5a31b8a11f5c5ee1879ec3454e5f3c738d2d9d201395faa4b61a96c8"
+assert(kdf.hkdf("sha256", ikm, nil, nil, 42, "hex") == okm, "RFC 5869 3")
+assert(kdf.hkdf("sha256", ikm, "", "", 42, "hex") == okm, "empty salt and info")
+assert(#kdf.hkdf("sha256", ikm, nil, nil, 255 * 32) == 255 * 32)
+assert(not pcall(kdf.hkdf, "sha256", ikm, nil, nil, 255 * 32 + 1), "too long a key accepted")
+
+-- TESTING SCRYPT
+
+-- RFC 7914, section 12
+assert(kdf.scrypt("", "", 16, 1, 1, 64, "hex") ==
+       "77d6576238657b203b19ca42c18a0497f16b4844e3074ae8dfdffa3fede21442" ..
+       "fcd0069ded0948f8326a753a0fc81f17e8d3e0fb2e0d3628cf35e20c38d18906", "RFC 7914 1")
+local nacl = "fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b373162" ..
+             "2eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640"
+for _, threads in ipairs({ 1, 4, 16 }) do
+  assert(kdf.scrypt("password", "NaCl", 1024, 8, 16, 64, "hex", { threads = threads }) == nacl, "RFC 7914 2, threads " .. threads)
+end
+assert(kdf.scrypt("pleaseletmein", "SodiumChloride", 16384, 8, 1, 64, "hex") ==
+       "7023bdcb3afd7348461c06cd81fd38ebfda8fbba904f8e3ea9b543f6545da1f2" ..
+       "d5432955613f0fcf62d49705242a9af9e61e85dc0d651e40dfcf017b45575887", "RFC 7914 3")
+
+-- 16 MiB per lane: over a 1 MiB budget, and running one lane at a time under 20 MiB
+local res, err = kdf.scrypt("p", "s", 16384, 8, 2, 32, true, { maxmem = 1024 * 1024 })
+assert(res == nil and err, "memory limit ignored")
+assert(kdf.scrypt("p", "s", 16384, 8, 2, 32, true, { maxmem = 20 * 1024 * 1024, threads = 2 }) ==
+       kdf.scrypt("p", "s", 16384, 8, 2, 32, true, { maxmem = 64 * 1024 * 1024, threads = 2 }), "threads cut to fit maxmem")
+
+assert(not pcall(kdf.scrypt, "p", "s", 1000, 8, 1, 32), "N not a power of two accepted")
+assert(not pcall(kdf.scrypt, "p", "s", 1, 8, 1, 32), "N of 1 accepted")
+assert(not pcall(kdf.scrypt, "p", "s", 65536, 1, 1, 32), "N too large for r accepted")
+assert(not pcall(kdf.scrypt, "p", "s", 16, 0, 1, 32), "r of 0 accepted")
+
+print("OK")
@@ -49,6 +49,80 @@ for i = 1, S do
 end
 print("")
 
+-- a negative count must be refused, not wrapped to a huge size
+local function negative_rejected(f, ...)
+	local ok, err = pcall(f, ...)
+	return not ok and err:match("must not be negative") ~= nil
+end
+
+print("generating tokens and integers from a pool")
+local pool = assert(rand.pool(64))
+assert(#pool:bytes(10) == 10 and #pool:bytes(100) == 100 and pool:bytes(0) == "")
+assert(#pool:token(16) == 32 and pool:token(16):match("^%x+$"), "hex token")
+assert(#pool:token(16, "base64url") == 22, "base64url token")
+assert(negative_rejected(pool.bytes, pool, -1), "negative pool:bytes accepted")
+assert(negative_rejected(pool.token, pool, -1), "negative pool:token accepted")
+local seen = {}
+for i = 1, 2000 do
+	local x = pool:int(-3, 3)
+	assert(x >= -3 and x <= 3 and x == math.floor(x), "integer out of range")
+	seen[x] = true
+end
+for x = -3, 3 do
+	assert(seen[x], "integer never drawn: " .. x)
+end
+assert(pool:int(7, 7) == 7)
+assert(pool:int(0, 2^53 - 1) >= 0)
+assert(not pcall(pool.int, pool, 2, 1), "empty range accepted")
+assert(not pcall(pool.int, pool, 0.5, 1), "fraction accepted")
+local tokens = {}
+for i = 1, 1000 do
+	local t = pool:token(8)
+	assert(not tokens[t], "repeated token")
+	tokens[t] = true
+end
+
+print("filling a buffer and drawing integers in bulk")
+local b = crypto.buffer.new()
+assert(rand.fill(b, 100000) == b and b:len() == 100000)
+local capacity = b:capacity()
+assert(rand.fill(b, 1000) == b and b:len() == 1000 and b:capacity() == capacity, "buffer not reused")
+assert(b:data() ~= rand.fill(crypto.buffer.new(), 1000):data())
+assert(pool:fill(b, 10):len() == 10 and rand.fill(b, 0):len() == 0)
+local ints = rand.ints(10000, 1, 6)
+assert(#ints == 10000)
+local counts = {}
+for _, v in ipairs(ints) do
+	assert(v >= 1 and v <= 6 and v == math.floor(v), "integer out of range")
+	counts[v] = (counts[v] or 0) + 1
+end
+for v = 1, 6 do
+	-- 1667 expected; 1400 is over six standard deviations away
+	assert(counts[v] > 1400 and counts[v] < 1934, "skewed integers")
+end
+assert(#rand.ints(0, 1, 2) == 0)
+for _, v in ipairs(pool:ints(1000, -2^40, 2^40)) do
+	assert(v >= -2^40 and v <= 2^40, "wide integer out of range")
+end
+assert(#pool:ints(3, 5, 5) == 3 and pool:ints(1, 5, 5)[1] == 5)
+assert(not pcall(rand.ints, -1, 1, 2), "negative count accepted")
+
+-- rand.bytes, token and int through the pool of this state
+assert(rand.set_pool(256))
+assert(#rand.bytes(16) == 16 and #rand.bytes(1000) == 1000)
+assert(#rand.token(16, "raw") == 16 and #rand.token(4) == 8)
+assert(negative_rejected(rand.bytes, -1), "negative rand.bytes accepted")
+assert(negative_rejected(rand.token, -1), "negative rand.token accepted")
+local x = rand.int(1, 6)
+assert(x >= 1 and x <= 6)
+assert(rand.set_pool(pool) == pool)
+assert(rand.set_pool(false) == nil)
+assert(#rand.bytes(16) == 16)
+print(string.format("token %s, die roll %d", rand.token(16), x))
+assert(negative_rejected(rand.bytes, -1), "negative rand.bytes accepted without a pool")
+assert(negative_rejected(rand.pseudo_bytes, -1), "negative rand.pseudo_bytes accepted")
+print("")
+
 print("saving seed in " .. SEEDFILE)
 print("")
 rand.write(SEEDFILE)
@@ -63,4 +63,159 @@ for i, t in ipairs({"sha1", "md5", "sha1", "hmac"}) do
   print("")
 end
 
+print("testing batch")
+assert(io.input(F))
+local all = io.read("*all")
+local batch = digest.batch("sha1", {all, "", all})
+assert(#batch == 3)
+report("batch", batch[1], F, "sha1")
+report("batch", batch[3], F, "sha1")
+assert(batch[2] == digest("sha1", ""))
+local rawbatch = digest.batch("md5", {all}, true)
+report("raw", crypto.hex(rawbatch[1]), F, "md5")
+assert(#digest.batch("sha1", {}) == 0)
+-- lengths straddling the padding boundaries, enough items to fill every lane
+local items = {}
+for i = 0, 200 do items[#items + 1] = string.rep(string.char(i % 256), i) end
+for _, t in ipairs({"sha1", "sha256"}) do
+  local hashes = digest.batch(t, items)
+  for i, s in ipairs(items) do
+    assert(hashes[i] == digest(t, s), "batch mismatch for " .. t .. " item " .. i)
+  end
+end
+print("")
+
+print("testing file")
+for _, t in ipairs({"md5", "sha1"}) do
+  report("file", digest.file(t, F), F, t)
+end
+report("file", hmac.file("sha1", F, "luacrypto"), F, "hmac")
+assert(digest.file("sha1", F, 10) == digest("sha1", all:sub(11)))
+assert(digest.file("sha1", F, 10, 20) == digest("sha1", all:sub(11, 30)))
+assert(digest.file("sha1", F, 0, 0) == digest("sha1", ""))
+assert(digest.file("sha1", F, #all + 100) == digest("sha1", ""))
+assert(digest.file("sha1", F, nil, nil, true) == digest("sha1", all, true))
+assert(hmac.file("sha1", F, "key", 5, 7, "base64") == hmac.digest("sha1", all:sub(6, 12), "key", "base64"))
+local res, err = digest.file("sha1", "no such file")
+assert(res == nil and err:find("no such file", 1, true), "missing file")
+-- a few pages, to cover ranges that do not start on a page boundary
+local tmp = os.tmpname()
+local big = string.rep(all, math.ceil(70000 / #all))
+local f = assert(io.open(tmp, "wb"))
+f:write(big)
+f:close()
+assert(digest.file("sha256", tmp) == digest("sha256", big))
+assert(digest.file("sha256", tmp, 4097, 30000) == digest("sha256", big:sub(4098, 34097)))
+os.remove(tmp)
+print("")
+
+print("testing handles")
+local md = crypto.md("sha1")
+assert(md == crypto.md("sha1"), "handles are not cached")
+assert(md:size() == 20 and md:block_size() == 64)
+report("handle", md:digest(all), F, "sha1")
+report("handle", digest(md, all), F, "sha1")
+report("handle", md:new():final(all), F, "sha1")
+assert(md:batch({all})[1] == md:digest(all))
+assert(md:hmac(all, "key") == crypto.hmac.digest("sha1", all, "key"))
+assert(md:hmac_new("key"):final(all) == crypto.hmac.digest(md, all, "key"))
+assert(not pcall(crypto.md, "no such digest"))
+print("")
+
+print("testing files")
+local paths, want = {}, {}
+for i = 1, 12 do
+  paths[i] = os.tmpname()
+  f = assert(io.open(paths[i], "wb"))
+  f:write(string.rep(all, i * 50))
+  f:close()
+  want[paths[i]] = digest("sha256", string.rep(all, i * 50))
+end
+for threads = 1, 5 do
+  local got = digest.files("sha256", paths, nil, {threads = threads})
+  for _, p in ipairs(paths) do assert(got[p] == want[p], "files " .. threads) end
+end
+assert(digest.files("sha1", {F}, true)[F] == digest("sha1", all, true))
+assert(next(digest.files("sha1", {})) == nil)
+paths[#paths + 1] = "no such file"
+local got, errs = digest.files("sha256", paths)
+assert(got["no such file"] == nil and got[paths[1]] == want[paths[1]])
+assert(errs["no such file"]:find("no such file", 1, true) and errs[paths[1]] == nil)
+assert(select("#", digest.files("sha1", {F})) == 1)
+assert(not pcall(digest.files, "sha1", {F, 42}))
+for i = 1, 12 do os.remove(paths[i]) end
+print("")
+
+print("testing tree")
+-- RFC 6962 Merkle tree over fixed-size chunks, as documented in the manual
+local function tree(t, s, chunk)
+  local function mth(first, n)
+    if n == 1 then
+      return digest(t, "\0" .. s:sub((first - 1) * chunk + 1, first * chunk), true)
+    end
+    local k = 1
+    while k * 2 < n do k = k * 2 end
+    return digest(t, "\1" .. mth(first, k) .. mth(first + k, n - k), true)
+  end
+  return crypto.hex(mth(1, math.max(1, math.ceil(#s / chunk))))
+end
+assert(digest.tree("sha256", "") == "6e340b9cffb37a989ca544e6bb780a2c78901d3fb33738768511a30617afa01d")
+assert(digest.tree("sha256", "The quick brown fox jumps over the lazy dog", nil, {chunk = 4}) ==
+       "2bf3bfd4b8c740646546123a6e8d9488d920b7190d008eeca23178f01bb0bbad")
+local bytes = {}
+for i = 0, 255 do bytes[#bytes + 1] = string.char(i) end
+local blob = string.rep(table.concat(bytes), 1000)
+assert(digest.tree("sha256", blob, nil, {chunk = 1000}) ==
+       "4e610836e2f46beb9657425be9e0f7db6db13f67860592383ab121c6ebc59c6a")
+for _, chunk in ipairs({1, 7, 64, 1000, 4096}) do
+  local s = blob:sub(1, chunk * 9 + 3)
+  local want = tree("sha1", s, chunk)
+  for threads = 1, 8 do
+    assert(digest.tree("sha1", s, nil, {chunk = chunk, threads = threads}) == want, "tree " .. chunk)
+  end
+  -- exact multiples of the chunk size have no partial last chunk
+  assert(digest.tree("sha1", s:sub(1, chunk * 8), nil, {chunk = chunk}) == tree("sha1", s:sub(1, chunk * 8), chunk))
+end
+assert(digest.tree("sha1", "abc", true, {chunk = 1}) == crypto.unhex(tree("sha1", "abc", 1)))
+assert(digest.tree("sha1", blob, "base64") == crypto.base64.encode(digest.tree("sha1", blob, true)))
+local b = crypto.buffer.new()
+b:append(blob)
+assert(digest.tree("sha1", b, nil, {chunk = 512}) == tree("sha1", blob, 512))
+assert(not pcall(digest.tree, "sha1", "", nil, {chunk = 0}))
+tmp = os.tmpname()
+f = assert(io.open(tmp, "wb"))
+f:write(blob)
+f:close()
+assert(digest.tree_file("sha256", tmp) == digest.tree("sha256", blob))
+assert(digest.tree_file("sha256", tmp, nil, nil, nil, {chunk = 1000, threads = 3}) ==
+       "4e610836e2f46beb9657425be9e0f7db6db13f67860592383ab121c6ebc59c6a")
+assert(digest.tree_file("sha1", tmp, 4097, 30000, nil, {chunk = 333}) == tree("sha1", blob:sub(4098, 34097), 333))
+os.remove(tmp)
+res, err = digest.tree_file("sha1", "no such file")
+assert(res == nil and err:find("no such file", 1, true), "missing file")
+assert(crypto.md("sha1"):tree(blob) == digest.tree("sha1", blob))
+print("")
+
+print("testing export")
+local text = string.rep("0123456789abcdefghijklmnopqrstuvwxyz", 40)
+for _, t in ipairs({"md5", "sha1", "sha224", "sha256", "sha384", "sha512"}) do
+  for _, cut in ipairs({0, 1, 55, 63, 64, 65, 111, 127, 128, 129, 1000}) do
+    local d = digest.new(t)
+    d:update(text:sub(1, cut))
+    local state = assert(d:export())
+    local e = assert(digest.import(t, state))
+    assert(e:export() == state, "state changed by the round trip")
+    assert(e:update(text:sub(cut + 1)):final() == digest(t, text), t .. " resumed at " .. cut)
+    assert(d:final() == digest(t, text:sub(1, cut)), "exporting changed the digest")
+  end
+end
+local state = digest.new("sha256"):update("abc"):export()
+assert(#state == 10 + 32 + 3, "state not compact")
+res, err = digest.import("sha1", state)
+assert(res == nil and err, "state imported as another digest")
+assert(digest.import("sha256", state:sub(1, -2)) == nil, "truncated state accepted")
+assert(digest.import("sha256", state .. "x") == nil, "padded state accepted")
+assert(digest.import(crypto.md("sha256"), state):final() == digest("sha256", "abc"))
+print("")
+
 print("all tests passed")